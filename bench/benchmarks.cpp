@@ -0,0 +1,641 @@
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "harness.h"
+#include "apng.h"
+#include "buffer_pool.h"
+#include "colour_transform.h"
+#include "canny.h"
+#include "context.h"
+#include "corners.h"
+#include "crc.h"
+#include "distance.h"
+#include "hough.h"
+#include "labeling.h"
+#include "matrix.h"
+#include "pattern.h"
+#include "png.h"
+#include "pnm.h"
+#include "qoi.h"
+#include "result_cache.h"
+#include "strip.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace PixorBench;
+
+struct ImageSize {
+  int width;
+  int height;
+};
+
+struct ColourType {
+  const char *name;
+  Pixor::PngImageType type;
+  int channels;
+};
+
+static const ImageSize QUICK_SIZES[] = {{256, 256}, {1024, 1024}};
+static const ImageSize FULL_SIZES[] = {{256, 256}, {1024, 1024}, {4096, 4096}};
+
+static const ColourType COLOUR_TYPES[] = {
+  {"grey", Pixor::PNG_TYPE_GREYSCALE, 1},
+  {"rgb", Pixor::PNG_TYPE_TRUECOLOUR, 3},
+  {"rgba", Pixor::PNG_TYPE_TRUECOLOUR_ALPHA, 4},
+};
+
+// Keeps the optimiser from dropping work whose result is never used.
+static volatile double sink;
+
+static std::string size_name(ImageSize size)
+{
+  return std::to_string(size.width) + "x" + std::to_string(size.height);
+}
+
+// Gradients with a little noise, so the images compress like photos
+// rather than like flat colour. The same seed gives the same image.
+static std::shared_ptr<byte[]> synthetic_bitmap(ImageSize size, int channels)
+{
+  size_t count = (size_t) size.width * size.height * channels;
+  std::shared_ptr<byte[]> bitmap(new byte[count]);
+  unsigned int state = 2463534242u;
+
+  for (int y = 0; y < size.height; y++) {
+    for (int x = 0; x < size.width; x++) {
+      for (int c = 0; c < channels; c++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        int gradient = c == 3 ? 255 - (x * 64 / size.width) : ((x + c * 37) * 255 / size.width + y * 255 / size.height) / 2;
+        bitmap[((size_t) y * size.width + x) * channels + c] = (byte) std::min(255u, gradient + (state & 15));
+      }
+    }
+  }
+
+  return bitmap;
+}
+
+static std::shared_ptr<Pixor::PngImage> synthetic_png(ImageSize size, const ColourType &colour)
+{
+  auto image = std::make_shared<Pixor::PngImage>();
+  auto bitmap = synthetic_bitmap(size, colour.channels);
+
+  image->set_header(new Pixor::PngHeader(size.width, size.height, colour.type));
+  image->set_bitmap(bitmap.get());
+
+  return image;
+}
+
+static void bench_crc(Harness &harness)
+{
+  for (size_t length : {(size_t) 64 << 10, (size_t) 16 << 20}) {
+    std::vector<byte> buffer(length);
+    for (size_t i = 0; i < length; i++) buffer[i] = (byte) (i * 31);
+
+    harness.run("crc/" + std::to_string(length >> 10) + "KB", length, 0, [&] {
+      sink = crc(buffer.data(), (int) length);
+    });
+  }
+}
+
+static void bench_png(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  for (auto size : sizes) {
+    size_t pixels = (size_t) size.width * size.height;
+
+    for (const auto &colour : COLOUR_TYPES) {
+      std::string suffix = std::string(colour.name) + "/" + size_name(size);
+      auto bitmap = synthetic_bitmap(size, colour.channels);
+      auto image = synthetic_png(size, colour);
+      size_t raw_bytes = pixels * colour.channels;
+
+      harness.run("png/encode/" + suffix, raw_bytes, pixels, [&] {
+        Pixor::PngImage encoded;
+        std::ostringstream out;
+
+        encoded.set_header(new Pixor::PngHeader(size.width, size.height, colour.type));
+        encoded.set_bitmap(bitmap.get());
+        out << encoded;
+        sink = out.tellp();
+      });
+
+      std::ostringstream encoded;
+      encoded << *image;
+      std::string file = encoded.str();
+
+      harness.run("png/parse/" + suffix, file.size(), pixels, [&] {
+        std::istringstream in(file);
+        std::unique_ptr<Pixor::PngImage> decoded(Pixor::decode_png(in));
+        sink = decoded->get_width();
+      });
+
+      harness.run("png/inflate_unfilter/" + suffix, raw_bytes, pixels, [&] {
+        image->release_pixels();
+        sink = image->get_pixels()[0];
+      });
+      harness.run("png/cached_bitmap/" + suffix, raw_bytes, pixels, [&] {
+        sink = image->get_image_bitmap()[0];
+      });
+    }
+  }
+}
+
+// The formats meant for intermediates, next to png/ above.
+static void bench_intermediates(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  for (auto size : sizes) {
+    size_t pixels = (size_t) size.width * size.height;
+    std::string suffix = "/" + size_name(size);
+    auto bitmap = synthetic_bitmap(size, 4);
+    Pixor::QoiImage qoi(size.width, size.height, 4);
+    Pixor::PnmImage pnm(size.width, size.height, 4);
+
+    harness.run("qoi/encode" + suffix, pixels * 4, pixels, [&] {
+      qoi.set_bitmap(bitmap.get());
+      sink = qoi.get_encoded_size();
+    });
+    harness.run("qoi/decode" + suffix, pixels * 4, pixels, [&] {
+      sink = qoi.get_image_bitmap()[0];
+    });
+
+    pnm.set_bitmap(bitmap.get());
+    std::ostringstream encoded;
+    encoded << pnm;
+    std::string file = encoded.str();
+
+    harness.run("pam/read" + suffix, pixels * 4, pixels, [&] {
+      std::istringstream in(file);
+      std::unique_ptr<Pixor::PnmImage> decoded(Pixor::decode_pnm(in));
+      sink = decoded->get_image_bitmap_with_alpha()[0];
+    });
+  }
+}
+
+// A cache hit against the decode it replaces.
+static void bench_cache(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  for (auto size : sizes) {
+    size_t pixels = (size_t) size.width * size.height;
+    std::string suffix = "/" + size_name(size);
+    std::ostringstream encoded;
+    encoded << *synthetic_png(size, COLOUR_TYPES[1]);
+    std::istringstream in(encoded.str());
+    // Decoded, so the chunk CRCs are known.
+    std::shared_ptr<Pixor::PngImage> image(Pixor::decode_png(in));
+    Pixor::ResultCache cache;
+    Pixor::CacheKey key = {image->get_content_hash(), Pixor::hash_params("greyscale", {Pixor::LUMA_REC601})};
+
+    cache.put_bitmap(key, image->get_image_bitmap_greyscale(Pixor::LUMA_REC601).get(), size.width, size.height);
+
+    harness.run("cache/content_hash" + suffix, 0, pixels, [&] {
+      sink = image->get_content_hash();
+    });
+    harness.run("cache/greyscale_miss" + suffix, pixels * 4, pixels, [&] {
+      image->release_pixels();
+      sink = image->get_image_bitmap_greyscale(Pixor::LUMA_REC601)[0];
+    });
+    harness.run("cache/greyscale_hit" + suffix, pixels * 4, pixels, [&] {
+      sink = cache.get_bitmap(key, size.width, size.height)[0];
+    });
+  }
+}
+
+static std::shared_ptr<Pixor::Context> synthetic_context(ImageSize size)
+{
+  auto bitmap = synthetic_bitmap(size, 4);
+  return std::make_shared<Pixor::Context>(bitmap, size.width, size.height);
+}
+
+static void bench_canny(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  for (auto size : sizes) {
+    std::string suffix = "/" + size_name(size);
+    size_t pixels = (size_t) size.width * size.height;
+    size_t bytes = pixels * sizeof(double);
+    auto input = synthetic_context(size)->get_matrix();
+    auto kernel = gaussian_kernel(5);
+    auto blurred = input->convolve(kernel);
+    Pixor::Matrix<double> theta(1, 1);
+    auto gradient = sobel_filter(blurred, theta);
+    auto suppressed = non_max_suppression(gradient, theta);
+    auto thresholded = threshold(suppressed);
+
+    harness.run("canny/gaussian" + suffix, bytes, pixels, [&] {
+      sink = input->convolve(kernel).data()[0];
+    });
+    harness.run("canny/sobel" + suffix, bytes, pixels, [&] {
+      Pixor::Matrix<double> t(1, 1);
+      sink = sobel_filter(blurred, t).data()[0];
+    });
+    harness.run("canny/non_max_suppression" + suffix, bytes, pixels, [&] {
+      sink = non_max_suppression(gradient, theta).data()[0];
+    });
+    harness.run("canny/threshold" + suffix, bytes, pixels, [&] {
+      sink = threshold(suppressed).data()[0];
+    });
+    harness.run("canny/hysteresis" + suffix, bytes, pixels, [&] {
+      Pixor::Matrix<double> copy(thresholded);
+      sink = hysteresis(copy).data()[0];
+    });
+    harness.run("canny/full" + suffix, bytes, pixels, [&] {
+      sink = canny_edge_detector(*input).data()[0];
+    });
+
+    // Decode to encode in one graph, the whole pipeline of the app.
+    auto png = synthetic_png(size, COLOUR_TYPES[1]);
+    harness.run("canny/graph_png" + suffix, bytes, pixels, [&] {
+      Pixor::Graph graph;
+      png->release_pixels();
+      sink = graph.encode(canny_graph(graph, graph.luma(graph.decode(png))))->get_width();
+    });
+
+    // The same from a stream in strips, with a limit far below the image.
+    std::ostringstream encoded;
+    encoded << *png;
+    std::string png_data = encoded.str();
+    Pixor::StripOptions strip_options;
+    strip_options.max_bytes = (size_t) 4 << 20;
+    harness.run("canny/strips_png" + suffix, bytes, pixels, [&] {
+      std::istringstream in(png_data);
+      std::ostringstream out;
+      sink = Pixor::canny_png_strips(in, out, CannyOptions(), strip_options).strip_rows;
+    });
+  }
+}
+
+// Edges and corners separately, then from one graph that computes the
+// blur and the gradients once for both.
+static void bench_corners(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  for (auto size : sizes) {
+    std::string suffix = "/" + size_name(size);
+    size_t pixels = (size_t) size.width * size.height;
+    size_t bytes = pixels * sizeof(double);
+    auto input = synthetic_context(size)->get_matrix();
+    Pixor::CornerOptions shi_tomasi;
+    shi_tomasi.method = Pixor::CORNER_SHI_TOMASI;
+
+    harness.run("corners/harris" + suffix, bytes, pixels, [&] {
+      sink = Pixor::corner_detector(*input).size();
+    });
+    harness.run("corners/shi_tomasi" + suffix, bytes, pixels, [&] {
+      sink = Pixor::corner_detector(*input, nullptr, shi_tomasi).size();
+    });
+    harness.run("corners/canny_then_harris" + suffix, bytes, pixels, [&] {
+      sink = canny_edge_detector(*input).data()[0] + Pixor::corner_detector(*input).size();
+    });
+    harness.run("corners/features" + suffix, bytes, pixels, [&] {
+      auto features = Pixor::detect_features(*input);
+      sink = features.edges.data()[0] + features.corners.size();
+    });
+  }
+}
+
+// An edge map with a grid of lines, a row of circles and scattered noise,
+// about as busy as the edges of a photo.
+static Pixor::Matrix<double> synthetic_edges(ImageSize size)
+{
+  Pixor::Matrix<double> edges(size.width, size.height);
+  double *data = edges.data();
+  unsigned int state = 2463534242u;
+  auto set = [&](int x, int y) {
+    if (x >= 0 && y >= 0 && x < size.width && y < size.height) data[(size_t) y * size.width + x] = 255;
+  };
+
+  for (int i = 1; i < 8; i++) {
+    for (int t = 0; t < size.width; t++) set(t, size.height * i / 8 + t / 8);
+    for (int t = 0; t < size.height; t++) set(size.width * i / 8, t);
+  }
+  for (int i = 0; i < 4; i++) {
+    int radius = std::min(size.width, size.height) / 16;
+    for (int a = 0; a < 720; a++) {
+      set(size.width * (2 * i + 1) / 8 + (int) std::lround(radius * std::cos(a * M_PI / 360)),
+        size.height / 3 + (int) std::lround(radius * std::sin(a * M_PI / 360)));
+    }
+  }
+  for (size_t i = 0; i < (size_t) size.width * size.height / 200; i++) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    set(state % size.width, (state >> 12) % size.height);
+  }
+
+  return edges;
+}
+
+static void bench_hough(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  for (auto size : sizes) {
+    std::string suffix = "/" + size_name(size);
+    size_t pixels = (size_t) size.width * size.height;
+    auto edges = synthetic_edges(size);
+    Pixor::HoughCircleOptions circle_options;
+    circle_options.min_radius = std::min(size.width, size.height) / 20;
+    circle_options.max_radius = std::min(size.width, size.height) / 12;
+
+    harness.run("hough/lines" + suffix, pixels * sizeof(double), pixels, [&] {
+      sink = Pixor::hough_lines(edges).size();
+    });
+    harness.run("hough/segments" + suffix, pixels * sizeof(double), pixels, [&] {
+      sink = Pixor::hough_line_segments(edges).size();
+    });
+    harness.run("hough/circles" + suffix, pixels * sizeof(double), pixels, [&] {
+      sink = Pixor::hough_circles(edges, circle_options).size();
+    });
+  }
+}
+
+static void bench_distance(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  for (auto size : sizes) {
+    std::string suffix = "/" + size_name(size);
+    size_t pixels = (size_t) size.width * size.height;
+    auto edges = synthetic_edges(size);
+
+    harness.run("distance/transform" + suffix, pixels * sizeof(double), pixels, [&] {
+      sink = Pixor::distance_transform(edges).data()[0];
+    });
+    harness.run("distance/transform_nearest" + suffix, pixels * sizeof(double), pixels, [&] {
+      Pixor::Matrix<int> nearest(1, 1);
+      sink = Pixor::distance_transform(edges, &nearest).data()[0];
+    });
+  }
+}
+
+static void bench_labeling(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  for (auto size : sizes) {
+    std::string suffix = "/" + size_name(size);
+    size_t pixels = (size_t) size.width * size.height;
+    auto edges = synthetic_edges(size);
+    Pixor::LabelOptions four;
+    four.connectivity = Pixor::FILL_CONNECTIVITY_4;
+
+    harness.run("labeling/8" + suffix, pixels * sizeof(double), pixels, [&] {
+      sink = Pixor::label_components(edges).stats.size();
+    });
+    harness.run("labeling/4" + suffix, pixels * sizeof(double), pixels, [&] {
+      sink = Pixor::label_components(edges, four).stats.size();
+    });
+  }
+}
+
+// A full first frame and a quarter sized patch moving over it, with canny
+// on every frame. The pipelined run overlaps inflating, compositing and
+// filtering of neighbouring frames.
+static void bench_apng(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  const int frame_count = 16;
+
+  for (auto size : sizes) {
+    if (size.width > 256) continue;
+
+    std::string suffix = "/" + size_name(size) + "x" + std::to_string(frame_count);
+    size_t pixels = (size_t) size.width * size.height * frame_count;
+    ImageSize patch = {size.width / 2, size.height / 2};
+    auto background = synthetic_bitmap(size, 4);
+    auto foreground = synthetic_bitmap(patch, 4);
+    Pixor::PngImage image;
+
+    image.set_header(new Pixor::PngHeader(size.width, size.height, Pixor::PNG_TYPE_TRUECOLOUR_ALPHA));
+    image.add_frame(new Pixor::PngFrameControl(size.width, size.height), background.get());
+    for (int i = 1; i < frame_count; i++) {
+      int x = (size.width - patch.width) * i / frame_count;
+      image.add_frame(new Pixor::PngFrameControl(patch.width, patch.height, x, x * size.height / size.width, 1, 30,
+        Pixor::APNG_DISPOSE_PREVIOUS, Pixor::APNG_BLEND_OVER), foreground.get());
+    }
+
+    harness.run("apng/canny_serial" + suffix, pixels * 4, pixels, [&] {
+      Pixor::ApngCanvas canvas(size.width, size.height);
+
+      for (int i = 0; i < frame_count; i++) {
+        auto &frame = image.get_frame(i);
+        canvas.composite(*frame.control, frame.image->get_image_bitmap_with_alpha().get());
+        frame.image->release_pixels();
+        sink = canny_edge_detector(*canvas.get_canvas().get_matrix()).data()[0];
+      }
+    });
+    harness.run("apng/canny_pipelined" + suffix, pixels * 4, pixels, [&] {
+      Pixor::process_apng_frames(image, [](int index, const Pixor::Context &canvas) {
+        UNUSED(index);
+        sink = canny_edge_detector(*canvas.get_matrix()).data()[0];
+      });
+    });
+  }
+}
+
+// Single threaded, one call over the whole bitmap.
+static void bench_colour(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  Pixor::ColourTransform luma;
+  luma.luma();
+  Pixor::ColourTransform linear_luma;
+  linear_luma.srgb_to_linear().luma().linear_to_srgb();
+  Pixor::ColourTransform curve_hsv;
+  curve_hsv.adjust_hsv(0.1f, 1.2f, 1).curve({{0, 0}, {0.5f, 0.6f}, {1, 1}});
+
+  for (auto size : sizes) {
+    std::string suffix = "/" + size_name(size);
+    size_t pixels = (size_t) size.width * size.height;
+    auto src = synthetic_bitmap(size, 4);
+    std::vector<byte> dest(pixels * 4);
+
+    harness.run("colour/luma" + suffix, pixels * 4, pixels, [&] {
+      luma.apply(src.get(), dest.data(), pixels);
+      sink = dest[0];
+    });
+    harness.run("colour/linear_luma" + suffix, pixels * 4, pixels, [&] {
+      linear_luma.apply(src.get(), dest.data(), pixels);
+      sink = dest[0];
+    });
+    harness.run("colour/hsv_curve" + suffix, pixels * 4, pixels, [&] {
+      curve_hsv.apply(src.get(), dest.data(), pixels);
+      sink = dest[0];
+    });
+  }
+}
+
+static void bench_context(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  RGBA colour = Pixor::rgba(0, 255, 0, 255);
+  auto brush = Pixor::Pattern::make_circle(5, &colour);
+
+  for (auto size : sizes) {
+    std::string suffix = "/" + size_name(size);
+    size_t pixels = (size_t) size.width * size.height;
+    size_t bytes = pixels * 4;
+    auto context = synthetic_context(size);
+    Pixor::Matrix<float> box3({{1 / 9.0f, 1 / 9.0f, 1 / 9.0f}, {1 / 9.0f, 1 / 9.0f, 1 / 9.0f}, {1 / 9.0f, 1 / 9.0f, 1 / 9.0f}});
+
+    harness.run("context/convolve3x3" + suffix, bytes, pixels, [&] {
+      sink = context->convolve(box3)->get_pixel({0, 0});
+    });
+    harness.run("context/scale_half" + suffix, bytes, pixels, [&] {
+      sink = context->scale(size.width / 2, size.height / 2)->get_width();
+    });
+
+    // A zigzag stroke across the whole image.
+    std::vector<Pixor::point> stroke;
+    for (int x = 0; x < size.width; x += 4) {
+      stroke.push_back({x, (x / 4) % 2 ? size.height / 4 : size.height * 3 / 4});
+    }
+    context->set_source_pattern(brush);
+
+    harness.run("pattern/draw_onto" + suffix, 0, 0, [&] {
+      for (const auto &p : stroke) brush->draw_onto(*context, p);
+    });
+    harness.run("pattern/polyline" + suffix, 0, 0, [&] {
+      context->draw_polyline_with_pattern(stroke);
+    });
+  }
+}
+
+static void bench_matrix(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  for (auto size : sizes) {
+    std::string suffix = "/" + size_name(size);
+    size_t pixels = (size_t) size.width * size.height;
+    size_t bytes = pixels * sizeof(double);
+    auto a = synthetic_context(size)->get_matrix();
+    auto b = a->mult(0.5);
+
+    harness.run("matrix/add" + suffix, bytes, pixels, [&] {sink = a->add(b).data()[0];});
+    harness.run("matrix/mult" + suffix, bytes, pixels, [&] {sink = a->mult(2).data()[0];});
+    harness.run("matrix/power" + suffix, bytes, pixels, [&] {sink = a->power(2).data()[0];});
+    harness.run("matrix/exp" + suffix, bytes, pixels, [&] {sink = a->div(255).exp().data()[0];});
+    harness.run("matrix/hypot" + suffix, bytes, pixels, [&] {sink = a->hypot(b).data()[0];});
+    harness.run("matrix/arctan2" + suffix, bytes, pixels, [&] {sink = a->arctan2(b).data()[0];});
+    harness.run("matrix/sum" + suffix, bytes, pixels, [&] {sink = a->sum();});
+    harness.run("matrix/max" + suffix, bytes, pixels, [&] {sink = a->max();});
+  }
+}
+
+// The same work at 1, 2, 4, ... threads up to the size of the pool.
+static void bench_scaling(Harness &harness, const std::vector<ImageSize> &sizes)
+{
+  Pixor::ThreadPool &pool = Pixor::ThreadPool::shared();
+  int max_threads = pool.get_concurrency();
+  ImageSize size = sizes.back();
+  size_t pixels = (size_t) size.width * size.height;
+  auto context = synthetic_context(size);
+  auto input = context->get_matrix();
+  Pixor::Matrix<float> box3({{1 / 9.0f, 1 / 9.0f, 1 / 9.0f}, {1 / 9.0f, 1 / 9.0f, 1 / 9.0f}, {1 / 9.0f, 1 / 9.0f, 1 / 9.0f}});
+
+  for (int threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+    std::string suffix = "/" + size_name(size) + "/threads=" + std::to_string(threads);
+    pool.set_concurrency(threads);
+
+    harness.run("scaling/canny" + suffix, pixels * sizeof(double), pixels, [&] {
+      sink = canny_edge_detector(*input).data()[0];
+    });
+    harness.run("scaling/convolve3x3" + suffix, pixels * 4, pixels, [&] {
+      sink = context->convolve(box3)->get_pixel({0, 0});
+    });
+
+    if (threads == max_threads) break;
+  }
+
+  pool.set_concurrency(max_threads);
+}
+
+static void usage(const char *program)
+{
+  printf("usage: %s [--filter SUBSTRING] [--reps N] [--warmup N] [--full]\n"
+    "          [--json OUT] [--baseline FILE] [--tolerance FRACTION] [--trace OUT]\n", program);
+}
+
+int main(int argc, char *argv[])
+{
+  Options options;
+  std::string json_path;
+  std::string baseline_path;
+  std::string trace_path;
+  double tolerance = 0.1;
+  bool full = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+
+    if (arg == "--filter" && has_value) {
+      options.filter = argv[++i];
+    } else if (arg == "--reps" && has_value) {
+      options.repetitions = atoi(argv[++i]);
+    } else if (arg == "--warmup" && has_value) {
+      options.warmup = atoi(argv[++i]);
+    } else if (arg == "--json" && has_value) {
+      json_path = argv[++i];
+    } else if (arg == "--baseline" && has_value) {
+      baseline_path = argv[++i];
+    } else if (arg == "--tolerance" && has_value) {
+      tolerance = atof(argv[++i]);
+    } else if (arg == "--trace" && has_value) {
+      trace_path = argv[++i];
+    } else if (arg == "--full") {
+      full = true;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  std::vector<ImageSize> sizes;
+  if (full) {
+    sizes.assign(std::begin(FULL_SIZES), std::end(FULL_SIZES));
+  } else {
+    sizes.assign(std::begin(QUICK_SIZES), std::end(QUICK_SIZES));
+  }
+
+  // Tracing shows where the time goes inside each benchmark, it is off by
+  // default so it does not skew the numbers.
+  if (!trace_path.empty()) Pixor::set_tracing(true);
+
+  Harness harness(options);
+  bench_crc(harness);
+  bench_png(harness, sizes);
+  bench_intermediates(harness, sizes);
+  bench_cache(harness, sizes);
+  bench_canny(harness, sizes);
+  bench_corners(harness, sizes);
+  bench_hough(harness, sizes);
+  bench_distance(harness, sizes);
+  bench_labeling(harness, sizes);
+  bench_apng(harness, sizes);
+  bench_colour(harness, sizes);
+  bench_context(harness, sizes);
+  bench_matrix(harness, sizes);
+  bench_scaling(harness, sizes);
+
+  // After the warm-up runs every temporary should come from the pool, so
+  // system allocations stay close to the number of distinct buffer sizes.
+  auto pool = Pixor::BufferPool::shared().get_stats();
+  printf("\npool: %zu allocations, %zu reused, %zu from the system, peak %zu MB in use, %zu MB cached\n",
+    pool.allocations, pool.reuses, pool.system_allocations, pool.peak_bytes_in_use >> 20, pool.bytes_cached >> 20);
+
+  if (!json_path.empty() && !harness.write_json(json_path)) {
+    printf("cannot write %s\n", json_path.c_str());
+    return 1;
+  }
+
+  if (!trace_path.empty() && !Pixor::write_trace(trace_path)) {
+    printf("cannot write %s\n", trace_path.c_str());
+    return 1;
+  }
+
+  if (!baseline_path.empty()) {
+    int regressions = harness.compare(baseline_path, tolerance);
+    if (regressions < 0) {
+      printf("cannot read baseline %s\n", baseline_path.c_str());
+      return 1;
+    }
+    return regressions > 0 ? 1 : 0;
+  }
+
+  return 0;
+}
@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdio.h>
+#include "harness.h"
+
+using namespace PixorBench;
+
+static double percentile(const std::vector<double> &sorted, double fraction)
+{
+  size_t index = (size_t) std::ceil(fraction * sorted.size());
+  return sorted[std::min(sorted.size() - 1, index > 0 ? index - 1 : 0)];
+}
+
+void Harness::run(const std::string &name, size_t bytes, size_t pixels, std::function<void()> body)
+{
+  if (!options.filter.empty() && name.find(options.filter) == std::string::npos) return;
+
+  for (int i = 0; i < options.warmup; i++) {
+    body();
+  }
+
+  std::vector<double> times;
+  for (int i = 0; i < std::max(1, options.repetitions); i++) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    auto end = std::chrono::steady_clock::now();
+    times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+  }
+
+  std::sort(times.begin(), times.end());
+
+  Result result;
+  result.name = name;
+  result.repetitions = times.size();
+  result.median_ms = percentile(times, 0.5);
+  result.p95_ms = percentile(times, 0.95);
+  result.min_ms = times[0];
+  result.mb_per_s = bytes && result.median_ms > 0 ? bytes / (result.median_ms * 1000) : 0;
+  result.mp_per_s = pixels && result.median_ms > 0 ? pixels / (result.median_ms * 1000) : 0;
+  results.push_back(result);
+
+  printf("%-40s %10.3f ms %10.3f ms p95", name.c_str(), result.median_ms, result.p95_ms);
+  if (result.mb_per_s > 0) printf(" %10.1f MB/s", result.mb_per_s);
+  if (result.mp_per_s > 0) printf(" %10.1f MP/s", result.mp_per_s);
+  printf("\n");
+  fflush(stdout);
+}
+
+bool Harness::write_json(const std::string &path) const
+{
+  std::ofstream out(path);
+  if (!out.is_open()) return false;
+
+  out << "{\n  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+
+    out << "    {\"name\": \"" << r.name << "\""
+      << ", \"repetitions\": " << r.repetitions
+      << ", \"median_ms\": " << r.median_ms
+      << ", \"p95_ms\": " << r.p95_ms
+      << ", \"min_ms\": " << r.min_ms
+      << ", \"mb_per_s\": " << r.mb_per_s
+      << ", \"mp_per_s\": " << r.mp_per_s
+      << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+
+  return out.good();
+}
+
+// Only understands the layout write_json() produces: one result object
+// per line with the name first.
+static bool read_medians(const std::string &path, std::map<std::string, double> &medians)
+{
+  std::ifstream in(path);
+  if (!in.is_open()) return false;
+
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t name_pos = line.find("\"name\": \"");
+    size_t median_pos = line.find("\"median_ms\": ");
+    if (name_pos == std::string::npos || median_pos == std::string::npos) continue;
+
+    name_pos += 9;
+    std::string name = line.substr(name_pos, line.find('"', name_pos) - name_pos);
+    std::istringstream value(line.substr(median_pos + 13));
+    double median;
+    if (value >> median) medians[name] = median;
+  }
+
+  return true;
+}
+
+int Harness::compare(const std::string &baseline_path, double tolerance) const
+{
+  std::map<std::string, double> baseline;
+  if (!read_medians(baseline_path, baseline)) return -1;
+
+  int regressions = 0;
+  for (const Result &r : results) {
+    auto it = baseline.find(r.name);
+    if (it == baseline.end() || it->second <= 0) continue;
+
+    double change = r.median_ms / it->second - 1;
+    if (change > tolerance) {
+      printf("REGRESSION %-40s %10.3f ms -> %10.3f ms (+%.1f%%)\n", r.name.c_str(), it->second, r.median_ms, change * 100);
+      regressions++;
+    }
+  }
+
+  return regressions;
+}
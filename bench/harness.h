@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace PixorBench {
+
+struct Result {
+  std::string name;
+  int repetitions;
+  double median_ms;
+  double p95_ms;
+  double min_ms;
+  double mb_per_s;
+  double mp_per_s;
+};
+
+struct Options {
+  int warmup = 2;
+  int repetitions = 10;
+  std::string filter;
+};
+
+// Times a benchmark body: a few untimed warmup runs, then the requested
+// number of timed repetitions. bytes and pixels are the amount of data one
+// run processes and are turned into throughput figures, 0 leaves the
+// figure out.
+class Harness {
+  Options options;
+  std::vector<Result> results;
+
+public:
+  Harness(const Options &options) : options(options) {}
+
+  void run(const std::string &name, size_t bytes, size_t pixels, std::function<void()> body);
+  const std::vector<Result> &get_results() const {return results;}
+  bool write_json(const std::string &path) const;
+
+  // Compares the medians against a file written by write_json() and
+  // prints every benchmark that got slower by more than tolerance (0.1 is
+  // 10%). Returns the number of regressions, or -1 if the baseline cannot
+  // be read.
+  int compare(const std::string &baseline_path, double tolerance) const;
+};
+
+}
@@ -0,0 +1,182 @@
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include "apng.h"
+#include "debug.h"
+#include "pixel_format.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+// Frames a pipeline stage may run ahead of the next one.
+static const size_t PIPELINE_DEPTH = 2;
+
+ApngCanvas::ApngCanvas(int width, int height) : canvas(width, height, CONTEXT_STORAGE_TILED) {}
+
+void ApngCanvas::dispose()
+{
+  if (dispose_op == APNG_DISPOSE_BACKGROUND) {
+    scratch.assign((size_t) dispose_area.width * dispose_area.height, 0);
+    canvas.write_rect(dispose_area, scratch.data());
+  } else if (dispose_op == APNG_DISPOSE_PREVIOUS) {
+    canvas.write_rect(dispose_area, saved.data());
+  }
+}
+
+void ApngCanvas::composite(const PngFrameControl &control, const byte *pixels)
+{
+  rect area = control.get_area();
+  if (area.x < 0 || area.y < 0 || area.x + area.width > canvas.get_width() || area.y + area.height > canvas.get_height()) {
+    throw std::invalid_argument("APNG frame outside of the canvas");
+  }
+
+  PIXOR_TRACE_SCOPE("apng.composite", "png");
+  dispose();
+
+  dispose_area = area;
+  dispose_op = control.get_dispose_op();
+  // There is nothing to go back to before the first frame.
+  if (first_frame && dispose_op == APNG_DISPOSE_PREVIOUS) dispose_op = APNG_DISPOSE_BACKGROUND;
+  first_frame = false;
+
+  size_t pixel_count = (size_t) area.width * area.height;
+  if (dispose_op == APNG_DISPOSE_PREVIOUS) {
+    saved.resize(pixel_count);
+    canvas.read_rect(area, saved.data());
+  }
+
+  if (control.get_blend_op() == APNG_BLEND_SOURCE) {
+    canvas.write_rect(area, (const RGBA *) pixels);
+    return;
+  }
+
+  scratch.resize(pixel_count);
+  canvas.read_rect(area, scratch.data());
+  blend_over(pixels, (byte *) scratch.data(), pixel_count);
+  canvas.write_rect(area, scratch.data());
+}
+
+// Hands items from one stage to the next, blocking the producer while the
+// queue is full and the consumer while it is empty.
+template <class T>
+class StageQueue {
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<T> items;
+  bool closed = false;
+
+public:
+  // Returns false if the queue was closed in the meantime.
+  bool push(T item)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] {return closed || items.size() < PIPELINE_DEPTH;});
+    if (closed) return false;
+
+    items.push_back(std::move(item));
+    changed.notify_all();
+    return true;
+  }
+
+  // Returns false once the queue is closed and drained.
+  bool pop(T &item)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] {return closed || !items.empty();});
+    if (items.empty()) return false;
+
+    item = std::move(items.front());
+    items.pop_front();
+    changed.notify_all();
+    return true;
+  }
+
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    changed.notify_all();
+  }
+
+  // Closes the queue and drops what is still in it.
+  void abort()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    items.clear();
+    changed.notify_all();
+  }
+};
+
+void Pixor::process_apng_frames(const PngImage &image, FrameCallback on_frame, Job *job)
+{
+  if (!image.is_animated()) throw std::invalid_argument("PNG image is not animated");
+
+  int frame_count = image.get_frame_count();
+  StageQueue<std::shared_ptr<byte[]>> decoded;
+  StageQueue<std::shared_ptr<Context>> composited;
+  std::mutex error_mutex;
+  std::exception_ptr error;
+
+  auto fail = [&](std::exception_ptr e) {
+    {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) error = e;
+    }
+    decoded.abort();
+    composited.abort();
+  };
+
+  std::thread decoder([&] {
+    try {
+      for (int i = 0; i < frame_count; i++) {
+        PIXOR_TRACE_SCOPE("apng.decode", "png");
+        auto &frame_image = *image.get_frame(i).image;
+        auto pixels = frame_image.get_image_bitmap_with_alpha();
+        if (!pixels) throw std::invalid_argument("Cannot decode APNG frame");
+        // The frame is not needed again, a long animation would otherwise
+        // keep every decoded frame.
+        frame_image.release_pixels();
+        if (!decoded.push(pixels)) return;
+      }
+      decoded.close();
+    } catch (...) {
+      fail(std::current_exception());
+    }
+  });
+
+  std::thread compositor([&] {
+    try {
+      ApngCanvas canvas(image.get_width(), image.get_height());
+      std::shared_ptr<byte[]> pixels;
+
+      for (int i = 0; decoded.pop(pixels); i++) {
+        canvas.composite(*image.get_frame(i).control, pixels.get());
+        pixels.reset();
+        if (!composited.push(std::make_shared<Context>(canvas.get_canvas()))) return;
+      }
+      composited.close();
+    } catch (...) {
+      fail(std::current_exception());
+    }
+  });
+
+  try {
+    std::shared_ptr<Context> canvas;
+
+    for (int i = 0; composited.pop(canvas); i++) {
+      on_frame(i, *canvas);
+      canvas.reset();
+      if (job) job->set_progress((float) (i + 1) / frame_count);
+    }
+  } catch (...) {
+    fail(std::current_exception());
+  }
+
+  decoder.join();
+  compositor.join();
+  if (error) std::rethrow_exception(error);
+}
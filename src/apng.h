@@ -0,0 +1,52 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <vector>
+#include "pixor.h"
+#include "context.h"
+#include "job.h"
+#include "png.h"
+
+namespace Pixor {
+
+// Builds the frames of an animated PNG the way a viewer shows them. Each
+// frame is blended onto an RGBA canvas, and its area is disposed of as the
+// frame asks before the next one is drawn. The canvas starts out fully
+// transparent.
+//
+// The canvas is tiled, so keeping a copy of it per frame only costs the
+// tiles the following frames change.
+class ApngCanvas {
+  Context canvas;
+  std::vector<RGBA> saved;
+  std::vector<RGBA> scratch;
+  rect dispose_area = {0, 0, 0, 0};
+  ApngDisposeOp dispose_op = APNG_DISPOSE_NONE;
+  bool first_frame = true;
+
+  void dispose();
+
+public:
+  ApngCanvas(int width, int height);
+
+  // Frames have to come in order. pixels holds the RGBA8 pixels of the
+  // frame's area, as get_image_bitmap_with_alpha() returns them.
+  void composite(const PngFrameControl &control, const byte *pixels);
+  const Context &get_canvas() const {return canvas;}
+};
+
+// Called with the canvas after each frame, in frame order.
+typedef std::function<void(int index, const Context &canvas)> FrameCallback;
+
+// Runs the frames of image through a pipeline of three threads: while
+// on_frame handles frame N-1 on the calling thread, frame N is composited
+// and frame N+1 inflated. A stage runs at most a couple of frames ahead of
+// the next one, so a long animation does not pile up in memory. The
+// pipeline as a whole moves at the pace of its slowest stage.
+//
+// With a job, progress is reported after every frame and a cancelled job
+// stops the pipeline with JobCancelled. An exception thrown by any stage
+// stops the others and is rethrown here.
+void process_apng_frames(const PngImage &image, FrameCallback on_frame, Job *job = nullptr);
+
+}
@@ -1,14 +1,30 @@
+#include <algorithm>
 #include <fstream>
-#include "png.h"
+#include <thread>
+#include <stdexcept>
+#include "image_io.h"
 #include "debug.h"
 #include "application.h"
 #include "main_window.h"
 
+static const size_t DECODE_MEMORY_BUDGET = (size_t) 1 << 30;
+
 Application::Application()
-: Gtk::Application("org.gtkmm.example.main_menu")
+: Gtk::Application("org.gtkmm.example.main_menu"),
+  decode_queue(std::max(1u, std::thread::hardware_concurrency())),
+  decode_admission(DECODE_MEMORY_BUDGET)
 {
   Glib::set_application_name("Main Menu Example");
   set_flags(Gio::APPLICATION_HANDLES_OPEN);
+  decode_dispatcher.connect(sigc::mem_fun(*this, &Application::on_image_decoded));
+}
+
+Application::~Application()
+{
+  for (auto &job : decode_jobs) {
+    job->cancel();
+    job->wait();
+  }
 }
 
 Glib::RefPtr<Application> Application::create()
@@ -77,32 +93,34 @@ void Application::on_activate()
   // The application has been started, so let's show a window.
   // A real application might want to reuse this window in on_open(),
   // when asked to open a file, if no changes have been made yet.
-  create_window();
-}
-
-void Application::create_window()
-{
   if (!current_image) {
     dbgln("No current image available");
     return;
   }
-  
-  auto win = new MainWindow(current_image);
+
+  // Mostly a cache hit, the image has been decoded before.
+  create_window(current_image, Pixor::load_greyscale(current_image), 0);
+}
+
+void Application::create_window(std::shared_ptr<Pixor::Image> &image, std::shared_ptr<byte[]> greyscale, size_t reserved)
+{
+  auto win = new MainWindow(image, greyscale);
   dbgln("Created main window");
   //Make sure that the application runs for as long this window is still open:
   add_window(*win);
 
   //Delete the window when it is hidden.
   //That's enough for this simple example.
-  win->signal_hide().connect(sigc::bind<Gtk::Window*>(
-    sigc::mem_fun(*this, &Application::on_window_hide), win));
+  win->signal_hide().connect(sigc::bind<Gtk::Window*, size_t>(
+    sigc::mem_fun(*this, &Application::on_window_hide), win, reserved));
 
   win->show_all();
 }
 
-void Application::on_window_hide(Gtk::Window* window)
+void Application::on_window_hide(Gtk::Window* window, size_t reserved)
 {
   delete window;
+  decode_admission.release(reserved);
 }
 
 void Application::on_menu_file_new_generic()
@@ -132,23 +150,98 @@ void Application::on_menu_help_about()
   dbgln("App|Help|About was selected.");
 }
 
+// Decoding keeps the inflated scanlines and the RGBA bitmap around at the
+// same time, the estimate counts both.
+static size_t estimate_decoded_size(const std::string &path)
+{
+  std::ifstream file(path, std::ios::in|std::ios::binary);
+  int width;
+  int height;
+
+  if (!file.is_open() || !Pixor::peek_image_size(file, width, height)) return 0;
+  return (size_t) width * height * 4 * 2;
+}
+
 void Application::on_file_open(const type_vec_files &files, const Glib::ustring &name) {
   dbgln("Called on_file_open!");
   dbgln("Name: %s", name.c_str());
+
+  std::vector<std::pair<size_t, std::string>> queue;
   for (const auto &file : files) {
-    dbgln("File path: %s", file.get()->get_path().c_str());
+    auto path = file.get()->get_path();
+    dbgln("File path: %s", path.c_str());
+    queue.push_back({estimate_decoded_size(path), path});
   }
 
-  std::ifstream file(files[0].get()->get_path(), std::ios::in|std::ios::binary);
+  // Largest first, so the batch takes about as long as its biggest file
+  // instead of ending with a big decode on an otherwise idle pool.
+  std::stable_sort(queue.begin(), queue.end(), [](const auto &a, const auto &b) {
+    return a.first > b.first;
+  });
 
-  if (!file.is_open()) {
-    printf("cannot open %s (No such file or directory)\n", "some file");
-    return;
+  for (const auto &entry : queue) {
+    submit_decode(entry.second, entry.first);
+  }
+}
+
+void Application::submit_decode(const std::string &path, size_t estimated_size)
+{
+  hold();
+  auto job = decode_queue.submit([this, path, estimated_size](Pixor::Job &decode_job) {
+    DecodedImage decoded;
+
+    // Whatever happens the main loop hears about the file, it drops the
+    // hold and gives back what is still reserved.
+    try {
+      decode_admission.acquire(estimated_size, decode_job);
+      decoded.reserved = estimated_size;
+      decode_job.check_cancelled();
+      decoded.image = Pixor::open_image(path);
+      decoded.greyscale = Pixor::load_greyscale(decoded.image);
+
+      size_t resident = (size_t) decoded.image->get_width() * decoded.image->get_height() * 4;
+      if (resident < decoded.reserved) {
+        decode_admission.release(decoded.reserved - resident);
+        decoded.reserved = resident;
+      }
+    } catch (const Pixor::JobCancelled &) {
+      // Shutting down, nothing to report.
+    } catch (const std::exception &e) {
+      errln("Cannot decode %s: %s", path.c_str(), e.what());
+    } catch (...) {
+      errln("Cannot decode %s", path.c_str());
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(decode_mutex);
+      decoded_images.push_back(decoded);
+    }
+    decode_dispatcher.emit();
+  });
+  decode_jobs.push_back(job);
+}
+
+void Application::on_image_decoded()
+{
+  std::vector<DecodedImage> images;
+  {
+    std::lock_guard<std::mutex> lock(decode_mutex);
+    images.swap(decoded_images);
+  }
+
+  for (auto &decoded : images) {
+    if (decoded.greyscale) {
+      decoded.image->print_image_info();
+      current_image = decoded.image;
+      // The window keeps the application running from here on.
+      create_window(current_image, decoded.greyscale, decoded.reserved);
+    } else {
+      decode_admission.release(decoded.reserved);
+    }
+    release();
   }
 
-  auto image_ptr = Pixor::decode_png(file);
-  auto image = std::shared_ptr<Pixor::Image>((Pixor::Image *) image_ptr);
-  image->print_image_info();
-  current_image = image;
-  on_activate();
+  decode_jobs.erase(std::remove_if(decode_jobs.begin(), decode_jobs.end(), [](const std::shared_ptr<Pixor::Job> &job) {
+    return job->is_finished();
+  }), decode_jobs.end());
 }
@@ -1,6 +1,10 @@
 #pragma once
 #include <gtkmm.h>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include "image.h"
+#include "job.h"
 
 class Application : public Gtk::Application
 {
@@ -10,18 +14,42 @@ public:
 protected:
   //Overrides of default signal handlers:
   Application();
+  ~Application() override;
   void on_startup() override;
   void on_activate() override;
 
 private:
-  void create_window();
+  void create_window(std::shared_ptr<Pixor::Image> &image, std::shared_ptr<byte[]> greyscale, size_t reserved);
 
-  void on_window_hide(Gtk::Window* window);
+  void on_window_hide(Gtk::Window* window, size_t reserved);
   void on_menu_file_new_generic();
   void on_menu_file_quit();
   void on_menu_help_about();
   void on_file_open(const type_vec_files &files, const Glib::ustring &name);
+  void on_image_decoded();
+  void submit_decode(const std::string &path, size_t estimated_size);
 
   Glib::RefPtr<Gtk::Builder> m_refBuilder;
   std::shared_ptr<Pixor::Image> current_image;
+
+  // Without a greyscale bitmap the file could not be decoded. reserved is
+  // what the decode still holds of decode_admission.
+  struct DecodedImage {
+    std::shared_ptr<Pixor::Image> image;
+    std::shared_ptr<byte[]> greyscale;
+    size_t reserved = 0;
+  };
+
+  // Files are decoded on a pool of their own so a large batch does not
+  // hold up the filters on the shared queue. Each decode reserves its
+  // estimated size from decode_admission before it starts, gives back
+  // what it needed only while decoding and keeps the size of the bitmap
+  // until its window is gone. Finished and failed decodes alike are handed
+  // to the main loop through the dispatcher.
+  Pixor::JobQueue decode_queue;
+  Pixor::MemoryAdmission decode_admission;
+  Glib::Dispatcher decode_dispatcher;
+  std::mutex decode_mutex;
+  std::vector<DecodedImage> decoded_images;
+  std::vector<std::shared_ptr<Pixor::Job>> decode_jobs;
 };
@@ -0,0 +1,140 @@
+#include <new>
+#include "buffer_pool.h"
+
+using namespace Pixor;
+
+static const int MIN_CLASS_SHIFT = 8;
+static const int CLASSES_PER_DOUBLING = 4;
+static const int CLASS_COUNT = (64 - MIN_CLASS_SHIFT) * CLASSES_PER_DOUBLING + 1;
+static const std::align_val_t BUFFER_ALIGNMENT{64};
+
+// Class 0 holds everything up to 256 bytes, after that every doubling is
+// split into four steps: 320, 384, 448, 512, 640, ...
+int BufferPool::size_class(size_t bytes)
+{
+  if (bytes <= ((size_t) 1 << MIN_CLASS_SHIFT)) return 0;
+
+  int shift = 63 - __builtin_clzll(bytes - 1);
+  size_t step = ((size_t) 1 << shift) / CLASSES_PER_DOUBLING;
+  size_t k = (bytes - ((size_t) 1 << shift) + step - 1) / step;
+
+  return (shift - MIN_CLASS_SHIFT) * CLASSES_PER_DOUBLING + (int) k;
+}
+
+size_t BufferPool::class_size(int index)
+{
+  if (index == 0) return (size_t) 1 << MIN_CLASS_SHIFT;
+
+  int shift = MIN_CLASS_SHIFT + (index - 1) / CLASSES_PER_DOUBLING;
+  size_t k = (index - 1) % CLASSES_PER_DOUBLING + 1;
+
+  return ((size_t) 1 << shift) + k * (((size_t) 1 << shift) / CLASSES_PER_DOUBLING);
+}
+
+BufferPool::BufferPool(size_t max_cached_bytes) :
+  classes(CLASS_COUNT),
+  max_cached_bytes(max_cached_bytes)
+{}
+
+BufferPool::~BufferPool()
+{
+  trim();
+}
+
+void *BufferPool::acquire(size_t bytes, int &index)
+{
+  if (bytes > ((size_t) 1 << 62)) throw std::bad_alloc();
+
+  index = size_class(bytes);
+  size_t size = class_size(index);
+  void *buffer = nullptr;
+
+  {
+    SizeClass &c = classes[index];
+    std::lock_guard<std::mutex> lock(c.mutex);
+
+    if (!c.free.empty()) {
+      buffer = c.free.back();
+      c.free.pop_back();
+    }
+  }
+
+  if (buffer) {
+    bytes_cached.fetch_sub(size, std::memory_order_relaxed);
+    reuses.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    buffer = ::operator new(size, BUFFER_ALIGNMENT);
+    system_allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  size_t in_use = bytes_in_use.fetch_add(size, std::memory_order_relaxed) + size;
+  size_t peak = peak_bytes_in_use.load(std::memory_order_relaxed);
+  while (in_use > peak && !peak_bytes_in_use.compare_exchange_weak(peak, in_use, std::memory_order_relaxed));
+
+  return buffer;
+}
+
+void BufferPool::release(void *buffer, int index)
+{
+  size_t size = class_size(index);
+  bytes_in_use.fetch_sub(size, std::memory_order_relaxed);
+
+  // Over the cap the buffer goes back to the system, so one huge image
+  // does not pin its memory for the rest of the session.
+  size_t cached = bytes_cached.load(std::memory_order_relaxed);
+  if (cached + size <= max_cached_bytes) {
+    bytes_cached.fetch_add(size, std::memory_order_relaxed);
+
+    SizeClass &c = classes[index];
+    std::lock_guard<std::mutex> lock(c.mutex);
+    c.free.push_back(buffer);
+    return;
+  }
+
+  ::operator delete(buffer, BUFFER_ALIGNMENT);
+  system_frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+void BufferPool::trim()
+{
+  for (int index = 0; index < CLASS_COUNT; index++) {
+    SizeClass &c = classes[index];
+    std::lock_guard<std::mutex> lock(c.mutex);
+
+    for (void *buffer : c.free) {
+      ::operator delete(buffer, BUFFER_ALIGNMENT);
+    }
+
+    bytes_cached.fetch_sub(c.free.size() * class_size(index), std::memory_order_relaxed);
+    system_frees.fetch_add(c.free.size(), std::memory_order_relaxed);
+    c.free.clear();
+  }
+}
+
+void BufferPool::set_max_cached_bytes(size_t bytes)
+{
+  max_cached_bytes = bytes;
+  if (bytes_cached.load(std::memory_order_relaxed) > bytes) trim();
+}
+
+BufferPoolStats BufferPool::get_stats() const
+{
+  return {
+    allocations.load(std::memory_order_relaxed),
+    reuses.load(std::memory_order_relaxed),
+    system_allocations.load(std::memory_order_relaxed),
+    system_frees.load(std::memory_order_relaxed),
+    bytes_in_use.load(std::memory_order_relaxed),
+    bytes_cached.load(std::memory_order_relaxed),
+    peak_bytes_in_use.load(std::memory_order_relaxed),
+  };
+}
+
+// Never destroyed: buffers held by other statics may be released during
+// exit, after a static pool would be gone.
+BufferPool &BufferPool::shared()
+{
+  static BufferPool *pool = new BufferPool();
+  return *pool;
+}
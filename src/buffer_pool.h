@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+namespace Pixor {
+
+struct BufferPoolStats {
+  size_t allocations;
+  size_t reuses;
+  size_t system_allocations;
+  size_t system_frees;
+  size_t bytes_in_use;
+  size_t bytes_cached;
+  size_t peak_bytes_in_use;
+};
+
+// Recycles the large temporary buffers of the pipelines (pixel buffers,
+// matrices, inflate output, tiles). Requests are rounded up to a size
+// class, at most a quarter above the request, and a released buffer waits
+// in its class for the next request of that size instead of going back to
+// the system. Processing a batch of similar images therefore stops
+// allocating after the first one. Each class has its own lock, held only
+// to push or pop a pointer.
+//
+// Buffers are not initialised. They are handed out as shared_ptr whose
+// deleter returns them to the pool, from whichever thread drops the last
+// reference.
+class BufferPool {
+  struct SizeClass {
+    std::mutex mutex;
+    std::vector<void *> free;
+  };
+
+  std::vector<SizeClass> classes;
+  size_t max_cached_bytes;
+  std::atomic<size_t> allocations{0};
+  std::atomic<size_t> reuses{0};
+  std::atomic<size_t> system_allocations{0};
+  std::atomic<size_t> system_frees{0};
+  std::atomic<size_t> bytes_in_use{0};
+  std::atomic<size_t> bytes_cached{0};
+  std::atomic<size_t> peak_bytes_in_use{0};
+
+  static int size_class(size_t bytes);
+  static size_t class_size(int index);
+  void *acquire(size_t bytes, int &index);
+  void release(void *buffer, int index);
+
+public:
+  BufferPool(size_t max_cached_bytes = DEFAULT_MAX_CACHED_BYTES);
+  ~BufferPool();
+
+  static const size_t DEFAULT_MAX_CACHED_BYTES = (size_t) 512 << 20;
+
+  template <class T>
+  std::shared_ptr<T[]> allocate(size_t count)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "pooled buffers are not constructed");
+
+    int index;
+    T *buffer = (T *) acquire(count * sizeof(T), index);
+    return std::shared_ptr<T[]>(buffer, [this, index](T *p) {release(p, index);});
+  }
+
+  // Frees every cached buffer.
+  void trim();
+  void set_max_cached_bytes(size_t bytes);
+  BufferPoolStats get_stats() const;
+  static BufferPool &shared();
+};
+
+}
@@ -1,5 +1,6 @@
 #include "canny.h"
 #include "debug.h"
+#include "trace.h"
 #include <cassert>
 #include <math.h>
 
@@ -31,7 +32,7 @@ Pixor::Matrix<double> y_mgrid(int val)
   return res;
 }
 
-Pixor::Matrix<double> gaussian_kernel(int size, double sigma = 1)
+Pixor::Matrix<double> gaussian_kernel(int size, double sigma)
 {
   assert(size % 2 == 1);
   size /= 2;
@@ -45,6 +46,7 @@ Pixor::Matrix<double> gaussian_kernel(int size, double sigma = 1)
 
 Pixor::Matrix<double> sobel_filter(Pixor::Matrix<double> &m, Pixor::Matrix<double> &theta)
 {
+  PIXOR_TRACE_SCOPE("canny.sobel", "canny");
   std::vector<std::vector<double>> kx_v = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
   std::vector<std::vector<double>> ky_v = {{1, 2, 1}, {0, 0, 0}, {-1, -2, -1}};
   Matrix<double> kx(kx_v);
@@ -61,6 +63,7 @@ Pixor::Matrix<double> sobel_filter(Pixor::Matrix<double> &m, Pixor::Matrix<doubl
 
 Pixor::Matrix<double> non_max_suppression(Pixor::Matrix<double> &m, Pixor::Matrix<double> &theta)
 {
+  PIXOR_TRACE_SCOPE("canny.non_max_suppression", "canny");
   int width = m.get_width();
   int height = m.get_height();
   Pixor::Matrix<double> res(width, height);
@@ -112,8 +115,9 @@ Pixor::Matrix<double> non_max_suppression(Pixor::Matrix<double> &m, Pixor::Matri
   return res;
 }
 
-Pixor::Matrix<double> threshold(Pixor::Matrix<double> &m, double low_threshold_ratio = 0.03, double high_threshold_ratio = 0.12)
+Pixor::Matrix<double> threshold(Pixor::Matrix<double> &m, double low_threshold_ratio, double high_threshold_ratio)
 {
+  PIXOR_TRACE_SCOPE("canny.threshold", "canny");
   auto high_threshold = m.max() * high_threshold_ratio;
   auto low_threshold = high_threshold * low_threshold_ratio;
   int width = m.get_width();
@@ -137,8 +141,9 @@ Pixor::Matrix<double> threshold(Pixor::Matrix<double> &m, double low_threshold_r
   return res;
 }
 
-Pixor::Matrix<double> hysteresis(Pixor::Matrix<double> &m, int weak = 25, int strong = 255)
+Pixor::Matrix<double> hysteresis(Pixor::Matrix<double> &m, int weak, int strong)
 {
+  PIXOR_TRACE_SCOPE("canny.hysteresis", "canny");
   int width = m.get_width();
   int height = m.get_height();
   Pixor::Matrix<double> res(m);
@@ -175,14 +180,40 @@ Pixor::Matrix<double> hysteresis(Pixor::Matrix<double> &m, int weak = 25, int st
   return res;
 }
 
-Pixor::Matrix<double> canny_edge_detector(Pixor::Matrix<double> &m)
+SobelGradients sobel_graph(Pixor::Graph &graph, Pixor::GraphNode input, const CannyOptions &options)
 {
-  auto res = m.convolve(gaussian_kernel(5));
-  Pixor::Matrix<double> theta(100, 100);
-  res = sobel_filter(res, theta);
-  res = non_max_suppression(res, theta);
-  res = threshold(res);
-  res = hysteresis(res);
-  
-  return res;
+  auto blurred = graph.convolve(input, gaussian_kernel(options.kernel_size, options.sigma));
+  auto ix = graph.convolve(blurred, Matrix<double>({{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}}));
+  auto iy = graph.convolve(blurred, Matrix<double>({{1, 2, 1}, {0, 0, 0}, {-1, -2, -1}}));
+
+  return {ix, iy};
+}
+
+Pixor::GraphNode canny_graph(Pixor::Graph &graph, Pixor::GraphNode input, const CannyOptions &options)
+{
+  return canny_graph(graph, sobel_graph(graph, input, options), options);
+}
+
+Pixor::GraphNode canny_graph(Pixor::Graph &graph, SobelGradients gradients, const CannyOptions &options)
+{
+  auto magnitude = graph.normalize(graph.hypot(gradients.ix, gradients.iy), 255);
+  auto theta = graph.arctan2(gradients.iy, gradients.ix);
+  auto suppressed = graph.non_max_suppression(magnitude, theta);
+  auto thresholded = graph.threshold(suppressed, options.low_threshold_ratio, options.high_threshold_ratio);
+
+  return graph.hysteresis(thresholded);
+}
+
+// When a job is given, progress is reported after every stage and a
+// cancelled job stops the detector with JobCancelled.
+//
+// Runs as a graph: the blur and the gradients are computed in bands and
+// never stored whole, only the gradient magnitude and direction and the
+// suppressed edges get full-size buffers.
+Pixor::Matrix<double> canny_edge_detector(Pixor::Matrix<double> &m, Pixor::Job *job, const CannyOptions &options)
+{
+  PIXOR_TRACE_SCOPE("canny", "canny");
+  Pixor::Graph graph;
+
+  return graph.run(canny_graph(graph, graph.input(m), options), job);
 }
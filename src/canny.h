@@ -1,4 +1,37 @@
 #pragma once
 #include "matrix.h"
+#include "job.h"
+#include "graph.h"
 
-Pixor::Matrix<double> canny_edge_detector(Pixor::Matrix<double> &m);
+struct CannyOptions {
+  int kernel_size = 5;
+  double sigma = 1;
+  double low_threshold_ratio = 0.03;
+  double high_threshold_ratio = 0.12;
+};
+
+// The individual stages, exposed for the benchmarks.
+Pixor::Matrix<double> gaussian_kernel(int size, double sigma = 1);
+Pixor::Matrix<double> sobel_filter(Pixor::Matrix<double> &m, Pixor::Matrix<double> &theta);
+Pixor::Matrix<double> non_max_suppression(Pixor::Matrix<double> &m, Pixor::Matrix<double> &theta);
+Pixor::Matrix<double> threshold(Pixor::Matrix<double> &m, double low_threshold_ratio = 0.03, double high_threshold_ratio = 0.12);
+Pixor::Matrix<double> hysteresis(Pixor::Matrix<double> &m, int weak = 25, int strong = 255);
+
+// The gradients of the blurred image, what the edge and the corner
+// detectors have in common.
+struct SobelGradients {
+  Pixor::GraphNode ix;
+  Pixor::GraphNode iy;
+};
+
+// Declares the blur and the Sobel filters on graph.
+SobelGradients sobel_graph(Pixor::Graph &graph, Pixor::GraphNode input, const CannyOptions &options = CannyOptions());
+
+// Declares the detector on graph, from input to the edge map. The result
+// matches canny_edge_detector().
+Pixor::GraphNode canny_graph(Pixor::Graph &graph, Pixor::GraphNode input, const CannyOptions &options = CannyOptions());
+// The same from gradients already on graph.
+Pixor::GraphNode canny_graph(Pixor::Graph &graph, SobelGradients gradients, const CannyOptions &options = CannyOptions());
+
+Pixor::Matrix<double> canny_edge_detector(Pixor::Matrix<double> &m, Pixor::Job *job = nullptr,
+  const CannyOptions &options = CannyOptions());
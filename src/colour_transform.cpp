@@ -0,0 +1,433 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "colour_transform.h"
+#include "context.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+static const int BLOCK_SIZE = 256;
+
+static float unit_clamp(float x)
+{
+  return std::min(1.0f, std::max(0.0f, x));
+}
+
+static float lut_lookup(const std::vector<float> &lut, float x)
+{
+  return lut[(int) (unit_clamp(x) * (lut.size() - 1) + 0.5f)];
+}
+
+static float srgb_to_linear_value(float x)
+{
+  if (x <= 0.04045f) return x / 12.92f;
+  return std::pow((x + 0.055f) / 1.055f, 2.4f);
+}
+
+static float linear_to_srgb_value(float x)
+{
+  if (x <= 0.0031308f) return x * 12.92f;
+  return 1.055f * std::pow(x, 1 / 2.4f) - 0.055f;
+}
+
+// Tabulates func over [0, 1]. If the last stage is also a per-channel
+// lookup the two are merged, so the hot loop does a single lookup.
+void ColourTransform::add_channel_stage(std::function<float(float)> func, int lut_size)
+{
+  lut_size = std::max(lut_size, 2);
+
+  if (!stages.empty() && stages.back().type == STAGE_CHANNEL_LUT) {
+    auto previous = stages.back().lut;
+    auto inner = func;
+    lut_size = std::max(lut_size, (int) previous.size());
+    func = [previous, inner](float x) {return inner(lut_lookup(previous, x));};
+    stages.pop_back();
+  }
+
+  Stage stage{STAGE_CHANNEL_LUT, std::vector<float>(lut_size), std::vector<byte>(256), {0, 0, 0}};
+
+  for (int i = 0; i < lut_size; i++) {
+    stage.lut[i] = unit_clamp(func(i / (float) (lut_size - 1)));
+  }
+  for (int i = 0; i < 256; i++) {
+    stage.byte_lut[i] = (byte) (unit_clamp(func(i / 255.0f)) * 255 + 0.5f);
+  }
+
+  stages.push_back(std::move(stage));
+}
+
+ColourTransform &ColourTransform::luma(LumaWeights weights)
+{
+  Stage stage{STAGE_LUMA, {}, {}, {1 / 3.0f, 1 / 3.0f, 1 / 3.0f}};
+
+  if (weights == LUMA_REC601) {
+    stage.params[0] = 0.299f;
+    stage.params[1] = 0.587f;
+    stage.params[2] = 0.114f;
+  } else if (weights == LUMA_REC709) {
+    stage.params[0] = 0.2126f;
+    stage.params[1] = 0.7152f;
+    stage.params[2] = 0.0722f;
+  }
+
+  stages.push_back(stage);
+  return *this;
+}
+
+ColourTransform &ColourTransform::srgb_to_linear(int lut_size)
+{
+  add_channel_stage(srgb_to_linear_value, lut_size);
+  return *this;
+}
+
+ColourTransform &ColourTransform::linear_to_srgb(int lut_size)
+{
+  add_channel_stage(linear_to_srgb_value, lut_size);
+  return *this;
+}
+
+ColourTransform &ColourTransform::adjust_hsv(float hue_shift, float saturation, float value)
+{
+  stages.push_back({STAGE_HSV, {}, {}, {hue_shift, saturation, value}});
+  return *this;
+}
+
+ColourTransform &ColourTransform::adjust_hsl(float hue_shift, float saturation, float lightness)
+{
+  stages.push_back({STAGE_HSL, {}, {}, {hue_shift, saturation, lightness}});
+  return *this;
+}
+
+ColourTransform &ColourTransform::levels(float in_black, float in_white, float gamma, float out_black, float out_white)
+{
+  float in_range = std::max(in_white - in_black, 1e-6f);
+  float exponent = 1 / std::max(gamma, 1e-6f);
+
+  add_channel_stage([=](float x) {
+    float v = std::pow(unit_clamp((x - in_black) / in_range), exponent);
+    return out_black + v * (out_white - out_black);
+  }, 4096);
+
+  return *this;
+}
+
+// Monotone cubic interpolation through the control points (Fritsch-Carlson),
+// so the curve never overshoots between points.
+ColourTransform &ColourTransform::curve(std::vector<std::pair<float, float>> points)
+{
+  std::sort(points.begin(), points.end());
+  int n = points.size();
+
+  if (n < 2) {
+    float y = n == 1 ? points[0].second : 0;
+    add_channel_stage([=](float x) {return n == 1 ? y : x;}, 256);
+    return *this;
+  }
+
+  std::vector<float> slopes(n - 1);
+  std::vector<float> tangents(n);
+
+  for (int i = 0; i < n - 1; i++) {
+    float dx = std::max(points[i + 1].first - points[i].first, 1e-6f);
+    slopes[i] = (points[i + 1].second - points[i].second) / dx;
+  }
+
+  tangents[0] = slopes[0];
+  tangents[n - 1] = slopes[n - 2];
+  for (int i = 1; i < n - 1; i++) {
+    tangents[i] = slopes[i - 1] * slopes[i] <= 0 ? 0 : (slopes[i - 1] + slopes[i]) / 2;
+  }
+  for (int i = 0; i < n - 1; i++) {
+    if (slopes[i] == 0) {
+      tangents[i] = 0;
+      tangents[i + 1] = 0;
+      continue;
+    }
+
+    float a = tangents[i] / slopes[i];
+    float b = tangents[i + 1] / slopes[i];
+    float h = a * a + b * b;
+    if (h > 9) {
+      float t = 3 / std::sqrt(h);
+      tangents[i] = t * a * slopes[i];
+      tangents[i + 1] = t * b * slopes[i];
+    }
+  }
+
+  add_channel_stage([=](float x) {
+    if (x <= points[0].first) return points[0].second;
+    if (x >= points[n - 1].first) return points[n - 1].second;
+
+    int i = 0;
+    while (x > points[i + 1].first) i++;
+
+    float dx = std::max(points[i + 1].first - points[i].first, 1e-6f);
+    float t = (x - points[i].first) / dx;
+    float t2 = t * t;
+    float t3 = t2 * t;
+
+    return (2 * t3 - 3 * t2 + 1) * points[i].second
+      + (t3 - 2 * t2 + t) * dx * tangents[i]
+      + (-2 * t3 + 3 * t2) * points[i + 1].second
+      + (t3 - t2) * dx * tangents[i + 1];
+  }, 4096);
+
+  return *this;
+}
+
+static void rgb_to_hsv(float r, float g, float b, float &h, float &s, float &v)
+{
+  float max = std::max(r, std::max(g, b));
+  float min = std::min(r, std::min(g, b));
+  float delta = max - min;
+
+  v = max;
+  s = max > 0 ? delta / max : 0;
+
+  if (delta <= 0) {
+    h = 0;
+  } else if (max == r) {
+    h = (g - b) / delta / 6;
+  } else if (max == g) {
+    h = ((b - r) / delta + 2) / 6;
+  } else {
+    h = ((r - g) / delta + 4) / 6;
+  }
+
+  if (h < 0) h += 1;
+}
+
+static void hsv_to_rgb(float h, float s, float v, float &r, float &g, float &b)
+{
+  float sector = h * 6;
+  int i = (int) sector % 6;
+  float f = sector - std::floor(sector);
+  float p = v * (1 - s);
+  float q = v * (1 - s * f);
+  float t = v * (1 - s * (1 - f));
+
+  switch (i) {
+    case 0: r = v; g = t; b = p; break;
+    case 1: r = q; g = v; b = p; break;
+    case 2: r = p; g = v; b = t; break;
+    case 3: r = p; g = q; b = v; break;
+    case 4: r = t; g = p; b = v; break;
+    default: r = v; g = p; b = q; break;
+  }
+}
+
+static float hue_wrap(float h)
+{
+  return h - std::floor(h);
+}
+
+#ifdef __SSE2__
+// The SSE2 kernels below do the same float operations in the same order
+// as the scalar loops, so their results are identical. Each returns where
+// the scalar loop has to take over.
+
+// Four table indices at a time, the lookups stay scalar as SSE2 has no
+// gather. The clamp sends NaN to 0 like unit_clamp().
+static int lut_lookup_sse2(const std::vector<float> &lut, float *values, int count)
+{
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1);
+  const __m128 scale = _mm_set1_ps((float) (lut.size() - 1));
+  const __m128 half = _mm_set1_ps(0.5f);
+  alignas(16) int index[4];
+  int i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(values + i), zero), one);
+    _mm_store_si128((__m128i *) index, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, scale), half)));
+    values[i + 0] = lut[index[0]];
+    values[i + 1] = lut[index[1]];
+    values[i + 2] = lut[index[2]];
+    values[i + 3] = lut[index[3]];
+  }
+
+  return i;
+}
+
+static int luma_sse2(const float *weights, float *r, float *g, float *b, int count)
+{
+  const __m128 wr = _mm_set1_ps(weights[0]);
+  const __m128 wg = _mm_set1_ps(weights[1]);
+  const __m128 wb = _mm_set1_ps(weights[2]);
+  int i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(wr, _mm_loadu_ps(r + i)), _mm_mul_ps(wg, _mm_loadu_ps(g + i))),
+      _mm_mul_ps(wb, _mm_loadu_ps(b + i)));
+    _mm_storeu_ps(r + i, y);
+    _mm_storeu_ps(g + i, y);
+    _mm_storeu_ps(b + i, y);
+  }
+
+  return i;
+}
+
+static __m128i to_byte_lanes_sse2(const float *values)
+{
+  __m128 x = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(values), _mm_setzero_ps()), _mm_set1_ps(1));
+  return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(255)), _mm_set1_ps(0.5f)));
+}
+
+// Packs four pixels back into RGBA8, alpha comes from src.
+static int store_block_sse2(const float *r, const float *g, const float *b, const byte *src, byte *dest, int count)
+{
+  const __m128i alpha_mask = _mm_set1_epi32((int) 0xff000000);
+  int i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    __m128i alpha = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + i * 4)), alpha_mask);
+    __m128i pixels = _mm_or_si128(to_byte_lanes_sse2(r + i), _mm_slli_epi32(to_byte_lanes_sse2(g + i), 8));
+    pixels = _mm_or_si128(pixels, _mm_slli_epi32(to_byte_lanes_sse2(b + i), 16));
+    _mm_storeu_si128((__m128i *) (dest + i * 4), _mm_or_si128(pixels, alpha));
+  }
+
+  return i;
+}
+#endif
+
+void ColourTransform::apply_stage(const Stage &stage, float *r, float *g, float *b, int count)
+{
+  switch (stage.type) {
+    case STAGE_CHANNEL_LUT:
+      for (float *values : {r, g, b}) {
+        int i = 0;
+#ifdef __SSE2__
+        i = lut_lookup_sse2(stage.lut, values, count);
+#endif
+        for (; i < count; i++) {
+          values[i] = lut_lookup(stage.lut, values[i]);
+        }
+      }
+      break;
+    case STAGE_LUMA: {
+      float wr = stage.params[0];
+      float wg = stage.params[1];
+      float wb = stage.params[2];
+      int i = 0;
+
+#ifdef __SSE2__
+      i = luma_sse2(stage.params, r, g, b, count);
+#endif
+      for (; i < count; i++) {
+        float y = wr * r[i] + wg * g[i] + wb * b[i];
+        r[i] = y;
+        g[i] = y;
+        b[i] = y;
+      }
+      break;
+    }
+    case STAGE_HSV:
+      for (int i = 0; i < count; i++) {
+        float h, s, v;
+        rgb_to_hsv(r[i], g[i], b[i], h, s, v);
+        h = hue_wrap(h + stage.params[0]);
+        s = unit_clamp(s * stage.params[1]);
+        v = unit_clamp(v * stage.params[2]);
+        hsv_to_rgb(h, s, v, r[i], g[i], b[i]);
+      }
+      break;
+    case STAGE_HSL:
+      for (int i = 0; i < count; i++) {
+        float h, s, v;
+        rgb_to_hsv(r[i], g[i], b[i], h, s, v);
+
+        float l = v * (1 - s / 2);
+        float sl = (l <= 0 || l >= 1) ? 0 : (v - l) / std::min(l, 1 - l);
+
+        h = hue_wrap(h + stage.params[0]);
+        sl = unit_clamp(sl * stage.params[1]);
+        l = unit_clamp(l * stage.params[2]);
+
+        v = l + sl * std::min(l, 1 - l);
+        s = v <= 0 ? 0 : 2 * (1 - l / v);
+        hsv_to_rgb(h, s, v, r[i], g[i], b[i]);
+      }
+      break;
+  }
+}
+
+void ColourTransform::apply(const byte *src, byte *dest, size_t count) const
+{
+  if (stages.empty()) {
+    if (src != dest) memcpy(dest, src, count * 4);
+    return;
+  }
+
+  if (stages.size() == 1 && stages[0].type == STAGE_CHANNEL_LUT) {
+    const byte *lut = stages[0].byte_lut.data();
+
+    for (size_t i = 0; i < count * 4; i += 4) {
+      byte a = src[i + 3];
+      dest[i + 0] = lut[src[i + 0]];
+      dest[i + 1] = lut[src[i + 1]];
+      dest[i + 2] = lut[src[i + 2]];
+      dest[i + 3] = a;
+    }
+    return;
+  }
+
+  // A leading per-channel stage is folded into the byte-to-float load
+  // table, the remaining stages run on the block.
+  bool fold_first = stages[0].type == STAGE_CHANNEL_LUT;
+  float load_table[256];
+  float r[BLOCK_SIZE];
+  float g[BLOCK_SIZE];
+  float b[BLOCK_SIZE];
+
+  for (int i = 0; i < 256; i++) {
+    load_table[i] = fold_first ? lut_lookup(stages[0].lut, i / 255.0f) : i / 255.0f;
+  }
+
+  for (size_t start = 0; start < count; start += BLOCK_SIZE) {
+    int n = (int) std::min((size_t) BLOCK_SIZE, count - start);
+    const byte *block_src = src + start * 4;
+    byte *block_dest = dest + start * 4;
+
+    for (int i = 0; i < n; i++) {
+      const byte *pixel = block_src + i * 4;
+      r[i] = load_table[pixel[0]];
+      g[i] = load_table[pixel[1]];
+      b[i] = load_table[pixel[2]];
+    }
+
+    for (size_t s = fold_first ? 1 : 0; s < stages.size(); s++) {
+      apply_stage(stages[s], r, g, b, n);
+    }
+
+    int i = 0;
+#ifdef __SSE2__
+    i = store_block_sse2(r, g, b, block_src, block_dest, n);
+#endif
+    for (; i < n; i++) {
+      byte *pixel = block_dest + i * 4;
+      byte a = block_src[i * 4 + 3];
+      pixel[0] = (byte) (unit_clamp(r[i]) * 255 + 0.5f);
+      pixel[1] = (byte) (unit_clamp(g[i]) * 255 + 0.5f);
+      pixel[2] = (byte) (unit_clamp(b[i]) * 255 + 0.5f);
+      pixel[3] = a;
+    }
+  }
+}
+
+void ColourTransform::apply(Context &context) const
+{
+  PIXOR_TRACE_SCOPE("colour_transform", "context");
+  JournalScope scope(context.get_journal());
+  std::vector<RGBA> tile(TILE_PIXELS);
+
+  context.for_each_tile([&](rect area) {
+    size_t count = (size_t) area.width * area.height;
+    context.read_rect(area, tile.data());
+    apply((const byte *) tile.data(), (byte *) tile.data(), count);
+    context.write_rect(area, tile.data());
+  });
+}
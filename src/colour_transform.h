@@ -0,0 +1,60 @@
+#pragma once
+#include <functional>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include "pixor.h"
+
+namespace Pixor {
+
+class Context;
+
+enum LumaWeights {
+  LUMA_AVERAGE = 0,
+  LUMA_REC601 = 1,
+  LUMA_REC709 = 2,
+};
+
+// A chain of colour operations on RGBA8 pixels, applied in one pass.
+// Pixels are processed in small blocks that stay in cache, every stage
+// runs over the block before it is written back, so chaining stages does
+// not allocate image-sized buffers. Per-channel stages (sRGB/linear,
+// levels, curves) are tabulated when they are added and merged with the
+// previous per-channel stage, a chain made only of them becomes a single
+// 256-entry lookup. Alpha is passed through unchanged. With SSE2 the luma
+// and lookup stages and the conversion back to bytes run on four pixels
+// at a time, with the same results as the scalar code.
+class ColourTransform {
+  enum StageType {
+    STAGE_CHANNEL_LUT = 0,
+    STAGE_LUMA = 1,
+    STAGE_HSV = 2,
+    STAGE_HSL = 3,
+  };
+
+  struct Stage {
+    StageType type;
+    std::vector<float> lut;
+    std::vector<byte> byte_lut;
+    float params[3];
+  };
+
+  std::vector<Stage> stages;
+
+  void add_channel_stage(std::function<float(float)> func, int lut_size);
+  static void apply_stage(const Stage &stage, float *r, float *g, float *b, int count);
+
+public:
+  ColourTransform &luma(LumaWeights weights = LUMA_REC601);
+  ColourTransform &srgb_to_linear(int lut_size = 4096);
+  ColourTransform &linear_to_srgb(int lut_size = 4096);
+  ColourTransform &adjust_hsv(float hue_shift, float saturation, float value);
+  ColourTransform &adjust_hsl(float hue_shift, float saturation, float lightness);
+  ColourTransform &levels(float in_black, float in_white, float gamma = 1, float out_black = 0, float out_white = 1);
+  ColourTransform &curve(std::vector<std::pair<float, float>> points);
+  bool empty() const {return stages.empty();}
+  void apply(const byte *src, byte *dest, size_t count) const;
+  void apply(Context &context) const;
+};
+
+}
@@ -1,9 +1,13 @@
 #include "context.h"
 #include "debug.h"
 #include "pixor.h"
+#include "pixel_format.h"
+#include "trace.h"
+#include "thread_pool.h"
 #include <memory>
 #include <vector>
 #include <cmath>
+#include <algorithm>
 
 using namespace Pixor;
 
@@ -29,7 +33,14 @@ void Context::set_source_rgba(RGBA color)
 
 void Context::set_pixel(point coord, RGBA value)
 {
-  pixel_data[coord.y * width + coord.x] = value;
+  if (journal) journal->record_write(*this, coord);
+
+  if (tiles) {
+    tiles->set_pixel(coord, value);
+    return;
+  }
+
+  pixel_data[(size_t) coord.y * width + coord.x] = value;
 }
 
 void Context::set_pixel_safe(point coord, RGBA value)
@@ -45,18 +56,21 @@ void Context::set_pixel_clamped(point coord, RGBA value)
 
 RGBA Context::get_pixel(point coord) const
 {
-  return pixel_data[coord.y * width + coord.x];
+  if (tiles) return tiles->get_pixel(coord);
+  return pixel_data[(size_t) coord.y * width + coord.x];
 }
 
+// For tiled contexts the pointer is only good for reading, writing through
+// it would bypass copy-on-write and change every copy sharing the tile.
 RGBA *Context::get_pixel_ptr(point coord) const
 {
-  return pixel_data + coord.y * width + coord.x;
+  if (tiles) return tiles->get_pixel_ptr(coord);
+  return pixel_data + (size_t) coord.y * width + coord.x;
 }
 
 RGBA *Context::get_pixel_ptr_clamped(point coord) const
 {
-  point clamped = clamp_coord(coord);
-  return pixel_data + clamped.y * width + clamped.x;
+  return get_pixel_ptr(clamp_coord(coord));
 }
 
 RGBA Context::get_pixel_safe(point coord, RGBA default_value)
@@ -65,8 +79,65 @@ RGBA Context::get_pixel_safe(point coord, RGBA default_value)
   return get_pixel(coord);
 }
 
+const std::shared_ptr<byte[]> Context::get_target_bitmap() const
+{
+  if (tiles) return tiles->flatten();
+  return bitmap;
+}
+
+void Context::for_each_tile(std::function<void(rect)> func) const
+{
+  for (int y = 0; y < height; y += TILE_SIZE) {
+    for (int x = 0; x < width; x += TILE_SIZE) {
+      func({x, y, std::min(TILE_SIZE, width - x), std::min(TILE_SIZE, height - y)});
+    }
+  }
+}
+
+// Returns the area changed by drawing operations since the last call.
+// Plain set_pixel calls are not tracked, every drawing primitive marks the
+// area it touched.
+rect Context::take_dirty()
+{
+  rect res = dirty;
+  dirty = {0, 0, 0, 0};
+
+  return res;
+}
+
+void Context::read_rect(rect area, RGBA *dest) const
+{
+  if (tiles) {
+    tiles->read_rect(area, dest);
+    return;
+  }
+
+  for (int row = 0; row < area.height; row++) {
+    const RGBA *src = pixel_data + (size_t) (area.y + row) * width + area.x;
+    memcpy(dest + (size_t) row * area.width, src, area.width * sizeof(RGBA));
+  }
+}
+
+void Context::write_rect(rect area, const RGBA *src)
+{
+  if (journal) journal->record_rect(*this, area);
+  mark_dirty(area);
+
+  if (tiles) {
+    tiles->write_rect(area, src);
+    return;
+  }
+
+  for (int row = 0; row < area.height; row++) {
+    RGBA *dest = pixel_data + (size_t) (area.y + row) * width + area.x;
+    memcpy(dest, src + (size_t) row * area.width, area.width * sizeof(RGBA));
+  }
+}
+
 void Context::draw_pattern(std::vector<point> &points, Pattern &p)
 {
+  JournalScope scope(journal);
+
   for (const auto &point : points) {
     p.draw_onto(*this, point);
   }
@@ -74,6 +145,7 @@ void Context::draw_pattern(std::vector<point> &points, Pattern &p)
 
 void Context::draw_line(point p1, point p2, int line_width)
 {
+  JournalScope scope(journal);
   auto points = approx_line(p1, p2);
   auto drawing_pattern = Pattern::make_square(line_width, &source_color);
   draw_pattern(points, *drawing_pattern);
@@ -87,6 +159,27 @@ void Context::draw_line_with_pattern(point p1, point p2)
   draw_pattern(points, *source_pattern);
 }
 
+void Context::draw_polyline_with_pattern(const std::vector<point> &points)
+{
+  if (!source_pattern || points.empty()) return;
+
+  JournalScope scope(journal);
+  std::vector<point> stamps = {points[0]};
+
+  // Consecutive segments share their end points, stamp those only once.
+  for (size_t i = 1; i < points.size(); i++) {
+    if (points[i].x == points[i - 1].x && points[i].y == points[i - 1].y) continue;
+
+    auto line = approx_line(points[i - 1], points[i]);
+    bool reversed = line.front().x != points[i - 1].x || line.front().y != points[i - 1].y;
+
+    if (reversed) std::reverse(line.begin(), line.end());
+    stamps.insert(stamps.end(), line.begin() + 1, line.end());
+  }
+
+  draw_pattern(stamps, *source_pattern);
+}
+
 std::shared_ptr<Pattern> Context::scale(int new_width, int new_height) const
 {
   auto bitmap = std::shared_ptr<RGBA *[]>(new RGBA *[new_width * new_height]);
@@ -94,10 +187,13 @@ std::shared_ptr<Pattern> Context::scale(int new_width, int new_height) const
   float scale_x = new_width / (float) width;
   float scale_y = new_height / (float) height;
 
-  for (int x = 0; x < new_width; x++) {
-    for (int y = 0; y < new_height; y++) {
+  // Row by row, so both the pattern and the source are walked in memory
+  // order.
+  for (int y = 0; y < new_height; y++) {
+    int src_y = std::round(y / scale_y);
+
+    for (int x = 0; x < new_width; x++) {
       int src_x = std::round(x / scale_x);
-      int src_y = std::round(y / scale_y);
 
       res->set_pixel({x, y}, get_pixel_ptr_clamped({src_x, src_y}));
     }
@@ -106,17 +202,14 @@ std::shared_ptr<Pattern> Context::scale(int new_width, int new_height) const
   return res;
 }
 
-std::shared_ptr<Context> Context::convolve(Matrix<float> kernel)
+void Context::convolve_rect(Matrix<float> &kernel, Context &dest, rect area) const
 {
-  auto res = std::shared_ptr<Context>(new Context(*this));
   int kernel_width = kernel.get_width();
   int kernel_height = kernel.get_height();
   int offset = (kernel_width - 1) / 2;
-  assert(kernel_width == kernel_height);
-  assert(kernel_width % 2 == 1);
 
-  for (int image_row = 0; image_row < height; image_row++) {
-    for (int image_col = 0; image_col < width; image_col++) {
+  for (int image_row = area.y; image_row < area.y + area.height; image_row++) {
+    for (int image_col = area.x; image_col < area.x + area.width; image_col++) {
       RGBA pixel = get_pixel({image_col, image_row});
       float r_val = 0;
       float g_val = 0;
@@ -130,7 +223,7 @@ std::shared_ptr<Context> Context::convolve(Matrix<float> kernel)
             src_row = image_row + (kernel_height - kernel_row) - offset;
           }
           if (src_col < 0 || src_col > width - 1) {
-            src_col = image_row + (kernel_width - kernel_col) - offset;
+            src_col = image_col + (kernel_width - kernel_col) - offset;
           }
           RGBA src_pixel = get_pixel({src_col, src_row});
           float k_val = kernel[kernel_height - 1 - kernel_row][kernel_width - 1 - kernel_col];
@@ -141,13 +234,29 @@ std::shared_ptr<Context> Context::convolve(Matrix<float> kernel)
         }
       }
 
-      res->set_pixel({image_col, image_row}, rgba(
+      dest.set_pixel({image_col, image_row}, rgba(
         r_val,
         g_val,
         b_val,
         alpha(pixel)));
     }
   }
+}
+
+std::shared_ptr<Context> Context::convolve(Matrix<float> kernel)
+{
+  PIXOR_TRACE_SCOPE("context.convolve", "context");
+
+  // Every destination pixel gets written, so there is no need to copy the
+  // source first.
+  auto res = std::make_shared<Context>(width, height, tiles ? CONTEXT_STORAGE_TILED : CONTEXT_STORAGE_FLAT);
+  assert(kernel.get_width() == kernel.get_height());
+  assert(kernel.get_width() % 2 == 1);
+
+  // Tiles of a tiled destination are each written by a single task.
+  parallel_for_tiles(width, height, [&](rect area) {
+    convolve_rect(kernel, *res, area);
+  });
 
   return res;
 }
@@ -156,23 +265,50 @@ std::shared_ptr<Matrix<double>> Context::get_matrix() const
 {
   auto res = std::shared_ptr<Matrix<double>>(new Matrix<double>(width, height));
 
-  for (int x = 0; x < width; x++) {
-    for (int y = 0; y < height; y++) {
-      RGBA pixel = get_pixel({x, y});
-      (*res)[y][x] = red(pixel);
-    }
+  if (!tiles) {
+    parallel_for_rows(height, width, [&](int begin, int end) {
+      size_t offset = (size_t) begin * width;
+      extract_channel((const byte *) (pixel_data + offset), PIXEL_FORMAT_RGBA8, 0, res->data() + offset, (size_t) (end - begin) * width);
+    });
+    return res;
   }
 
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    std::vector<RGBA> row(width);
+
+    for (int y = begin; y < end; y++) {
+      read_rect({0, y, width, 1}, row.data());
+      extract_channel((const byte *) row.data(), PIXEL_FORMAT_RGBA8, 0, res->data() + (size_t) y * width, width);
+    }
+  });
+
   return res;
 }
 
 void Context::set_matrix(Matrix<double> &m)
 {
-  for (int x = 0; x < width; x++) {
-    for (int y = 0; y < height; y++) {
-      RGBA pixel = get_pixel({x, y});
-      double val = m[y][x];
-      set_pixel({x, y}, rgba(val, val, val, alpha(pixel)));
-    }
+  JournalScope scope(journal);
+  mark_dirty(get_bounds());
+
+  if (journal) journal->record_rect(*this, get_bounds());
+
+  if (!tiles) {
+    parallel_for_rows(height, width, [&](int begin, int end) {
+      size_t offset = (size_t) begin * width;
+      grey_to_rgba(m.data() + offset, (byte *) (pixel_data + offset), (size_t) (end - begin) * width);
+    });
+    return;
   }
+
+  // Whole rows of tiles per task, so no two tasks write to the same tile.
+  int tile_rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+  ThreadPool::shared().parallel_for(0, tile_rows, 1, [&](int begin, int end) {
+    std::vector<RGBA> row(width);
+
+    for (int y = begin * TILE_SIZE; y < std::min(height, end * TILE_SIZE); y++) {
+      tiles->read_rect({0, y, width, 1}, row.data());
+      grey_to_rgba(m.data() + (size_t) y * width, (byte *) row.data(), width);
+      tiles->write_rect({0, y, width, 1}, row.data());
+    }
+  });
 }
@@ -2,24 +2,37 @@
 #include <memory>
 #include <vector>
 #include <cstring>
+#include <functional>
 #include "pixor.h"
 #include "debug.h"
 #include "pattern.h"
 #include "matrix.h"
+#include "tiled_bitmap.h"
+#include "undo_journal.h"
+#include "buffer_pool.h"
 
 namespace Pixor {
 
 class Pattern;
 
+enum ContextStorage {
+  CONTEXT_STORAGE_FLAT = 0,
+  CONTEXT_STORAGE_TILED = 1,
+};
+
 class Context {
   std::shared_ptr<byte[]> bitmap;
+  std::shared_ptr<TiledBitmap> tiles;
+  std::shared_ptr<UndoJournal> journal;
   std::shared_ptr<Pattern> source_pattern;
-  RGBA *pixel_data;
+  RGBA *pixel_data = nullptr;
   int width;
   int height;
   RGBA source_color = 0;
+  rect dirty = {0, 0, 0, 0};
 
   point clamp_coord(point coord) const;
+  void convolve_rect(Matrix<float> &kernel, Context &dest, rect area) const;
 
 public:
   Context(std::shared_ptr<byte[]> bitmap, int width, int height) :
@@ -30,33 +43,59 @@ public:
     pixel_data = (RGBA *) bitmap.get();
   }
 
-  Context(int width, int height) :
-    bitmap(new byte[width * height * 4]),
+  Context(std::shared_ptr<TiledBitmap> tiles) :
+    tiles(tiles),
+    width(tiles->get_width()),
+    height(tiles->get_height())
+  {}
+
+  Context(int width, int height, ContextStorage storage = CONTEXT_STORAGE_FLAT) :
     width(width),
     height(height)
   {
-    pixel_data = (RGBA *) bitmap.get();
-
-    for (int i = 0; i < width * height * 4; i++) {
-      bitmap[i] = 0;
+    if (storage == CONTEXT_STORAGE_TILED) {
+      tiles = std::make_shared<TiledBitmap>(width, height);
+      return;
     }
+
+    bitmap = BufferPool::shared().allocate<byte>(get_byte_size());
+    memset(bitmap.get(), 0, get_byte_size());
+    pixel_data = (RGBA *) bitmap.get();
   }
 
+  // Tiled contexts share their tiles with the copy and only clone the ones
+  // that get written to afterwards, flat contexts copy the whole bitmap.
   Context(const Context &context) :
     width(context.get_width()),
     height(context.get_height())
   {
-    int bitmap_size = width * height * 4;
-    byte *bitmap_data = new byte[bitmap_size];
-
-    memcpy(bitmap_data, context.get_target_bitmap().get(), bitmap_size);
+    if (context.tiles) {
+      tiles = std::make_shared<TiledBitmap>(*context.tiles);
+      return;
+    }
 
-    pixel_data = (RGBA *) bitmap_data;
-    bitmap.reset(bitmap_data);
+    bitmap = BufferPool::shared().allocate<byte>(get_byte_size());
+    memcpy(bitmap.get(), context.get_target_bitmap().get(), get_byte_size());
+    pixel_data = (RGBA *) bitmap.get();
   }
 
+  // A member-wise assignment would share a flat bitmap and a tiled one
+  // without copy on write, copy construct instead.
+  Context &operator=(const Context &context) = delete;
+
   int get_width() const {return width;}
   int get_height() const {return height;}
+  size_t get_byte_size() const {return (size_t) width * height * 4;}
+  bool is_tiled() const {return (bool) tiles;}
+  std::shared_ptr<TiledBitmap> get_tiles() const {return tiles;}
+  rect get_bounds() const {return {0, 0, width, height};}
+  void for_each_tile(std::function<void(rect)> func) const;
+  void set_journal(std::shared_ptr<UndoJournal> journal) {this->journal = journal;}
+  std::shared_ptr<UndoJournal> get_journal() const {return journal;}
+  void mark_dirty(rect area) {dirty = rect_union(dirty, rect_intersect(area, get_bounds()));}
+  rect take_dirty();
+  void read_rect(rect area, RGBA *dest) const;
+  void write_rect(rect area, const RGBA *src);
   bool coord_in_bounds(point p);
   void set_source_pattern(std::shared_ptr<Pattern> pattern);
   void set_source_rgba(RGBA color);
@@ -70,7 +109,8 @@ public:
   void draw_pattern(std::vector<point> &points, Pattern &p);
   void draw_line(point p1, point p2, int line_width);
   void draw_line_with_pattern(point p1, point p2);
-  const std::shared_ptr<byte[]> get_target_bitmap() const {return bitmap;}
+  void draw_polyline_with_pattern(const std::vector<point> &points);
+  const std::shared_ptr<byte[]> get_target_bitmap() const;
   std::shared_ptr<Pattern> scale(int new_width, int new_height) const;
   std::shared_ptr<Context> convolve(Matrix<float> m);
   std::shared_ptr<Matrix<double>> get_matrix() const;
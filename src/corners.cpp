@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <cmath>
+#include "corners.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+static std::vector<double> gaussian_window(int size, double sigma)
+{
+  std::vector<double> res(size);
+  double sum = 0;
+
+  for (int i = 0; i < size; i++) {
+    double x = i - size / 2;
+    res[i] = std::exp(-x * x / (2 * sigma * sigma));
+    sum += res[i];
+  }
+  for (double &value : res) {
+    value /= sum;
+  }
+
+  return res;
+}
+
+GraphNode Pixor::corner_graph(Graph &graph, SobelGradients gradients, const CornerOptions &options)
+{
+  auto window = gaussian_window(options.window_size, options.window_sigma);
+  auto xx = graph.convolve_separable(graph.multiply(gradients.ix, gradients.ix), window);
+  auto yy = graph.convolve_separable(graph.multiply(gradients.iy, gradients.iy), window);
+  auto xy = graph.convolve_separable(graph.multiply(gradients.ix, gradients.iy), window);
+
+  return graph.corner_response(xx, yy, xy, options.method == CORNER_SHI_TOMASI, options.harris_k);
+}
+
+std::vector<Corner> Pixor::select_corners(Matrix<double> &response, const CornerOptions &options)
+{
+  PIXOR_TRACE_SCOPE("corners.select", "corners");
+  int width = response.get_width();
+  int height = response.get_height();
+  const double *data = response.data();
+  std::vector<std::vector<Corner>> rows(height);
+  std::vector<double> row_max(height, 0);
+
+  // Local maxima over their 8 neighbours. Of equal neighbours the first in
+  // raster order wins.
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      for (int x = 0; x < width; x++) {
+        double value = data[(size_t) y * width + x];
+        if (value <= 0) continue;
+        row_max[y] = std::max(row_max[y], value);
+
+        bool peak = true;
+        for (int ny = std::max(0, y - 1); ny <= std::min(height - 1, y + 1) && peak; ny++) {
+          for (int nx = std::max(0, x - 1); nx <= std::min(width - 1, x + 1); nx++) {
+            double other = data[(size_t) ny * width + nx];
+            bool earlier = ny < y || (ny == y && nx < x);
+
+            if (other > value || (other == value && earlier)) {
+              peak = false;
+              break;
+            }
+          }
+        }
+
+        if (peak) rows[y].push_back({{x, y}, value});
+      }
+    }
+  });
+
+  double max = height > 0 ? *std::max_element(row_max.begin(), row_max.end()) : 0;
+  double threshold = max * options.quality_ratio;
+  std::vector<Corner> candidates;
+
+  for (auto &row : rows) {
+    for (auto &corner : row) {
+      if (corner.response >= threshold) candidates.push_back(corner);
+    }
+  }
+  std::stable_sort(candidates.begin(), candidates.end(), [](const Corner &a, const Corner &b) {
+    return a.response > b.response;
+  });
+
+  int cell = std::max(1, options.min_distance);
+  int grid_width = (width + cell - 1) / cell;
+  int grid_height = (height + cell - 1) / cell;
+  std::vector<std::vector<point>> grid((size_t) grid_width * grid_height);
+  std::vector<Corner> res;
+
+  for (auto &corner : candidates) {
+    int gx = corner.position.x / cell;
+    int gy = corner.position.y / cell;
+    bool suppressed = false;
+
+    for (int y = std::max(0, gy - 1); y <= std::min(grid_height - 1, gy + 1) && !suppressed; y++) {
+      for (int x = std::max(0, gx - 1); x <= std::min(grid_width - 1, gx + 1) && !suppressed; x++) {
+        for (point p : grid[(size_t) y * grid_width + x]) {
+          int dx = p.x - corner.position.x;
+          int dy = p.y - corner.position.y;
+
+          if (dx * dx + dy * dy < options.min_distance * options.min_distance) {
+            suppressed = true;
+            break;
+          }
+        }
+      }
+    }
+    if (suppressed) continue;
+
+    grid[(size_t) gy * grid_width + gx].push_back(corner.position);
+    res.push_back(corner);
+    if (options.max_corners > 0 && (int) res.size() == options.max_corners) break;
+  }
+
+  return res;
+}
+
+std::vector<Corner> Pixor::corner_detector(Matrix<double> &m, Job *job, const CornerOptions &options,
+  const CannyOptions &gradient_options)
+{
+  PIXOR_TRACE_SCOPE("corners", "corners");
+  Graph graph;
+  auto response = graph.run(corner_graph(graph, sobel_graph(graph, graph.input(m), gradient_options), options), job);
+
+  return select_corners(response, options);
+}
+
+Features Pixor::detect_features(Matrix<double> &m, Job *job, const CannyOptions &canny_options,
+  const CornerOptions &corner_options)
+{
+  PIXOR_TRACE_SCOPE("features", "corners");
+  Graph graph;
+  auto gradients = sobel_graph(graph, graph.input(m), canny_options);
+  auto edges = canny_graph(graph, gradients, canny_options);
+  auto response = corner_graph(graph, gradients, corner_options);
+  auto outputs = graph.run(std::vector<GraphNode> {edges, response}, job);
+
+  return {outputs[0], select_corners(outputs[1], corner_options)};
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <vector>
+#include "pixor.h"
+#include "canny.h"
+#include "graph.h"
+#include "job.h"
+#include "matrix.h"
+
+namespace Pixor {
+
+enum CornerMethod {
+  // det - k * trace^2 of the structure tensor.
+  CORNER_HARRIS,
+  // The smaller eigenvalue of the structure tensor.
+  CORNER_SHI_TOMASI,
+};
+
+struct CornerOptions {
+  CornerMethod method = CORNER_HARRIS;
+  // Larger values find fewer Harris corners.
+  double harris_k = 0.04;
+  // The Gaussian window the products of the gradients are summed over.
+  int window_size = 5;
+  double window_sigma = 1;
+  // Corners need at least this share of the strongest response.
+  double quality_ratio = 0.01;
+  // Corners closer than this to a stronger one are dropped.
+  int min_distance = 8;
+  // 0 keeps every corner.
+  int max_corners = 0;
+};
+
+struct Corner {
+  point position;
+  double response;
+};
+
+struct Features {
+  Matrix<double> edges;
+  std::vector<Corner> corners;
+};
+
+// Declares the corner response on graph from the gradients of
+// sobel_graph(). Everything up to the response is computed in bands.
+GraphNode corner_graph(Graph &graph, SobelGradients gradients, const CornerOptions &options = CornerOptions());
+
+// Local maxima of response above quality_ratio of the strongest, strongest
+// first. Accepted corners go into a grid of min_distance cells, so each
+// candidate is only checked against the cells around it.
+std::vector<Corner> select_corners(Matrix<double> &response, const CornerOptions &options = CornerOptions());
+
+// The gradients are those of canny_edge_detector() with gradient_options.
+std::vector<Corner> corner_detector(Matrix<double> &m, Job *job = nullptr, const CornerOptions &options = CornerOptions(),
+  const CannyOptions &gradient_options = CannyOptions());
+
+// Edges and corners from one run of one graph, the blur and the gradients
+// are computed once for both. The edges match canny_edge_detector().
+Features detect_features(Matrix<double> &m, Job *job = nullptr, const CannyOptions &canny_options = CannyOptions(),
+  const CornerOptions &corner_options = CornerOptions());
+
+}
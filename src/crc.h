@@ -1 +1,2 @@
+unsigned int update_crc(unsigned int crc, unsigned char *buf, int len);
 unsigned int crc(unsigned char *buf, int len);
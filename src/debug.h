@@ -1,16 +1,76 @@
 #pragma once
+#include <atomic>
 #include <ctime>
 #include <stdio.h>
 #include <string>
 
+namespace Pixor {
+
+enum LogLevel {
+  LOG_LEVEL_ERROR = 0,
+  LOG_LEVEL_WARNING = 1,
+  LOG_LEVEL_INFO = 2,
+  LOG_LEVEL_DEBUG = 3,
+};
+
+// Messages above PIXOR_LOG_LEVEL are compiled out, the rest are filtered
+// at run time against log_level, which defaults to info.
+#ifndef PIXOR_LOG_LEVEL
+#define PIXOR_LOG_LEVEL 3
+#endif
+
+inline std::atomic<int> log_level{LOG_LEVEL_INFO};
+
+inline void set_log_level(LogLevel level) {log_level.store(level, std::memory_order_relaxed);}
+
+inline bool log_enabled(LogLevel level)
+{
+  return level <= PIXOR_LOG_LEVEL && level <= log_level.load(std::memory_order_relaxed);
+}
+
+// Parses "error", "warning", "info" or "debug", returns false otherwise.
+inline bool parse_log_level(const std::string &name, LogLevel &level)
+{
+  static const char *names[] = {"error", "warning", "info", "debug"};
+
+  for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+    if (name == names[i]) {
+      level = (LogLevel) i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
 template<class... T>
-void dbgln(std::string str, T&&... args) 
+void logln(LogLevel level, std::string str, T&&... args)
 {
+  static const char *labels[] = {"Error", "Warning", "Info", "Debug"};
   std::time_t t = std::time(0);
-  std::tm* now = std::localtime(&t);
+  std::tm now;
+  localtime_r(&t, &now);
 
-  std::string date_template = "%d-%02d-%02d, %02d:%02d:%02d [Debug] ";
+  std::string date_template = "%d-%02d-%02d, %02d:%02d:%02d [%s] ";
   std::string print_template = date_template + str + '\n';
 
-  printf(print_template.c_str(), now->tm_year + 1900, now->tm_mon + 1, now->tm_mday, now->tm_hour, now->tm_min, now->tm_sec, std::forward<T>(args)...);
+  printf(print_template.c_str(), now.tm_year + 1900, now.tm_mon + 1, now.tm_mday, now.tm_hour, now.tm_min, now.tm_sec, labels[level], std::forward<T>(args)...);
+}
+
+}
+
+// The level check comes before anything else, including building the
+// format string, so a disabled message costs a relaxed load and a branch.
+template<class S, class... T>
+void dbgln(const S &str, T&&... args)
+{
+  if (!Pixor::log_enabled(Pixor::LOG_LEVEL_DEBUG)) return;
+  Pixor::logln(Pixor::LOG_LEVEL_DEBUG, str, std::forward<T>(args)...);
+}
+
+template<class S, class... T>
+void errln(const S &str, T&&... args)
+{
+  if (!Pixor::log_enabled(Pixor::LOG_LEVEL_ERROR)) return;
+  Pixor::logln(Pixor::LOG_LEVEL_ERROR, str, std::forward<T>(args)...);
 }
@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include "distance.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+// Columns copied out together. A whole cache line of every row is read at
+// once, instead of one value at a stride that may alias in the cache.
+static const int COLUMN_BLOCK = 8;
+
+// Scratch for the envelope of one line.
+struct Envelope {
+  std::vector<int> roots;
+  std::vector<double> bounds;
+
+  Envelope(int length) :
+    roots(length),
+    bounds(length + 1)
+    {}
+};
+
+// The 1D transform of the n samples of f: d[q] is the least of
+// (q - p)^2 + f[p] over all p, and at[q] the p it comes from. Infinite
+// samples have no parabola, a line without any finite one stays infinite.
+// at may be null.
+static void transform_line(const double *f, int n, double *d, int *at, Envelope &envelope)
+{
+  int *v = envelope.roots.data();
+  double *z = envelope.bounds.data();
+  int k = -1;
+
+  for (int q = 0; q < n; q++) {
+    double fq = f[q];
+    if (fq == INFINITY) continue;
+
+    double s = -INFINITY;
+    while (k >= 0) {
+      int p = v[k];
+      s = ((fq + (double) q * q) - (f[p] + (double) p * p)) / (2.0 * (q - p));
+      if (s > z[k]) break;
+      k--;
+    }
+    if (k < 0) s = -INFINITY;
+
+    k++;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = INFINITY;
+  }
+
+  if (k < 0) {
+    for (int q = 0; q < n; q++) {
+      d[q] = INFINITY;
+      if (at) at[q] = -1;
+    }
+    return;
+  }
+
+  k = 0;
+  for (int q = 0; q < n; q++) {
+    while (z[k + 1] < q) k++;
+
+    int p = v[k];
+    d[q] = (double) (q - p) * (q - p) + f[p];
+    if (at) at[q] = p;
+  }
+}
+
+Matrix<double> Pixor::distance_transform(Matrix<double> &edges, Matrix<int> *nearest)
+{
+  PIXOR_TRACE_SCOPE("distance_transform", "distance");
+  int width = edges.get_width();
+  int height = edges.get_height();
+  if (nearest && (size_t) width * height > (size_t) INT_MAX) {
+    throw std::invalid_argument("Image too large for nearest edge indices");
+  }
+
+  const double *src = edges.data();
+  Matrix<double> rows(width, height);
+  Matrix<double> res(width, height);
+  // Where the minima come from, only kept for nearest.
+  Matrix<int> row_at(nearest ? width : 0, nearest ? height : 0);
+  Matrix<int> column_at(nearest ? width : 0, nearest ? height : 0);
+
+  // Along the rows the edges are parabolas at height 0, everything else
+  // has none.
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    Envelope envelope(width);
+    std::vector<double> f(width);
+
+    for (int y = begin; y < end; y++) {
+      size_t offset = (size_t) y * width;
+
+      for (int x = 0; x < width; x++) {
+        f[x] = src[offset + x] > 0 ? 0 : INFINITY;
+      }
+      transform_line(f.data(), width, rows.data() + offset, nearest ? row_at.data() + offset : nullptr, envelope);
+    }
+  });
+
+  int blocks = (width + COLUMN_BLOCK - 1) / COLUMN_BLOCK;
+  parallel_for_rows(blocks, height * COLUMN_BLOCK, [&](int begin, int end) {
+    Envelope envelope(height);
+    std::vector<double> f((size_t) COLUMN_BLOCK * height);
+    std::vector<double> d((size_t) COLUMN_BLOCK * height);
+    std::vector<int> at((size_t) COLUMN_BLOCK * height);
+
+    for (int block = begin; block < end; block++) {
+      int x0 = block * COLUMN_BLOCK;
+      int columns = std::min(COLUMN_BLOCK, width - x0);
+
+      for (int y = 0; y < height; y++) {
+        const double *row = rows.data() + (size_t) y * width + x0;
+        for (int i = 0; i < columns; i++) {
+          f[(size_t) i * height + y] = row[i];
+        }
+      }
+
+      for (int i = 0; i < columns; i++) {
+        size_t offset = (size_t) i * height;
+        transform_line(f.data() + offset, height, d.data() + offset, nearest ? at.data() + offset : nullptr, envelope);
+      }
+
+      for (int y = 0; y < height; y++) {
+        size_t offset = (size_t) y * width + x0;
+
+        for (int i = 0; i < columns; i++) {
+          res.data()[offset + i] = d[(size_t) i * height + y];
+          if (nearest) column_at.data()[offset + i] = at[(size_t) i * height + y];
+        }
+      }
+    }
+  });
+
+  double *distances = res.data();
+  if (nearest) *nearest = Matrix<int>(width, height);
+
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      size_t offset = (size_t) y * width;
+
+      for (int x = 0; x < width; x++) {
+        distances[offset + x] = std::sqrt(distances[offset + x]);
+
+        if (nearest) {
+          int row = column_at.data()[offset + x];
+          nearest->data()[offset + x] = row < 0 ? -1 : row * width + row_at.data()[(size_t) row * width + x];
+        }
+      }
+    }
+  });
+
+  return res;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "pixor.h"
+#include "matrix.h"
+
+namespace Pixor {
+
+// The exact Euclidean distance from every pixel to the nearest edge of
+// edges, every value above 0 being an edge, as in canny_edge_detector().
+//
+// Felzenszwalb and Huttenlocher: the squared distance along every row,
+// then along every column the lower envelope of parabolas rooted at the
+// row results. Linear in the number of pixels whatever the distances,
+// rows and then columns are shared between threads.
+//
+// With nearest, also the index y * width + x of the nearest edge. Without
+// any edges every distance is INFINITY and every index -1. Throws
+// std::invalid_argument if nearest is asked for and the indices would not
+// fit an int.
+Matrix<double> distance_transform(Matrix<double> &edges, Matrix<int> *nearest = nullptr);
+
+}
@@ -0,0 +1,67 @@
+#include <algorithm>
+#include "filter_preview.h"
+#include "pattern.h"
+
+using namespace Pixor;
+
+static const int PREVIEW_DIVISORS[] = {8, 4, 2, 1};
+static const int MIN_PREVIEW_SIDE = 64;
+
+static std::shared_ptr<Matrix<double>> scaled_matrix(const Context &source, int divisor)
+{
+  if (divisor == 1) return source.get_matrix();
+
+  int width = std::max(1, source.get_width() / divisor);
+  int height = std::max(1, source.get_height() / divisor);
+  Context scaled(source.scale(width, height)->hydrate(), width, height);
+
+  return scaled.get_matrix();
+}
+
+static void run_passes(const Context &source, const MatrixFilter &filter, const PreviewCallback &on_result, Job &job)
+{
+  int side = std::min(source.get_width(), source.get_height());
+  std::vector<int> divisors;
+  double total_cost = 0;
+  double done_cost = 0;
+
+  for (int divisor : PREVIEW_DIVISORS) {
+    if (divisor > 1 && side / divisor < MIN_PREVIEW_SIDE) continue;
+    divisors.push_back(divisor);
+    total_cost += 1.0 / (divisor * divisor);
+  }
+
+  for (int divisor : divisors) {
+    double cost = 1.0 / (divisor * divisor);
+    double base = done_cost / total_cost;
+    double weight = cost / total_cost;
+
+    // Each pass reports into the outer job, weighted by its pixel count.
+    Job pass([&job, base, weight](Job &pass_job) {
+      job.set_progress(base + weight * pass_job.get_progress());
+    });
+
+    auto m = scaled_matrix(source, divisor);
+    job.check_cancelled();
+    auto result = std::make_shared<Matrix<double>>(filter(*m, &pass, divisor));
+    job.check_cancelled();
+
+    on_result(result, divisor);
+    done_cost += cost;
+  }
+}
+
+std::shared_ptr<Job> Pixor::run_progressive_filter(JobQueue &queue, std::shared_ptr<const Context> source, MatrixFilter filter,
+  PreviewCallback on_result, std::function<void(Job &)> progress_callback, std::function<void()> on_finished)
+{
+  return queue.submit([source, filter, on_result, on_finished](Job &job) {
+    try {
+      run_passes(*source, filter, on_result, job);
+    } catch (...) {
+      if (on_finished) on_finished();
+      throw;
+    }
+
+    if (on_finished) on_finished();
+  }, progress_callback);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include "context.h"
+#include "job.h"
+#include "matrix.h"
+
+namespace Pixor {
+
+// A filter over a grey matrix. scale_divisor tells how far the input has
+// been scaled down, so size dependent parameters can follow it.
+typedef std::function<Matrix<double>(Matrix<double> &m, Job *job, int scale_divisor)> MatrixFilter;
+typedef std::function<void(std::shared_ptr<Matrix<double>> result, int scale_divisor)> PreviewCallback;
+
+// Runs filter on the source scaled down to 1/8, 1/4 and 1/2 and then at
+// full size, calling on_result from the worker after each pass. Coarse
+// passes that would leave the image too small are skipped. The job's
+// progress covers all passes, cancelling it stops the refinement at the
+// next progress report.
+//
+// on_finished is called from the worker once a run that started is over:
+// after the full size result, or when it was cancelled or the filter
+// threw.
+std::shared_ptr<Job> run_progressive_filter(JobQueue &queue, std::shared_ptr<const Context> source, MatrixFilter filter,
+  PreviewCallback on_result, std::function<void(Job &)> progress_callback = nullptr,
+  std::function<void()> on_finished = nullptr);
+
+}
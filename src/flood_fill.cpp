@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <vector>
+#include "flood_fill.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+static inline bool colour_within(RGBA c1, RGBA c2, int tolerance)
+{
+  for (int shift = 0; shift < 32; shift += 8) {
+    int diff = (int) ((c1 >> shift) & 0xff) - (int) ((c2 >> shift) & 0xff);
+    if (diff > tolerance || diff < -tolerance) return false;
+  }
+
+  return true;
+}
+
+struct fill_segment {
+  int x1;
+  int x2;
+  int y;
+  int dy;
+};
+
+// Span based scanline fill (Heckbert's seed fill). A segment on the stack
+// is a filled run [x1, x2] of row y - dy whose neighbours on row y still
+// have to be scanned. Runs of matching pixels found there are filled and
+// pushed onward in the same direction, a run is only pushed back towards
+// the row it came from when it reaches past the neighbours of its parent,
+// so most pixels are read once. The only allocations are the segment stack
+// and, when the fill colour itself matches the target, a visited mask so
+// filled pixels are not revisited.
+rect Pixor::flood_fill(Context &context, point seed, RGBA color, int tolerance, FillConnectivity connectivity)
+{
+  PIXOR_TRACE_SCOPE("flood_fill", "context");
+  int width = context.get_width();
+  int height = context.get_height();
+  if (!context.coord_in_bounds(seed)) return {0, 0, 0, 0};
+
+  RGBA target = context.get_pixel(seed);
+  bool tiled = context.is_tiled();
+  bool need_mask = colour_within(color, target, tolerance);
+  if (need_mask && tolerance == 0) return {0, 0, 0, 0};
+
+  JournalScope scope(context.get_journal());
+  auto journal = context.get_journal();
+  RGBA *pixels = tiled ? nullptr : context.get_pixel_ptr({0, 0});
+  std::vector<bool> visited(need_mask ? (size_t) width * height : 0);
+  std::vector<fill_segment> stack;
+  int diagonal = connectivity == FILL_CONNECTIVITY_8 ? 1 : 0;
+  int min_x = width;
+  int min_y = height;
+  int max_x = -1;
+  int max_y = -1;
+
+  // Settings are captured by value so the compiler can keep them in
+  // registers across the pixel stores.
+  auto inside = [=, &context, &visited](int x, int y) {
+    if (x < 0 || x >= width) return false;
+
+    size_t index = (size_t) y * width + x;
+    if (need_mask && visited[index]) return false;
+
+    RGBA pixel = tiled ? context.get_pixel({x, y}) : pixels[index];
+    if (tolerance == 0) return pixel == target;
+    return colour_within(pixel, target, tolerance);
+  };
+
+  auto set = [=, &context, &visited](int x, int y) {
+    size_t index = (size_t) y * width + x;
+
+    if (tiled) {
+      context.set_pixel({x, y}, color);
+    } else {
+      if (journal) journal->record_write(context, {x, y});
+      pixels[index] = color;
+    }
+    if (need_mask) visited[index] = true;
+  };
+
+  auto push = [&](int x1, int x2, int y, int dy) {
+    if (y < 0 || y >= height) return;
+    stack.push_back({x1, x2, y, dy});
+  };
+
+  auto mark_span = [&](int x1, int x2, int y) {
+    min_x = std::min(min_x, x1);
+    max_x = std::max(max_x, x2);
+    min_y = std::min(min_y, y);
+    max_y = std::max(max_y, y);
+  };
+
+  stack.reserve(1024);
+  push(seed.x, seed.x, seed.y, 1);
+  push(seed.x, seed.x, seed.y - 1, -1);
+
+  while (!stack.empty()) {
+    fill_segment segment = stack.back();
+    stack.pop_back();
+
+    int y = segment.y;
+    int dy = segment.dy;
+    int x1 = std::max(0, segment.x1 - diagonal);
+    int x2 = std::min(width - 1, segment.x2 + diagonal);
+    int x = x1;
+
+    if (inside(x, y)) {
+      while (inside(x - 1, y)) {
+        set(x - 1, y);
+        x--;
+      }
+    }
+
+    while (x1 <= x2) {
+      while (inside(x1, y)) {
+        set(x1, y);
+        x1++;
+      }
+
+      if (x1 > x) {
+        int run_end = x1 - 1;
+        mark_span(x, run_end, y);
+        push(x, run_end, y + dy, dy);
+
+        if (std::max(0, x - diagonal) < segment.x1 || std::min(width - 1, run_end + diagonal) > segment.x2) {
+          push(x, run_end, y - dy, -dy);
+        }
+      }
+
+      x1++;
+      while (x1 < x2 && !inside(x1, y)) x1++;
+      x = x1;
+    }
+  }
+
+  if (max_x < 0) return {0, 0, 0, 0};
+
+  rect res = {min_x, min_y, max_x - min_x + 1, max_y - min_y + 1};
+  context.mark_dirty(res);
+
+  return res;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include "pixor.h"
+#include "context.h"
+
+namespace Pixor {
+
+enum FillConnectivity {
+  FILL_CONNECTIVITY_4 = 4,
+  FILL_CONNECTIVITY_8 = 8,
+};
+
+// Fills the region connected to seed whose pixels differ from the seed
+// colour by at most tolerance in every channel. Returns the bounding box
+// of the filled pixels, which is empty if nothing changed.
+rect flood_fill(Context &context, point seed, RGBA color, int tolerance = 0, FillConnectivity connectivity = FILL_CONNECTIVITY_4);
+
+}
@@ -0,0 +1,778 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "graph.h"
+#include "buffer_pool.h"
+#include "pixel_format.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+// Rows per band. A band of every value a stage computes stays in cache
+// for typical widths.
+static const int BAND_ROWS = 32;
+
+GraphNode Graph::add(Node node, int node_width, int node_height)
+{
+  if (nodes.empty()) {
+    width = node_width;
+    height = node_height;
+  } else if (node_width != width || node_height != height) {
+    throw std::invalid_argument("Graph sources differ in size");
+  }
+
+  for (int i = 0; i < input_count(node); i++) {
+    GraphNode input = node.inputs[i];
+    if (input < 0 || input >= (int) nodes.size()) throw std::invalid_argument("Unknown graph node");
+
+    bool wants_rgba = node.op == OP_CHANNEL || node.op == OP_LUMA;
+    if (nodes[input].rgba != wants_rgba) throw std::invalid_argument("Graph node input has the wrong type");
+  }
+
+  nodes.push_back(std::move(node));
+  return nodes.size() - 1;
+}
+
+GraphNode Graph::add_plane_op(Op op, GraphNode a, GraphNode b, GraphNode c)
+{
+  Node node;
+  node.op = op;
+  node.inputs[0] = a;
+  node.inputs[1] = b;
+  node.inputs[2] = c;
+
+  return add(std::move(node), width, height);
+}
+
+int Graph::input_count(const Node &node) const
+{
+  switch (node.op) {
+    case OP_INPUT:
+    case OP_INPUT_RGBA:
+    case OP_DECODE:
+      return 0;
+    case OP_HYPOT:
+    case OP_ARCTAN2:
+    case OP_NON_MAX_SUPPRESSION:
+    case OP_MULTIPLY:
+      return 2;
+    case OP_CORNER_RESPONSE:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+// Rows of the input needed above and below every output row. Convolution
+// needs one more than its radius because of the way Matrix::convolve
+// mirrors the image edges.
+int Graph::halo(const Node &node, int input) const
+{
+  if (node.op == OP_CONVOLVE) return node.kernel_size / 2 + 1;
+  if (node.op == OP_NON_MAX_SUPPRESSION && input == 0) return 1;
+  if (node.op == OP_CONVOLVE_COLUMNS) return node.kernel_size / 2;
+  return 0;
+}
+
+GraphNode Graph::input(Matrix<double> &m)
+{
+  Node node;
+  node.op = OP_INPUT;
+  node.plane = std::shared_ptr<double>(std::shared_ptr<double>(), m.data());
+
+  // The matrix keeps its own reference, the graph only borrows the data.
+  return add(std::move(node), m.get_width(), m.get_height());
+}
+
+GraphNode Graph::input(const Context &context)
+{
+  Node node;
+  node.op = OP_INPUT_RGBA;
+  node.rgba = true;
+  node.bitmap = context.get_target_bitmap();
+
+  return add(std::move(node), context.get_width(), context.get_height());
+}
+
+GraphNode Graph::decode(std::shared_ptr<Image> image)
+{
+  Node node;
+  node.op = OP_DECODE;
+  node.rgba = true;
+  node.image = image;
+
+  return add(std::move(node), image->get_width(), image->get_height());
+}
+
+GraphNode Graph::channel(GraphNode rgba, int channel)
+{
+  Node node;
+  node.op = OP_CHANNEL;
+  node.inputs[0] = rgba;
+  node.channel = channel;
+
+  return add(std::move(node), width, height);
+}
+
+GraphNode Graph::luma(GraphNode rgba, LumaWeights weights)
+{
+  Node node;
+  node.op = OP_LUMA;
+  node.inputs[0] = rgba;
+  node.weights = weights;
+
+  return add(std::move(node), width, height);
+}
+
+GraphNode Graph::scale(GraphNode src, double k)
+{
+  GraphNode res = add_plane_op(OP_SCALE, src);
+  nodes[res].params[0] = k;
+
+  return res;
+}
+
+GraphNode Graph::hypot(GraphNode a, GraphNode b)
+{
+  return add_plane_op(OP_HYPOT, a, b);
+}
+
+GraphNode Graph::arctan2(GraphNode y, GraphNode x)
+{
+  return add_plane_op(OP_ARCTAN2, y, x);
+}
+
+GraphNode Graph::multiply(GraphNode a, GraphNode b)
+{
+  return add_plane_op(OP_MULTIPLY, a, b);
+}
+
+GraphNode Graph::convolve(GraphNode src, Matrix<double> kernel)
+{
+  if (kernel.get_width() != kernel.get_height() || kernel.get_width() % 2 == 0) {
+    throw std::invalid_argument("Convolution kernel must be square and of odd size");
+  }
+
+  GraphNode res = add_plane_op(OP_CONVOLVE, src);
+  Node &node = nodes[res];
+
+  node.kernel_size = kernel.get_width();
+  node.kernel.assign(kernel.data(), kernel.data() + node.kernel_size * node.kernel_size);
+
+  return res;
+}
+
+GraphNode Graph::convolve_separable(GraphNode src, const std::vector<double> &kernel)
+{
+  if (kernel.size() % 2 == 0) throw std::invalid_argument("Convolution kernel must be of odd size");
+
+  GraphNode rows = add_plane_op(OP_CONVOLVE_ROWS, src);
+  nodes[rows].kernel_size = kernel.size();
+  nodes[rows].kernel = kernel;
+
+  GraphNode res = add_plane_op(OP_CONVOLVE_COLUMNS, rows);
+  nodes[res].kernel_size = kernel.size();
+  nodes[res].kernel = kernel;
+
+  return res;
+}
+
+GraphNode Graph::non_max_suppression(GraphNode magnitude, GraphNode theta)
+{
+  return add_plane_op(OP_NON_MAX_SUPPRESSION, magnitude, theta);
+}
+
+GraphNode Graph::normalize(GraphNode src, double max_value)
+{
+  GraphNode res = add_plane_op(OP_NORMALIZE, src);
+  nodes[res].params[0] = max_value;
+
+  return res;
+}
+
+GraphNode Graph::threshold(GraphNode src, double low_ratio, double high_ratio, int weak, int strong)
+{
+  GraphNode res = add_plane_op(OP_THRESHOLD, src);
+  Node &node = nodes[res];
+
+  node.params[0] = low_ratio;
+  node.params[1] = high_ratio;
+  node.params[2] = weak;
+  node.params[3] = strong;
+
+  return res;
+}
+
+GraphNode Graph::hysteresis(GraphNode src, int weak, int strong)
+{
+  GraphNode res = add_plane_op(OP_HYSTERESIS, src);
+  Node &node = nodes[res];
+
+  node.params[0] = weak;
+  node.params[1] = strong;
+
+  return res;
+}
+
+GraphNode Graph::corner_response(GraphNode xx, GraphNode yy, GraphNode xy, bool min_eigenvalue, double k)
+{
+  GraphNode res = add_plane_op(OP_CORNER_RESPONSE, xx, yy, xy);
+  nodes[res].params[0] = min_eigenvalue;
+  nodes[res].params[1] = k;
+
+  return res;
+}
+
+// Decides which values get a full-size buffer and in which stage every
+// value is computed.
+//
+// A value can be computed one stage after the full-size values it reads,
+// and no earlier than the values it computes from. Values that need the
+// whole of their input first (a maximum, a serial pass) always get a
+// buffer, as do those inputs. A value computed in bands is recomputed by
+// every stage that reads it, so one read by a later stage than its own
+// gets a buffer instead.
+Graph::Plan Graph::make_plan(const std::vector<GraphNode> &outputs) const
+{
+  int count = nodes.size();
+  Plan plan;
+
+  plan.output.assign(count, false);
+  plan.live.assign(count, false);
+  plan.materialized.assign(count, false);
+  plan.needs_max.assign(count, false);
+  plan.level.assign(count, 0);
+  plan.readers.assign(count, 0);
+  plan.last_use.assign(count, 0);
+  plan.read_in_stage.assign(count, false);
+
+  for (GraphNode output : outputs) {
+    plan.output[output] = true;
+    plan.live[output] = true;
+    plan.materialized[output] = true;
+  }
+
+  for (int n = count - 1; n >= 0; n--) {
+    if (!plan.live[n]) continue;
+    const Node &node = nodes[n];
+
+    if (input_count(node) == 0) plan.materialized[n] = true;
+    if (node.op == OP_HYSTERESIS) plan.materialized[n] = true;
+
+    for (int i = 0; i < input_count(node); i++) {
+      GraphNode input = node.inputs[i];
+
+      plan.live[input] = true;
+      plan.readers[input]++;
+      if (node.op == OP_NORMALIZE || node.op == OP_THRESHOLD) {
+        plan.materialized[input] = true;
+        plan.needs_max[input] = true;
+      }
+      if (node.op == OP_HYSTERESIS) plan.materialized[input] = true;
+    }
+  }
+
+  for (int n = 0; n < count; n++) {
+    const Node &node = nodes[n];
+    if (!plan.live[n] || input_count(node) == 0) continue;
+
+    int level = 1;
+    for (int i = 0; i < input_count(node); i++) {
+      GraphNode input = node.inputs[i];
+      level = std::max(level, plan.level[input] + (plan.materialized[input] ? 1 : 0));
+    }
+    plan.level[n] = level;
+  }
+
+  for (int n = 0; n < count; n++) {
+    const Node &node = nodes[n];
+    if (!plan.live[n]) continue;
+
+    for (int i = 0; i < input_count(node); i++) {
+      GraphNode input = node.inputs[i];
+
+      if (plan.level[n] > plan.level[input]) plan.materialized[input] = true;
+      if (plan.level[n] == plan.level[input]) plan.read_in_stage[input] = true;
+      plan.last_use[input] = std::max(plan.last_use[input], plan.level[n]);
+    }
+    plan.last_level = std::max(plan.last_level, plan.level[n]);
+  }
+
+  return plan;
+}
+
+void Graph::load_source(GraphNode n, State &state) const
+{
+  const Node &node = nodes[n];
+
+  if (node.op == OP_INPUT) {
+    state.planes[n] = std::shared_ptr<double[]>(node.plane, node.plane.get());
+  } else if (node.op == OP_INPUT_RGBA) {
+    state.bitmaps[n] = node.bitmap;
+  } else if (node.op == OP_DECODE) {
+    PIXOR_TRACE_SCOPE("graph.decode", "graph");
+    state.bitmaps[n] = node.image->get_image_bitmap_with_alpha();
+    if (!state.bitmaps[n]) throw std::runtime_error("Graph source failed to decode");
+
+    state.bytes[n] = (size_t) width * height * 4;
+    state.bytes_in_use += state.bytes[n];
+  }
+}
+
+void Graph::compute_max(GraphNode n, State &state) const
+{
+  int bands = (height + BAND_ROWS - 1) / BAND_ROWS;
+  std::vector<double> partial(bands, -INFINITY);
+  const double *plane = state.planes[n].get();
+
+  ThreadPool::shared().parallel_for(0, bands, 1, [&](int begin, int end) {
+    for (int band = begin; band < end; band++) {
+      size_t first = (size_t) band * BAND_ROWS * width;
+      size_t last = (size_t) std::min(height, (band + 1) * BAND_ROWS) * width;
+
+      partial[band] = *std::max_element(plane + first, plane + last);
+    }
+  });
+
+  state.maxima[n] = *std::max_element(partial.begin(), partial.end());
+}
+
+// Works out the rows every value of the stage needs for rows [y0, y1) of
+// its outputs, widened by the stencil halos, then computes them in node
+// order. Band scratch comes from the buffer pool and goes back as soon as
+// its last reader in the band is done.
+void Graph::compute_band(const Plan &plan, int level, int y0, int y1, State &state) const
+{
+  int count = nodes.size();
+  std::vector<int> first(count, 0);
+  std::vector<int> last(count, 0);
+  std::vector<int> readers(count, 0);
+  std::vector<View> views(count);
+  std::vector<std::shared_ptr<double[]>> scratch(count);
+
+  auto computed_here = [&](int n) {
+    return plan.live[n] && plan.level[n] == level && input_count(nodes[n]) > 0;
+  };
+
+  auto widen = [&](int n, int from, int to) {
+    if (first[n] == last[n]) {
+      first[n] = from;
+      last[n] = to;
+    } else {
+      first[n] = std::min(first[n], from);
+      last[n] = std::max(last[n], to);
+    }
+  };
+
+  for (int n = count - 1; n >= 0; n--) {
+    if (!computed_here(n)) continue;
+
+    if (plan.materialized[n]) widen(n, y0, y1);
+    if (first[n] == last[n]) continue;
+
+    const Node &node = nodes[n];
+    for (int i = 0; i < input_count(node); i++) {
+      GraphNode input = node.inputs[i];
+
+      widen(input, std::max(0, first[n] - halo(node, i)), std::min(height, last[n] + halo(node, i)));
+      readers[input]++;
+    }
+  }
+
+  for (int n = 0; n < count; n++) {
+    if (!plan.live[n]) continue;
+
+    if (plan.materialized[n] && !computed_here(n)) {
+      views[n] = {state.planes[n].get(), state.bitmaps[n].get(), 0};
+      continue;
+    }
+    if (!computed_here(n) || first[n] == last[n]) continue;
+
+    const Node &node = nodes[n];
+    GraphNode input = node.inputs[0];
+    bool band_only = first[n] == y0 && last[n] == y1;
+    double *out;
+
+    if (plan.materialized[n] && band_only) {
+      out = state.planes[n].get() + (size_t) y0 * width;
+      views[n] = {state.planes[n].get(), nullptr, 0};
+    } else {
+      // A point-wise value over the same rows of a value nobody else
+      // reads in this band takes over that value's scratch.
+      bool point_wise = node.op == OP_SCALE || node.op == OP_HYPOT || node.op == OP_ARCTAN2 || node.op == OP_NORMALIZE
+        || node.op == OP_MULTIPLY || node.op == OP_CORNER_RESPONSE;
+      if (point_wise && scratch[input] && readers[input] == 1 && first[input] == first[n] && last[input] == last[n]) {
+        scratch[n] = std::move(scratch[input]);
+      } else {
+        scratch[n] = BufferPool::shared().allocate<double>((size_t) (last[n] - first[n]) * width);
+      }
+
+      out = scratch[n].get();
+      views[n] = {out, nullptr, first[n]};
+    }
+
+    compute_rows(node, first[n], last[n], views, state, out);
+
+    // Readers in the same stage needed rows around the band as well, only
+    // the band itself goes into the full-size buffer.
+    if (plan.materialized[n] && !band_only) {
+      memcpy(state.planes[n].get() + (size_t) y0 * width, out + (size_t) (y0 - first[n]) * width, (size_t) (y1 - y0) * width * sizeof(double));
+    }
+
+    for (int i = 0; i < input_count(node); i++) {
+      GraphNode input = node.inputs[i];
+      if (--readers[input] == 0) scratch[input].reset();
+    }
+  }
+}
+
+void Graph::compute_rows(const Node &node, int y0, int y1, const std::vector<View> &views, const State &state, double *out) const
+{
+  const View &a = views[node.inputs[0]];
+  const View &b = node.inputs[1] >= 0 ? views[node.inputs[1]] : a;
+  const View &c = node.inputs[2] >= 0 ? views[node.inputs[2]] : a;
+  size_t count = (size_t) (y1 - y0) * width;
+  const double *src = a.plane ? a.plane + (size_t) (y0 - a.first) * width : nullptr;
+  const double *src2 = b.plane ? b.plane + (size_t) (y0 - b.first) * width : nullptr;
+  const double *src3 = c.plane ? c.plane + (size_t) (y0 - c.first) * width : nullptr;
+
+  auto row_of = [this](const View &view, int y) {
+    return view.plane + (size_t) (y - view.first) * width;
+  };
+
+  switch (node.op) {
+    case OP_CHANNEL:
+      extract_channel(a.rgba + (size_t) y0 * width * 4, PIXEL_FORMAT_RGBA8, node.channel, out, count);
+      break;
+    case OP_LUMA: {
+      // Through ColourTransform, so the values match
+      // get_image_bitmap_greyscale().
+      auto transform = ColourTransform().luma(node.weights);
+      std::vector<byte> row((size_t) width * 4);
+
+      for (int y = y0; y < y1; y++) {
+        transform.apply(a.rgba + (size_t) y * width * 4, row.data(), width);
+        extract_channel(row.data(), PIXEL_FORMAT_RGBA8, 0, out + (size_t) (y - y0) * width, width);
+      }
+      break;
+    }
+    case OP_SCALE:
+      for (size_t i = 0; i < count; i++) out[i] = src[i] * node.params[0];
+      break;
+    case OP_HYPOT:
+      for (size_t i = 0; i < count; i++) out[i] = sqrt(src[i] * src[i] + src2[i] * src2[i]);
+      break;
+    case OP_ARCTAN2:
+      // Same as Matrix::arctan2.
+      for (size_t i = 0; i < count; i++) out[i] = atan(src[i] / src2[i]);
+      break;
+    case OP_MULTIPLY:
+      for (size_t i = 0; i < count; i++) out[i] = src[i] * src2[i];
+      break;
+    case OP_CORNER_RESPONSE:
+      for (size_t i = 0; i < count; i++) {
+        double trace = src[i] + src2[i];
+
+        if (node.params[0]) {
+          double half_difference = (src[i] - src2[i]) / 2;
+          out[i] = trace / 2 - sqrt(half_difference * half_difference + src3[i] * src3[i]);
+        } else {
+          out[i] = src[i] * src2[i] - src3[i] * src3[i] - node.params[1] * trace * trace;
+        }
+      }
+      break;
+    case OP_NORMALIZE: {
+      // Rounded to float like the factors of Matrix::div and Matrix::mult,
+      // so canny gives the same edges as the stage functions.
+      double max = (float) state.maxima[node.inputs[0]];
+      double k = (float) node.params[0];
+
+      for (size_t i = 0; i < count; i++) out[i] = src[i] / max * k;
+      break;
+    }
+    case OP_THRESHOLD: {
+      double high = state.maxima[node.inputs[0]] * node.params[1];
+      double low = high * node.params[0];
+
+      for (size_t i = 0; i < count; i++) {
+        out[i] = src[i] >= high ? node.params[3] : src[i] >= low ? node.params[2] : 0;
+      }
+      break;
+    }
+    case OP_CONVOLVE: {
+      // Matrix::convolve, row by row.
+      int size = node.kernel_size;
+      int offset = (size - 1) / 2;
+
+      for (int row = y0; row < y1; row++) {
+        double *dest = out + (size_t) (row - y0) * width;
+
+        for (int col = 0; col < width; col++) {
+          double val = 0;
+
+          for (int kernel_row = 0; kernel_row < size; kernel_row++) {
+            int src_row = row + kernel_row - offset;
+            if (src_row < 0 || src_row > height - 1) {
+              src_row = row + (size - kernel_row) - offset;
+            }
+            const double *src_values = row_of(a, src_row);
+            const double *kernel_values = node.kernel.data() + (size_t) (size - 1 - kernel_row) * size;
+
+            for (int kernel_col = 0; kernel_col < size; kernel_col++) {
+              int src_col = col + kernel_col - offset;
+              if (src_col < 0 || src_col > width - 1) {
+                src_col = col + (size - kernel_col) - offset;
+              }
+
+              val += kernel_values[size - 1 - kernel_col] * src_values[src_col];
+            }
+          }
+
+          dest[col] = val;
+        }
+      }
+      break;
+    }
+    case OP_CONVOLVE_ROWS: {
+      int radius = node.kernel_size / 2;
+
+      for (int row = y0; row < y1; row++) {
+        const double *src_values = row_of(a, row);
+        double *dest = out + (size_t) (row - y0) * width;
+
+        for (int col = 0; col < width; col++) {
+          double val = 0;
+
+          for (int k = 0; k < node.kernel_size; k++) {
+            int src_col = std::min(width - 1, std::max(0, col + k - radius));
+            val += node.kernel[k] * src_values[src_col];
+          }
+
+          dest[col] = val;
+        }
+      }
+      break;
+    }
+    case OP_CONVOLVE_COLUMNS: {
+      // A row of the kernel at a time over whole rows, so the inner loop
+      // runs along memory.
+      int radius = node.kernel_size / 2;
+
+      for (int row = y0; row < y1; row++) {
+        double *dest = out + (size_t) (row - y0) * width;
+        std::fill_n(dest, width, 0.0);
+
+        for (int k = 0; k < node.kernel_size; k++) {
+          const double *src_values = row_of(a, std::min(height - 1, std::max(0, row + k - radius)));
+          double weight = node.kernel[k];
+
+          for (int col = 0; col < width; col++) {
+            dest[col] += weight * src_values[col];
+          }
+        }
+      }
+      break;
+    }
+    case OP_NON_MAX_SUPPRESSION: {
+      // Same as non_max_suppression() in canny.cpp.
+      const double angle_scale = (float) 180;
+      const double angle_div = (float) M_PI;
+
+      for (int i = y0; i < y1; i++) {
+        const double *theta = row_of(b, i);
+        double *dest = out + (size_t) (i - y0) * width;
+
+        for (int j = 0; j < width; j++) {
+          double q = 255;
+          double r = 255;
+          double angle = theta[j] * angle_scale / angle_div;
+          if (angle < 0) angle += 180;
+          dest[j] = 0;
+
+          if ((angle >= 0 && angle < 22.5) || (angle >= 157.5 && angle <= 180)) {
+            if (j + 1 > width - 1 || j - 1 < 0) continue;
+            q = row_of(a, i)[j + 1];
+            r = row_of(a, i)[j - 1];
+          } else if (angle >= 22.5 && angle < 67.5) {
+            if (j + 1 > width - 1 || j - 1 < 0) continue;
+            if (i + 1 > height - 1 || i - 1 < 0) continue;
+            q = row_of(a, i + 1)[j - 1];
+            r = row_of(a, i - 1)[j + 1];
+          } else if (angle >= 67.5 && angle < 112.5) {
+            if (i + 1 > height - 1 || i - 1 < 0) continue;
+            q = row_of(a, i + 1)[j];
+            r = row_of(a, i - 1)[j];
+          } else if (angle >= 112.5 && angle < 157.5) {
+            if (j + 1 > width - 1 || j - 1 < 0) continue;
+            if (i + 1 > height - 1 || i - 1 < 0) continue;
+            q = row_of(a, i - 1)[j - 1];
+            r = row_of(a, i + 1)[j + 1];
+          }
+
+          double m = row_of(a, i)[j];
+          dest[j] = m >= q && m >= r ? m : 0;
+        }
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// Same as hysteresis() in canny.cpp: a single serial pass in place, where
+// pixels promoted earlier in the scan count as strong.
+void Graph::hysteresis_pass(const Node &node, double *plane) const
+{
+  double weak = node.params[0];
+  double strong = node.params[1];
+
+  for (int i = 0; i < height; i++) {
+    for (int j = 0; j < width; j++) {
+      double &value = plane[(size_t) i * width + j];
+      if (value != weak) continue;
+
+      bool promoted = false;
+      for (int src_row = std::max(0, i - 1); src_row <= std::min(height - 1, i + 1) && !promoted; src_row++) {
+        for (int src_col = std::max(0, j - 1); src_col <= std::min(width - 1, j + 1); src_col++) {
+          if (src_row == i && src_col == j) continue;
+          if (plane[(size_t) src_row * width + src_col] == strong) {
+            promoted = true;
+            break;
+          }
+        }
+      }
+
+      value = promoted ? strong : 0;
+    }
+  }
+}
+
+Matrix<double> Graph::run(GraphNode output, Job *job)
+{
+  return run(std::vector<GraphNode> {output}, job)[0];
+}
+
+std::vector<Matrix<double>> Graph::run(const std::vector<GraphNode> &outputs, Job *job)
+{
+  for (GraphNode output : outputs) {
+    if (output < 0 || output >= (int) nodes.size()) throw std::invalid_argument("Unknown graph node");
+    if (nodes[output].rgba) throw std::invalid_argument("Graph output must be a plane");
+  }
+
+  PIXOR_TRACE_SCOPE("graph.run", "graph");
+  Plan plan = make_plan(outputs);
+  int count = nodes.size();
+  size_t plane_bytes = (size_t) width * height * sizeof(double);
+  State state;
+
+  state.planes.resize(count);
+  state.bitmaps.resize(count);
+  state.maxima.assign(count, 0);
+  state.bytes.assign(count, 0);
+  stats = {0, 0, 0, 0};
+
+  auto report = [&](float progress) {
+    if (job) job->set_progress(progress);
+  };
+
+  report(0);
+  for (int n = 0; n < count; n++) {
+    if (!plan.live[n] || input_count(nodes[n]) > 0) continue;
+
+    load_source(n, state);
+    if (plan.needs_max[n]) compute_max(n, state);
+  }
+  stats.peak_bytes = state.bytes_in_use;
+
+  for (int level = 1; level <= plan.last_level; level++) {
+    PIXOR_TRACE_SCOPE("graph.stage", "graph");
+    bool banded = false;
+
+    for (int n = 0; n < count; n++) {
+      const Node &node = nodes[n];
+      if (!plan.live[n] || !plan.materialized[n] || plan.level[n] != level || input_count(node) == 0) continue;
+
+      // A value read only by this node and dead after this stage becomes
+      // the output buffer when the node reads it row for row, and no other
+      // band needs rows of the node it would overwrite.
+      GraphNode input = node.inputs[0];
+      bool row_for_row = node.op == OP_SCALE || node.op == OP_HYPOT || node.op == OP_ARCTAN2
+        || node.op == OP_NORMALIZE || node.op == OP_THRESHOLD || node.op == OP_HYSTERESIS
+        || node.op == OP_MULTIPLY || node.op == OP_CORNER_RESPONSE;
+      bool owned = nodes[input].op != OP_INPUT && !nodes[input].rgba && !plan.output[input];
+
+      if (row_for_row && owned && plan.materialized[input] && plan.readers[input] == 1 && plan.last_use[input] == level
+        && !plan.read_in_stage[n]) {
+        state.planes[n] = state.planes[input];
+        std::swap(state.bytes[n], state.bytes[input]);
+        stats.in_place++;
+      } else {
+        state.planes[n] = BufferPool::shared().allocate<double>((size_t) width * height);
+        state.bytes[n] = plane_bytes;
+        state.bytes_in_use += plane_bytes;
+      }
+      stats.materialized++;
+      stats.peak_bytes = std::max(stats.peak_bytes, state.bytes_in_use);
+
+      if (node.op == OP_HYSTERESIS) {
+        if (state.planes[n] != state.planes[input]) memcpy(state.planes[n].get(), state.planes[input].get(), plane_bytes);
+        hysteresis_pass(node, state.planes[n].get());
+      } else {
+        banded = true;
+      }
+    }
+
+    if (banded) {
+      int bands = (height + BAND_ROWS - 1) / BAND_ROWS;
+
+      ThreadPool::shared().parallel_for(0, bands, 1, [&](int begin, int end) {
+        for (int band = begin; band < end; band++) {
+          if (job) job->check_cancelled();
+          compute_band(plan, level, band * BAND_ROWS, std::min(height, (band + 1) * BAND_ROWS), state);
+        }
+      });
+    }
+
+    for (int n = 0; n < count; n++) {
+      if (plan.live[n] && plan.level[n] == level && plan.needs_max[n]) compute_max(n, state);
+    }
+
+    for (int n = 0; n < count; n++) {
+      if (!plan.live[n] || plan.output[n] || plan.last_use[n] != level) continue;
+
+      state.planes[n].reset();
+      state.bitmaps[n].reset();
+      state.bytes_in_use -= state.bytes[n];
+      state.bytes[n] = 0;
+    }
+
+    stats.stages++;
+    report((float) level / plan.last_level);
+  }
+
+  std::vector<Matrix<double>> res;
+  for (GraphNode output : outputs) {
+    auto plane = state.planes[output];
+    res.push_back(Matrix<double>(width, height, std::shared_ptr<double>(plane, plane.get())));
+  }
+
+  return res;
+}
+
+std::shared_ptr<PngImage> Graph::encode(GraphNode output, Job *job)
+{
+  auto plane = run(output, job);
+  size_t count = (size_t) width * height;
+  auto bitmap = BufferPool::shared().allocate<byte>(count);
+  auto image = std::make_shared<PngImage>();
+
+  PIXOR_TRACE_SCOPE("graph.encode", "graph");
+  insert_channel(plane.data(), bitmap.get(), PIXEL_FORMAT_GRAY8, 0, count);
+  image->set_header(new PngHeader(width, height, PNG_TYPE_GREYSCALE));
+  image->set_bitmap(bitmap.get());
+
+  return image;
+}
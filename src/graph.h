@@ -0,0 +1,161 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include "pixor.h"
+#include "colour_transform.h"
+#include "context.h"
+#include "image.h"
+#include "job.h"
+#include "matrix.h"
+#include "png.h"
+
+namespace Pixor {
+
+typedef int GraphNode;
+
+struct GraphStats {
+  int stages;
+  int materialized;
+  int in_place;
+  size_t peak_bytes;
+};
+
+// A pipeline declared as a graph of nodes and run in one go.
+//
+// Values are planes of doubles, or RGBA pixels for sources. Nodes are
+// declared in order, so the inputs of a node always exist before it.
+// Nothing runs until run() or encode().
+//
+// The scheduler gives a full-size buffer only to a few values: sources,
+// the output, inputs of nodes that need the whole image first (a maximum,
+// a serial pass), and values read by a later stage. Everything else is
+// computed in bands of rows inside the stage that reads it. Stencil halos
+// are recomputed at band edges. A point-wise node writes over its input
+// when nothing else reads that input. Full-size buffers go back to the
+// BufferPool after the last stage that reads them.
+class Graph {
+  enum Op {
+    OP_INPUT,
+    OP_INPUT_RGBA,
+    OP_DECODE,
+    OP_CHANNEL,
+    OP_LUMA,
+    OP_SCALE,
+    OP_HYPOT,
+    OP_ARCTAN2,
+    OP_CONVOLVE,
+    OP_NON_MAX_SUPPRESSION,
+    OP_NORMALIZE,
+    OP_THRESHOLD,
+    OP_HYSTERESIS,
+    OP_MULTIPLY,
+    OP_CONVOLVE_ROWS,
+    OP_CONVOLVE_COLUMNS,
+    OP_CORNER_RESPONSE,
+  };
+
+  struct Node {
+    Op op;
+    GraphNode inputs[3] = {-1, -1, -1};
+    bool rgba = false;
+    int channel = 0;
+    LumaWeights weights = LUMA_REC601;
+    double params[4] = {0, 0, 0, 0};
+    int kernel_size = 0;
+    std::vector<double> kernel;
+    std::shared_ptr<double> plane;
+    std::shared_ptr<byte[]> bitmap;
+    std::shared_ptr<Image> image;
+  };
+
+  struct Plan {
+    std::vector<bool> output;
+    std::vector<bool> live;
+    std::vector<bool> materialized;
+    std::vector<bool> needs_max;
+    std::vector<int> level;
+    std::vector<int> readers;
+    std::vector<int> last_use;
+    std::vector<bool> read_in_stage;
+    int last_level = 0;
+  };
+
+  // Where the rows of a value are during a band: a full-size buffer
+  // starting at row 0 or band scratch starting at first.
+  struct View {
+    const double *plane = nullptr;
+    const byte *rgba = nullptr;
+    int first = 0;
+  };
+
+  struct State {
+    std::vector<std::shared_ptr<double[]>> planes;
+    std::vector<std::shared_ptr<byte[]>> bitmaps;
+    std::vector<double> maxima;
+    std::vector<size_t> bytes;
+    size_t bytes_in_use = 0;
+  };
+
+  std::vector<Node> nodes;
+  int width = 0;
+  int height = 0;
+  GraphStats stats = {0, 0, 0, 0};
+
+  GraphNode add(Node node, int node_width, int node_height);
+  GraphNode add_plane_op(Op op, GraphNode a, GraphNode b = -1, GraphNode c = -1);
+  int input_count(const Node &node) const;
+  int halo(const Node &node, int input) const;
+  Plan make_plan(const std::vector<GraphNode> &outputs) const;
+  void load_source(GraphNode node, State &state) const;
+  void compute_max(GraphNode node, State &state) const;
+  void compute_band(const Plan &plan, int level, int y0, int y1, State &state) const;
+  void compute_rows(const Node &node, int y0, int y1, const std::vector<View> &views, const State &state, double *out) const;
+  void hysteresis_pass(const Node &node, double *plane) const;
+
+public:
+  // The matrix is borrowed, it has to outlive the runs.
+  GraphNode input(Matrix<double> &m);
+  GraphNode input(const Context &context);
+  GraphNode decode(std::shared_ptr<Image> image);
+
+  GraphNode channel(GraphNode rgba, int channel);
+  GraphNode luma(GraphNode rgba, LumaWeights weights = LUMA_REC601);
+
+  GraphNode scale(GraphNode src, double k);
+  GraphNode hypot(GraphNode a, GraphNode b);
+  GraphNode arctan2(GraphNode y, GraphNode x);
+  GraphNode multiply(GraphNode a, GraphNode b);
+
+  GraphNode convolve(GraphNode src, Matrix<double> kernel);
+  // The kernel along the rows, then along the columns. The image edges are
+  // extended, unlike convolve().
+  GraphNode convolve_separable(GraphNode src, const std::vector<double> &kernel);
+  GraphNode non_max_suppression(GraphNode magnitude, GraphNode theta);
+
+  // Scaled so the maximum of src becomes max_value.
+  GraphNode normalize(GraphNode src, double max_value);
+  // The ratios are relative to the maximum of src, as in canny.h.
+  GraphNode threshold(GraphNode src, double low_ratio, double high_ratio, int weak = 25, int strong = 255);
+  GraphNode hysteresis(GraphNode src, int weak = 25, int strong = 255);
+
+  // From the windowed products of the gradients: the Harris response
+  // det - k * trace^2, or with min_eigenvalue the smaller eigenvalue of
+  // the structure tensor as in Shi and Tomasi.
+  GraphNode corner_response(GraphNode xx, GraphNode yy, GraphNode xy, bool min_eigenvalue, double k = 0.04);
+
+  // With a job, progress is reported after every stage and a cancelled
+  // job stops the run with JobCancelled.
+  Matrix<double> run(GraphNode output, Job *job = nullptr);
+  // Several outputs in one run, values they have in common are computed
+  // once.
+  std::vector<Matrix<double>> run(const std::vector<GraphNode> &outputs, Job *job = nullptr);
+  // Runs the graph and stores output as a greyscale PNG.
+  std::shared_ptr<PngImage> encode(GraphNode output, Job *job = nullptr);
+
+  int get_width() const {return width;}
+  int get_height() const {return height;}
+  // Of the last run.
+  GraphStats get_stats() const {return stats;}
+};
+
+}
@@ -0,0 +1,487 @@
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include "hough.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+// Rows scanned for edges by one task.
+static const int BAND_ROWS = 32;
+// Below this many points per thread an accumulator of its own costs more
+// than the votes.
+static const size_t MIN_CHUNK_POINTS = 1024;
+// Accumulator cells summed by one task of the reduction.
+static const size_t REDUCE_BLOCK = 64 * 1024;
+
+// The edge pixels in raster order.
+static std::vector<point> edge_points(Matrix<double> &edges)
+{
+  PIXOR_TRACE_SCOPE("hough.edge_points", "hough");
+  int width = edges.get_width();
+  int height = edges.get_height();
+  const double *data = edges.data();
+  int bands = (height + BAND_ROWS - 1) / BAND_ROWS;
+  std::vector<std::vector<point>> partial(bands);
+
+  ThreadPool::shared().parallel_for(0, bands, 1, [&](int begin, int end) {
+    for (int band = begin; band < end; band++) {
+      for (int y = band * BAND_ROWS; y < std::min(height, (band + 1) * BAND_ROWS); y++) {
+        const double *row = data + (size_t) y * width;
+
+        for (int x = 0; x < width; x++) {
+          if (row[x] > 0) partial[band].push_back({x, y});
+        }
+      }
+    }
+  });
+
+  std::vector<point> res;
+  for (auto &band : partial) {
+    res.insert(res.end(), band.begin(), band.end());
+  }
+
+  return res;
+}
+
+// Splits points between the threads, each votes into an accumulator of
+// its own, so the votes need no atomics. The accumulators are summed in
+// blocks at the end.
+template <class F>
+static std::vector<int> accumulate(const std::vector<point> &points, size_t cells, F vote)
+{
+  PIXOR_TRACE_SCOPE("hough.accumulate", "hough");
+  ThreadPool &pool = ThreadPool::shared();
+  int chunks = std::max<size_t>(1, std::min<size_t>(pool.get_concurrency(), points.size() / MIN_CHUNK_POINTS));
+  std::vector<std::vector<int>> partial(chunks);
+
+  pool.parallel_for(0, chunks, 1, [&](int begin, int end) {
+    for (int chunk = begin; chunk < end; chunk++) {
+      size_t first = points.size() * chunk / chunks;
+      size_t last = points.size() * (chunk + 1) / chunks;
+
+      partial[chunk].assign(cells, 0);
+      for (size_t i = first; i < last; i++) {
+        vote(points[i], partial[chunk].data());
+      }
+    }
+  });
+
+  std::vector<int> res = std::move(partial[0]);
+  int blocks = (cells + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+
+  pool.parallel_for(0, blocks, 1, [&](int begin, int end) {
+    for (int block = begin; block < end; block++) {
+      size_t first = block * REDUCE_BLOCK;
+      size_t last = std::min(cells, first + REDUCE_BLOCK);
+
+      for (int chunk = 1; chunk < chunks; chunk++) {
+        const int *src = partial[chunk].data();
+        for (size_t i = first; i < last; i++) {
+          res[i] += src[i];
+        }
+      }
+    }
+  });
+
+  return res;
+}
+
+// Cells of a rows by columns accumulator with at least threshold votes and
+// no more votes anywhere within radius cells. Of equal neighbours the first
+// in raster order wins. Strongest first.
+//
+// With wrap_rows the rows are theta and the columns rho: theta 0 follows pi
+// with rho negated.
+static std::vector<size_t> find_peaks(const std::vector<int> &acc, int rows, int columns, int threshold, int radius,
+  bool wrap_rows = false)
+{
+  PIXOR_TRACE_SCOPE("hough.peaks", "hough");
+  std::vector<std::vector<size_t>> partial(rows);
+
+  parallel_for_rows(rows, columns, [&](int begin, int end) {
+    for (int row = begin; row < end; row++) {
+      for (int col = 0; col < columns; col++) {
+        size_t index = (size_t) row * columns + col;
+        int votes = acc[index];
+        bool peak = votes >= threshold;
+
+        for (int r = row - radius; r <= row + radius && peak; r++) {
+          int other_row = r;
+          bool mirrored = false;
+
+          if (r < 0 || r >= rows) {
+            if (!wrap_rows) continue;
+            other_row = (r + rows) % rows;
+            mirrored = true;
+          }
+
+          for (int c = std::max(0, col - radius); c <= std::min(columns - 1, col + radius); c++) {
+            size_t other = (size_t) other_row * columns + (mirrored ? columns - 1 - c : c);
+            if (acc[other] > votes || (acc[other] == votes && other < index)) {
+              peak = false;
+              break;
+            }
+          }
+        }
+
+        if (peak) partial[row].push_back(index);
+      }
+    }
+  });
+
+  std::vector<size_t> res;
+  for (auto &row : partial) {
+    res.insert(res.end(), row.begin(), row.end());
+  }
+  std::stable_sort(res.begin(), res.end(), [&](size_t a, size_t b) {
+    return acc[a] > acc[b];
+  });
+
+  return res;
+}
+
+// cos and sin of every theta step, divided by the rho step, so a pixel's
+// rho cell is one multiply-add away.
+class TrigTable {
+public:
+  int theta_count;
+  int rho_count;
+  int rho_offset;
+  std::vector<double> cos_values;
+  std::vector<double> sin_values;
+
+  TrigTable(int width, int height, double rho_step, double theta_step)
+  {
+    if (!(rho_step > 0) || !(theta_step > 0) || theta_step > M_PI) throw std::invalid_argument("Invalid Hough step");
+
+    theta_count = std::max(1L, std::lround(M_PI / theta_step));
+    rho_offset = (int) std::ceil(std::hypot(width, height) / rho_step);
+    rho_count = 2 * rho_offset + 1;
+
+    for (int t = 0; t < theta_count; t++) {
+      cos_values.push_back(std::cos(t * theta_step) / rho_step);
+      sin_values.push_back(std::sin(t * theta_step) / rho_step);
+    }
+  }
+
+  int rho_index(point p, int t) const
+  {
+    return (int) std::lround(p.x * cos_values[t] + p.y * sin_values[t]) + rho_offset;
+  }
+};
+
+std::vector<HoughLine> Pixor::hough_lines(Matrix<double> &edges, const HoughLineOptions &options)
+{
+  PIXOR_TRACE_SCOPE("hough.lines", "hough");
+  TrigTable table(edges.get_width(), edges.get_height(), options.rho_step, options.theta_step);
+  auto points = edge_points(edges);
+  int rho_count = table.rho_count;
+
+  auto acc = accumulate(points, (size_t) table.theta_count * rho_count, [&](point p, int *votes) {
+    for (int t = 0; t < table.theta_count; t++) {
+      votes[(size_t) t * rho_count + table.rho_index(p, t)]++;
+    }
+  });
+
+  auto peaks = find_peaks(acc, table.theta_count, rho_count, std::max(1, options.threshold), options.suppression_radius, true);
+  std::vector<HoughLine> res;
+
+  for (size_t peak : peaks) {
+    int rho = peak % rho_count - table.rho_offset;
+    int theta = peak / rho_count;
+
+    res.push_back({rho * options.rho_step, theta * options.theta_step, acc[peak]});
+    if (options.max_lines > 0 && (int) res.size() == options.max_lines) break;
+  }
+
+  return res;
+}
+
+bool Pixor::clip_line(const HoughLine &line, int width, int height, LineSegment &res)
+{
+  double c = std::cos(line.theta);
+  double s = std::sin(line.theta);
+  double right = width - 1;
+  double bottom = height - 1;
+  std::vector<std::pair<double, double>> ends;
+
+  // Where the line crosses the edges of the image, half a pixel of slack
+  // keeps lines along an edge.
+  if (std::abs(s) > 1e-9) {
+    for (double x : {0.0, right}) {
+      double y = (line.rho - x * c) / s;
+      if (y >= -0.5 && y <= bottom + 0.5) ends.push_back({x, y});
+    }
+  }
+  if (std::abs(c) > 1e-9) {
+    for (double y : {0.0, bottom}) {
+      double x = (line.rho - y * s) / c;
+      if (x >= -0.5 && x <= right + 0.5) ends.push_back({x, y});
+    }
+  }
+  if (ends.empty()) return false;
+
+  size_t a = 0;
+  size_t b = 0;
+  double longest = -1;
+  for (size_t i = 0; i < ends.size(); i++) {
+    for (size_t j = i + 1; j < ends.size(); j++) {
+      double length = std::hypot(ends[i].first - ends[j].first, ends[i].second - ends[j].second);
+      if (length > longest) {
+        longest = length;
+        a = i;
+        b = j;
+      }
+    }
+  }
+
+  auto to_point = [&](std::pair<double, double> p) {
+    return point {(int) std::min(right, std::max(0.0, std::round(p.first))), (int) std::min(bottom, std::max(0.0, std::round(p.second)))};
+  };
+  res = {to_point(ends[a]), to_point(ends[b])};
+
+  return true;
+}
+
+std::vector<LineSegment> Pixor::hough_line_segments(Matrix<double> &edges, const HoughSegmentOptions &options)
+{
+  PIXOR_TRACE_SCOPE("hough.segments", "hough");
+  int width = edges.get_width();
+  int height = edges.get_height();
+  TrigTable table(width, height, options.rho_step, options.theta_step);
+  int rho_count = table.rho_count;
+  auto points = edge_points(edges);
+  std::vector<int> acc((size_t) table.theta_count * rho_count, 0);
+  // 0 for no edge or one taken by a segment, 1 for an edge waiting to
+  // vote, 2 for one that has voted.
+  std::vector<byte> state((size_t) width * height, 0);
+  std::vector<LineSegment> res;
+
+  for (point p : points) {
+    state[(size_t) p.y * width + p.x] = 1;
+  }
+
+  auto vote = [&](point p, int delta) {
+    for (int t = 0; t < table.theta_count; t++) {
+      acc[(size_t) t * rho_count + table.rho_index(p, t)] += delta;
+    }
+  };
+
+  std::mt19937 random(options.seed);
+  std::shuffle(points.begin(), points.end(), random);
+
+  for (point p : points) {
+    byte &p_state = state[(size_t) p.y * width + p.x];
+    if (p_state == 0) continue;
+    p_state = 2;
+
+    int best_votes = 0;
+    int best_theta = 0;
+    for (int t = 0; t < table.theta_count; t++) {
+      int votes = ++acc[(size_t) t * rho_count + table.rho_index(p, t)];
+      if (votes > best_votes) {
+        best_votes = votes;
+        best_theta = t;
+      }
+    }
+    if (best_votes < options.threshold) continue;
+
+    // Along the line one pixel at a time on the longer axis, both ways
+    // from p, as long as the gaps stay short. The quantized angle drifts
+    // off long lines, so an edge one pixel to either side on the shorter
+    // axis counts too, and the walk moves over to it.
+    double dx = -table.sin_values[best_theta];
+    double dy = table.cos_values[best_theta];
+    double scale = std::max(std::abs(dx), std::abs(dy));
+    dx /= scale;
+    dy /= scale;
+    point side = std::abs(dx) >= std::abs(dy) ? point {0, 1} : point {1, 0};
+
+    auto inside = [&](point q) {
+      return q.x >= 0 && q.y >= 0 && q.x < width && q.y < height;
+    };
+    auto beside = [&](point q, int offset) {
+      return point {q.x + side.x * offset, q.y + side.y * offset};
+    };
+
+    std::vector<point> walked[2];
+    size_t walked_end[2] = {0, 0};
+    point ends[2] = {p, p};
+    for (int k = 0; k < 2; k++) {
+      int direction = k == 0 ? 1 : -1;
+      int shift = 0;
+      int gap = 0;
+
+      for (int step = 1;; step++) {
+        point q = beside({(int) std::lround(p.x + dx * step * direction), (int) std::lround(p.y + dy * step * direction)}, shift);
+        if (!inside(q)) break;
+        walked[k].push_back(q);
+
+        int found = -2;
+        for (int offset : {0, -1, 1}) {
+          point r = beside(q, offset);
+          if (inside(r) && state[(size_t) r.y * width + r.x]) {
+            found = offset;
+            break;
+          }
+        }
+
+        if (found != -2) {
+          shift += found;
+          gap = 0;
+          walked_end[k] = walked[k].size();
+          ends[k] = beside(q, found);
+        } else if (++gap > options.max_gap) {
+          break;
+        }
+      }
+      walked[k].resize(walked_end[k]);
+    }
+
+    point p1 = ends[0];
+    point p2 = ends[1];
+    bool long_enough = std::max(std::abs(p1.x - p2.x), std::abs(p1.y - p2.y)) >= options.min_length;
+
+    // The pixels walked over and their neighbours on the shorter axis
+    // belong to this line either way, those that voted take their votes
+    // back.
+    walked[0].push_back(p);
+    for (int k = 0; k < 2; k++) {
+      for (point q : walked[k]) {
+        for (int offset = -1; offset <= 1; offset++) {
+          point r = beside(q, offset);
+          if (!inside(r)) continue;
+          byte &r_state = state[(size_t) r.y * width + r.x];
+
+          if (r_state == 2) vote(r, -1);
+          r_state = 0;
+        }
+      }
+    }
+
+    if (long_enough) {
+      res.push_back({p1, p2});
+      if (options.max_segments > 0 && (int) res.size() == options.max_segments) break;
+    }
+  }
+
+  return res;
+}
+
+// Pixels of an 8-connected circle around (0, 0), what an edge detector
+// leaves of a circle of that radius.
+static int circle_size(int radius)
+{
+  int res = 0;
+  int x = radius;
+  int y = 0;
+  int error = 1 - radius;
+
+  // One octant, counting the pixels on the diagonal and the axes once.
+  while (x >= y) {
+    res += (y == 0 || x == y) ? 4 : 8;
+
+    y++;
+    if (error < 0) {
+      error += 2 * y + 1;
+    } else {
+      x--;
+      error += 2 * (y - x) + 1;
+    }
+  }
+
+  return res;
+}
+
+// Offsets within half a pixel of the radius. Edges of a circle stay in
+// the ring however they were rasterized.
+static std::vector<point> ring_offsets(int radius)
+{
+  std::vector<point> res;
+
+  for (int y = -radius - 1; y <= radius + 1; y++) {
+    for (int x = -radius - 1; x <= radius + 1; x++) {
+      if (std::abs(std::hypot(x, y) - radius) < 0.5) res.push_back({x, y});
+    }
+  }
+
+  return res;
+}
+
+std::vector<HoughCircle> Pixor::hough_circles(Matrix<double> &edges, const HoughCircleOptions &options)
+{
+  PIXOR_TRACE_SCOPE("hough.circles", "hough");
+  if (options.min_radius < 1 || options.max_radius < options.min_radius) {
+    throw std::invalid_argument("Invalid Hough circle radii");
+  }
+
+  int width = edges.get_width();
+  int height = edges.get_height();
+  int radii = options.max_radius - options.min_radius + 1;
+  auto points = edge_points(edges);
+  std::vector<std::vector<HoughCircle>> partial(radii);
+
+  // Every thread takes whole radii, with an accumulator of centres of its
+  // own, so nothing needs summing and the votes of a centre are the edge
+  // pixels on its circle.
+  ThreadPool::shared().parallel_for(0, radii, 1, [&](int begin, int end) {
+    std::vector<int> votes((size_t) width * height);
+
+    for (int i = begin; i < end; i++) {
+      int radius = options.min_radius + i;
+      int size = circle_size(radius);
+      auto ring = ring_offsets(radius);
+
+      std::fill(votes.begin(), votes.end(), 0);
+      for (point p : points) {
+        for (point offset : ring) {
+          int x = p.x + offset.x;
+          int y = p.y + offset.y;
+          if (x >= 0 && y >= 0 && x < width && y < height) votes[(size_t) y * width + x]++;
+        }
+      }
+
+      int threshold = std::max(1, (int) std::ceil(options.min_coverage * size));
+      for (size_t peak : find_peaks(votes, height, width, threshold, options.min_distance)) {
+        point centre = {(int) (peak % width), (int) (peak / width)};
+        partial[i].push_back({centre, radius, votes[peak], (double) votes[peak] / size});
+      }
+    }
+  });
+
+  std::vector<HoughCircle> candidates;
+  for (auto &circles : partial) {
+    candidates.insert(candidates.end(), circles.begin(), circles.end());
+  }
+  std::stable_sort(candidates.begin(), candidates.end(), [](const HoughCircle &a, const HoughCircle &b) {
+    return a.coverage > b.coverage;
+  });
+
+  // The same circle shows up at neighbouring radii and a thick edge can
+  // cover more than the whole circle.
+  std::vector<HoughCircle> res;
+  for (auto &circle : candidates) {
+    bool suppressed = false;
+
+    for (auto &other : res) {
+      int dx = circle.centre.x - other.centre.x;
+      int dy = circle.centre.y - other.centre.y;
+      if (dx * dx + dy * dy < options.min_distance * options.min_distance) {
+        suppressed = true;
+        break;
+      }
+    }
+    if (suppressed) continue;
+
+    res.push_back(circle);
+    if (options.max_circles > 0 && (int) res.size() == options.max_circles) break;
+  }
+
+  for (auto &circle : res) {
+    circle.coverage = std::min(1.0, circle.coverage);
+  }
+
+  return res;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <cmath>
+#include <vector>
+#include "pixor.h"
+#include "matrix.h"
+
+namespace Pixor {
+
+// A line in normal form: x * cos(theta) + y * sin(theta) = rho, with the
+// origin at the top left pixel and theta in [0, pi).
+struct HoughLine {
+  double rho;
+  double theta;
+  int votes;
+};
+
+// End points in pixels, ready for Context::draw_line().
+struct LineSegment {
+  point p1;
+  point p2;
+};
+
+struct HoughCircle {
+  point centre;
+  int radius;
+  int votes;
+  // The share of the circle's pixels that are edges.
+  double coverage;
+};
+
+struct HoughLineOptions {
+  double rho_step = 1;
+  double theta_step = M_PI / 180;
+  // Votes a line needs.
+  int threshold = 80;
+  // Lines closer than this many accumulator cells to a stronger one in
+  // both rho and theta are dropped.
+  int suppression_radius = 3;
+  // 0 keeps every line over the threshold.
+  int max_lines = 0;
+};
+
+struct HoughSegmentOptions {
+  double rho_step = 1;
+  double theta_step = M_PI / 180;
+  int threshold = 40;
+  // Shorter segments are dropped, in pixels along the longer axis.
+  int min_length = 30;
+  // Gaps of up to this many pixels are bridged.
+  int max_gap = 3;
+  int max_segments = 0;
+  unsigned int seed = 1;
+};
+
+struct HoughCircleOptions {
+  int min_radius = 8;
+  int max_radius = 64;
+  // Share of a circle's pixels that have to be edges.
+  double min_coverage = 0.5;
+  // Centres closer than this to a stronger one are dropped.
+  int min_distance = 8;
+  int max_circles = 0;
+};
+
+// The detectors take the edge map of canny_edge_detector(), every value
+// above 0 is an edge. Only the edge pixels vote, and threads vote into
+// accumulators of their own. Results come strongest first.
+
+// The standard transform: lines through the whole image.
+std::vector<HoughLine> hough_lines(Matrix<double> &edges, const HoughLineOptions &options = HoughLineOptions());
+
+// Clips line to an image of the given size. Returns false if it misses
+// the image.
+bool clip_line(const HoughLine &line, int width, int height, LineSegment &res);
+
+// The progressive probabilistic transform of Matas et al.: edge pixels
+// vote in random order, and as soon as a line has enough votes the pixels
+// along it, give or take a pixel across it, are walked, taken out of the
+// accumulator and returned as a segment. Serial by nature, it stops early
+// instead. The order only depends on the seed.
+std::vector<LineSegment> hough_line_segments(Matrix<double> &edges, const HoughSegmentOptions &options = HoughSegmentOptions());
+
+// Every edge pixel votes for the centres of the circles through it, one
+// accumulator per radius, so the votes of a centre are the edge pixels on
+// its circle. Circles at neighbouring radii or centres closer than
+// min_distance to a better covered one are dropped.
+std::vector<HoughCircle> hough_circles(Matrix<double> &edges, const HoughCircleOptions &options = HoughCircleOptions());
+
+}
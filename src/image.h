@@ -1,6 +1,7 @@
 #pragma once
 #include <memory>
 #include "pixor.h"
+#include "colour_transform.h"
 
 namespace Pixor {
 
@@ -8,12 +9,16 @@ class Image {
 public:
   virtual std::shared_ptr<byte[]> get_image_bitmap() const = 0;
   virtual std::shared_ptr<byte[]> get_image_bitmap_with_alpha() const = 0;
-  virtual std::shared_ptr<byte[]> get_image_bitmap_greyscale() const = 0;
+  // Defaults come from the static type of the call, so only this
+  // declaration has one.
+  virtual std::shared_ptr<byte[]> get_image_bitmap_greyscale(LumaWeights weights = LUMA_REC601) const = 0;
   virtual int get_width() const = 0;
   virtual int get_height() const = 0;
   virtual bool has_alpha() const = 0;
   virtual void print_image_info() const = 0;
   virtual void set_bitmap(byte *bitmap) = 0;
+  // Identifies the pixels for the ResultCache, 0 if the image cannot tell.
+  virtual uint64_t get_content_hash() const {return 0;}
 };
 
 }
@@ -1,102 +1,528 @@
 #include <cairomm/context.h>
+#include <cairomm/matrix.h>
 #include <giomm/resource.h>
-#include <gdkmm/general.h> // set_source_pixbuf()
 #include <glibmm/fileutils.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
 #include <stdio.h>
 #include "image_area.h"
 #include "debug.h"
 #include "canny.h"
+#include "flood_fill.h"
+#include "pixel_format.h"
+#include "result_cache.h"
 
-ImageArea::ImageArea(std::shared_ptr<Pixor::Image> &image) :
-  drawing_context(image->get_image_bitmap_greyscale(), image->get_width(), image->get_height())
+ImageArea::ImageArea(std::shared_ptr<Pixor::Image> &image, std::shared_ptr<byte[]> greyscale) :
+  drawing_context(greyscale, image->get_width(), image->get_height()),
+  pyramid(drawing_context)
 {
-  set_events(Gdk::BUTTON_MOTION_MASK|Gdk::BUTTON_PRESS_MASK|Gdk::BUTTON_RELEASE_MASK);
+  set_events(Gdk::BUTTON_MOTION_MASK|Gdk::BUTTON_PRESS_MASK|Gdk::BUTTON_RELEASE_MASK|Gdk::SCROLL_MASK);
   signal_motion_notify_event().connect(sigc::mem_fun(*this, &ImageArea::on_mouse_motion));
   if (!image) return;
   this->image = image;
 
-  image_bitmap = drawing_context.get_target_bitmap();
-  auto m = *drawing_context.get_matrix();
+  brush = Pixor::Pattern::make_circle(5, &brush_color);
+  drawing_context.set_source_pattern(brush);
+  drawing_context.set_source_rgba(brush_color);
 
-  auto start = std::chrono::steady_clock::now();
-  auto canny_m = canny_edge_detector(m);
-  auto end = std::chrono::steady_clock::now();
+  flush_drawing();
 
-  dbgln("Canny duration: %dms", std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
-  drawing_context.set_matrix(canny_m);
-  image_bitmap = drawing_context.get_target_bitmap();
-  saved_bitmap = image_bitmap.get();
+  filter_source = std::make_shared<const Pixor::Context>(drawing_context);
+  filter_dispatcher.connect(sigc::mem_fun(*this, &ImageArea::on_filter_update));
+  start_filter();
 }
 
 ImageArea::~ImageArea()
 {
+  // The workers write into this object, so they have to be gone before we are.
+  if (filter_job) stale_filter_jobs.push_back(filter_job);
+
+  for (auto &job : stale_filter_jobs) {
+    job->cancel();
+    job->wait();
+  }
 }
 
-bool ImageArea::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
+// Shows the decoded image right away and runs the edge detector in the
+// background. Quick coarse passes are shown as previews until the full
+// resolution result replaces the image.
+void ImageArea::start_filter()
+{
+  if (filter_job) {
+    filter_job->cancel();
+    stale_filter_jobs.push_back(filter_job);
+  }
+
+  unsigned int generation = ++filter_generation;
+  auto options = filter_options;
+  auto start = std::chrono::steady_clock::now();
+  uint64_t content = image->get_content_hash();
+
+  // Every pass is cached, going back to a threshold tried before shows
+  // its result at once.
+  filter_job = Pixor::run_progressive_filter(Pixor::JobQueue::shared(), filter_source,
+    [options, content](Pixor::Matrix<double> &m, Pixor::Job *job, int scale_divisor) {
+      CannyOptions scaled = options;
+      scaled.sigma = std::max(0.5, options.sigma / scale_divisor);
+      if (!content) return canny_edge_detector(m, job, scaled);
+
+      auto &cache = Pixor::ResultCache::shared();
+      Pixor::CacheKey key = {content, Pixor::hash_params("canny", {(double) scale_divisor, (double) scaled.kernel_size,
+        scaled.sigma, scaled.low_threshold_ratio, scaled.high_threshold_ratio})};
+      Pixor::Matrix<double> res(0, 0);
+      if (cache.get_matrix(key, res)) return res;
+
+      res = canny_edge_detector(m, job, scaled);
+      cache.put_matrix(key, res);
+      return res;
+    },
+    [this, generation, start](std::shared_ptr<Pixor::Matrix<double>> result, int scale_divisor) {
+      auto end = std::chrono::steady_clock::now();
+      dbgln("Canny 1/%d done after %dms", scale_divisor, std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
+
+      {
+        std::lock_guard<std::mutex> lock(filter_mutex);
+        filter_results.push_back({generation, result, scale_divisor});
+      }
+      filter_dispatcher.emit();
+    },
+    [this](Pixor::Job &job) {
+      UNUSED(job);
+      filter_dispatcher.emit();
+    },
+    [this, generation]() {
+      {
+        std::lock_guard<std::mutex> lock(filter_mutex);
+        filter_results.push_back({generation, nullptr, 0});
+      }
+      filter_dispatcher.emit();
+    });
+}
+
+void ImageArea::set_edge_threshold(double ratio)
+{
+  if (!filter_source) return;
+
+  filter_options.high_threshold_ratio = ratio;
+  start_filter();
+}
+
+void ImageArea::on_filter_update()
+{
+  stale_filter_jobs.erase(std::remove_if(stale_filter_jobs.begin(), stale_filter_jobs.end(), [](const std::shared_ptr<Pixor::Job> &job) {
+    return job->is_finished();
+  }), stale_filter_jobs.end());
+
+  if (!filter_job) return;
+
+  std::vector<FilterResult> results;
+  {
+    std::lock_guard<std::mutex> lock(filter_mutex);
+    results.swap(filter_results);
+  }
+
+  // Results arrive coarse to fine, only the last one of the current run
+  // matters. A result without a matrix marks the end of the run.
+  std::shared_ptr<Pixor::Matrix<double>> result;
+  int scale_divisor = 0;
+  bool ended = false;
+  for (auto &r : results) {
+    if (r.generation != filter_generation) continue;
+    if (!r.matrix) {
+      ended = true;
+      continue;
+    }
+    result = r.matrix;
+    scale_divisor = r.scale_divisor;
+  }
+
+  bool complete = result && scale_divisor == 1;
+  if (!complete && !ended) {
+    if (result) show_preview(*result);
+    filter_progress.emit(filter_job->get_progress());
+    return;
+  }
+
+  // A run that failed leaves the image as it was, but drawing has to work
+  // again either way.
+  filter_progress.emit(1.0);
+  stale_filter_jobs.push_back(filter_job);
+  filter_job.reset();
+  preview_surface.reset();
+  if (complete) {
+    drawing_context.set_matrix(*result);
+    flush_drawing();
+  } else {
+    queue_draw();
+  }
+
+  if (!journal) {
+    journal = std::make_shared<Pixor::UndoJournal>();
+    drawing_context.set_journal(journal);
+  }
+}
+
+// Converts a coarse filter result into a surface that on_draw stretches
+// over the whole image until the next pass is done.
+void ImageArea::show_preview(Pixor::Matrix<double> &m)
+{
+  int width = m.get_width();
+  int height = m.get_height();
+  std::vector<RGBA> row(width);
+
+  preview_surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, width, height);
+  int stride = preview_surface->get_stride();
+  byte *data = preview_surface->get_data();
+
+  for (int y = 0; y < height; y++) {
+    std::fill(row.begin(), row.end(), Pixor::rgba(0, 0, 0, 255));
+    Pixor::grey_to_rgba(m.data() + (size_t) y * width, (byte *) row.data(), width);
+    Pixor::rgba_to_premultiplied_argb((const byte *) row.data(), data + (size_t) y * stride, width);
+  }
+
+  preview_surface->mark_dirty();
+  queue_draw();
+}
+
+static const double MIN_ZOOM = 1 / 256.0;
+static const double MAX_ZOOM = 32;
+static const double ZOOM_STEP = 1.25;
+static const double SCROLL_STEP = 64;
+static const size_t MAX_CACHED_TILES = 2048;
+
+static unsigned long long tile_key(int level, int index)
 {
-  auto color = Pixor::rgba(0, 255, 0, 255);
-  auto pattern = Pixor::Pattern::make_circle(5, &color);
+  return ((unsigned long long) level << 32) | (unsigned int) index;
+}
 
-  drawing_context.set_source_pattern(pattern);
-  drawing_context.set_source_rgba(color);
+static int level_tiles_x(const Pixor::ImagePyramid &pyramid, int level)
+{
+  return (pyramid.get_level_width(level) + Pixor::TILE_SIZE - 1) / Pixor::TILE_SIZE;
+}
 
-  if (button1_pressed) {
-    if (mouse_pointer_trace.size() >= 2) {
-      auto last_point = mouse_pointer_trace.back();
-      auto second_to_last_point = *(mouse_pointer_trace.rbegin() + 1);
+Pixor::point ImageArea::to_image(double x, double y) const
+{
+  return {(int) std::floor(view_x + x / zoom), (int) std::floor(view_y + y / zoom)};
+}
 
-      drawing_context.draw_line_with_pattern(second_to_last_point, last_point);
-    } else if (mouse_pointer_trace.size() == 1) {
-      auto cur_point = mouse_pointer_trace[0];
+// Returns the surface of one pyramid tile, converting it on a cache miss.
+Cairo::RefPtr<Cairo::ImageSurface> ImageArea::get_tile_surface(int level, int index)
+{
+  auto key = tile_key(level, index);
+  auto cached = tile_cache.find(key);
+
+  if (cached != tile_cache.end()) {
+    cached->second.last_used = frame_count;
+    return cached->second.surface;
+  }
+
+  int tiles_x = level_tiles_x(pyramid, level);
+  Pixor::rect area = Pixor::rect_intersect({(index % tiles_x) * Pixor::TILE_SIZE, (index / tiles_x) * Pixor::TILE_SIZE,
+    Pixor::TILE_SIZE, Pixor::TILE_SIZE}, pyramid.get_level_bounds(level));
+  auto surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, area.width, area.height);
+  int stride = surface->get_stride();
+  byte *data = surface->get_data();
+
+  tile_buffer.resize(Pixor::TILE_PIXELS);
+  pyramid.read_rect(level, area, tile_buffer.data());
+
+  for (int y = 0; y < area.height; y++) {
+    Pixor::rgba_to_premultiplied_argb((const byte *) (tile_buffer.data() + y * area.width), data + (size_t) y * stride, area.width);
+  }
+  surface->mark_dirty();
+
+  tile_cache[key] = {surface, frame_count};
+  return surface;
+}
 
-      pattern->draw_onto(drawing_context, {cur_point.x, cur_point.y});
+// Forgets the cached surfaces of every level that cover area.
+void ImageArea::drop_cached_tiles(Pixor::rect area)
+{
+  for (int level = 0; level < pyramid.get_level_count(); level++) {
+    int tiles_x = level_tiles_x(pyramid, level);
+    int first_x = (area.x >> level) / Pixor::TILE_SIZE;
+    int first_y = (area.y >> level) / Pixor::TILE_SIZE;
+    int last_x = ((area.x + area.width - 1) >> level) / Pixor::TILE_SIZE;
+    int last_y = ((area.y + area.height - 1) >> level) / Pixor::TILE_SIZE;
+
+    for (int ty = first_y; ty <= last_y; ty++) {
+      for (int tx = first_x; tx <= last_x; tx++) {
+        tile_cache.erase(tile_key(level, ty * tiles_x + tx));
+      }
     }
   }
+}
+
+// Drops tiles that were not painted in the last frame once the cache grows
+// past its limit.
+void ImageArea::trim_tile_cache()
+{
+  if (tile_cache.size() <= MAX_CACHED_TILES) return;
+
+  for (auto it = tile_cache.begin(); it != tile_cache.end();) {
+    if (it->second.last_used != frame_count) {
+      it = tile_cache.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
 
-  auto pixbuf = Gdk::Pixbuf::create_from_data(image_bitmap.get(),
-					      Gdk::Colorspace::COLORSPACE_RGB,
-					      true,
-					      8,
-					      drawing_context.get_width(),
-					      drawing_context.get_height(),
-					      drawing_context.get_width() * 4);
-  Gdk::Cairo::set_source_pixbuf(cr, pixbuf, 0, 0);
+void ImageArea::invalidate(Pixor::rect area)
+{
+  area = Pixor::rect_intersect(area, drawing_context.get_bounds());
+  if (Pixor::rect_empty(area)) return;
+
+  pyramid.invalidate(area);
+  drop_cached_tiles(area);
+
+  int x1 = (int) std::floor((area.x - view_x) * zoom);
+  int y1 = (int) std::floor((area.y - view_y) * zoom);
+  int x2 = (int) std::ceil((area.x + area.width - view_x) * zoom);
+  int y2 = (int) std::ceil((area.y + area.height - view_y) * zoom);
+
+  // One extra pixel on each side covers the filtering of scaled tiles.
+  queue_draw_area(x1 - 1, y1 - 1, x2 - x1 + 2, y2 - y1 + 2);
+}
+
+void ImageArea::set_view(double zoom, double view_x, double view_y)
+{
+  this->zoom = std::min(MAX_ZOOM, std::max(MIN_ZOOM, zoom));
+  this->view_x = view_x;
+  this->view_y = view_y;
+  queue_draw();
+}
+
+// Zooms by factor keeping the image point under widget position (x, y) in
+// place.
+void ImageArea::zoom_at(double factor, double x, double y)
+{
+  double new_zoom = std::min(MAX_ZOOM, std::max(MIN_ZOOM, zoom * factor));
+  double image_x = view_x + x / zoom;
+  double image_y = view_y + y / zoom;
+
+  set_view(new_zoom, image_x - x / new_zoom, image_y - y / new_zoom);
+}
+
+void ImageArea::zoom_in()
+{
+  zoom_at(ZOOM_STEP, get_allocated_width() / 2.0, get_allocated_height() / 2.0);
+}
+
+void ImageArea::zoom_out()
+{
+  zoom_at(1 / ZOOM_STEP, get_allocated_width() / 2.0, get_allocated_height() / 2.0);
+}
+
+void ImageArea::zoom_reset()
+{
+  set_view(1, 0, 0);
+}
+
+void ImageArea::flush_drawing()
+{
+  invalidate(drawing_context.take_dirty());
+}
+
+void ImageArea::undo()
+{
+  if (button1_pressed || !journal) return;
+  journal->undo(drawing_context);
+  flush_drawing();
+}
+
+void ImageArea::redo()
+{
+  if (button1_pressed || !journal) return;
+  journal->redo(drawing_context);
+  flush_drawing();
+}
+
+bool ImageArea::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
+{
+  double x1;
+  double y1;
+  double x2;
+  double y2;
+
+  cr->get_clip_extents(x1, y1, x2, y2);
+  cr->set_source_rgb(0.2, 0.2, 0.2);
   cr->paint();
 
+  if (preview_surface) {
+    cr->save();
+    cr->scale(zoom, zoom);
+    cr->translate(-view_x, -view_y);
+    cr->scale(drawing_context.get_width() / (double) preview_surface->get_width(),
+      drawing_context.get_height() / (double) preview_surface->get_height());
+    cr->set_source(preview_surface, 0, 0);
+    cr->rectangle(0, 0, preview_surface->get_width(), preview_surface->get_height());
+    cr->fill();
+    cr->restore();
+
+    return true;
+  }
+
+  // Only the tiles of the chosen level under the clip are painted, their
+  // cost depends on the widget size, not on the image size.
+  int level = pyramid.choose_level(zoom);
+  double level_scale = 1 << level;
+  double scale = zoom * level_scale;
+  int left = (int) std::floor((view_x + x1 / zoom) / level_scale);
+  int top = (int) std::floor((view_y + y1 / zoom) / level_scale);
+  int right = (int) std::ceil((view_x + x2 / zoom) / level_scale);
+  int bottom = (int) std::ceil((view_y + y2 / zoom) / level_scale);
+  Pixor::rect visible = Pixor::rect_intersect({left, top, right - left, bottom - top}, pyramid.get_level_bounds(level));
+
+  frame_count++;
+  if (Pixor::rect_empty(visible)) return true;
+
+  int tiles_x = level_tiles_x(pyramid, level);
+  int first_x = visible.x / Pixor::TILE_SIZE;
+  int first_y = visible.y / Pixor::TILE_SIZE;
+  int last_x = (visible.x + visible.width - 1) / Pixor::TILE_SIZE;
+  int last_y = (visible.y + visible.height - 1) / Pixor::TILE_SIZE;
+
+  cr->save();
+  cr->scale(scale, scale);
+  cr->translate(-view_x / level_scale, -view_y / level_scale);
+  cr->set_antialias(Cairo::ANTIALIAS_NONE);
+
+  for (int ty = first_y; ty <= last_y; ty++) {
+    for (int tx = first_x; tx <= last_x; tx++) {
+      auto surface = get_tile_surface(level, ty * tiles_x + tx);
+      auto pattern = Cairo::SurfacePattern::create(surface);
+      double tile_x = tx * Pixor::TILE_SIZE;
+      double tile_y = ty * Pixor::TILE_SIZE;
+
+      // Pixels stay sharp when zoomed in, padding hides the seams between
+      // tiles when they are filtered.
+      pattern->set_filter(scale >= 1 ? Cairo::FILTER_NEAREST : Cairo::FILTER_GOOD);
+      pattern->set_extend(Cairo::EXTEND_PAD);
+      pattern->set_matrix(Cairo::translation_matrix(-tile_x, -tile_y));
+      cr->set_source(pattern);
+      cr->rectangle(tile_x, tile_y, surface->get_width(), surface->get_height());
+      cr->fill();
+    }
+  }
+
+  cr->restore();
+  trim_tile_cache();
+
   return true;
 }
 
+// Motion events only queue positions, they are drawn once per frame.
 bool ImageArea::on_mouse_motion(GdkEventMotion *motion_event)
 {
+  if (panning) {
+    set_view(zoom, view_x - (motion_event->x - pan_last_x) / zoom, view_y - (motion_event->y - pan_last_y) / zoom);
+    pan_last_x = motion_event->x;
+    pan_last_y = motion_event->y;
+    return true;
+  }
+
   if (!button1_pressed) return true;
 
-  mouse_pointer_trace.push_back({(int) motion_event->x, (int) motion_event->y});
-  queue_draw();
+  stroke.add(to_image(motion_event->x, motion_event->y), motion_event->time / 1000.0);
+
+  return true;
+}
+
+void ImageArea::draw_pending_stroke(bool finish)
+{
+  auto points = finish ? stroke.finish() : stroke.drain();
+  if (points.size() < 2) return;
+
+  drawing_context.draw_polyline_with_pattern(points);
+  flush_drawing();
+}
+
+bool ImageArea::on_frame_tick(const Glib::RefPtr<Gdk::FrameClock> &frame_clock)
+{
+  UNUSED(frame_clock);
+  if (stroke.has_pending()) draw_pending_stroke(false);
 
   return true;
 }
 
 bool ImageArea::on_button_press_event(GdkEventButton *button_event)
 {
-  if (button_event->button != 1) return true;
+  if (button_event->button == 2) {
+    panning = true;
+    pan_last_x = button_event->x;
+    pan_last_y = button_event->y;
+    return true;
+  }
+
+  if (button_event->button != 1 || filter_job) return true;
+
+  Pixor::point pointer = to_image(button_event->x, button_event->y);
+
+  if (fill_mode) {
+    Pixor::flood_fill(drawing_context, pointer, brush_color, fill_tolerance, fill_connectivity);
+    flush_drawing();
+    return true;
+  }
 
-  int pointer_x;
-  int pointer_y;
-  get_pointer(pointer_x, pointer_y);
   button1_pressed = true;
-  mouse_pointer_trace.push_back({pointer_x, pointer_y});
-  queue_draw();
+  if (journal) journal->begin_entry();
+  stroke.begin(pointer, button_event->time / 1000.0);
+  brush->draw_onto(drawing_context, pointer);
+  flush_drawing();
+
+  if (!tick_callback_id) {
+    tick_callback_id = add_tick_callback(sigc::mem_fun(*this, &ImageArea::on_frame_tick));
+  }
 
   return true;
 }
 
 bool ImageArea::on_button_release_event(GdkEventButton *button_event)
 {
+  if (button_event->button == 2) panning = false;
   if (button_event->button != 1) return true;
 
+  if (!button1_pressed) return true;
+
   button1_pressed = false;
-  mouse_pointer_trace.clear();
+  draw_pending_stroke(true);
+  if (journal) journal->end_entry();
+
+  if (tick_callback_id) {
+    remove_tick_callback(tick_callback_id);
+    tick_callback_id = 0;
+  }
+
+  return true;
+}
+
+// Ctrl + wheel zooms around the pointer, the wheel alone scrolls (Shift
+// scrolls horizontally).
+bool ImageArea::on_scroll_event(GdkEventScroll *scroll_event)
+{
+  bool control = scroll_event->state & GDK_CONTROL_MASK;
+  bool shift = scroll_event->state & GDK_SHIFT_MASK;
+  double dx = 0;
+  double dy = 0;
+
+  switch (scroll_event->direction) {
+    case GDK_SCROLL_UP: dy = -1; break;
+    case GDK_SCROLL_DOWN: dy = 1; break;
+    case GDK_SCROLL_LEFT: dx = -1; break;
+    case GDK_SCROLL_RIGHT: dx = 1; break;
+    default: return false;
+  }
+
+  if (control) {
+    zoom_at(dy < 0 ? ZOOM_STEP : 1 / ZOOM_STEP, scroll_event->x, scroll_event->y);
+    return true;
+  }
+
+  if (shift) std::swap(dx, dy);
+  set_view(zoom, view_x + dx * SCROLL_STEP / zoom, view_y + dy * SCROLL_STEP / zoom);
 
   return true;
 }
@@ -1,31 +1,117 @@
 #pragma once
-#include <deque>
 #include <gtkmm/drawingarea.h>
 #include <gdkmm/pixbuf.h>
 #include <gdkmm/dragcontext.h>
+#include <cairomm/surface.h>
+#include <glibmm/dispatcher.h>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include "image.h"
 #include "context.h"
+#include "job.h"
+#include "canny.h"
+#include "filter_preview.h"
+#include "flood_fill.h"
+#include "stroke.h"
+#include "image_pyramid.h"
 
 class ImageArea : public Gtk::DrawingArea
 {
   bool on_mouse_motion(GdkEventMotion *motion_event);
   bool on_button_press_event(GdkEventButton *button_event) override;
   bool on_button_release_event(GdkEventButton *button_event) override;
+  bool on_scroll_event(GdkEventScroll *scroll_event) override;
+  Pixor::point to_image(double x, double y) const;
+  Cairo::RefPtr<Cairo::ImageSurface> get_tile_surface(int level, int index);
+  void drop_cached_tiles(Pixor::rect area);
+  void trim_tile_cache();
+  void set_view(double zoom, double view_x, double view_y);
+  void zoom_at(double factor, double x, double y);
+  void invalidate(Pixor::rect area);
+  void flush_drawing();
+  void start_filter();
+  void on_filter_update();
+  void show_preview(Pixor::Matrix<double> &m);
+  bool on_frame_tick(const Glib::RefPtr<Gdk::FrameClock> &frame_clock);
+  void draw_pending_stroke(bool finish);
 
-  std::shared_ptr<byte[]> image_bitmap;
   Pixor::Context drawing_context;
-  byte *saved_bitmap;
-  std::deque<Pixor::point> mouse_pointer_trace; // deque has clear method vs. stack
+  std::shared_ptr<Pixor::UndoJournal> journal;
+  std::shared_ptr<Pixor::Pattern> brush;
+  RGBA brush_color = Pixor::rgba(0, 255, 0, 255);
+  int fill_tolerance = 32;
+  Pixor::FillConnectivity fill_connectivity = Pixor::FILL_CONNECTIVITY_4;
+
+  // The image is shown through a pyramid of downscaled levels. Tiles of
+  // the level that matches the zoom are converted to Cairo surfaces when
+  // they first become visible and are kept until the pixels under them
+  // change, so panning and zooming only repaint cached tiles.
+  struct CachedTile {
+    Cairo::RefPtr<Cairo::ImageSurface> surface;
+    unsigned long last_used;
+  };
+
+  Pixor::ImagePyramid pyramid;
+  std::unordered_map<unsigned long long, CachedTile> tile_cache;
+  std::vector<RGBA> tile_buffer;
+  unsigned long frame_count = 0;
+
+  // view_x and view_y are the image coordinates shown at the top left
+  // corner of the widget, zoom is in screen pixels per image pixel.
+  double zoom = 1;
+  double view_x = 0;
+  double view_y = 0;
+  double pan_last_x = 0;
+  double pan_last_y = 0;
+  bool panning = false;
+  Pixor::StrokeBuilder stroke;
+  guint tick_callback_id = 0;
   bool button1_pressed = false;
+  bool fill_mode = false;
+
+  // matrix is null for the end of a run.
+  struct FilterResult {
+    unsigned int generation;
+    std::shared_ptr<Pixor::Matrix<double>> matrix;
+    int scale_divisor;
+  };
+
+  // The edge filter runs on a worker thread, coarse to fine, and the
+  // dispatcher brings its progress and results back to the main loop.
+  // Restarting it bumps filter_generation, results of older runs are
+  // dropped and their jobs are kept only until they have wound down.
+  Glib::Dispatcher filter_dispatcher;
+  std::shared_ptr<Pixor::Job> filter_job;
+  std::vector<std::shared_ptr<Pixor::Job>> stale_filter_jobs;
+  std::shared_ptr<const Pixor::Context> filter_source;
+  CannyOptions filter_options;
+  unsigned int filter_generation = 0;
+  std::mutex filter_mutex;
+  std::vector<FilterResult> filter_results;
+  Cairo::RefPtr<Cairo::ImageSurface> preview_surface;
+  sigc::signal<void, double> filter_progress;
 
 public:
-  ImageArea(std::shared_ptr<Pixor::Image> &image);
+  // greyscale is the bitmap load_greyscale() made of image, the drawing
+  // context takes it over.
+  ImageArea(std::shared_ptr<Pixor::Image> &image, std::shared_ptr<byte[]> greyscale);
   virtual ~ImageArea();
+  void undo();
+  void redo();
+  void set_fill_mode(bool enabled) {fill_mode = enabled;}
+  // How far a channel may be from the clicked colour, see flood_fill().
+  void set_fill_tolerance(int tolerance) {fill_tolerance = tolerance;}
+  void set_fill_connectivity(Pixor::FillConnectivity connectivity) {fill_connectivity = connectivity;}
+  void zoom_in();
+  void zoom_out();
+  void zoom_reset();
+  void set_edge_threshold(double ratio);
+  void set_stroke_smoothing(bool catmull_rom, bool one_euro) {stroke.set_smoothing(catmull_rom, one_euro);}
+  sigc::signal<void, double> signal_filter_progress() {return filter_progress;}
 
 protected:
   bool on_draw(const Cairo::RefPtr<Cairo::Context> &cr) override;
 
-  Glib::RefPtr<Gdk::Pixbuf> m_image;
   std::shared_ptr<Pixor::Image> image;
 };
@@ -0,0 +1,136 @@
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "image_io.h"
+#include "buffer_pool.h"
+#include "png.h"
+#include "pnm.h"
+#include "qoi.h"
+#include "result_cache.h"
+
+using namespace Pixor;
+
+ImageFormat Pixor::detect_image_format(const byte *magic, size_t size)
+{
+  if (size >= 8 && memcmp(magic, PNG_SIGNATURE, 8) == 0) return IMAGE_FORMAT_PNG;
+  if (size >= 4 && memcmp(magic, QOI_MAGIC, 4) == 0) return IMAGE_FORMAT_QOI;
+  if (size >= 3 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6' || magic[1] == '7') &&
+      (magic[2] == ' ' || magic[2] == '\t' || magic[2] == '\r' || magic[2] == '\n')) {
+    return IMAGE_FORMAT_PNM;
+  }
+
+  return IMAGE_FORMAT_UNKNOWN;
+}
+
+ImageFormat Pixor::detect_image_format(std::istream &data_stream)
+{
+  byte magic[8];
+
+  data_stream.read((char *) magic, sizeof(magic));
+  size_t size = data_stream.gcount();
+  data_stream.clear();
+  data_stream.seekg(0);
+
+  return detect_image_format(magic, size);
+}
+
+std::shared_ptr<Image> Pixor::decode_image(std::istream &data_stream)
+{
+  // Detecting the format rewinds the stream, a pipe has to be read into
+  // memory first.
+  if (data_stream.tellg() == -1) {
+    size_t size;
+    auto data = read_stream(data_stream, size);
+    std::istringstream buffered(std::string((const char *) data.get(), size));
+    return decode_image(buffered);
+  }
+
+  switch (detect_image_format(data_stream)) {
+    case IMAGE_FORMAT_PNG:
+      return std::shared_ptr<Image>(decode_png(data_stream));
+    case IMAGE_FORMAT_QOI:
+      return std::shared_ptr<Image>(decode_qoi(data_stream));
+    case IMAGE_FORMAT_PNM:
+      return std::shared_ptr<Image>(decode_pnm(data_stream));
+    default:
+      throw std::invalid_argument("Unknown image format");
+  }
+}
+
+std::shared_ptr<Image> Pixor::open_image(const std::string &path)
+{
+  std::ifstream file(path, std::ios::in|std::ios::binary);
+  if (!file.is_open()) throw std::invalid_argument("Cannot open " + path);
+
+  if (detect_image_format(file) == IMAGE_FORMAT_PNM) {
+    file.close();
+    return std::shared_ptr<Image>(map_pnm(path));
+  }
+
+  return decode_image(file);
+}
+
+std::shared_ptr<byte[]> Pixor::load_greyscale(std::shared_ptr<Image> image)
+{
+  if (!image) throw std::invalid_argument("No image to convert to greyscale");
+
+  auto &cache = ResultCache::shared();
+  uint64_t content = image->get_content_hash();
+  CacheKey key = {content, hash_params("greyscale", {LUMA_REC601})};
+
+  auto bitmap = content ? cache.get_bitmap(key, image->get_width(), image->get_height()) : nullptr;
+  if (bitmap) return bitmap;
+
+  bitmap = image->get_image_bitmap_greyscale();
+  if (!bitmap) throw std::invalid_argument("Cannot decode the pixels of the image");
+  if (content) cache.put_bitmap(key, bitmap.get(), image->get_width(), image->get_height());
+
+  auto png = std::dynamic_pointer_cast<PngImage>(image);
+  if (png) png->release_pixels();
+
+  return bitmap;
+}
+
+bool Pixor::peek_image_size(std::istream &data_stream, int &width, int &height)
+{
+  switch (detect_image_format(data_stream)) {
+    case IMAGE_FORMAT_PNG:
+      return peek_png_size(data_stream, width, height);
+    case IMAGE_FORMAT_QOI:
+      return peek_qoi_size(data_stream, width, height);
+    case IMAGE_FORMAT_PNM:
+      return peek_pnm_size(data_stream, width, height);
+    default:
+      return false;
+  }
+}
+
+std::shared_ptr<byte[]> Pixor::read_stream(std::istream &data_stream, size_t &size)
+{
+  auto start = data_stream.tellg();
+
+  // Seekable streams are read in one go, anything else in blocks.
+  if (start != -1 && data_stream.seekg(0, std::ios::end)) {
+    size = data_stream.tellg() - start;
+    data_stream.seekg(start);
+
+    auto res = BufferPool::shared().allocate<byte>(size);
+    data_stream.read((char *) res.get(), size);
+    size = data_stream.gcount();
+    return res;
+  }
+
+  data_stream.clear();
+  std::vector<byte> buffer;
+  byte block[1 << 16];
+  while (data_stream.read((char *) block, sizeof(block)) || data_stream.gcount()) {
+    buffer.insert(buffer.end(), block, block + data_stream.gcount());
+  }
+
+  size = buffer.size();
+  auto res = BufferPool::shared().allocate<byte>(size);
+  memcpy(res.get(), buffer.data(), size);
+  return res;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <iostream>
+#include <memory>
+#include <string>
+#include "pixor.h"
+#include "image.h"
+
+namespace Pixor {
+
+enum ImageFormat {
+  IMAGE_FORMAT_UNKNOWN = 0,
+  IMAGE_FORMAT_PNG = 1,
+  IMAGE_FORMAT_QOI = 2,
+  IMAGE_FORMAT_PNM = 3,
+};
+
+// Tells the format from the first bytes of a file, 8 are enough.
+ImageFormat detect_image_format(const byte *magic, size_t size);
+// Peeks at the start of the stream and rewinds it.
+ImageFormat detect_image_format(std::istream &data_stream);
+
+// Decodes the stream with the reader its magic bytes ask for. Throws
+// std::invalid_argument for formats it does not know.
+std::shared_ptr<Image> decode_image(std::istream &data_stream);
+// Like decode_image(), but PAM/PPM files are mapped instead of read.
+std::shared_ptr<Image> open_image(const std::string &path);
+
+// The bitmap of image in greyscale, through the result cache since
+// decoding is most of the time it takes to open an image. Pixels the image
+// decoded on the way are released, the caller holds the only copy. Throws
+// std::invalid_argument if image is null or its pixels cannot be decoded.
+std::shared_ptr<byte[]> load_greyscale(std::shared_ptr<Image> image);
+
+// Reads the dimensions from the header of any known format and rewinds
+// the stream.
+bool peek_image_size(std::istream &data_stream, int &width, int &height);
+
+// Reads the rest of the stream into a pooled buffer.
+std::shared_ptr<byte[]> read_stream(std::istream &data_stream, size_t &size);
+
+}
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include "image_pyramid.h"
+#include "context.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+static TraceCounter tiles_built("pyramid.tiles_built");
+
+ImagePyramid::ImagePyramid(const Context &context) :
+  context(context)
+{
+  int width = context.get_width();
+  int height = context.get_height();
+
+  levels.emplace_back();
+  while (width > TILE_SIZE || height > TILE_SIZE) {
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+    levels.emplace_back();
+  }
+}
+
+int ImagePyramid::get_level_width(int level) const
+{
+  int width = context.get_width();
+  for (int i = 0; i < level; i++) width = (width + 1) / 2;
+  return width;
+}
+
+int ImagePyramid::get_level_height(int level) const
+{
+  int height = context.get_height();
+  for (int i = 0; i < level; i++) height = (height + 1) / 2;
+  return height;
+}
+
+// Picks the smallest level that still has at least one pixel per screen
+// pixel, so the view is only ever scaled down from a level, never up
+// (except at level 0).
+int ImagePyramid::choose_level(double zoom) const
+{
+  int level = 0;
+
+  while (level + 1 < get_level_count() && 1.0 / (1 << (level + 1)) >= zoom) {
+    level++;
+  }
+
+  return level;
+}
+
+void ImagePyramid::ensure_level(int level)
+{
+  Level &l = levels[level];
+  if (l.bitmap) return;
+
+  l.bitmap = std::make_unique<TiledBitmap>(get_level_width(level), get_level_height(level));
+  l.stale.assign(l.bitmap->get_tile_count(), true);
+}
+
+void ImagePyramid::invalidate(rect area)
+{
+  area = rect_intersect(area, context.get_bounds());
+  if (rect_empty(area)) return;
+
+  for (int level = 1; level < get_level_count(); level++) {
+    Level &l = levels[level];
+    if (!l.bitmap) continue;
+
+    int first_x = (area.x >> level) / TILE_SIZE;
+    int first_y = (area.y >> level) / TILE_SIZE;
+    int last_x = ((area.x + area.width - 1) >> level) / TILE_SIZE;
+    int last_y = ((area.y + area.height - 1) >> level) / TILE_SIZE;
+
+    for (int ty = first_y; ty <= last_y; ty++) {
+      for (int tx = first_x; tx <= last_x; tx++) {
+        l.stale[ty * l.bitmap->get_tiles_x() + tx] = true;
+      }
+    }
+  }
+}
+
+void ImagePyramid::read_rect(int level, rect area, RGBA *dest)
+{
+  if (level == 0) {
+    context.read_rect(area, dest);
+    return;
+  }
+
+  update_area(level, area);
+  levels[level].bitmap->read_rect(area, dest);
+}
+
+// Rebuilds the stale tiles of a level that intersect area from the level
+// below, which is brought up to date first.
+void ImagePyramid::update_area(int level, rect area)
+{
+  if (level == 0) return;
+  ensure_level(level);
+
+  Level &l = levels[level];
+  area = rect_intersect(area, get_level_bounds(level));
+  if (rect_empty(area)) return;
+
+  rect source_bounds = get_level_bounds(level - 1);
+  std::vector<RGBA> source(TILE_PIXELS * 4);
+  std::vector<RGBA> tile(TILE_PIXELS);
+
+  int first_x = area.x / TILE_SIZE;
+  int first_y = area.y / TILE_SIZE;
+  int last_x = (area.x + area.width - 1) / TILE_SIZE;
+  int last_y = (area.y + area.height - 1) / TILE_SIZE;
+
+  for (int ty = first_y; ty <= last_y; ty++) {
+    for (int tx = first_x; tx <= last_x; tx++) {
+      int index = ty * l.bitmap->get_tiles_x() + tx;
+      if (!l.stale[index]) continue;
+
+      rect tile_area = l.bitmap->get_tile_rect(index);
+      rect source_area = rect_intersect({tile_area.x * 2, tile_area.y * 2, tile_area.width * 2, tile_area.height * 2}, source_bounds);
+      read_rect(level - 1, source_area, source.data());
+
+      // Odd sized levels repeat their last row and column.
+      for (int y = 0; y < tile_area.height; y++) {
+        int y0 = y * 2;
+        int y1 = std::min(y0 + 1, source_area.height - 1);
+        const byte *row0 = (const byte *) (source.data() + (size_t) y0 * source_area.width);
+        const byte *row1 = (const byte *) (source.data() + (size_t) y1 * source_area.width);
+        byte *out = (byte *) (tile.data() + (size_t) y * tile_area.width);
+
+        for (int x = 0; x < tile_area.width; x++) {
+          int x0 = x * 8;
+          int x1 = std::min(x * 2 + 1, source_area.width - 1) * 4;
+
+          for (int c = 0; c < 4; c++) {
+            out[x * 4 + c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2;
+          }
+        }
+      }
+
+      l.bitmap->write_rect(tile_area, tile.data());
+      l.stale[index] = false;
+      PIXOR_TRACE_COUNT(tiles_built, 1);
+    }
+  }
+}
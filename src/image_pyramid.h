@@ -0,0 +1,39 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include "pixor.h"
+#include "tiled_bitmap.h"
+
+namespace Pixor {
+
+class Context;
+
+// Mipmap pyramid over a context. Level 0 is the context itself, every
+// further level is a 2x box-filtered copy of the previous one. Levels are
+// built lazily, tile by tile, only where they are read, and invalidate()
+// marks just the tiles covering a changed area as stale on every level.
+class ImagePyramid {
+  struct Level {
+    std::unique_ptr<TiledBitmap> bitmap;
+    std::vector<bool> stale;
+  };
+
+  const Context &context;
+  std::vector<Level> levels;
+
+  void ensure_level(int level);
+  void update_area(int level, rect area);
+
+public:
+  ImagePyramid(const Context &context);
+
+  int get_level_count() const {return levels.size();}
+  int get_level_width(int level) const;
+  int get_level_height(int level) const;
+  rect get_level_bounds(int level) const {return {0, 0, get_level_width(level), get_level_height(level)};}
+  int choose_level(double zoom) const;
+  void invalidate(rect area);
+  void read_rect(int level, rect area, RGBA *dest);
+};
+
+}
@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <chrono>
+#include "job.h"
+#include "debug.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+void Job::check_cancelled() const
+{
+  if (cancelled) throw JobCancelled();
+}
+
+void Job::set_progress(float value)
+{
+  check_cancelled();
+  progress = value;
+  if (progress_callback) progress_callback(*this);
+}
+
+void Job::mark_finished()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+  }
+  finished_condition.notify_all();
+}
+
+void Job::wait()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  finished_condition.wait(lock, [this] {return (bool) finished;});
+}
+
+JobQueue::JobQueue(int threads)
+{
+  for (int i = 0; i < std::max(1, threads); i++) {
+    workers.emplace_back(&JobQueue::worker_loop, this);
+  }
+}
+
+JobQueue::~JobQueue()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    for (auto &task : tasks) {
+      task.job->cancel();
+    }
+  }
+  condition.notify_all();
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void JobQueue::worker_loop()
+{
+  while (true) {
+    Task task;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      condition.wait(lock, [this] {return stopping || !tasks.empty();});
+      if (tasks.empty()) return;
+
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+
+    try {
+      PIXOR_TRACE_SCOPE("job", "job");
+      if (!task.job->is_cancelled()) task.work(*task.job);
+    } catch (const JobCancelled &) {
+      dbgln("Job cancelled");
+    } catch (const std::exception &e) {
+      errln("Job failed: %s", e.what());
+    }
+
+    task.job->mark_finished();
+  }
+}
+
+std::shared_ptr<Job> JobQueue::submit(std::function<void(Job &)> work, std::function<void(Job &)> progress_callback)
+{
+  auto job = std::make_shared<Job>(progress_callback);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back({job, work});
+  }
+  condition.notify_one();
+
+  return job;
+}
+
+void MemoryAdmission::acquire(size_t bytes, const Job &job)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (in_use > 0 && in_use + bytes > budget) {
+    job.check_cancelled();
+    released.wait_for(lock, std::chrono::milliseconds(50));
+  }
+
+  in_use += bytes;
+}
+
+void MemoryAdmission::release(size_t bytes)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    in_use -= std::min(bytes, in_use);
+  }
+  released.notify_all();
+}
+
+size_t MemoryAdmission::get_in_use()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return in_use;
+}
+
+JobQueue &JobQueue::shared()
+{
+  static JobQueue queue(std::max(1u, std::thread::hardware_concurrency()));
+  return queue;
+}
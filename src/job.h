@@ -0,0 +1,91 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Pixor {
+
+class JobCancelled : public std::exception {
+public:
+  const char *what() const noexcept override {return "Job cancelled";}
+};
+
+// Handle shared between the code that submitted a job and the worker
+// running it. Cancellation is cooperative: long running work reports its
+// progress through set_progress(), which throws JobCancelled once the job
+// has been cancelled.
+class Job {
+  std::atomic<bool> cancelled{false};
+  std::atomic<bool> finished{false};
+  std::atomic<float> progress{0};
+  std::function<void(Job &)> progress_callback;
+  std::mutex mutex;
+  std::condition_variable finished_condition;
+
+public:
+  Job(std::function<void(Job &)> progress_callback = nullptr) : progress_callback(progress_callback) {}
+
+  void cancel() {cancelled = true;}
+  bool is_cancelled() const {return cancelled;}
+  bool is_finished() const {return finished;}
+  float get_progress() const {return progress;}
+  void check_cancelled() const;
+  void set_progress(float value);
+  void mark_finished();
+  void wait();
+};
+
+// Runs jobs in submission order on a fixed set of worker threads.
+class JobQueue {
+  struct Task {
+    std::shared_ptr<Job> job;
+    std::function<void(Job &)> work;
+  };
+
+  std::vector<std::thread> workers;
+  std::deque<Task> tasks;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stopping = false;
+
+  void worker_loop();
+
+public:
+  JobQueue(int threads = 1);
+  ~JobQueue();
+
+  // The job is finished once work returns or throws, JobCancelled is
+  // swallowed. Jobs cancelled before they start are skipped.
+  std::shared_ptr<Job> submit(std::function<void(Job &)> work, std::function<void(Job &)> progress_callback = nullptr);
+  static JobQueue &shared();
+};
+
+// Bounds the memory held by jobs that run at the same time. A job takes
+// its estimated size with acquire() before allocating and gives it back
+// with release() once the memory has been handed off. A request larger
+// than the whole budget is admitted when nothing else is in flight, so it
+// cannot wait forever.
+class MemoryAdmission {
+  size_t budget;
+  size_t in_use = 0;
+  std::mutex mutex;
+  std::condition_variable released;
+
+public:
+  MemoryAdmission(size_t budget) : budget(budget) {}
+
+  // Blocks until bytes fit into the budget, throws JobCancelled if job is
+  // cancelled while waiting.
+  void acquire(size_t bytes, const Job &job);
+  void release(size_t bytes);
+  size_t get_in_use();
+};
+
+}
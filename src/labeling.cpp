@@ -0,0 +1,315 @@
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+#include "labeling.h"
+#include "buffer_pool.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+// A few strips per thread, so the pool can balance uneven ones.
+static const int STRIPS_PER_THREAD = 4;
+
+struct Accumulator {
+  size_t area = 0;
+  int min_x = INT_MAX;
+  int min_y = INT_MAX;
+  int max_x = INT_MIN;
+  int max_y = INT_MIN;
+  uint64_t sum_x = 0;
+  uint64_t sum_y = 0;
+
+  // Pixels [x0, x1) of row y.
+  void add_run(int x0, int x1, int y)
+  {
+    uint64_t length = x1 - x0;
+
+    area += length;
+    min_x = std::min(min_x, x0);
+    min_y = std::min(min_y, y);
+    max_x = std::max(max_x, x1 - 1);
+    max_y = std::max(max_y, y);
+    sum_x += length * (x0 + x1 - 1) / 2;
+    sum_y += length * y;
+  }
+
+  void merge(const Accumulator &other)
+  {
+    area += other.area;
+    min_x = std::min(min_x, other.min_x);
+    min_y = std::min(min_y, other.min_y);
+    max_x = std::max(max_x, other.max_x);
+    max_y = std::max(max_y, other.max_y);
+    sum_x += other.sum_x;
+    sum_y += other.sum_y;
+  }
+};
+
+// The union-find forest lives in the label plane: a pixel holds 1 + the
+// index of its parent and the background 0. A root is its own parent.
+// Parents always come earlier in raster order, so the root of a component
+// is its first pixel.
+class Labeler {
+  const double *src;
+  int *labels;
+  int width;
+  bool by_value;
+  bool eight;
+  // Pixels given a new parent, when kept.
+  std::vector<int> *written;
+
+  void set_parent(int i, int parent)
+  {
+    labels[i] = parent + 1;
+    if (written) written->push_back(i);
+  }
+
+public:
+  Labeler(const double *src, int *labels, int width, const LabelOptions &options, std::vector<int> *written = nullptr) :
+    src(src),
+    labels(labels),
+    width(width),
+    by_value(options.by_value),
+    eight(options.connectivity == FILL_CONNECTIVITY_8),
+    written(written)
+    {}
+
+  // p is foreground.
+  bool connects(int p, int q) const
+  {
+    return by_value ? src[q] == src[p] : src[q] > 0;
+  }
+
+  int find(int i)
+  {
+    int root = i;
+    while (labels[root] - 1 != root) root = labels[root] - 1;
+
+    while (labels[i] - 1 != root) {
+      int next = labels[i] - 1;
+      set_parent(i, root);
+      i = next;
+    }
+
+    return root;
+  }
+
+  int unite(int i, int j)
+  {
+    i = find(i);
+    j = find(j);
+    if (i > j) std::swap(i, j);
+    if (i != j) set_parent(j, i);
+
+    return i;
+  }
+
+  // Rows [y0, y1) on their own, the new roots go to roots. With
+  // 8-connectivity the neighbour above is connected to all the others, and
+  // the upper left one to the left one, so at most two trees ever need
+  // joining.
+  void scan(int y0, int y1, std::vector<int> &roots)
+  {
+    for (int y = y0; y < y1; y++) {
+      bool up = y > y0;
+
+      for (int x = 0; x < width; x++) {
+        int p = y * width + x;
+        if (!(src[p] > 0)) {
+          labels[p] = 0;
+          continue;
+        }
+
+        bool left = x > 0 && connects(p, p - 1);
+        bool above = up && connects(p, p - width);
+        int root;
+
+        if (!eight) {
+          if (above && left) {
+            root = unite(p - width, p - 1);
+          } else if (above || left) {
+            root = find(above ? p - width : p - 1);
+          } else {
+            root = p;
+          }
+        } else if (above) {
+          root = find(p - width);
+        } else {
+          bool above_left = up && x > 0 && connects(p, p - width - 1);
+          bool above_right = up && x + 1 < width && connects(p, p - width + 1);
+
+          if (above_right && (above_left || left)) {
+            root = unite(p - width + 1, above_left ? p - width - 1 : p - 1);
+          } else if (above_right || above_left || left) {
+            root = find(above_right ? p - width + 1 : above_left ? p - width - 1 : p - 1);
+          } else {
+            root = p;
+          }
+        }
+
+        labels[p] = root + 1;
+        if (root == p) roots.push_back(p);
+      }
+    }
+  }
+
+  // Joins row y to the row above it, both already labelled.
+  void merge_border(int y)
+  {
+    for (int x = 0; x < width; x++) {
+      int p = y * width + x;
+      if (!labels[p]) continue;
+
+      for (int dx = eight ? -1 : 0; dx <= (eight ? 1 : 0); dx++) {
+        int q = p - width + dx;
+        if (x + dx < 0 || x + dx >= width || !labels[q] || !connects(p, q)) continue;
+
+        unite(p, q);
+      }
+    }
+  }
+};
+
+Components Pixor::label_components(Matrix<double> &mask, const LabelOptions &options)
+{
+  PIXOR_TRACE_SCOPE("label_components", "labeling");
+  int width = mask.get_width();
+  int height = mask.get_height();
+  if ((size_t) width * height >= (size_t) INT_MAX) throw std::invalid_argument("Image too large to label");
+
+  ThreadPool &pool = ThreadPool::shared();
+  // Every pixel is written by the scan, the plane needs no clearing.
+  auto buffer = BufferPool::shared().allocate<int>((size_t) width * height);
+  Components res = {Matrix<int>(width, height, std::shared_ptr<int>(buffer, buffer.get())), {}};
+  int *labels = res.labels.data();
+  int strips = std::max(1, std::min(height, pool.get_concurrency() * STRIPS_PER_THREAD));
+  std::vector<std::vector<int>> roots(strips);
+
+  auto first_row = [&](int strip) {
+    return (int) ((int64_t) height * strip / strips);
+  };
+
+  pool.parallel_for(0, strips, 1, [&](int begin, int end) {
+    for (int strip = begin; strip < end; strip++) {
+      Labeler(mask.data(), labels, width, options).scan(first_row(strip), first_row(strip + 1), roots[strip]);
+    }
+  });
+
+  // Round by round, neighbouring runs of strips that are already merged
+  // inside are joined, so no two merges of a round touch the same tree.
+  // Only pixels written here can have a parent in another strip.
+  std::vector<std::vector<int>> written(strips);
+  for (int step = 1; step < strips; step *= 2) {
+    int merges = (strips - step + 2 * step - 1) / (2 * step);
+
+    pool.parallel_for(0, merges, 1, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        int strip = step + i * 2 * step;
+        Labeler(mask.data(), labels, width, options, &written[strip]).merge_border(first_row(strip));
+      }
+    });
+  }
+
+  // Those now point straight at their roots, so every pixel's parent is
+  // either a root or an earlier pixel of its own strip.
+  for (auto &pixels : written) {
+    for (int p : pixels) {
+      int root = labels[p] - 1;
+      while (labels[root] - 1 != root) root = labels[root] - 1;
+      labels[p] = root + 1;
+    }
+  }
+
+  // Roots get their final labels, negated to tell them apart while the
+  // other pixels are relabelled.
+  std::vector<int> first_label(strips + 1, 0);
+  pool.parallel_for(0, strips, 1, [&](int begin, int end) {
+    for (int strip = begin; strip < end; strip++) {
+      auto &strip_roots = roots[strip];
+      strip_roots.erase(std::remove_if(strip_roots.begin(), strip_roots.end(), [&](int p) {
+        return labels[p] - 1 != p;
+      }), strip_roots.end());
+    }
+  });
+  for (int strip = 0; strip < strips; strip++) {
+    first_label[strip + 1] = first_label[strip] + roots[strip].size();
+  }
+
+  pool.parallel_for(0, strips, 1, [&](int begin, int end) {
+    for (int strip = begin; strip < end; strip++) {
+      for (size_t i = 0; i < roots[strip].size(); i++) {
+        labels[roots[strip][i]] = -(first_label[strip] + (int) i + 1);
+      }
+    }
+  });
+
+  // In raster order the parent of a pixel in the same strip is relabelled
+  // already. Stats are summed per run of a row, for components rooted in
+  // the strip in place and for the others from strips above in a map.
+  std::vector<std::vector<Accumulator>> own(strips);
+  std::vector<std::unordered_map<int, Accumulator>> foreign(strips);
+
+  pool.parallel_for(0, strips, 1, [&](int begin, int end) {
+    for (int strip = begin; strip < end; strip++) {
+      int base = first_label[strip];
+      int count = roots[strip].size();
+      own[strip].resize(count);
+
+      auto add_run = [&](int label, int x0, int x1, int y) {
+        Accumulator &sum = label > base && label <= base + count ? own[strip][label - base - 1] : foreign[strip][label];
+        sum.add_run(x0, x1, y);
+      };
+
+      for (int y = first_row(strip); y < first_row(strip + 1); y++) {
+        int run_label = 0;
+        int run_start = 0;
+
+        for (int x = 0; x < width; x++) {
+          int p = y * width + x;
+          int value = labels[p];
+          int label = 0;
+
+          if (value < 0) {
+            label = -value;
+          } else if (value) {
+            label = std::abs(labels[value - 1]);
+            labels[p] = label;
+          }
+
+          if (label != run_label) {
+            if (run_label) add_run(run_label, run_start, x, y);
+            run_label = label;
+            run_start = x;
+          }
+        }
+        if (run_label) add_run(run_label, run_start, width, y);
+      }
+    }
+  });
+
+  for (int strip = 0; strip < strips; strip++) {
+    for (auto &entry : foreign[strip]) {
+      int owner = std::upper_bound(first_label.begin(), first_label.end(), entry.first - 1) - first_label.begin() - 1;
+      own[owner][entry.first - 1 - first_label[owner]].merge(entry.second);
+    }
+  }
+
+  res.stats.resize(first_label[strips]);
+  pool.parallel_for(0, strips, 1, [&](int begin, int end) {
+    for (int strip = begin; strip < end; strip++) {
+      for (size_t i = 0; i < roots[strip].size(); i++) {
+        int label = first_label[strip] + i + 1;
+        const Accumulator &sum = own[strip][i];
+        rect bounds = {sum.min_x, sum.min_y, sum.max_x - sum.min_x + 1, sum.max_y - sum.min_y + 1};
+
+        labels[roots[strip][i]] = label;
+        res.stats[label - 1] = {sum.area, bounds, (double) sum.sum_x / sum.area, (double) sum.sum_y / sum.area};
+      }
+    }
+  });
+
+  return res;
+}
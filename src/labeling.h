@@ -0,0 +1,44 @@
+#pragma once
+#include <vector>
+#include "pixor.h"
+#include "flood_fill.h"
+#include "matrix.h"
+
+namespace Pixor {
+
+struct LabelOptions {
+  FillConnectivity connectivity = FILL_CONNECTIVITY_8;
+  // Neighbours only connect when their values are equal, for images of
+  // labels or classes. Otherwise every value above 0 is one foreground.
+  bool by_value = false;
+};
+
+struct ComponentStats {
+  size_t area;
+  rect bounds;
+  // The mean position of the pixels.
+  double centroid_x;
+  double centroid_y;
+};
+
+struct Components {
+  // 0 for the background, components are numbered from 1 in the raster
+  // order of their first pixels.
+  Matrix<int> labels;
+  // Of label l at l - 1.
+  std::vector<ComponentStats> stats;
+};
+
+// Connected components of the pixels of mask above 0, such as the output
+// of threshold() or hysteresis().
+//
+// Strips of rows are labelled by different threads with union-find over
+// the label plane itself, and a decision tree that skips neighbours
+// already known to be connected. Strip borders are then merged pairwise,
+// each round of merges touching disjoint strips. The stats are gathered
+// while the labels are made consecutive.
+//
+// Throws std::invalid_argument if the pixels cannot be indexed by int.
+Components label_components(Matrix<double> &mask, const LabelOptions &options = LabelOptions());
+
+}
@@ -1,7 +1,36 @@
+#include <stdlib.h>
+#include <string.h>
 #include "application.h"
+#include "debug.h"
+#include "pixel_format.h"
+#include "result_cache.h"
+#include "trace.h"
 
 int main(int argc, char* argv[])
 {
+  // PIXOR_LOG sets the log level (error, warning, info, debug), PIXOR_TRACE
+  // names a file the Chrome trace is written to on exit, PIXOR_CACHE_DIR
+  // keeps decoded images and filter results on disk between runs and
+  // PIXOR_PARALLEL_CONVERSIONS=0 keeps pixel conversions on one thread.
+  Pixor::LogLevel level;
+  const char *log = getenv("PIXOR_LOG");
+  if (log && Pixor::parse_log_level(log, level)) Pixor::set_log_level(level);
+
+  const char *trace_path = getenv("PIXOR_TRACE");
+  if (trace_path) Pixor::set_tracing(true);
+
+  const char *cache_dir = getenv("PIXOR_CACHE_DIR");
+  if (cache_dir) Pixor::ResultCache::shared().set_directory(cache_dir);
+
+  const char *parallel = getenv("PIXOR_PARALLEL_CONVERSIONS");
+  if (parallel) Pixor::set_parallel_conversions(strcmp(parallel, "0") != 0);
+
   auto application = Application::create();
-  return application->run(argc, argv);
+  int status = application->run(argc, argv);
+
+  if (trace_path && !Pixor::write_trace(trace_path)) {
+    errln("Cannot write trace to %s", trace_path);
+  }
+
+  return status;
 }
@@ -2,9 +2,10 @@
 #include "main_window.h"
 #include "image_area.h"
 
-MainWindow::MainWindow(std::shared_ptr<Pixor::Image> &image) :
-  image_area(image),
-  m_Box(Gtk::ORIENTATION_VERTICAL)
+MainWindow::MainWindow(std::shared_ptr<Pixor::Image> &image, std::shared_ptr<byte[]> greyscale) :
+  image_area(image, greyscale),
+  m_Box(Gtk::ORIENTATION_VERTICAL),
+  m_ThresholdScale(Gtk::Adjustment::create(0.12, 0.01, 0.5, 0.01, 0.05), Gtk::ORIENTATION_HORIZONTAL)
 {
   set_title("Pixor");
   set_default_size(1000, 1000);
@@ -23,10 +24,19 @@ MainWindow::MainWindow(std::shared_ptr<Pixor::Image> &image) :
   // to layout the menu.
 
   //Edit menu:
+  m_refFill = add_action_bool("fill",
+    sigc::mem_fun(*this, &MainWindow::on_menu_fill), false);
   add_action("copy", sigc::mem_fun(*this, &MainWindow::on_menu_others));
   add_action("paste", sigc::mem_fun(*this, &MainWindow::on_menu_others));
+  add_action("undo", sigc::mem_fun(*this, &MainWindow::on_menu_undo));
+  add_action("redo", sigc::mem_fun(*this, &MainWindow::on_menu_redo));
   add_action("something", sigc::mem_fun(*this, &MainWindow::on_menu_others));
 
+  //View menu:
+  add_action("zoom-in", sigc::mem_fun(*this, &MainWindow::on_menu_zoom_in));
+  add_action("zoom-out", sigc::mem_fun(*this, &MainWindow::on_menu_zoom_out));
+  add_action("zoom-reset", sigc::mem_fun(*this, &MainWindow::on_menu_zoom_reset));
+
   //Choices menus, to demonstrate Radio items,
   //using our convenience methods for string and int radio values:
   m_refChoice = add_action_radio_string("choice",
@@ -67,6 +77,16 @@ MainWindow::MainWindow(std::shared_ptr<Pixor::Image> &image) :
   
   image_area.show();
   m_Box.pack_start(image_area);
+
+  m_ProgressBar.set_text("Detecting edges");
+  m_ProgressBar.set_show_text(true);
+  m_Box.pack_start(m_ProgressBar, Gtk::PACK_SHRINK);
+  image_area.signal_filter_progress().connect(sigc::mem_fun(*this, &MainWindow::on_filter_progress));
+
+  // Edge threshold, the filter restarts with a coarse preview on every change.
+  m_ThresholdScale.set_digits(2);
+  m_Box.pack_start(m_ThresholdScale, Gtk::PACK_SHRINK);
+  m_ThresholdScale.signal_value_changed().connect(sigc::mem_fun(*this, &MainWindow::on_threshold_changed));
 }
 
 MainWindow::~MainWindow()
@@ -78,6 +98,31 @@ void MainWindow::on_menu_others()
   dbgln("A menu item was selected.");
 }
 
+void MainWindow::on_menu_undo()
+{
+  image_area.undo();
+}
+
+void MainWindow::on_menu_redo()
+{
+  image_area.redo();
+}
+
+void MainWindow::on_menu_zoom_in()
+{
+  image_area.zoom_in();
+}
+
+void MainWindow::on_menu_zoom_out()
+{
+  image_area.zoom_out();
+}
+
+void MainWindow::on_menu_zoom_reset()
+{
+  image_area.zoom_reset();
+}
+
 void MainWindow::on_menu_choices(const Glib::ustring& parameter)
 {
   //The radio action's state does not change automatically:
@@ -123,3 +168,29 @@ void MainWindow::on_menu_toggle()
 
   dbgln(message);
 }
+
+void MainWindow::on_menu_fill()
+{
+  bool active = false;
+  m_refFill->get_state(active);
+
+  //The toggle action's state does not change automatically:
+  active = !active;
+  m_refFill->change_state(active);
+  image_area.set_fill_mode(active);
+}
+
+void MainWindow::on_filter_progress(double fraction)
+{
+  m_ProgressBar.set_fraction(fraction);
+  if (fraction >= 1) {
+    m_ProgressBar.hide();
+  } else {
+    m_ProgressBar.show();
+  }
+}
+
+void MainWindow::on_threshold_changed()
+{
+  image_area.set_edge_threshold(m_ThresholdScale.get_value());
+}
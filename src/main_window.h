@@ -10,20 +10,30 @@ class MainWindow : public Gtk::ApplicationWindow
   void on_action_file_quit() {}
 
 public:
-  MainWindow(std::shared_ptr<Pixor::Image> &image);
+  MainWindow(std::shared_ptr<Pixor::Image> &image, std::shared_ptr<byte[]> greyscale);
   virtual ~MainWindow();
   
 protected:
   ImageArea image_area;
 
   void on_menu_others();
+  void on_menu_undo();
+  void on_menu_redo();
+  void on_menu_zoom_in();
+  void on_menu_zoom_out();
+  void on_menu_zoom_reset();
 
   void on_menu_choices(const Glib::ustring &parameter);
   void on_menu_choices_other(int parameter);
   void on_menu_toggle();
+  void on_menu_fill();
+  void on_filter_progress(double fraction);
+  void on_threshold_changed();
 
   //Child widgets:
   Gtk::Box m_Box;
+  Gtk::ProgressBar m_ProgressBar;
+  Gtk::Scale m_ThresholdScale;
 
   Glib::RefPtr<Gtk::Builder> m_refBuilder;
 
@@ -32,4 +42,5 @@ protected:
   Glib::RefPtr<Gio::SimpleAction> m_refChoiceOther;
 
   Glib::RefPtr<Gio::SimpleAction> m_refToggle;
+  Glib::RefPtr<Gio::SimpleAction> m_refFill;
 };
@@ -1,6 +1,8 @@
 #pragma once
 #include <memory>
 #include <vector>
+#include "buffer_pool.h"
+#include "thread_pool.h"
 
 namespace Pixor {
 
@@ -20,11 +22,16 @@ class Matrix {
   int width;
   int height;
 
+  void allocate();
+
 public:
   Matrix(int width, int height);
   Matrix(std::vector<std::vector<T>> matrix);
+  // Takes over width * height values without copying them.
+  Matrix(int width, int height, std::shared_ptr<T> data) : m(data), width(width), height(height) {}
   int get_width() {return width;};
   int get_height() {return height;};
+  T *data() {return m.get();};
   Row<T> operator[](int index);
   Matrix<T> power(int exponent);
   Matrix<T> add(Matrix<T> other);
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <cassert>
 #include <cmath>
+#include <algorithm>
 
 using namespace Pixor;
 
@@ -17,18 +18,22 @@ T &Row<T>::operator[](int index)
   return r[index];
 }
 
+// Matrices are the temporaries of every filter, so they come from the
+// pool. The aliasing constructor keeps the pooled buffer alive.
+template <class T>
+void Matrix<T>::allocate()
+{
+  auto buffer = BufferPool::shared().allocate<T>((size_t) width * height);
+  m = std::shared_ptr<T>(buffer, buffer.get());
+}
+
 template <class T>
 Matrix<T>::Matrix(int width, int height) :
   width(width),
   height(height)
 {
-  m = std::shared_ptr<T>(new T[width * height]);
-
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      (*this)[i][j] = 0;
-    }
-  }
+  allocate();
+  std::fill_n(m.get(), (size_t) width * height, 0);
 }
 
 template <class T>
@@ -36,7 +41,7 @@ Matrix<T>::Matrix(std::vector<std::vector<T>> matrix) :
   width(matrix[0].size()),
   height(matrix.size())
 {
-  m = std::shared_ptr<T>(new T[width * height]);
+  allocate();
 
   for (int i = 0; i < height; i++) {
     for (int j = 0; j < width; j++) {
@@ -49,7 +54,7 @@ template <class T>
 Row<T> Matrix<T>::operator[](int index)
 {
   assert(index >= 0 && index < height);
-  return Row<T>(width, m.get() + index * width);
+  return Row<T>(width, m.get() + (size_t) index * width);
 }
 
 template <class T>
@@ -68,11 +73,13 @@ Matrix<T> Matrix<T>::power(int exponent)
 {
   Matrix<T> res(width, height);
 
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      res[i][j] = pow((*this)[i][j], exponent);
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      for (int j = 0; j < width; j++) {
+        res[i][j] = pow((*this)[i][j], exponent);
+      }
     }
-  }
+  });
   
   return res;
 }
@@ -82,11 +89,13 @@ Matrix<T> Matrix<T>::add(Matrix<T> other)
 {
   Matrix<T> res(width, height);
 
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      res[i][j] = (*this)[i][j] + other[i][j];
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      for (int j = 0; j < width; j++) {
+        res[i][j] = (*this)[i][j] + other[i][j];
+      }
     }
-  }
+  });
   
   return res;
 }
@@ -96,11 +105,13 @@ Matrix<T> Matrix<T>::mult(float k)
 {
   Matrix<T> res(width, height);
 
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      res[i][j] = (*this)[i][j] * k;
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      for (int j = 0; j < width; j++) {
+        res[i][j] = (*this)[i][j] * k;
+      }
     }
-  }
+  });
   
   return res;
 }
@@ -110,11 +121,13 @@ Matrix<T> Matrix<T>::div(float k)
 {
   Matrix<T> res(width, height);
 
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      res[i][j] = (*this)[i][j] / k;
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      for (int j = 0; j < width; j++) {
+        res[i][j] = (*this)[i][j] / k;
+      }
     }
-  }
+  });
   
   return res;
 }
@@ -124,11 +137,13 @@ Matrix<T> Matrix<T>::exp()
 {
   Matrix<T> res(width, height);
 
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      res[i][j] = std::exp((*this)[i][j]);
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      for (int j = 0; j < width; j++) {
+        res[i][j] = std::exp((*this)[i][j]);
+      }
     }
-  }
+  });
   
   return res;
 }
@@ -137,11 +152,13 @@ template <class T>
 Matrix<T> Matrix<T>::neg() {
   Matrix<T> res(width, height);
 
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      res[i][j] = -(*this)[i][j];
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      for (int j = 0; j < width; j++) {
+        res[i][j] = -(*this)[i][j];
+      }
     }
-  }
+  });
   
   return res;
 }
@@ -182,30 +199,32 @@ Matrix<T> Matrix<T>::convolve(Matrix<T> kernel) {
   assert(kernel_width == kernel_height);
   assert(kernel_width % 2 == 1);
 
-  for (int row = 0; row < height; row++) {
-    for (int col = 0; col < width; col++) {
-      T val = 0;
-
-      for (int kernel_row = 0; kernel_row < kernel_height; kernel_row++) {
-        for (int kernel_col = 0; kernel_col < kernel_width; kernel_col++) {
-          int src_row = row + kernel_row - offset;
-          int src_col = col + kernel_col - offset;
-          if (src_row < 0 || src_row > height - 1) {
-            src_row = row + (kernel_height - kernel_row) - offset;
-          }
-          if (src_col < 0 || src_col > width - 1) {
-            src_col = col + (kernel_width - kernel_col) - offset;
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int row = begin; row < end; row++) {
+      for (int col = 0; col < width; col++) {
+        T val = 0;
+
+        for (int kernel_row = 0; kernel_row < kernel_height; kernel_row++) {
+          for (int kernel_col = 0; kernel_col < kernel_width; kernel_col++) {
+            int src_row = row + kernel_row - offset;
+            int src_col = col + kernel_col - offset;
+            if (src_row < 0 || src_row > height - 1) {
+              src_row = row + (kernel_height - kernel_row) - offset;
+            }
+            if (src_col < 0 || src_col > width - 1) {
+              src_col = col + (kernel_width - kernel_col) - offset;
+            }
+            T src_val = (*this)[src_row][src_col];
+            T k_val = kernel[kernel_height - 1 - kernel_row][kernel_width - 1 - kernel_col];
+
+            val += k_val * src_val;
           }
-          T src_val = (*this)[src_row][src_col];
-          T k_val = kernel[kernel_height - 1 - kernel_row][kernel_width - 1 - kernel_col];
-
-          val += k_val * src_val;
         }
-      }
       
-      res[row][col] = val;
+        res[row][col] = val;
+      }
     }
-  }
+  });
 
   return res;
 }
@@ -215,15 +234,17 @@ Matrix<T> Matrix<T>::hypot(Matrix<T> other)
 {
   auto res = Matrix<T>(width, height);
 
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      T val1 = (*this)[i][j];
-      T val2 = other[i][j];
-      T r = sqrt(val1 * val1 + val2 * val2);
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      for (int j = 0; j < width; j++) {
+        T val1 = (*this)[i][j];
+        T val2 = other[i][j];
+        T r = sqrt(val1 * val1 + val2 * val2);
 
-      res[i][j] = r;
+        res[i][j] = r;
+      }
     }
-  }
+  });
 
   return res;
 }
@@ -233,15 +254,17 @@ Matrix<T> Matrix<T>::arctan2(Matrix<T> other)
 {
   auto res = Matrix<T>(width, height);
 
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      T val1 = (*this)[i][j];
-      T val2 = other[i][j];
-      T r = atan(val1 / val2);
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      for (int j = 0; j < width; j++) {
+        T val1 = (*this)[i][j];
+        T val2 = other[i][j];
+        T r = atan(val1 / val2);
 
-      res[i][j] = r;
+        res[i][j] = r;
+      }
     }
-  }
+  });
 
   return res;
 }
@@ -1,5 +1,6 @@
 #include "pattern.h"
 #include "debug.h"
+#include "buffer_pool.h"
 #include "pixor.h"
 #include <cmath>
 #include <memory>
@@ -20,8 +21,10 @@ void Pattern::draw_onto(Context &context, point center) {
   if (!bitmap)
     return;
 
+  JournalScope scope(context.get_journal());
   point start{center.x - (int)std::floor(width / 2.0),
               center.y - (int)std::floor(height / 2.0)};
+  context.mark_dirty({start.x, start.y, width, height});
 
   for (int y = 0; y < height; y++) {
     for (int x = 0; x < width; x++) {
@@ -108,18 +111,19 @@ std::shared_ptr<Pattern> Pattern::make_circle(int radius, RGBA *color) {
 
 std::shared_ptr<byte[]> Pattern::hydrate() const
 {
-  auto dest = new RGBA[width * height];
+  auto res = BufferPool::shared().allocate<byte>((size_t) width * height * 4);
+  auto dest = (RGBA *) res.get();
   auto src = (RGBA **) bitmap.get();
 
   for (int i = 0; i < width * height; i++) {
     RGBA *pixel_ptr = src[i];
     if (!pixel_ptr) {
-      dbgln("Can't hydrate pattern that contains null pointers!");
+      errln("Can't hydrate pattern that contains null pointers!");
       return nullptr;
     }
     
     dest[i] = *pixel_ptr;
   }
 
-  return std::shared_ptr<byte[]>((byte *) dest);
+  return res;
 }
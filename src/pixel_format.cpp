@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "pixel_format.h"
+#include "thread_pool.h"
+
+using namespace Pixor;
+
+static const size_t PIXELS_PER_CHUNK = 1 << 16;
+static std::atomic<bool> parallel_conversions{true};
+
+// Calls func(begin, end) on disjoint pixel ranges covering [0, count).
+// Large buffers are shared out on the thread pool, which also keeps a
+// conversion inside another parallel loop from starting threads of its
+// own.
+template <class Func>
+static void split_pixels(size_t count, Func func)
+{
+  size_t chunks = (count + PIXELS_PER_CHUNK - 1) / PIXELS_PER_CHUNK;
+
+  if (chunks <= 1 || !parallel_conversions.load(std::memory_order_relaxed)) {
+    func(0, count);
+    return;
+  }
+
+  ThreadPool::shared().parallel_for(0, (int) chunks, 1, [&](int begin, int end) {
+    func(begin * PIXELS_PER_CHUNK, std::min(count, end * PIXELS_PER_CHUNK));
+  });
+}
+
+void Pixor::set_parallel_conversions(bool enabled)
+{
+  parallel_conversions.store(enabled, std::memory_order_relaxed);
+}
+
+bool Pixor::get_parallel_conversions()
+{
+  return parallel_conversions.load(std::memory_order_relaxed);
+}
+
+template <class T>
+static byte saturate(T value)
+{
+  if (!(value > 0)) return 0;
+  if (value >= 255) return 255;
+  return (byte) (value + (T) 0.5);
+}
+
+template <>
+byte saturate<byte>(byte value)
+{
+  return value;
+}
+
+template <>
+byte saturate<short>(short value)
+{
+  return (byte) clamp<short>(0, 255, value);
+}
+
+static void gray_to_interleaved(const byte *src, byte *dest, int channels, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; i++) {
+    byte *pixel = dest + i * channels;
+    pixel[0] = src[i];
+    pixel[1] = src[i];
+    pixel[2] = src[i];
+    if (channels == 4) pixel[3] = 255;
+  }
+}
+
+static void colour_to_gray(const byte *src, int channels, byte *dest, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; i++) {
+    const byte *pixel = src + i * channels;
+    dest[i] = (pixel[0] * 299 + pixel[1] * 587 + pixel[2] * 114 + 500) / 1000;
+  }
+}
+
+static void rgb_to_rgba(const byte *src, byte *dest, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; i++) {
+    dest[i * 4 + 0] = src[i * 3 + 0];
+    dest[i * 4 + 1] = src[i * 3 + 1];
+    dest[i * 4 + 2] = src[i * 3 + 2];
+    dest[i * 4 + 3] = 255;
+  }
+}
+
+static void rgba_to_rgb(const byte *src, byte *dest, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; i++) {
+    dest[i * 3 + 0] = src[i * 4 + 0];
+    dest[i * 3 + 1] = src[i * 4 + 1];
+    dest[i * 3 + 2] = src[i * 4 + 2];
+  }
+}
+
+void Pixor::convert_pixels(const byte *src, PixelFormat src_format, byte *dest, PixelFormat dest_format, size_t count)
+{
+  int src_channels = pixel_format_channels(src_format);
+  int dest_channels = pixel_format_channels(dest_format);
+
+  split_pixels(count, [=](size_t begin, size_t end) {
+    if (src_format == dest_format) {
+      memcpy(dest + begin * dest_channels, src + begin * src_channels, (end - begin) * src_channels);
+    } else if (src_format == PIXEL_FORMAT_GRAY8) {
+      gray_to_interleaved(src, dest, dest_channels, begin, end);
+    } else if (dest_format == PIXEL_FORMAT_GRAY8) {
+      colour_to_gray(src, src_channels, dest, begin, end);
+    } else if (src_format == PIXEL_FORMAT_RGB8) {
+      rgb_to_rgba(src, dest, begin, end);
+    } else {
+      rgba_to_rgb(src, dest, begin, end);
+    }
+  });
+}
+
+void Pixor::rgba_to_premultiplied_argb(const byte *src, byte *dest, size_t count)
+{
+  split_pixels(count, [=](size_t begin, size_t end) {
+    const RGBA *in = (const RGBA *) src;
+    unsigned int *out = (unsigned int *) dest;
+
+    for (size_t i = begin; i < end; i++) {
+      RGBA pixel = in[i];
+      unsigned int a = alpha(pixel);
+      unsigned int r = red(pixel);
+      unsigned int g = green(pixel);
+      unsigned int b = blue(pixel);
+
+      if (a != 255) {
+        r = (r * a + 127) / 255;
+        g = (g * a + 127) / 255;
+        b = (b * a + 127) / 255;
+      }
+
+      out[i] = (a << 24) | (r << 16) | (g << 8) | b;
+    }
+  });
+}
+
+void Pixor::blend_over(const byte *src, byte *dest, size_t count)
+{
+  split_pixels(count, [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const byte *s = src + i * 4;
+      byte *d = dest + i * 4;
+      unsigned int sa = s[3];
+
+      if (sa == 255) {
+        memcpy(d, s, 4);
+        continue;
+      }
+      if (sa == 0) continue;
+
+      // Weights and the resulting alpha are in units of 1/255^2.
+      unsigned int source_weight = sa * 255;
+      unsigned int dest_weight = d[3] * (255 - sa);
+      unsigned int out_alpha = source_weight + dest_weight;
+
+      for (int c = 0; c < 3; c++) {
+        d[c] = (s[c] * source_weight + d[c] * dest_weight + out_alpha / 2) / out_alpha;
+      }
+      d[3] = (out_alpha + 127) / 255;
+    }
+  });
+}
+
+// Vector kernels for the RGBA8 <-> float/double paths used by the filters.
+// They handle four pixels at a time and return how many pixels were done,
+// the scalar loops finish the rest.
+#ifdef __SSE2__
+static size_t extract_rgba_sse2(const byte *src, int channel, float *dest, size_t begin, size_t end)
+{
+  const __m128i mask = _mm_set1_epi32(0xff);
+  size_t i = begin;
+
+  for (; i + 4 <= end; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *) (src + i * 4));
+    __m128i values = _mm_and_si128(_mm_srl_epi32(pixels, _mm_cvtsi32_si128(channel * 8)), mask);
+    _mm_storeu_ps(dest + i, _mm_cvtepi32_ps(values));
+  }
+
+  return i;
+}
+
+static size_t extract_rgba_sse2(const byte *src, int channel, double *dest, size_t begin, size_t end)
+{
+  const __m128i mask = _mm_set1_epi32(0xff);
+  size_t i = begin;
+
+  for (; i + 4 <= end; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *) (src + i * 4));
+    __m128i values = _mm_and_si128(_mm_srl_epi32(pixels, _mm_cvtsi32_si128(channel * 8)), mask);
+    _mm_storeu_pd(dest + i, _mm_cvtepi32_pd(values));
+    _mm_storeu_pd(dest + i + 2, _mm_cvtepi32_pd(_mm_unpackhi_epi64(values, values)));
+  }
+
+  return i;
+}
+
+template <class T>
+static size_t extract_rgba_sse2(const byte *src, int channel, T *dest, size_t begin, size_t end)
+{
+  UNUSED(src);
+  UNUSED(channel);
+  UNUSED(dest);
+  UNUSED(end);
+  return begin;
+}
+
+// Saturates four int32 lanes to 0..255 and spreads them over R, G and B,
+// taking alpha from the pixels already in dest.
+static void store_grey_sse2(__m128i values, byte *dest)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i packed = _mm_packus_epi16(_mm_packs_epi32(values, values), zero);
+  __m128i grey = _mm_unpacklo_epi16(_mm_unpacklo_epi8(packed, zero), zero);
+  __m128i old = _mm_loadu_si128((const __m128i *) dest);
+  __m128i alpha = _mm_and_si128(old, _mm_set1_epi32(0xff000000));
+  __m128i rgb = _mm_or_si128(_mm_or_si128(grey, _mm_slli_epi32(grey, 8)), _mm_slli_epi32(grey, 16));
+
+  _mm_storeu_si128((__m128i *) dest, _mm_or_si128(rgb, alpha));
+}
+
+static size_t grey_to_rgba_sse2(const float *src, byte *dest, size_t begin, size_t end)
+{
+  const __m128 half = _mm_set1_ps(0.5f);
+  size_t i = begin;
+
+  for (; i + 4 <= end; i += 4) {
+    __m128i values = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(src + i), half));
+    store_grey_sse2(values, dest + i * 4);
+  }
+
+  return i;
+}
+
+static size_t grey_to_rgba_sse2(const double *src, byte *dest, size_t begin, size_t end)
+{
+  const __m128d half = _mm_set1_pd(0.5);
+  size_t i = begin;
+
+  for (; i + 4 <= end; i += 4) {
+    __m128i lo = _mm_cvttpd_epi32(_mm_add_pd(_mm_loadu_pd(src + i), half));
+    __m128i hi = _mm_cvttpd_epi32(_mm_add_pd(_mm_loadu_pd(src + i + 2), half));
+    store_grey_sse2(_mm_unpacklo_epi64(lo, hi), dest + i * 4);
+  }
+
+  return i;
+}
+
+template <class T>
+static size_t grey_to_rgba_sse2(const T *src, byte *dest, size_t begin, size_t end)
+{
+  UNUSED(src);
+  UNUSED(dest);
+  UNUSED(end);
+  return begin;
+}
+#endif
+
+template <class T>
+void Pixor::extract_channel(const byte *src, PixelFormat src_format, int channel, T *dest, size_t count)
+{
+  int channels = pixel_format_channels(src_format);
+
+  split_pixels(count, [=](size_t begin, size_t end) {
+    size_t i = begin;
+#ifdef __SSE2__
+    if (src_format == PIXEL_FORMAT_RGBA8) i = extract_rgba_sse2(src, channel, dest, begin, end);
+#endif
+    for (; i < end; i++) {
+      dest[i] = src[i * channels + channel];
+    }
+  });
+}
+
+template <class T>
+void Pixor::insert_channel(const T *src, byte *dest, PixelFormat dest_format, int channel, size_t count)
+{
+  int channels = pixel_format_channels(dest_format);
+
+  split_pixels(count, [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      dest[i * channels + channel] = saturate<T>(src[i]);
+    }
+  });
+}
+
+template <class T>
+void Pixor::deinterleave(const byte *src, PixelFormat src_format, T *const *planes, size_t count)
+{
+  int channels = pixel_format_channels(src_format);
+
+  split_pixels(count, [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      for (int c = 0; c < channels; c++) {
+        planes[c][i] = src[i * channels + c];
+      }
+    }
+  });
+}
+
+template <class T>
+void Pixor::interleave(const T *const *planes, byte *dest, PixelFormat dest_format, size_t count)
+{
+  int channels = pixel_format_channels(dest_format);
+
+  split_pixels(count, [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      for (int c = 0; c < channels; c++) {
+        dest[i * channels + c] = saturate<T>(planes[c][i]);
+      }
+    }
+  });
+}
+
+template <class T>
+void Pixor::grey_to_rgba(const T *src, byte *dest, size_t count)
+{
+  split_pixels(count, [=](size_t begin, size_t end) {
+    size_t i = begin;
+#ifdef __SSE2__
+    i = grey_to_rgba_sse2(src, dest, begin, end);
+#endif
+    for (; i < end; i++) {
+      byte value = saturate<T>(src[i]);
+      dest[i * 4 + 0] = value;
+      dest[i * 4 + 1] = value;
+      dest[i * 4 + 2] = value;
+    }
+  });
+}
+
+#define PIXOR_INSTANTIATE_PLANAR(T) \
+  template void Pixor::extract_channel<T>(const byte *, PixelFormat, int, T *, size_t); \
+  template void Pixor::insert_channel<T>(const T *, byte *, PixelFormat, int, size_t); \
+  template void Pixor::deinterleave<T>(const byte *, PixelFormat, T *const *, size_t); \
+  template void Pixor::interleave<T>(const T *const *, byte *, PixelFormat, size_t); \
+  template void Pixor::grey_to_rgba<T>(const T *, byte *, size_t);
+
+PIXOR_INSTANTIATE_PLANAR(byte)
+PIXOR_INSTANTIATE_PLANAR(short)
+PIXOR_INSTANTIATE_PLANAR(float)
+PIXOR_INSTANTIATE_PLANAR(double)
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include "pixor.h"
+
+namespace Pixor {
+
+// Interleaved 8-bit layouts. The value of each format is its channel count.
+enum PixelFormat {
+  PIXEL_FORMAT_GRAY8 = 1,
+  PIXEL_FORMAT_RGB8 = 3,
+  PIXEL_FORMAT_RGBA8 = 4,
+};
+
+inline int pixel_format_channels(PixelFormat format) {return (int) format;}
+
+// Conversions of large buffers are split across ThreadPool::shared(),
+// unless turned off here. Off, every conversion runs on the calling
+// thread, which suits callers that already convert one image per thread.
+void set_parallel_conversions(bool enabled);
+bool get_parallel_conversions();
+
+// Interleaved to interleaved. Grey expands to equal R, G and B, colour is
+// reduced to its Rec. 601 luma like ColourTransform::luma() does by
+// default, and a missing alpha channel becomes 255.
+void convert_pixels(const byte *src, PixelFormat src_format, byte *dest, PixelFormat dest_format, size_t count);
+
+// Converts RGBA8 to the premultiplied 32-bit ARGB layout used by Cairo
+// image surfaces (native endian words).
+void rgba_to_premultiplied_argb(const byte *src, byte *dest, size_t count);
+
+// Composites straight alpha RGBA8 src over dest, as APNG_BLEND_OVER does.
+void blend_over(const byte *src, byte *dest, size_t count);
+
+// Planar conversions are provided for byte, short, float and double planes.
+// Values written back into 8-bit pixels are rounded and saturated.
+template <class T>
+void extract_channel(const byte *src, PixelFormat src_format, int channel, T *dest, size_t count);
+
+template <class T>
+void insert_channel(const T *src, byte *dest, PixelFormat dest_format, int channel, size_t count);
+
+template <class T>
+void deinterleave(const byte *src, PixelFormat src_format, T *const *planes, size_t count);
+
+template <class T>
+void interleave(const T *const *planes, byte *dest, PixelFormat dest_format, size_t count);
+
+// Writes a single grey plane into R, G and B of RGBA8 pixels, keeping the
+// alpha already stored in dest.
+template <class T>
+void grey_to_rgba(const T *src, byte *dest, size_t count);
+
+}
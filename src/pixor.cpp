@@ -1,5 +1,6 @@
 #include "pixor.h"
 #include <cmath>
+#include <algorithm>
 
 using namespace Pixor;
 
@@ -28,6 +29,35 @@ RGBA Pixor::rgba(unsigned int r, unsigned int g, unsigned int b, unsigned int a)
   return (r << 0) | (g << 8) | (b << 16) | (a << 24);
 }
 
+bool Pixor::rect_empty(rect r)
+{
+  return r.width <= 0 || r.height <= 0;
+}
+
+rect Pixor::rect_union(rect r1, rect r2)
+{
+  if (rect_empty(r1)) return r2;
+  if (rect_empty(r2)) return r1;
+
+  int x1 = std::min(r1.x, r2.x);
+  int y1 = std::min(r1.y, r2.y);
+  int x2 = std::max(r1.x + r1.width, r2.x + r2.width);
+  int y2 = std::max(r1.y + r1.height, r2.y + r2.height);
+
+  return {x1, y1, x2 - x1, y2 - y1};
+}
+
+rect Pixor::rect_intersect(rect r1, rect r2)
+{
+  int x1 = std::max(r1.x, r2.x);
+  int y1 = std::max(r1.y, r2.y);
+  int x2 = std::min(r1.x + r1.width, r2.x + r2.width);
+  int y2 = std::min(r1.y + r1.height, r2.y + r2.height);
+
+  if (x2 <= x1 || y2 <= y1) return {0, 0, 0, 0};
+  return {x1, y1, x2 - x1, y2 - y1};
+}
+
 std::vector<point> Pixor::approx_line(point p1, point p2)
 {
   std::vector<point> res;
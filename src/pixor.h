@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include <vector>
 
 typedef unsigned char byte;
@@ -20,6 +21,16 @@ namespace Pixor {
     return *((T *) res);
   }
 
+  // Mixes value into a 64-bit hash with the splitmix64 finaliser.
+  inline uint64_t hash_combine(uint64_t seed, uint64_t value)
+  {
+    uint64_t x = seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
   template <class T>
   T clamp(T lower_bound, T upper_bound, T arg)
   {
@@ -39,6 +50,17 @@ namespace Pixor {
     int y;
   };
 
+  struct rect {
+    int x;
+    int y;
+    int width;
+    int height;
+  };
+
+  bool rect_empty(rect r);
+  rect rect_union(rect r1, rect r2);
+  rect rect_intersect(rect r1, rect r2);
+
   std::vector<point> approx_circle(int radius);
   std::vector<point> approx_line(point p1, point p2);
 
@@ -6,25 +6,62 @@
 #include <cstring>
 #include <zlib.h>
 #include <cassert>
+#include <algorithm>
+#include <stdexcept>
 #include "png.h"
 #include "png_chunk.h"
 #include "pixor.h"
 #include "debug.h"
 #include "crc.h"
+#include "pixel_format.h"
+#include "trace.h"
+#include "buffer_pool.h"
+#include "thread_pool.h"
 
 using namespace Pixor;
 
+static TraceCounter idat_chunks("png.idat_chunks");
+static TraceCounter compressed_bytes("png.compressed_bytes");
+static TraceCounter inflated_bytes("png.inflated_bytes");
+
+// PNG chunk lengths are limited to 31 bits.
+static const size_t MAX_CHUNK_LENGTH = (size_t) 1 << 30;
+// Compressed data is read and written in slices of this size by the row
+// reader and writer.
+static const size_t ROW_IO_BUFFER_SIZE = 64 * 1024;
+
+bool Pixor::peek_png_size(std::istream &data_stream, int &width, int &height)
+{
+  byte header[24];
+
+  data_stream.read((char *) header, sizeof(header));
+  bool valid = data_stream.gcount() == sizeof(header) && memcmp(header, PNG_SIGNATURE, 8) == 0
+    && *(unsigned int *) (header + 12) == IHDR;
+
+  data_stream.clear();
+  data_stream.seekg(0);
+  if (!valid) return false;
+
+  width = Pixor::byte_swap_32(*(unsigned int *) (header + 16));
+  height = Pixor::byte_swap_32(*(unsigned int *) (header + 20));
+
+  return true;
+}
+
 PngImage *Pixor::decode_png(std::istream &data_stream)
 {
   char signature[8];
   unsigned int chunk_len;
   unsigned int chunk_type;
-  std::unique_ptr<byte[]> chunk_type_with_data;
   std::shared_ptr<byte[]> chunk_data;
   unsigned int chunk_crc;
   unsigned int calculated_crc;
-  auto image = new PngImage();
+  std::unique_ptr<PngImage> image(new PngImage());
+  BufferPool &pool = BufferPool::shared();
+  std::vector<std::shared_ptr<PngFrameControl>> frame_controls;
+  std::vector<std::vector<std::shared_ptr<PngData>>> frame_chunks;
 
+  PIXOR_TRACE_SCOPE("png.decode", "png");
   dbgln("Decoding PNG...");
 
   data_stream.read(signature, 8);
@@ -34,34 +71,54 @@ PngImage *Pixor::decode_png(std::istream &data_stream)
     }
   }
 
-  while (data_stream.good()) {
+  bool has_header = false;
+  while (true) {
     data_stream.read((char *) &chunk_len, 4);
+    data_stream.read((char *) &chunk_type, 4);
+    if (!data_stream) throw std::invalid_argument("PNG data is truncated");
     chunk_len = Pixor::byte_swap_32(chunk_len);
-    chunk_data.reset(new byte[chunk_len]);
+    chunk_data = pool.allocate<byte>(chunk_len);
 
-    data_stream.read((char *) &chunk_type, 4);
     data_stream.read((char *) chunk_data.get(), chunk_len);
     data_stream.read((char *) &chunk_crc, 4);
+    if (!data_stream) throw std::invalid_argument("PNG data is truncated");
 
-    chunk_type_with_data.reset(new byte[chunk_len + 4]);
-    memcpy(chunk_type_with_data.get(), (char *) &chunk_type, 4);
-    memcpy(chunk_type_with_data.get() + 4, (char *) chunk_data.get(), chunk_len);
-
-    calculated_crc = crc((byte *) chunk_type_with_data.get(), chunk_len + 4);
+    calculated_crc = update_crc(0xffffffff, (byte *) &chunk_type, 4);
+    calculated_crc = update_crc(calculated_crc, chunk_data.get(), chunk_len) ^ 0xffffffff;
     if (calculated_crc != Pixor::byte_swap_32(chunk_crc)) {
-      dbgln("CRC check failed");
-      return NULL;
+      throw std::invalid_argument("PNG chunk CRC check failed");
     }
 
+    if (chunk_type != IHDR && !has_header) throw std::invalid_argument("PNG data does not start with a header");
     if (chunk_type == IHDR) {
+      has_header = true;
       dbgln("Header chunk found");
-      image->set_header(new PngHeader(chunk_len, chunk_data));
+      auto header = new PngHeader(chunk_len, chunk_data);
+      header->set_crc(calculated_crc);
+      image->set_header(header);
     } else if (chunk_type == PLTE) {
       dbgln("Palette chunk found");
-      image->set_palette(new PngPalette(chunk_len, chunk_data));
+      auto palette = new PngPalette(chunk_len, chunk_data);
+      palette->set_crc(calculated_crc);
+      image->set_palette(palette);
     } else if (chunk_type == IDAT) {
-      dbgln("Data chunk found");
-      image->add_data_chunk(new PngData(chunk_len, chunk_data));
+      PIXOR_TRACE_COUNT(idat_chunks, 1);
+      PIXOR_TRACE_COUNT(compressed_bytes, chunk_len);
+      auto data = std::make_shared<PngData>(chunk_len, chunk_data);
+      data->set_crc(calculated_crc);
+      image->add_data_chunk(data);
+      // An fcTL in front of the IDAT chunks makes them the first frame.
+      if (!frame_chunks.empty()) frame_chunks.back().push_back(data);
+    } else if (chunk_type == ACTL) {
+      dbgln("Animation control chunk found");
+      image->set_play_count(PngAnimationControl(chunk_len, chunk_data).get_play_count());
+    } else if (chunk_type == FCTL) {
+      frame_controls.push_back(std::make_shared<PngFrameControl>(chunk_len, chunk_data));
+      frame_chunks.emplace_back();
+    } else if (chunk_type == FDAT) {
+      if (chunk_len < 4 || frame_chunks.empty()) throw std::invalid_argument("fdAT chunk without a frame");
+      // Skips the sequence number without copying the data.
+      frame_chunks.back().push_back(std::make_shared<PngData>(chunk_len - 4, std::shared_ptr<byte[]>(chunk_data, chunk_data.get() + 4)));
     } else if (chunk_type == IEND) {
       dbgln("End chunk found");
       break;
@@ -70,7 +127,17 @@ PngImage *Pixor::decode_png(std::istream &data_stream)
     }
   }
 
-  return image;
+  for (size_t i = 0; i < frame_controls.size(); i++) {
+    auto frame_image = image->make_frame_image(frame_controls[i]->get_width(), frame_controls[i]->get_height());
+
+    for (auto &chunk : frame_chunks[i]) {
+      frame_image->add_data_chunk(chunk);
+    }
+    image->add_frame({frame_controls[i], frame_image});
+  }
+  if (!frame_controls.empty()) dbgln("Decoded %d animation frames", (int) frame_controls.size());
+
+  return image.release();
 }
 
 byte paeth_predictor(int a, int b, int c)
@@ -92,115 +159,96 @@ byte paeth_predictor(int a, int b, int c)
   return pr;
 }
 
-byte none_recon_filter(byte x, byte a, byte b, byte c)
-{
-  UNUSED(a);
-  UNUSED(b);
-  UNUSED(c);
-  return x;
-}
-
-byte sub_recon_filter(byte x, byte a, byte b, byte c)
-{
-  UNUSED(b);
-  UNUSED(c);
-  return x + a;
-}
-
-byte up_recon_filter(byte x, byte a, byte b, byte c)
-{
-  UNUSED(a);
-  UNUSED(c);
-  return x + b;
-}
-
-byte avg_recon_filter(byte x, byte a, byte b, byte c)
-{
-  UNUSED(c);
-  return x + std::floor((a + b) / 2);
-}
-
-byte paeth_recon_filter(byte x, byte a, byte b, byte c)
+static int pixel_width_of(PngImageType image_type)
 {
-  return x + paeth_predictor(a, b, c);
+  switch (image_type) {
+    case PNG_TYPE_GREYSCALE:
+      return 1;
+    case PNG_TYPE_TRUECOLOUR:
+      return 3;
+    case PNG_TYPE_INDEXED_COLOUR:
+      return 1;
+    case PNG_TYPE_GREYSCALE_ALPHA:
+      return 2;
+    case PNG_TYPE_TRUECOLOUR_ALPHA:
+      return 4;
+    default:
+      return -1;
+  }
 }
 
-typedef byte (*png_filter_func)(byte, byte, byte, byte);
-
-png_filter_func get_recon_filter(FilterType filter_type)
+// Undoes the filter of one scanline in place. previous is the scanline
+// above it, already unfiltered, or null for the first one. Bytes left of
+// the first pixel and above the first row count as 0.
+static void unfilter_row(FilterType filter_type, byte *row, const byte *previous, size_t length, int pixel_width)
 {
-  png_filter_func res;
-
-  switch(filter_type) {
+  switch (filter_type) {
     case FILTER_TYPE_NONE:
-      res = &none_recon_filter;
       break;
     case FILTER_TYPE_SUB:
-      res = &sub_recon_filter;
+      for (size_t i = pixel_width; i < length; i++) {
+        row[i] += row[i - pixel_width];
+      }
       break;
     case FILTER_TYPE_UP:
-      res = &up_recon_filter;
+      if (!previous) break;
+      for (size_t i = 0; i < length; i++) {
+        row[i] += previous[i];
+      }
       break;
     case FILTER_TYPE_AVERAGE:
-      res = &avg_recon_filter;
+      for (size_t i = 0; i < length; i++) {
+        int a = i >= (size_t) pixel_width ? row[i - pixel_width] : 0;
+        int b = previous ? previous[i] : 0;
+        row[i] += (a + b) / 2;
+      }
       break;
     case FILTER_TYPE_PAETH:
-      res = &paeth_recon_filter;
+      for (size_t i = 0; i < length; i++) {
+        bool left = i >= (size_t) pixel_width;
+        int a = left ? row[i - pixel_width] : 0;
+        int b = previous ? previous[i] : 0;
+        int c = previous && left ? previous[i - pixel_width] : 0;
+        row[i] += paeth_predictor(a, b, c);
+      }
       break;
     default:
       dbgln("Unknown filter type %d", filter_type);
-      res = &none_recon_filter;
   }
-
-  return res;
 }
 
-class ByteMatrix {
-  byte *data;
-  int width;
-  int height;
-  int row_start_offset;
-
-  bool coord_in_bounds(int i, int j) const
-  {
-    return !(i < 0 || j < 0 || i > height - 1 || j > width - 1 - row_start_offset);
-  }
-
-public:
-  ByteMatrix(byte *data, int width, int height, int row_start_offset = 0) :
-    data(data),
-    width(width),
-    height(height),
-    row_start_offset(row_start_offset)
-    {}
-
-  byte try_get_byte(int i, int j) const
-  {
-    if (!coord_in_bounds(i, j)) {
-      return 0;
-    }
-
-    return data[i * width + j + row_start_offset];
-  }
-
-  void try_set_byte(int i, int j, byte value)
-  {
-    if (!coord_in_bounds(i, j)) {
-      return;
-    }
-
-    data[i * width + j + row_start_offset] = value;
-  }
-};
-
-byte reconstruct_filtered_byte(ByteMatrix &image_matrix, png_filter_func filter_func, int pixel_width, int i, int j)
+// Converts one unfiltered scanline to the RGB8 or RGBA8 pixels
+// get_pixels() holds. Returns false if it cannot.
+static bool expand_row(PngImageType image_type, const byte *row, size_t width, PngPalette *palette, byte *dest)
 {
-  byte x = image_matrix.try_get_byte(i, j);
-  byte a = image_matrix.try_get_byte(i, j - pixel_width);
-  byte b = image_matrix.try_get_byte(i - 1, j);
-  byte c = image_matrix.try_get_byte(i - 1, j - pixel_width);
-
-  return filter_func(x, a, b, c);
+  switch (image_type) {
+    case PNG_TYPE_GREYSCALE:
+      for (size_t j = 0; j < width; j++) {
+        dest[j * 3] = dest[j * 3 + 1] = dest[j * 3 + 2] = row[j];
+      }
+      return true;
+    case PNG_TYPE_TRUECOLOUR:
+      memcpy(dest, row, width * 3);
+      return true;
+    case PNG_TYPE_TRUECOLOUR_ALPHA:
+      memcpy(dest, row, width * 4);
+      return true;
+    case PNG_TYPE_GREYSCALE_ALPHA:
+      for (size_t j = 0; j < width; j++) {
+        dest[j * 4] = dest[j * 4 + 1] = dest[j * 4 + 2] = row[j * 2];
+        dest[j * 4 + 3] = row[j * 2 + 1];
+      }
+      return true;
+    case PNG_TYPE_INDEXED_COLOUR:
+      if (!palette) return false;
+      for (size_t j = 0; j < width; j++) {
+        RGBA pixel = palette->get_pixel_value(row[j]);
+        memcpy(dest + j * 3, &pixel, 3);
+      }
+      return true;
+    default:
+      return false;
+  }
 }
 
 bool PngImage::has_alpha() const
@@ -225,9 +273,57 @@ void PngImage::print_image_info() const
   printf("  Interlace method: %d\n", header->get_interlace_method());
 }
 
-int PngImage::get_compressed_size() const
+uint64_t PngImage::get_content_hash() const
+{
+  if (compressed_released) return released_content_hash;
+
+  uint64_t res = hash_combine(0, ((uint64_t) header->get_crc() << 32) | header->get_length());
+
+  if (palette) res = hash_combine(res, ((uint64_t) palette->get_crc() << 32) | palette->get_length());
+  for (auto &chunk : data_chunks) {
+    res = hash_combine(res, ((uint64_t) chunk->get_crc() << 32) | chunk->get_length());
+  }
+
+  return res;
+}
+
+std::shared_ptr<PngImage> PngImage::make_frame_image(int width, int height) const
 {
-  int res = 0;
+  auto res = std::make_shared<PngImage>();
+
+  res->header = std::make_shared<PngHeader>(width, height, get_image_type(), header->get_bit_depth());
+  res->palette = palette;
+  return res;
+}
+
+void PngImage::add_frame(PngFrame frame)
+{
+  auto &control = *frame.control;
+  if (!control.get_width() || !control.get_height() ||
+      (uint64_t) control.get_x_offset() + control.get_width() > (uint64_t) get_width() ||
+      (uint64_t) control.get_y_offset() + control.get_height() > (uint64_t) get_height()) {
+    throw std::invalid_argument("APNG frame outside of the image");
+  }
+
+  if (frames.empty()) default_image_is_frame = !data_chunks.empty() && frame.image->data_chunks == data_chunks;
+  frames.push_back(frame);
+}
+
+void PngImage::add_frame(PngFrameControl *control, byte *bitmap)
+{
+  PngFrame frame = {std::shared_ptr<PngFrameControl>(control), make_frame_image(control->get_width(), control->get_height())};
+  frame.image->set_bitmap(bitmap);
+
+  bool covers_image = control->get_x_offset() == 0 && control->get_y_offset() == 0 &&
+    (int) control->get_width() == get_width() && (int) control->get_height() == get_height();
+  if (frames.empty() && data_chunks.empty() && covers_image) data_chunks = frame.image->data_chunks;
+
+  add_frame(frame);
+}
+
+size_t PngImage::get_compressed_size() const
+{
+  size_t res = 0;
 
   for (auto chunk : data_chunks) {
     res += chunk->get_length();
@@ -238,30 +334,17 @@ int PngImage::get_compressed_size() const
 
 int PngImage::get_pixel_width() const
 {
-  switch (get_image_type()) {
-    case PNG_TYPE_GREYSCALE:
-      return 1;
-    case PNG_TYPE_TRUECOLOUR:
-      return 3;
-    case PNG_TYPE_INDEXED_COLOUR:
-      return 1;
-    case PNG_TYPE_GREYSCALE_ALPHA:
-      return 2;
-    case PNG_TYPE_TRUECOLOUR_ALPHA:
-      return 4;
-    default:
-      return -1;
-  }
+  return pixel_width_of(get_image_type());
 }
 
-byte *PngImage::get_joined_chunks() const
+std::shared_ptr<byte[]> PngImage::get_joined_chunks() const
 {
-  int chunk_start = 0;
-  byte *joined_chunks = new byte[get_compressed_size()];
+  size_t chunk_start = 0;
+  auto joined_chunks = BufferPool::shared().allocate<byte>(get_compressed_size());
 
   for (auto chunk : data_chunks) {
-    int chunk_len = chunk->get_length();
-    memcpy(joined_chunks + chunk_start, chunk->get_data(), chunk_len);
+    size_t chunk_len = chunk->get_length();
+    memcpy(joined_chunks.get() + chunk_start, chunk->get_data(), chunk_len);
     chunk_start += chunk_len;
   }
 
@@ -272,154 +355,396 @@ void PngImage::set_bitmap(byte *bitmap)
 {
   if (!header) return;
   data_chunks.clear();
+  compressed_released = false;
+  release_pixels();
 
-  int pixel_width = get_pixel_width();
-  int width = get_width() * pixel_width + 1;
+  size_t stride = (size_t) get_width() * get_pixel_width() + 1;
   int height = get_height();
-  unsigned long initial_size = width * height * pixel_width;
-  unsigned long compressed_size = initial_size * 1.2 + 12;
-  std::unique_ptr<byte[]> data_to_compress(new byte[initial_size]);
-  std::shared_ptr<byte[]> compressed_data(new byte[compressed_size]);
-
-  for (int i = 0; i < height; i++) {
-    data_to_compress[i * width] = FILTER_TYPE_NONE;
-    // TODO: Add filtering to improve compression
-
-    for (int j = 1; j < width; j++) {
-      data_to_compress[i * width + j] = bitmap[i * (width - 1) + j - 1];
+  uLongf initial_size = stride * height;
+  uLongf compressed_size = compressBound(initial_size);
+  auto data_to_compress = BufferPool::shared().allocate<byte>(initial_size);
+  auto compressed_data = BufferPool::shared().allocate<byte>(compressed_size);
+
+  parallel_for_rows(height, get_width(), [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      data_to_compress[(size_t) i * stride] = FILTER_TYPE_NONE;
+      // TODO: Add filtering to improve compression
+      memcpy(&data_to_compress[(size_t) i * stride + 1], bitmap + (size_t) i * (stride - 1), stride - 1);
     }
-  }
+  });
 
   int result = compress(compressed_data.get(), &compressed_size, data_to_compress.get(), initial_size);
   if (result != 0) {
-    dbgln("Compression error code: %d", result);
+    errln("Compression error code: %d", result);
     return;
   }
 
-  data_chunks.push_back(std::make_shared<PngData>(compressed_size, compressed_data));
+  for (size_t offset = 0; offset < compressed_size; offset += MAX_CHUNK_LENGTH) {
+    size_t length = std::min<size_t>(compressed_size - offset, MAX_CHUNK_LENGTH);
+    data_chunks.push_back(std::make_shared<PngData>(length, std::shared_ptr<byte[]>(compressed_data, compressed_data.get() + offset)));
+  }
 }
 
-std::shared_ptr<byte[]> PngImage::get_image_bitmap() const
+std::shared_ptr<const byte[]> PngImage::get_pixels() const
+{
+  std::lock_guard<std::mutex> lock(pixels_mutex);
+
+  if (!pixels) pixels = decode();
+  return pixels;
+}
+
+void PngImage::release_compressed()
+{
+  if (compressed_released || !get_pixels()) return;
+
+  released_content_hash = get_content_hash();
+  {
+    std::lock_guard<std::mutex> lock(pixels_mutex);
+    compressed_released = true;
+  }
+  data_chunks.clear();
+  data_chunks.shrink_to_fit();
+}
+
+void PngImage::release_pixels() const
+{
+  std::lock_guard<std::mutex> lock(pixels_mutex);
+  if (compressed_released) return;
+  pixels.reset();
+}
+
+std::shared_ptr<byte[]> PngImage::decode() const
 {
   if (data_chunks.size() == 0) {
     return NULL;
   }
 
   PngImageType image_type = get_image_type();
-  int compressed_size = get_compressed_size();
+  size_t compressed_size = get_compressed_size();
   int pixel_width = get_pixel_width();
   int width = get_width();
   int height = get_height();
-  long unsigned dest_length = compressed_size * 1000;
-  auto joined_chunks = std::unique_ptr<byte[]>(get_joined_chunks());
-  auto uncompressed_data = std::unique_ptr<byte[]>(new byte[dest_length]);
+  size_t stride = (size_t) width * pixel_width + 1;
+  uLongf dest_length = stride * height;
+  auto uncompressed_data = BufferPool::shared().allocate<byte>(dest_length);
+  int res;
 
-  int res = uncompress(uncompressed_data.get(), &dest_length, joined_chunks.get(), compressed_size);
-  dbgln("Decompressed size: %ld\n", dest_length);
-  byte *decoded = new byte[width * height * (has_alpha() ? 4 : 3)];
-  ByteMatrix image_matrix(uncompressed_data.get(), width * pixel_width + 1, height, 1);
+  {
+    PIXOR_TRACE_SCOPE("png.inflate", "png");
+    auto joined_chunks = get_joined_chunks();
+    res = uncompress(uncompressed_data.get(), &dest_length, joined_chunks.get(), compressed_size);
+  }
 
   if (res != 0) {
-    dbgln("Uncompress error! %d\n", res);
+    errln("Uncompress error! %d", res);
     return NULL;
   }
 
+  PIXOR_TRACE_COUNT(inflated_bytes, dest_length);
+  PIXOR_TRACE_SCOPE("png.unfilter", "png");
+  int channels = has_alpha() ? 4 : 3;
+  auto bitmap = BufferPool::shared().allocate<byte>((size_t) width * height * channels);
+
   for (int i = 0; i < height; i++) {
-    FilterType filter_type = (FilterType) uncompressed_data[i * (width * pixel_width + 1)];
-    auto filter_func = get_recon_filter(filter_type);
-
-    for (int j = 0; j < width * pixel_width; j++) {
-      byte value = reconstruct_filtered_byte(image_matrix, filter_func, pixel_width, i, j);
-      image_matrix.try_set_byte(i, j, value);
-
-      if (image_type == PNG_TYPE_GREYSCALE) {
-        int dest_index = (i * width + j) * 3;
-        decoded[dest_index] = value;
-        decoded[dest_index + 1] = value;
-        decoded[dest_index + 2] = value;
-      } else if (image_type == PNG_TYPE_TRUECOLOUR) {
-        int dest_index = i * width * 3 + j;
-        decoded[dest_index] = value;
-      } else if (image_type == PNG_TYPE_TRUECOLOUR_ALPHA) {
-        int dest_index = i * width * 4 + j;
-        decoded[dest_index] = value;
-      } else if (image_type == PNG_TYPE_GREYSCALE_ALPHA) {
-        if (j % 2 == 0) {
-          int dest_index = (i * width + j / 2) * 4;
-          decoded[dest_index] = value;
-          decoded[dest_index + 1] = value;
-          decoded[dest_index + 2] = value;
-        } else {
-          int dest_index = (i * width + (j - 1) / 2) * 4;
-          decoded[dest_index + 3] = value;
-        }
-      } else if (image_type == PNG_TYPE_INDEXED_COLOUR) {
-        RGBA pixel = palette->get_pixel_value(value);
-        byte *channels = (byte *) &pixel;
-        int dest_index = (i * width + j) * 3;
-
-        decoded[dest_index] = channels[0];
-        decoded[dest_index + 1] = channels[1];
-        decoded[dest_index + 2] = channels[2];
-      } else {
-        return NULL;
-      }
+    byte *row = uncompressed_data.get() + (size_t) i * stride;
+
+    unfilter_row((FilterType) row[0], row + 1, i > 0 ? row + 1 - stride : nullptr, stride - 1, pixel_width);
+    if (!expand_row(image_type, row + 1, width, palette.get(), bitmap.get() + (size_t) i * width * channels)) {
+      return NULL;
     }
   }
 
-  return std::shared_ptr<byte[]>(decoded);
+  return bitmap;
+}
+
+std::shared_ptr<byte[]> PngImage::get_image_bitmap() const
+{
+  auto decoded = get_pixels();
+  if (!decoded) return nullptr;
+
+  int width = get_width();
+  int channels = has_alpha() ? 4 : 3;
+  auto res = BufferPool::shared().allocate<byte>((size_t) width * get_height() * channels);
+
+  parallel_for_rows(get_height(), width, [&](int begin, int end) {
+    size_t offset = (size_t) begin * width * channels;
+    memcpy(res.get() + offset, decoded.get() + offset, (size_t) (end - begin) * width * channels);
+  });
+
+  return res;
 }
 
 std::shared_ptr<byte[]> PngImage::get_image_bitmap_with_alpha() const
 {
   if (has_alpha()) return get_image_bitmap();
 
-  int width = get_width();
-  int height = get_height();
-  auto res = std::shared_ptr<byte[]>(new byte[width * height * 4]);
-  auto res_ptr = res.get();
-  auto bitmap_with_no_alpha = get_image_bitmap();
+  auto decoded = get_pixels();
+  if (!decoded) return nullptr;
 
-  for (int i = 0; i < width * height; i++) {
-    int src_index = i * 3;
-    int dest_index = i * 4;
+  int width = get_width();
+  auto res = BufferPool::shared().allocate<byte>((size_t) width * get_height() * 4);
 
-    res_ptr[dest_index + 0] = bitmap_with_no_alpha[src_index];
-    res_ptr[dest_index + 1] = bitmap_with_no_alpha[src_index + 1];
-    res_ptr[dest_index + 2] = bitmap_with_no_alpha[src_index + 2];
-    res_ptr[dest_index + 3] = 255;
-  }
+  // Unfiltering depends on the previous row and stays serial, the format
+  // conversion after it does not.
+  parallel_for_rows(get_height(), width, [&](int begin, int end) {
+    size_t offset = (size_t) begin * width;
+    convert_pixels(decoded.get() + offset * 3, PIXEL_FORMAT_RGB8, res.get() + offset * 4, PIXEL_FORMAT_RGBA8, (size_t) (end - begin) * width);
+  });
 
   return res;
 }
 
-std::shared_ptr<byte[]> PngImage::get_image_bitmap_greyscale() const
+std::shared_ptr<byte[]> PngImage::get_image_bitmap_greyscale(LumaWeights weights) const
 {
   auto res = get_image_bitmap_with_alpha();
-  auto res_ptr = (RGBA *) res.get();
+  if (!res) return nullptr;
+
   int width = get_width();
-  int height = get_height();
+  auto transform = ColourTransform().luma(weights);
 
-  for (int i = 0; i < width * height; i++) {
-    RGBA pixel = res_ptr[i];
-    RGBA avg_val = (red(pixel) + green(pixel) + blue(pixel)) / 3;
-    res_ptr[i] = rgba(avg_val, avg_val, avg_val, alpha(pixel));
-  }
+  parallel_for_rows(get_height(), width, [&](int begin, int end) {
+    byte *rows = res.get() + (size_t) begin * width * 4;
+    transform.apply(rows, rows, (size_t) (end - begin) * width);
+  });
 
   return res;
 }
 
+// Reads a 4-byte big-endian value, returns false at the end of the stream.
+static bool read_uint32(std::istream &stream, unsigned int &value)
+{
+  stream.read((char *) &value, 4);
+  value = Pixor::byte_swap_32(value);
+
+  return stream.gcount() == 4;
+}
+
+PngRowReader::PngRowReader(std::istream &stream) :
+  stream(stream),
+  inflater(new z_stream_s()),
+  input(ROW_IO_BUFFER_SIZE)
+{
+  byte signature[8];
+
+  stream.read((char *) signature, 8);
+  if (stream.gcount() != 8 || memcmp(signature, PNG_SIGNATURE, 8)) {
+    throw std::invalid_argument("PNG signature check failed");
+  }
+
+  // The chunks in front of the image data are small and read whole.
+  while (true) {
+    unsigned int length;
+    unsigned int type;
+    unsigned int crc;
+
+    if (!read_uint32(stream, length)) throw std::invalid_argument("PNG image has no data");
+    stream.read((char *) &type, 4);
+    if (type == IDAT) {
+      chunk_left = length;
+      chunk_crc = update_crc(0xffffffff, (byte *) &type, 4);
+      break;
+    }
+    if (type == IEND) throw std::invalid_argument("PNG image has no data");
+
+    auto data = BufferPool::shared().allocate<byte>(length);
+    stream.read((char *) data.get(), length);
+    if (!read_uint32(stream, crc)) throw std::invalid_argument("PNG chunk is truncated");
+    if ((update_crc(update_crc(0xffffffff, (byte *) &type, 4), data.get(), length) ^ 0xffffffff) != crc) {
+      throw std::invalid_argument("PNG CRC check failed");
+    }
+
+    if (type == IHDR) header = std::make_shared<PngHeader>(length, data);
+    else if (type == PLTE) palette = std::make_shared<PngPalette>(length, data);
+  }
+
+  if (!header) throw std::invalid_argument("PNG header is missing");
+  if (header->get_bit_depth() != 8 || header->get_interlace_method() != 0) {
+    throw std::invalid_argument("Only non-interlaced 8-bit PNG images can be read by row");
+  }
+
+  pixel_width = pixel_width_of(header->get_colour_type());
+  if (pixel_width < 0) throw std::invalid_argument("Unknown PNG colour type");
+  if (header->get_colour_type() == PNG_TYPE_INDEXED_COLOUR && !palette) {
+    throw std::invalid_argument("PNG palette is missing");
+  }
+
+  size_t length = (size_t) get_width() * pixel_width + 1;
+  scanline.resize(length);
+  previous.resize(length);
+  rgb.resize((size_t) get_width() * 3);
+
+  if (inflateInit(inflater.get()) != Z_OK) throw std::runtime_error("Cannot initialize inflate");
+}
+
+PngRowReader::~PngRowReader()
+{
+  inflateEnd(inflater.get());
+}
+
+// Checks the CRC of the used up IDAT chunk and starts the next one.
+void PngRowReader::next_data_chunk()
+{
+  unsigned int crc;
+  unsigned int length;
+  unsigned int type;
+
+  if (!read_uint32(stream, crc)) throw std::invalid_argument("PNG chunk is truncated");
+  if ((chunk_crc ^ 0xffffffff) != crc) throw std::invalid_argument("PNG CRC check failed");
+
+  if (!read_uint32(stream, length)) throw std::invalid_argument("PNG image data ends early");
+  stream.read((char *) &type, 4);
+  if (type != IDAT) throw std::invalid_argument("PNG image data ends early");
+
+  chunk_left = length;
+  chunk_crc = update_crc(0xffffffff, (byte *) &type, 4);
+}
+
+void PngRowReader::fill_input()
+{
+  while (chunk_left == 0) {
+    next_data_chunk();
+  }
+
+  size_t count = std::min<size_t>(chunk_left, input.size());
+  stream.read((char *) input.data(), count);
+  if ((size_t) stream.gcount() != count) throw std::invalid_argument("PNG chunk is truncated");
+
+  PIXOR_TRACE_COUNT(compressed_bytes, count);
+  chunk_crc = update_crc(chunk_crc, input.data(), count);
+  chunk_left -= count;
+  inflater->next_in = input.data();
+  inflater->avail_in = count;
+}
+
+void PngRowReader::read_row(byte *rgba)
+{
+  if (row >= get_height()) throw std::invalid_argument("No PNG rows left to read");
+
+  z_stream *z = inflater.get();
+  z->next_out = scanline.data();
+  z->avail_out = scanline.size();
+
+  while (z->avail_out > 0) {
+    if (z->avail_in == 0) fill_input();
+
+    int res = inflate(z, Z_NO_FLUSH);
+    if (res == Z_STREAM_END && z->avail_out > 0) throw std::invalid_argument("PNG image data ends early");
+    if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) throw std::invalid_argument("PNG image data is corrupt");
+  }
+  PIXOR_TRACE_COUNT(inflated_bytes, scanline.size());
+
+  PngImageType image_type = header->get_colour_type();
+  bool alpha = image_type == PNG_TYPE_GREYSCALE_ALPHA || image_type == PNG_TYPE_TRUECOLOUR_ALPHA;
+  unfilter_row((FilterType) scanline[0], scanline.data() + 1, row > 0 ? previous.data() + 1 : nullptr, scanline.size() - 1, pixel_width);
+  expand_row(image_type, scanline.data() + 1, get_width(), palette.get(), alpha ? rgba : rgb.data());
+  if (!alpha) convert_pixels(rgb.data(), PIXEL_FORMAT_RGB8, rgba, PIXEL_FORMAT_RGBA8, get_width());
+
+  std::swap(scanline, previous);
+  row++;
+}
+
+PngRowWriter::PngRowWriter(std::ostream &stream, int width, int height, PngImageType colour_type) :
+  stream(stream),
+  deflater(new z_stream_s()),
+  output(BufferPool::shared().allocate<byte>(ROW_IO_BUFFER_SIZE)),
+  height(height)
+{
+  int pixel_width = pixel_width_of(colour_type);
+  if (width <= 0 || height <= 0 || pixel_width < 0 || colour_type == PNG_TYPE_INDEXED_COLOUR) {
+    throw std::invalid_argument("Invalid PNG size or colour type");
+  }
+
+  if (deflateInit(deflater.get(), Z_DEFAULT_COMPRESSION) != Z_OK) throw std::runtime_error("Cannot initialize deflate");
+  deflater->next_out = output.get();
+  deflater->avail_out = ROW_IO_BUFFER_SIZE;
+  scanline.resize((size_t) width * pixel_width + 1);
+
+  for (int i = 0; i < 8; i++) {
+    stream << PNG_SIGNATURE[i];
+  }
+  PngHeader header(width, height, colour_type);
+  stream << header;
+}
+
+PngRowWriter::~PngRowWriter()
+{
+  deflateEnd(deflater.get());
+}
+
+void PngRowWriter::write_output()
+{
+  size_t length = ROW_IO_BUFFER_SIZE - deflater->avail_out;
+  if (length == 0) return;
+
+  PngData chunk(length, output);
+  stream << chunk;
+  deflater->next_out = output.get();
+  deflater->avail_out = ROW_IO_BUFFER_SIZE;
+}
+
+void PngRowWriter::write_row(const byte *data)
+{
+  if (row >= height) throw std::invalid_argument("No PNG rows left to write");
+
+  z_stream *z = deflater.get();
+  int flush = ++row == height ? Z_FINISH : Z_NO_FLUSH;
+  int res;
+
+  scanline[0] = FILTER_TYPE_NONE;
+  memcpy(scanline.data() + 1, data, scanline.size() - 1);
+  z->next_in = scanline.data();
+  z->avail_in = scanline.size();
+
+  do {
+    res = deflate(z, flush);
+    if (z->avail_out == 0) write_output();
+  } while (z->avail_in > 0 || (flush == Z_FINISH && res != Z_STREAM_END));
+
+  if (flush == Z_FINISH) {
+    write_output();
+    PngEnd end_chunk(0, nullptr);
+    stream << end_chunk;
+  }
+}
+
 std::ostream &Pixor::operator<<(std::ostream &os, PngImage &image)
 {
+  if (image.compressed_released) throw std::invalid_argument("Cannot write a PNG image after release_compressed()");
+
   for (int i = 0; i < 8; i++) {
     os << PNG_SIGNATURE[i];
   }
 
   os << *image.header.get();
+  if (image.is_animated()) {
+    PngAnimationControl animation_control(image.frames.size(), image.play_count);
+    os << animation_control;
+  }
+  if (image.palette) os << *image.palette.get();
+
+  unsigned int sequence = 0;
+  size_t first_frame = 0;
+  if (image.default_image_is_frame) {
+    image.frames[0].control->set_sequence(sequence++);
+    os << *image.frames[0].control.get();
+    first_frame = 1;
+  }
+
   for (const auto &chunk : image.data_chunks) {
     os << *chunk.get();
   }
 
+  for (size_t i = first_frame; i < image.frames.size(); i++) {
+    auto &frame = image.frames[i];
+
+    frame.control->set_sequence(sequence++);
+    os << *frame.control.get();
+    for (const auto &chunk : frame.image->data_chunks) {
+      PngFrameData frame_data(sequence++, *chunk.get());
+      os << frame_data;
+    }
+  }
+
   PngEnd end_chunk(0, nullptr);
   os << end_chunk;
 
@@ -2,10 +2,13 @@
 #include <iostream>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include "pixor.h"
 #include "png_chunk.h"
 #include "image.h"
 
+struct z_stream_s;
+
 namespace Pixor {
 
 enum FilterType {
@@ -18,33 +21,151 @@ enum FilterType {
 
 const byte PNG_SIGNATURE[] = {137, 80, 78, 71, 13, 10, 26, 10};
 
+class PngImage;
+
+// One frame of an animated PNG. The pixels are kept as a PngImage of the
+// frame's size, so they decode like any other image.
+struct PngFrame {
+  std::shared_ptr<PngFrameControl> control;
+  std::shared_ptr<PngImage> image;
+};
+
 class PngImage : public Pixor::Image {
   std::shared_ptr<PngHeader> header;
   std::vector<std::shared_ptr<PngData>> data_chunks;
   std::shared_ptr<PngPalette> palette;
+  std::vector<PngFrame> frames;
+  unsigned int play_count = 0;
+  // Whether the IDAT chunks are the first frame or a separate image for
+  // viewers without APNG support.
+  bool default_image_is_frame = false;
+  // Decoded on first use and shared by all the bitmap getters.
+  mutable std::mutex pixels_mutex;
+  mutable std::shared_ptr<const byte[]> pixels;
+  // Kept when the compressed data is released.
+  uint64_t released_content_hash = 0;
+  bool compressed_released = false;
 
-  int get_compressed_size() const;
+  size_t get_compressed_size() const;
   int get_pixel_width() const;
-  byte *get_joined_chunks() const;
+  std::shared_ptr<byte[]> get_joined_chunks() const;
+  std::shared_ptr<byte[]> decode() const;
 
 public:
-  void set_header(PngHeader *header) {this->header = std::shared_ptr<PngHeader>(header);}
-  void set_palette(PngPalette *palette) {this->palette = std::shared_ptr<PngPalette>(palette);}
-  void add_data_chunk(PngData *chunk) {data_chunks.push_back(std::shared_ptr<PngData>(chunk));}
+  void set_header(PngHeader *header) {this->header = std::shared_ptr<PngHeader>(header); release_pixels();}
+  void set_palette(PngPalette *palette) {this->palette = std::shared_ptr<PngPalette>(palette); release_pixels();}
+  void add_data_chunk(PngData *chunk) {data_chunks.push_back(std::shared_ptr<PngData>(chunk)); release_pixels();}
+  void add_data_chunk(std::shared_ptr<PngData> chunk) {data_chunks.push_back(chunk); release_pixels();}
   void set_bitmap(byte *bitmap);
+  // The decoded pixels, laid out as get_image_bitmap() returns them. The
+  // first call decodes, later ones share the same buffer without copying.
+  // The get_image_bitmap functions hand out copies of it or formats
+  // derived from it, since their callers may change what they get.
+  std::shared_ptr<const byte[]> get_pixels() const;
+  // Decodes if needed and drops the IDAT chunks, so the image is not held
+  // in memory twice. The image cannot be written afterwards. Frames keep
+  // their own data. The pixels are the only copy from then on and stay
+  // until set_bitmap() replaces them.
+  void release_compressed();
+  // Drops the decoded pixels, the next request decodes again. Does nothing
+  // after release_compressed(), there would be nothing to decode from.
+  void release_pixels() const;
   std::shared_ptr<byte[]> get_image_bitmap() const;
   std::shared_ptr<byte[]> get_image_bitmap_with_alpha() const;
-  std::shared_ptr<byte[]> get_image_bitmap_greyscale() const;
+  std::shared_ptr<byte[]> get_image_bitmap_greyscale(LumaWeights weights) const;
   int get_width() const {return header->get_width();};
   int get_height() const {return header->get_height();};
   bool has_alpha() const;
   PngImageType get_image_type() const {return header->get_colour_type();}
   void print_image_info() const;
+  // Built from the chunk CRCs, so a decoded image hashes without
+  // touching its data again.
+  uint64_t get_content_hash() const;
+
+  // APNG. The image itself keeps showing the default image, the frames
+  // are composited by ApngCanvas.
+  bool is_animated() const {return !frames.empty();}
+  int get_frame_count() const {return frames.size();}
+  const PngFrame &get_frame(int index) const {return frames[index];}
+  unsigned int get_play_count() const {return play_count;}
+  void set_play_count(unsigned int count) {play_count = count;}
+  // An empty image with the colour type and palette of this one, to hold
+  // the pixels of a frame.
+  std::shared_ptr<PngImage> make_frame_image(int width, int height) const;
+  void add_frame(PngFrame frame);
+  // Compresses bitmap, laid out like set_bitmap() expects for the area of
+  // control. A first frame covering the whole image doubles as the
+  // default image, otherwise call set_bitmap() too.
+  void add_frame(PngFrameControl *control, byte *bitmap);
+
   friend std::ostream &operator<<(std::ostream &os, PngImage &image);
 };
 
+// Throws std::invalid_argument if the data is not a complete PNG, such as
+// a truncated file or a chunk that fails its CRC.
 PngImage *decode_png(std::istream& data_stream);
 
+// Decodes a PNG a row at a time for images too large to hold in memory.
+// Only two scanlines and a slice of the compressed data are kept.
+// Ancillary chunks and animation frames are skipped.
+class PngRowReader {
+  std::istream &stream;
+  std::shared_ptr<PngHeader> header;
+  std::shared_ptr<PngPalette> palette;
+  std::unique_ptr<z_stream_s> inflater;
+  std::vector<byte> input;
+  std::vector<byte> scanline;
+  std::vector<byte> previous;
+  std::vector<byte> rgb;
+  unsigned int chunk_left = 0;
+  unsigned int chunk_crc = 0;
+  int pixel_width = 0;
+  int row = 0;
+
+  void next_data_chunk();
+  void fill_input();
+
+public:
+  // Reads up to the image data. Throws std::invalid_argument for anything
+  // but non-interlaced 8-bit images.
+  PngRowReader(std::istream &stream);
+  ~PngRowReader();
+
+  int get_width() const {return header->get_width();}
+  int get_height() const {return header->get_height();}
+  // Rows read so far.
+  int get_row() const {return row;}
+  // Writes the next row as RGBA8. Throws std::invalid_argument if the data
+  // is corrupt or ends early.
+  void read_row(byte *rgba);
+};
+
+// Encodes a PNG a row at a time, writing IDAT chunks as the compressed
+// data fills them. The image is complete after the last row.
+class PngRowWriter {
+  std::ostream &stream;
+  std::unique_ptr<z_stream_s> deflater;
+  std::shared_ptr<byte[]> output;
+  std::vector<byte> scanline;
+  int height;
+  int row = 0;
+
+  void write_output();
+
+public:
+  // Writes the signature and the header. Indexed colour is not supported.
+  PngRowWriter(std::ostream &stream, int width, int height, PngImageType colour_type);
+  ~PngRowWriter();
+
+  // data holds one row laid out as set_bitmap() takes it.
+  void write_row(const byte *data);
+};
+
+// Reads the dimensions from the IHDR chunk without decoding anything and
+// rewinds the stream. Returns false if the stream does not start with a
+// PNG header.
+bool peek_png_size(std::istream &data_stream, int &width, int &height);
+
 std::ostream &operator<<(std::ostream &os, PngImage &image);
 
 }
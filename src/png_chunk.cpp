@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string>
 #include <cstring>
+#include <stdexcept>
 #include "png_chunk.h"
 #include "debug.h"
 #include "pixor.h"
@@ -9,6 +10,19 @@
 
 using namespace Pixor;
 
+static unsigned int read_uint32(const byte *src)
+{
+  unsigned int res;
+  memcpy(&res, src, 4);
+  return Pixor::byte_swap_32(res);
+}
+
+static void write_uint32(byte *dest, unsigned int value)
+{
+  value = Pixor::byte_swap_32(value);
+  memcpy(dest, &value, 4);
+}
+
 PngChunk::PngChunk(PngChunkType type, int length, std::shared_ptr<byte[]> data) :
   type(type),
   length(length),
@@ -74,9 +88,102 @@ RGBA PngPalette::get_pixel_value(int index)
 
 PngData::PngData(int length, std::shared_ptr<byte[]> data) : PngChunk(IDAT, length, data) {}
 
+PngAnimationControl::PngAnimationControl(int length, std::shared_ptr<byte[]> data) : PngChunk(ACTL, length, data)
+{
+  if (length < 8) throw std::invalid_argument("acTL chunk too short");
+}
+
+PngAnimationControl::PngAnimationControl(unsigned int frame_count, unsigned int play_count) :
+  PngChunk(ACTL, 8, std::shared_ptr<byte[]>(new byte[8]))
+{
+  write_uint32(data.get(), frame_count);
+  write_uint32(data.get() + 4, play_count);
+}
+
+unsigned int PngAnimationControl::get_frame_count() const {return read_uint32(data.get());}
+
+unsigned int PngAnimationControl::get_play_count() const {return read_uint32(data.get() + 4);}
+
+
+PngFrameControl::PngFrameControl(int length, std::shared_ptr<byte[]> data) : PngChunk(FCTL, length, data)
+{
+  if (length < 26) throw std::invalid_argument("fcTL chunk too short");
+}
+
+PngFrameControl::PngFrameControl(
+  int width,
+  int height,
+  int x_offset,
+  int y_offset,
+  unsigned short delay_num,
+  unsigned short delay_den,
+  ApngDisposeOp dispose_op,
+  ApngBlendOp blend_op
+) : PngChunk(FCTL, 26, std::shared_ptr<byte[]>(new byte[26]))
+{
+  write_uint32(data.get(), 0);
+  write_uint32(data.get() + 4, width);
+  write_uint32(data.get() + 8, height);
+  write_uint32(data.get() + 12, x_offset);
+  write_uint32(data.get() + 16, y_offset);
+  data[20] = delay_num >> 8;
+  data[21] = delay_num & 0xff;
+  data[22] = delay_den >> 8;
+  data[23] = delay_den & 0xff;
+  data[24] = dispose_op;
+  data[25] = blend_op;
+}
+
+unsigned int PngFrameControl::get_sequence() const {return read_uint32(data.get());}
+
+void PngFrameControl::set_sequence(unsigned int sequence)
+{
+  write_uint32(data.get(), sequence);
+  has_crc = false;
+}
+
+unsigned int PngFrameControl::get_width() const {return read_uint32(data.get() + 4);}
+
+unsigned int PngFrameControl::get_height() const {return read_uint32(data.get() + 8);}
+
+unsigned int PngFrameControl::get_x_offset() const {return read_uint32(data.get() + 12);}
+
+unsigned int PngFrameControl::get_y_offset() const {return read_uint32(data.get() + 16);}
+
+rect PngFrameControl::get_area() const
+{
+  return {(int) get_x_offset(), (int) get_y_offset(), (int) get_width(), (int) get_height()};
+}
+
+unsigned short PngFrameControl::get_delay_num() const {return (data[20] << 8) | data[21];}
+
+unsigned short PngFrameControl::get_delay_den() const {return (data[22] << 8) | data[23];}
+
+ApngDisposeOp PngFrameControl::get_dispose_op() const {return (ApngDisposeOp) data[24];}
+
+ApngBlendOp PngFrameControl::get_blend_op() const {return (ApngBlendOp) data[25];}
+
+
+PngFrameData::PngFrameData(unsigned int sequence, const PngData &chunk) :
+  PngChunk(FDAT, chunk.get_length() + 4, std::shared_ptr<byte[]>(new byte[chunk.get_length() + 4]))
+{
+  write_uint32(data.get(), sequence);
+  memcpy(data.get() + 4, chunk.get_data(), chunk.get_length());
+}
+
+
 PngEnd::PngEnd(int length, std::shared_ptr<byte[]> data) : PngChunk(IEND, length, data) {}
 
 
+unsigned int PngChunk::get_crc() const
+{
+  if (has_crc) return crc;
+
+  unsigned int res = update_crc(0xffffffff, (byte *) &type, 4);
+  if (length) res = update_crc(res, data.get(), length);
+  return res ^ 0xffffffff;
+}
+
 std::ostream &Pixor::operator<<(std::ostream &os, PngChunk &chunk)
 {
   unsigned int swapped_len = Pixor::byte_swap_32((unsigned int) chunk.length);
@@ -86,10 +193,7 @@ std::ostream &Pixor::operator<<(std::ostream &os, PngChunk &chunk)
   os.write((const char *) &type, 4);
   os.write((const char *) chunk.data.get(), chunk.length);
 
-  auto crc_data = std::unique_ptr<byte[]>(new byte[chunk.length + 4]);
-  memcpy(crc_data.get(), &chunk.type, 4);
-  memcpy(crc_data.get() + 4, chunk.data.get(), chunk.length);
-  unsigned int calculated_crc = Pixor::byte_swap_32(crc(crc_data.get(), chunk.length + 4));
+  unsigned int calculated_crc = Pixor::byte_swap_32(chunk.get_crc());
   os.write((const char *) &calculated_crc, 4);
 
   return os;
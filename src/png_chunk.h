@@ -9,6 +9,10 @@ enum PngChunkType {
   PLTE = 0x45544C50,
   IDAT = 0x54414449,
   IEND = 0x444E4549,
+  // APNG
+  ACTL = 0x4C546361,
+  FCTL = 0x4C546366,
+  FDAT = 0x54416466,
 };
 
 enum PngImageType {
@@ -19,17 +23,35 @@ enum PngImageType {
   PNG_TYPE_TRUECOLOUR_ALPHA = 6,
 };
 
+// What happens to the area of an APNG frame before the next frame.
+enum ApngDisposeOp {
+  APNG_DISPOSE_NONE = 0,
+  APNG_DISPOSE_BACKGROUND = 1,
+  APNG_DISPOSE_PREVIOUS = 2,
+};
+
+enum ApngBlendOp {
+  APNG_BLEND_SOURCE = 0,
+  APNG_BLEND_OVER = 1,
+};
+
 class PngChunk {
 protected:
   PngChunkType type;
   int length;
   std::shared_ptr<byte[]> data;
+  unsigned int crc = 0;
+  bool has_crc = false;
 
 public:
   PngChunk(PngChunkType type, int length, std::shared_ptr<byte[]> data);
   int get_length() const {return length;};
   PngChunkType get_type() const {return type;}
   byte *get_data() const {return data.get();}
+  // The CRC of type and data. Decoded chunks keep the one checked while
+  // reading, others compute it on every call.
+  unsigned int get_crc() const;
+  void set_crc(unsigned int crc) {this->crc = crc; has_crc = true;}
   friend std::ostream &operator<<(std::ostream &os, PngChunk &chunk);
 };
 
@@ -66,6 +88,53 @@ public:
   PngData(int length, std::shared_ptr<byte[]> data);
 };
 
+class PngAnimationControl : public PngChunk {
+public:
+  PngAnimationControl(int length, std::shared_ptr<byte[]> data);
+  // A play count of 0 loops forever.
+  PngAnimationControl(unsigned int frame_count, unsigned int play_count = 0);
+
+  unsigned int get_frame_count() const;
+  unsigned int get_play_count() const;
+};
+
+class PngFrameControl : public PngChunk {
+public:
+  PngFrameControl(int length, std::shared_ptr<byte[]> data);
+  // The delay is delay_num / delay_den seconds.
+  PngFrameControl(
+    int width,
+    int height,
+    int x_offset = 0,
+    int y_offset = 0,
+    unsigned short delay_num = 0,
+    unsigned short delay_den = 100,
+    ApngDisposeOp dispose_op = APNG_DISPOSE_NONE,
+    ApngBlendOp blend_op = APNG_BLEND_SOURCE
+  );
+
+  // Sequence numbers run over fcTL and fdAT chunks together, the encoder
+  // sets them while writing.
+  unsigned int get_sequence() const;
+  void set_sequence(unsigned int sequence);
+  unsigned int get_width() const;
+  unsigned int get_height() const;
+  unsigned int get_x_offset() const;
+  unsigned int get_y_offset() const;
+  rect get_area() const;
+  unsigned short get_delay_num() const;
+  unsigned short get_delay_den() const;
+  ApngDisposeOp get_dispose_op() const;
+  ApngBlendOp get_blend_op() const;
+};
+
+// The compressed data of a frame after the first, an IDAT with a sequence
+// number in front.
+class PngFrameData : public PngChunk {
+public:
+  PngFrameData(unsigned int sequence, const PngData &data);
+};
+
 class PngEnd : public PngChunk {
 public:
   PngEnd(int length, std::shared_ptr<byte[]> data);
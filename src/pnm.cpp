@@ -0,0 +1,274 @@
+#include <cctype>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "pnm.h"
+#include "buffer_pool.h"
+#include "debug.h"
+#include "image_io.h"
+#include "pixel_format.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+struct PnmHeader {
+  int width = 0;
+  int height = 0;
+  int channels = 0;
+  int max_value = 0;
+  size_t offset = 0;
+};
+
+// Reads the next number of a P5/P6 header, skipping whitespace and
+// comments.
+static int read_header_number(const byte *data, size_t size, size_t &p)
+{
+  while (p < size && (isspace(data[p]) || data[p] == '#')) {
+    if (data[p] == '#') {
+      while (p < size && data[p] != '\n') p++;
+    } else {
+      p++;
+    }
+  }
+
+  if (p >= size || !isdigit(data[p])) throw std::invalid_argument("Malformed PNM header");
+
+  long res = 0;
+  while (p < size && isdigit(data[p])) {
+    res = res * 10 + (data[p++] - '0');
+    if (res > (1 << 24)) throw std::invalid_argument("PNM header value too large");
+  }
+
+  return res;
+}
+
+// Reads the KEY value lines of a P7 header up to ENDHDR.
+static void read_pam_header(const byte *data, size_t size, size_t &p, PnmHeader &header)
+{
+  while (p < size) {
+    size_t line_end = p;
+    while (line_end < size && data[line_end] != '\n') line_end++;
+    if (line_end == size) break;
+
+    std::string line((const char *) data + p, line_end - p);
+    p = line_end + 1;
+    if (line.empty() || line[0] == '#') continue;
+    if (line == "ENDHDR") return;
+
+    char key[16];
+    char value[32];
+    if (sscanf(line.c_str(), "%15s %31s", key, value) != 2) continue;
+
+    int number = atoi(value);
+    if (!strcmp(key, "WIDTH")) header.width = number;
+    else if (!strcmp(key, "HEIGHT")) header.height = number;
+    else if (!strcmp(key, "DEPTH")) header.channels = number;
+    else if (!strcmp(key, "MAXVAL")) header.max_value = number;
+  }
+
+  throw std::invalid_argument("PAM header without ENDHDR");
+}
+
+static PnmHeader parse_header(const byte *data, size_t size, bool check_size = true)
+{
+  PnmHeader header;
+  size_t p = 2;
+
+  if (size < 3 || data[0] != 'P' || !isspace(data[2])) throw std::invalid_argument("PNM signature check failed");
+
+  if (data[1] == '7') {
+    p = 3;
+    read_pam_header(data, size, p, header);
+  } else if (data[1] == '5' || data[1] == '6') {
+    header.channels = data[1] == '5' ? 1 : 3;
+    header.width = read_header_number(data, size, p);
+    header.height = read_header_number(data, size, p);
+    header.max_value = read_header_number(data, size, p);
+    // Exactly one whitespace character separates the header from the data.
+    p++;
+  } else {
+    throw std::invalid_argument("Unsupported PNM type");
+  }
+
+  if (header.width <= 0 || header.height <= 0 || header.channels < 1 || header.channels > 4) {
+    throw std::invalid_argument("Invalid PNM image size or depth");
+  }
+  if (header.max_value != 255) throw std::invalid_argument("Only 8-bit PNM samples are supported");
+  if (check_size && (p > size || size - p < (size_t) header.width * header.height * header.channels)) {
+    throw std::invalid_argument("PNM pixel data is truncated");
+  }
+
+  header.offset = p;
+  return header;
+}
+
+// Expands pixels of 1 to 4 channels to RGB8 or RGBA8.
+static void expand_pixels(const byte *src, int channels, byte *dest, PixelFormat dest_format, int width, int height)
+{
+  int dest_channels = pixel_format_channels(dest_format);
+
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    size_t offset = (size_t) begin * width;
+    size_t count = (size_t) (end - begin) * width;
+    const byte *in = src + offset * channels;
+    byte *out = dest + offset * dest_channels;
+
+    if (channels == dest_channels) {
+      memcpy(out, in, count * channels);
+    } else if (channels != 2) {
+      convert_pixels(in, (PixelFormat) channels, out, dest_format, count);
+    } else {
+      for (size_t i = 0; i < count; i++) {
+        out[i * dest_channels] = out[i * dest_channels + 1] = out[i * dest_channels + 2] = in[i * 2];
+        if (dest_channels == 4) out[i * 4 + 3] = in[i * 2 + 1];
+      }
+    }
+  });
+}
+
+PnmImage::PnmImage(int width, int height, int channels) :
+  width(width),
+  height(height),
+  channels(channels)
+{
+  if (width <= 0 || height <= 0 || channels < 1 || channels > 4) {
+    throw std::invalid_argument("Invalid PNM image size or channel count");
+  }
+}
+
+PnmImage::PnmImage(int width, int height, int channels, std::shared_ptr<byte[]> pixels) :
+  PnmImage(width, height, channels)
+{
+  this->pixels = pixels;
+}
+
+void PnmImage::set_bitmap(byte *bitmap)
+{
+  size_t size = (size_t) width * height * channels;
+
+  pixels = BufferPool::shared().allocate<byte>(size);
+  memcpy(pixels.get(), bitmap, size);
+}
+
+std::shared_ptr<byte[]> PnmImage::get_image_bitmap() const
+{
+  if (!pixels) return nullptr;
+
+  PixelFormat format = has_alpha() ? PIXEL_FORMAT_RGBA8 : PIXEL_FORMAT_RGB8;
+  auto res = BufferPool::shared().allocate<byte>((size_t) width * height * pixel_format_channels(format));
+  expand_pixels(pixels.get(), channels, res.get(), format, width, height);
+
+  return res;
+}
+
+std::shared_ptr<byte[]> PnmImage::get_image_bitmap_with_alpha() const
+{
+  if (!pixels) return nullptr;
+
+  auto res = BufferPool::shared().allocate<byte>((size_t) width * height * 4);
+  expand_pixels(pixels.get(), channels, res.get(), PIXEL_FORMAT_RGBA8, width, height);
+
+  return res;
+}
+
+std::shared_ptr<byte[]> PnmImage::get_image_bitmap_greyscale(LumaWeights weights) const
+{
+  auto res = get_image_bitmap_with_alpha();
+  if (!res) return nullptr;
+
+  auto transform = ColourTransform().luma(weights);
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    byte *rows = res.get() + (size_t) begin * width * 4;
+    transform.apply(rows, rows, (size_t) (end - begin) * width);
+  });
+
+  return res;
+}
+
+void PnmImage::print_image_info() const
+{
+  printf("Image info:\n");
+  printf("  Image width: %d\n", width);
+  printf("  Image height: %d\n", height);
+  printf("  Channels: %d\n", channels);
+}
+
+PnmImage *Pixor::decode_pnm(std::istream &data_stream)
+{
+  PIXOR_TRACE_SCOPE("pnm.read", "pnm");
+  size_t size;
+  auto data = read_stream(data_stream, size);
+  PnmHeader header = parse_header(data.get(), size);
+
+  return new PnmImage(header.width, header.height, header.channels,
+    std::shared_ptr<byte[]>(data, data.get() + header.offset));
+}
+
+PnmImage *Pixor::map_pnm(const std::string &path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::invalid_argument("Cannot open " + path);
+
+  struct stat info;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+
+  if (mapping == MAP_FAILED) {
+    dbgln("Cannot map %s, reading it instead", path.c_str());
+    std::ifstream file(path, std::ios::in|std::ios::binary);
+    return decode_pnm(file);
+  }
+
+  size_t size = info.st_size;
+  std::shared_ptr<byte[]> data((byte *) mapping, [size](byte *p) {munmap(p, size);});
+  PnmHeader header = parse_header(data.get(), size);
+  dbgln("Mapped PNM image %dx%d with %d channels", header.width, header.height, header.channels);
+
+  return new PnmImage(header.width, header.height, header.channels,
+    std::shared_ptr<byte[]>(data, data.get() + header.offset));
+}
+
+bool Pixor::peek_pnm_size(std::istream &data_stream, int &width, int &height)
+{
+  byte header[1024];
+  bool valid = true;
+
+  data_stream.read((char *) header, sizeof(header));
+  size_t size = data_stream.gcount();
+  data_stream.clear();
+  data_stream.seekg(0);
+
+  try {
+    PnmHeader parsed = parse_header(header, size, false);
+    width = parsed.width;
+    height = parsed.height;
+  } catch (const std::invalid_argument &e) {
+    valid = false;
+  }
+
+  return valid;
+}
+
+std::ostream &Pixor::operator<<(std::ostream &os, PnmImage &image)
+{
+  static const char *tuple_types[] = {"GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+
+  if (image.channels == 1 || image.channels == 3) {
+    os << "P" << (image.channels == 1 ? 5 : 6) << "\n" << image.width << " " << image.height << "\n255\n";
+  } else {
+    os << "P7\nWIDTH " << image.width << "\nHEIGHT " << image.height << "\nDEPTH " << image.channels
+      << "\nMAXVAL 255\nTUPLTYPE " << tuple_types[image.channels - 1] << "\nENDHDR\n";
+  }
+
+  os.write((const char *) image.pixels.get(), (size_t) image.width * image.height * image.channels);
+  return os;
+}
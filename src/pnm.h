@@ -0,0 +1,60 @@
+#pragma once
+#include <iostream>
+#include <memory>
+#include <string>
+#include "pixor.h"
+#include "image.h"
+
+namespace Pixor {
+
+// Uncompressed Netpbm images: PGM (P5), PPM (P6) and PAM (P7) with 8-bit
+// samples. The header is parsed once and the pixels are used where they
+// lie, so a mapped file is read straight from the page cache.
+//
+// get_pixels() gives that direct access. The get_image_bitmap functions
+// copy, callers own what they get.
+//
+// There is no content hash, so PNM images bypass the ResultCache: hashing
+// the pixels reads all of them, which costs as much as converting them.
+class PnmImage : public Pixor::Image {
+  int width;
+  int height;
+  int channels;
+  std::shared_ptr<byte[]> pixels;
+
+public:
+  // channels is 1 (grey), 2 (grey and alpha), 3 (RGB) or 4 (RGBA).
+  PnmImage(int width, int height, int channels);
+  // pixels has to hold width * height * channels bytes.
+  PnmImage(int width, int height, int channels, std::shared_ptr<byte[]> pixels);
+
+  // bitmap holds width * height * channels bytes.
+  void set_bitmap(byte *bitmap);
+  std::shared_ptr<byte[]> get_image_bitmap() const;
+  std::shared_ptr<byte[]> get_image_bitmap_with_alpha() const;
+  std::shared_ptr<byte[]> get_image_bitmap_greyscale(LumaWeights weights) const;
+  int get_width() const {return width;}
+  int get_height() const {return height;}
+  int get_channels() const {return channels;}
+  bool has_alpha() const {return channels == 2 || channels == 4;}
+  const byte *get_pixels() const {return pixels.get();}
+  void print_image_info() const;
+  friend std::ostream &operator<<(std::ostream &os, PnmImage &image);
+};
+
+// Throws std::invalid_argument for anything but 8-bit P5, P6 and P7.
+PnmImage *decode_pnm(std::istream &data_stream);
+
+// Maps the file read-only instead of reading it, the file must not be
+// truncated while the image is alive.
+// Falls back to reading when mapping fails.
+PnmImage *map_pnm(const std::string &path);
+
+// Reads the dimensions from the header and rewinds the stream. Returns
+// false if the stream does not start with a supported header.
+bool peek_pnm_size(std::istream &data_stream, int &width, int &height);
+
+// Writes P5 or P6 when the channels allow it and P7 otherwise.
+std::ostream &operator<<(std::ostream &os, PnmImage &image);
+
+}
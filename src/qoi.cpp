@@ -0,0 +1,342 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <stdio.h>
+#include "qoi.h"
+#include "buffer_pool.h"
+#include "debug.h"
+#include "image_io.h"
+#include "pixel_format.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+static const int QOI_HEADER_SIZE = 14;
+static const byte QOI_PADDING[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+// The limit of the reference decoder, 1.6 GB of RGBA pixels.
+static const size_t QOI_MAX_PIXELS = 400000000;
+
+enum QoiOp {
+  QOI_OP_INDEX = 0x00,
+  QOI_OP_DIFF = 0x40,
+  QOI_OP_LUMA = 0x80,
+  QOI_OP_RUN = 0xc0,
+  QOI_OP_RGB = 0xfe,
+  QOI_OP_RGBA = 0xff,
+};
+
+static const byte QOI_MASK = 0xc0;
+
+// Channels in memory order, so a pixel compares as one word.
+union QoiPixel {
+  struct {
+    byte r;
+    byte g;
+    byte b;
+    byte a;
+  };
+  unsigned int value;
+};
+
+static inline unsigned int qoi_hash(QoiPixel px)
+{
+  return (px.r * 3u + px.g * 5u + px.b * 7u + px.a * 11u) & 63;
+}
+
+static void write_uint32(byte *dest, unsigned int value)
+{
+  value = Pixor::byte_swap_32(value);
+  memcpy(dest, &value, 4);
+}
+
+static unsigned int read_uint32(const byte *src)
+{
+  unsigned int res;
+  memcpy(&res, src, 4);
+  return Pixor::byte_swap_32(res);
+}
+
+static inline void store_pixel(byte *dest, QoiPixel px, int channels)
+{
+  if (channels == 4) {
+    memcpy(dest, &px.value, 4);
+  } else {
+    dest[0] = px.r;
+    dest[1] = px.g;
+    dest[2] = px.b;
+  }
+}
+
+// Decodes into OUT_CHANNELS per pixel, 3 drops alpha and 4 keeps it.
+template <int OUT_CHANNELS>
+static void decode_pixels(const byte *data, size_t size, byte *out, size_t pixel_count)
+{
+  QoiPixel index[64] = {};
+  QoiPixel px;
+  size_t chunks_end = size - sizeof(QOI_PADDING);
+  size_t p = QOI_HEADER_SIZE;
+  size_t i = 0;
+
+  px.value = 0;
+  px.a = 255;
+
+  while (i < pixel_count) {
+    if (p >= chunks_end) {
+      // Too few chunks for the pixels, the rest repeats the last pixel.
+      store_pixel(out + i++ * OUT_CHANNELS, px, OUT_CHANNELS);
+      continue;
+    }
+
+    byte b1 = data[p++];
+
+    if (b1 == QOI_OP_RGB) {
+      px.r = data[p];
+      px.g = data[p + 1];
+      px.b = data[p + 2];
+      p += 3;
+    } else if (b1 == QOI_OP_RGBA) {
+      memcpy(&px.value, data + p, 4);
+      p += 4;
+    } else if ((b1 & QOI_MASK) == QOI_OP_INDEX) {
+      px = index[b1];
+    } else if ((b1 & QOI_MASK) == QOI_OP_DIFF) {
+      px.r += ((b1 >> 4) & 3) - 2;
+      px.g += ((b1 >> 2) & 3) - 2;
+      px.b += (b1 & 3) - 2;
+    } else if ((b1 & QOI_MASK) == QOI_OP_LUMA) {
+      byte b2 = data[p++];
+      int dg = (b1 & 0x3f) - 32;
+
+      px.r += dg - 8 + ((b2 >> 4) & 0x0f);
+      px.g += dg;
+      px.b += dg - 8 + (b2 & 0x0f);
+    } else {
+      size_t run_end = std::min(pixel_count, i + (b1 & 0x3f) + 1);
+      for (; i < run_end; i++) {
+        store_pixel(out + i * OUT_CHANNELS, px, OUT_CHANNELS);
+      }
+      continue;
+    }
+
+    index[qoi_hash(px)] = px;
+    store_pixel(out + i++ * OUT_CHANNELS, px, OUT_CHANNELS);
+  }
+}
+
+QoiImage::QoiImage(int width, int height, int channels) :
+  width(width),
+  height(height),
+  channels(channels)
+{
+  if (width <= 0 || height <= 0 || (channels != 3 && channels != 4)) {
+    throw std::invalid_argument("Invalid QOI image size or channel count");
+  }
+}
+
+QoiImage::QoiImage(int width, int height, int channels, byte colour_space, std::shared_ptr<byte[]> data, size_t size) :
+  QoiImage(width, height, channels)
+{
+  this->colour_space = colour_space;
+  this->data = data;
+  this->size = size;
+}
+
+void QoiImage::set_bitmap(byte *bitmap)
+{
+  PIXOR_TRACE_SCOPE("qoi.encode", "qoi");
+  size_t pixel_count = (size_t) width * height;
+  size_t max_size = QOI_HEADER_SIZE + pixel_count * (channels + 1) + sizeof(QOI_PADDING);
+  auto encoded = BufferPool::shared().allocate<byte>(max_size);
+  byte *out = encoded.get();
+  QoiPixel index[64] = {};
+  QoiPixel previous;
+  size_t p = 0;
+  int run = 0;
+
+  memcpy(out, QOI_MAGIC, 4);
+  write_uint32(out + 4, width);
+  write_uint32(out + 8, height);
+  out[12] = channels;
+  out[13] = colour_space;
+  p = QOI_HEADER_SIZE;
+  previous.value = 0;
+  previous.a = 255;
+
+  for (size_t i = 0; i < pixel_count; i++) {
+    QoiPixel px;
+    if (channels == 4) {
+      memcpy(&px.value, bitmap + i * 4, 4);
+    } else {
+      memcpy(&px.value, bitmap + i * 3, 3);
+      px.a = 255;
+    }
+
+    if (px.value == previous.value) {
+      run++;
+      if (run == 62 || i == pixel_count - 1) {
+        out[p++] = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+      continue;
+    }
+
+    if (run > 0) {
+      out[p++] = QOI_OP_RUN | (run - 1);
+      run = 0;
+    }
+
+    unsigned int hash = qoi_hash(px);
+    if (index[hash].value == px.value) {
+      out[p++] = QOI_OP_INDEX | hash;
+    } else if (px.a != previous.a) {
+      index[hash] = px;
+      out[p++] = QOI_OP_RGBA;
+      out[p++] = px.r;
+      out[p++] = px.g;
+      out[p++] = px.b;
+      out[p++] = px.a;
+    } else {
+      index[hash] = px;
+      signed char dr = px.r - previous.r;
+      signed char dg = px.g - previous.g;
+      signed char db = px.b - previous.b;
+      signed char dr_dg = dr - dg;
+      signed char db_dg = db - dg;
+
+      if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+        out[p++] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+      } else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8) {
+        out[p++] = QOI_OP_LUMA | (dg + 32);
+        out[p++] = (dr_dg + 8) << 4 | (db_dg + 8);
+      } else {
+        out[p++] = QOI_OP_RGB;
+        out[p++] = px.r;
+        out[p++] = px.g;
+        out[p++] = px.b;
+      }
+    }
+
+    previous = px;
+  }
+
+  memcpy(out + p, QOI_PADDING, sizeof(QOI_PADDING));
+  data = encoded;
+  size = p + sizeof(QOI_PADDING);
+}
+
+std::shared_ptr<byte[]> QoiImage::get_image_bitmap() const
+{
+  if (!data) return nullptr;
+
+  PIXOR_TRACE_SCOPE("qoi.decode", "qoi");
+  size_t pixel_count = (size_t) width * height;
+  auto res = BufferPool::shared().allocate<byte>(pixel_count * channels);
+  if (channels == 4) {
+    decode_pixels<4>(data.get(), size, res.get(), pixel_count);
+  } else {
+    decode_pixels<3>(data.get(), size, res.get(), pixel_count);
+  }
+
+  return res;
+}
+
+std::shared_ptr<byte[]> QoiImage::get_image_bitmap_with_alpha() const
+{
+  if (!data) return nullptr;
+
+  PIXOR_TRACE_SCOPE("qoi.decode", "qoi");
+  size_t pixel_count = (size_t) width * height;
+  auto res = BufferPool::shared().allocate<byte>(pixel_count * 4);
+  decode_pixels<4>(data.get(), size, res.get(), pixel_count);
+
+  return res;
+}
+
+std::shared_ptr<byte[]> QoiImage::get_image_bitmap_greyscale(LumaWeights weights) const
+{
+  auto res = get_image_bitmap_with_alpha();
+  if (!res) return nullptr;
+
+  auto transform = ColourTransform().luma(weights);
+  parallel_for_rows(height, width, [&](int begin, int end) {
+    byte *rows = res.get() + (size_t) begin * width * 4;
+    transform.apply(rows, rows, (size_t) (end - begin) * width);
+  });
+
+  return res;
+}
+
+uint64_t QoiImage::get_content_hash() const
+{
+  if (!data) return 0;
+
+  PIXOR_TRACE_SCOPE("qoi.hash", "qoi");
+  uint64_t res = hash_combine(0, size);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data.get() + i, 8);
+    res = hash_combine(res, word);
+  }
+
+  uint64_t tail = 0;
+  memcpy(&tail, data.get() + i, size - i);
+  return hash_combine(res, tail);
+}
+
+void QoiImage::print_image_info() const
+{
+  printf("Image info:\n");
+  printf("  Image width: %d\n", width);
+  printf("  Image height: %d\n", height);
+  printf("  Channels: %d\n", channels);
+  printf("  Colour space: %s\n", colour_space ? "linear" : "sRGB");
+  printf("  Encoded size: %zu\n", size);
+}
+
+QoiImage *Pixor::decode_qoi(std::istream &data_stream)
+{
+  PIXOR_TRACE_SCOPE("qoi.read", "qoi");
+  size_t size;
+  auto data = read_stream(data_stream, size);
+
+  if (size < QOI_HEADER_SIZE + sizeof(QOI_PADDING) || memcmp(data.get(), QOI_MAGIC, 4)) {
+    throw std::invalid_argument("QOI signature check failed");
+  }
+
+  unsigned int width = read_uint32(data.get() + 4);
+  unsigned int height = read_uint32(data.get() + 8);
+  if (width > (1u << 20) || height > (1u << 20) || (size_t) width * height > QOI_MAX_PIXELS) {
+    throw std::invalid_argument("QOI image too large");
+  }
+  if (memcmp(data.get() + size - sizeof(QOI_PADDING), QOI_PADDING, sizeof(QOI_PADDING))) {
+    throw std::invalid_argument("QOI data is truncated");
+  }
+  dbgln("Read QOI image %ux%u", width, height);
+
+  return new QoiImage(width, height, data[12], data[13], data, size);
+}
+
+bool Pixor::peek_qoi_size(std::istream &data_stream, int &width, int &height)
+{
+  byte header[QOI_HEADER_SIZE];
+
+  data_stream.read((char *) header, sizeof(header));
+  bool valid = data_stream.gcount() == sizeof(header) && memcmp(header, QOI_MAGIC, 4) == 0;
+
+  data_stream.clear();
+  data_stream.seekg(0);
+  if (!valid) return false;
+
+  width = read_uint32(header + 4);
+  height = read_uint32(header + 8);
+
+  return true;
+}
+
+std::ostream &Pixor::operator<<(std::ostream &os, QoiImage &image)
+{
+  os.write((const char *) image.data.get(), image.size);
+  return os;
+}
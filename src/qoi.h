@@ -0,0 +1,55 @@
+#pragma once
+#include <iostream>
+#include <memory>
+#include "pixor.h"
+#include "image.h"
+
+namespace Pixor {
+
+const byte QOI_MAGIC[] = {'q', 'o', 'i', 'f'};
+
+// The Quite OK Image format: lossless, no entropy coding, and an order of
+// magnitude faster than deflate in both directions. Meant for scratch
+// files between pipeline stages rather than for sharing images.
+//
+// Like PngImage the encoded bytes are kept and decoded on every request.
+class QoiImage : public Pixor::Image {
+  int width;
+  int height;
+  int channels;
+  byte colour_space = 0;
+  std::shared_ptr<byte[]> data;
+  size_t size = 0;
+
+public:
+  // channels is 3 for RGB and 4 for RGBA.
+  QoiImage(int width, int height, int channels = 4);
+  QoiImage(int width, int height, int channels, byte colour_space, std::shared_ptr<byte[]> data, size_t size);
+
+  // bitmap holds RGB or RGBA pixels, as many channels as the image has.
+  void set_bitmap(byte *bitmap);
+  std::shared_ptr<byte[]> get_image_bitmap() const;
+  std::shared_ptr<byte[]> get_image_bitmap_with_alpha() const;
+  std::shared_ptr<byte[]> get_image_bitmap_greyscale(LumaWeights weights) const;
+  int get_width() const {return width;}
+  int get_height() const {return height;}
+  int get_channels() const {return channels;}
+  bool has_alpha() const {return channels == 4;}
+  size_t get_encoded_size() const {return size;}
+  // Of the encoded bytes, which decode to exactly one image.
+  uint64_t get_content_hash() const;
+  void print_image_info() const;
+  friend std::ostream &operator<<(std::ostream &os, QoiImage &image);
+};
+
+// Reads the rest of the stream. Throws std::invalid_argument if it is not
+// a QOI image, is truncated or has more pixels than QOI allows.
+QoiImage *decode_qoi(std::istream &data_stream);
+
+// Reads the dimensions from the header and rewinds the stream. Returns
+// false if the stream does not start with a QOI header.
+bool peek_qoi_size(std::istream &data_stream, int &width, int &height);
+
+std::ostream &operator<<(std::ostream &os, QoiImage &image);
+
+}
@@ -0,0 +1,290 @@
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdio.h>
+#include <unistd.h>
+#include "result_cache.h"
+#include "buffer_pool.h"
+#include "debug.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+static const char CACHE_MAGIC[4] = {'P', 'X', 'C', '1'};
+// Numbers the temporary files of this process.
+static std::atomic<unsigned int> temp_files{0};
+
+// Written in front of the data of every cache file.
+struct CacheFileHeader {
+  char magic[4];
+  uint32_t kind;
+  int32_t width;
+  int32_t height;
+  uint64_t size;
+  uint64_t content;
+  uint64_t params;
+};
+
+std::string CacheKey::to_string() const
+{
+  char name[33];
+
+  snprintf(name, sizeof(name), "%016llx%016llx", (unsigned long long) content, (unsigned long long) params);
+  return name;
+}
+
+uint64_t Pixor::hash_params(const char *pipeline, std::initializer_list<double> values)
+{
+  uint64_t res = 0;
+
+  for (const char *c = pipeline; *c; c++) {
+    res = hash_combine(res, (byte) *c);
+  }
+
+  for (double value : values) {
+    uint64_t bits;
+    // -0 and 0 are the same setting.
+    if (value == 0) value = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    res = hash_combine(res, bits);
+  }
+
+  return res;
+}
+
+ResultCache::ResultCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+bool ResultCache::find(const CacheKey &key, Kind kind, Entry &entry)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(key);
+
+    if (found != index.end() && found->second->kind == kind) {
+      entries.splice(entries.begin(), entries, found->second);
+      entry = *found->second;
+      hits++;
+      return true;
+    }
+  }
+
+  if (load(key, kind, entry)) {
+    disk_hits++;
+    insert(entry);
+    return true;
+  }
+
+  misses++;
+  return false;
+}
+
+void ResultCache::insert(const Entry &entry)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (entry.size > max_bytes) return;
+
+  auto found = index.find(entry.key);
+
+  if (found != index.end()) {
+    bytes -= found->second->size;
+    entries.erase(found->second);
+  }
+
+  entries.push_front(entry);
+  index[entry.key] = entries.begin();
+  bytes += entry.size;
+  evict();
+}
+
+// Called with the mutex held.
+void ResultCache::evict()
+{
+  while (bytes > max_bytes && !entries.empty()) {
+    bytes -= entries.back().size;
+    index.erase(entries.back().key);
+    entries.pop_back();
+  }
+}
+
+size_t ResultCache::entry_size(uint32_t kind, int width, int height)
+{
+  if (width < 0 || height < 0) return 0;
+
+  size_t pixels = (size_t) width * height;
+  switch (kind) {
+    case KIND_BITMAP:
+      return pixels * 4;
+    case KIND_MATRIX:
+      return pixels * sizeof(double);
+    default:
+      return 0;
+  }
+}
+
+std::string ResultCache::file_path(const CacheKey &key) const
+{
+  return directory + "/" + key.to_string() + ".pxc";
+}
+
+bool ResultCache::load(const CacheKey &key, Kind kind, Entry &entry) const
+{
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (directory.empty()) return false;
+    path = file_path(key);
+  }
+
+  std::ifstream file(path, std::ios::binary);
+  if (!file) return false;
+
+  PIXOR_TRACE_SCOPE("cache.load", "cache");
+  CacheFileHeader header;
+  file.read((char *) &header, sizeof(header));
+  // A file that does not describe itself consistently is deleted, it
+  // would only be rejected again on the next run.
+  if (!file || memcmp(header.magic, CACHE_MAGIC, 4) || header.content != key.content || header.params != key.params ||
+    header.size != entry_size(header.kind, header.width, header.height)) {
+    errln("Deleting invalid cache file %s", path.c_str());
+    file.close();
+    remove(path.c_str());
+    return false;
+  }
+  if (header.kind != (uint32_t) kind) return false;
+
+  size_t budget;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = max_bytes;
+  }
+  if (header.size > budget) return false;
+
+  auto data = BufferPool::shared().allocate<byte>(header.size);
+  file.read((char *) data.get(), header.size);
+  if ((uint64_t) file.gcount() != header.size) {
+    errln("Deleting truncated cache file %s", path.c_str());
+    file.close();
+    remove(path.c_str());
+    return false;
+  }
+
+  entry = {key, kind, header.width, header.height, header.size, data};
+  return true;
+}
+
+// Writes to a temporary name first, so a reader never sees half a file.
+// The name is unique to the writer, threads and processes sharing the
+// directory can store the same key at once and the last rename wins.
+void ResultCache::store(const Entry &entry) const
+{
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (directory.empty()) return;
+    path = file_path(entry.key);
+  }
+
+  PIXOR_TRACE_SCOPE("cache.store", "cache");
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int) getpid(), temp_files.fetch_add(1, std::memory_order_relaxed));
+  std::string temp_path = path + suffix;
+  std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+  CacheFileHeader header = {{CACHE_MAGIC[0], CACHE_MAGIC[1], CACHE_MAGIC[2], CACHE_MAGIC[3]},
+    (uint32_t) entry.kind, entry.width, entry.height, entry.size, entry.key.content, entry.key.params};
+
+  file.write((const char *) &header, sizeof(header));
+  file.write((const char *) entry.data.get(), entry.size);
+  file.close();
+
+  if (!file || rename(temp_path.c_str(), path.c_str())) {
+    errln("Cannot write cache file %s", path.c_str());
+    remove(temp_path.c_str());
+  }
+}
+
+void ResultCache::put(const CacheKey &key, Kind kind, int width, int height, const void *data, size_t size)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (size > max_bytes) return;
+  }
+
+  Entry entry = {key, kind, width, height, size, BufferPool::shared().allocate<byte>(size)};
+
+  memcpy(entry.data.get(), data, size);
+  insert(entry);
+  store(entry);
+}
+
+std::shared_ptr<byte[]> ResultCache::get_bitmap(const CacheKey &key, int width, int height)
+{
+  Entry entry;
+  if (!find(key, KIND_BITMAP, entry) || entry.width != width || entry.height != height) return nullptr;
+  if (entry.size != entry_size(KIND_BITMAP, width, height)) return nullptr;
+
+  auto res = BufferPool::shared().allocate<byte>(entry.size);
+  memcpy(res.get(), entry.data.get(), entry.size);
+  return res;
+}
+
+void ResultCache::put_bitmap(const CacheKey &key, const byte *bitmap, int width, int height)
+{
+  put(key, KIND_BITMAP, width, height, bitmap, (size_t) width * height * 4);
+}
+
+bool ResultCache::get_matrix(const CacheKey &key, Matrix<double> &m)
+{
+  Entry entry;
+  if (!find(key, KIND_MATRIX, entry)) return false;
+  if (entry.size != entry_size(KIND_MATRIX, entry.width, entry.height)) return false;
+
+  Matrix<double> res(entry.width, entry.height);
+  memcpy(res.data(), entry.data.get(), entry.size);
+  m = res;
+  return true;
+}
+
+void ResultCache::put_matrix(const CacheKey &key, Matrix<double> &m)
+{
+  put(key, KIND_MATRIX, m.get_width(), m.get_height(), m.data(), (size_t) m.get_width() * m.get_height() * sizeof(double));
+}
+
+void ResultCache::set_directory(const std::string &path)
+{
+  std::error_code error;
+  if (!path.empty() && !std::filesystem::create_directories(path, error) && error) {
+    errln("Cannot create cache directory %s: %s", path.c_str(), error.message().c_str());
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  directory = path;
+}
+
+void ResultCache::set_max_bytes(size_t max_bytes)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  this->max_bytes = max_bytes;
+  evict();
+}
+
+void ResultCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.clear();
+  index.clear();
+  bytes = 0;
+}
+
+ResultCacheStats ResultCache::get_stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return {hits, disk_hits, misses, entries.size(), bytes};
+}
+
+ResultCache &ResultCache::shared()
+{
+  static ResultCache cache;
+  return cache;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "pixor.h"
+#include "matrix.h"
+
+namespace Pixor {
+
+// content identifies the input pixels (Image::get_content_hash()), params
+// the pipeline that ran on them and its settings.
+struct CacheKey {
+  uint64_t content;
+  uint64_t params;
+
+  bool operator==(const CacheKey &other) const {return content == other.content && params == other.params;}
+  // 32 hex digits, used as the file name on disk.
+  std::string to_string() const;
+};
+
+// Hashes the name of a pipeline and its settings into CacheKey::params.
+// Integer settings pass through double unchanged.
+uint64_t hash_params(const char *pipeline, std::initializer_list<double> values);
+
+struct ResultCacheStats {
+  size_t hits;
+  size_t disk_hits;
+  size_t misses;
+  size_t entries;
+  size_t bytes;
+};
+
+// Keeps decoded bitmaps and filter outputs so that opening the same image
+// again, or rerunning a filter with settings already seen, skips the work.
+//
+// Entries live in memory up to a byte budget and the least recently used
+// go first. With a directory set, every put is also written there as a
+// raw file and a memory miss looks for it before reporting a miss. The
+// files are in native byte order and are never evicted, the directory is
+// meant to be a scratch location the user clears. Files whose header does
+// not match their size are deleted when read. Results larger than the
+// whole budget are kept neither in memory nor on disk.
+//
+// Results are copied in and out, callers own what they get and may
+// change it.
+class ResultCache {
+  enum Kind {
+    KIND_BITMAP = 1,
+    KIND_MATRIX = 2,
+  };
+
+  struct Entry {
+    CacheKey key;
+    Kind kind;
+    int width;
+    int height;
+    size_t size;
+    std::shared_ptr<byte[]> data;
+  };
+
+  struct KeyHash {
+    size_t operator()(const CacheKey &key) const {return hash_combine(key.content, key.params);}
+  };
+
+  mutable std::mutex mutex;
+  std::list<Entry> entries;
+  std::unordered_map<CacheKey, std::list<Entry>::iterator, KeyHash> index;
+  size_t max_bytes;
+  size_t bytes = 0;
+  std::string directory;
+  std::atomic<size_t> hits{0};
+  std::atomic<size_t> disk_hits{0};
+  std::atomic<size_t> misses{0};
+
+  bool find(const CacheKey &key, Kind kind, Entry &entry);
+  void insert(const Entry &entry);
+  void evict();
+  // What an entry of the kind and dimensions takes, 0 if they make no
+  // sense.
+  static size_t entry_size(uint32_t kind, int width, int height);
+  std::string file_path(const CacheKey &key) const;
+  bool load(const CacheKey &key, Kind kind, Entry &entry) const;
+  void store(const Entry &entry) const;
+  void put(const CacheKey &key, Kind kind, int width, int height, const void *data, size_t size);
+
+public:
+  ResultCache(size_t max_bytes = DEFAULT_MAX_BYTES);
+
+  static const size_t DEFAULT_MAX_BYTES = (size_t) 256 << 20;
+
+  // RGBA bitmaps of width x height pixels. Returns nullptr on a miss.
+  std::shared_ptr<byte[]> get_bitmap(const CacheKey &key, int width, int height);
+  void put_bitmap(const CacheKey &key, const byte *bitmap, int width, int height);
+
+  // Returns false on a miss and leaves m alone.
+  bool get_matrix(const CacheKey &key, Matrix<double> &m);
+  void put_matrix(const CacheKey &key, Matrix<double> &m);
+
+  // Enables the disk copy, created if missing. An empty path turns it off.
+  void set_directory(const std::string &path);
+  void set_max_bytes(size_t max_bytes);
+  // Drops the memory entries, files on disk stay.
+  void clear();
+  ResultCacheStats get_stats() const;
+  static ResultCache &shared();
+};
+
+}
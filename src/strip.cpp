@@ -0,0 +1,447 @@
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "strip.h"
+#include "buffer_pool.h"
+#include "colour_transform.h"
+#include "debug.h"
+#include "pixel_format.h"
+#include "png.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+// zlib's state and the compressed data buffers of the decoder and the
+// encoder, which the limit has to leave room for.
+static const size_t ZLIB_STATE_BYTES = 512 * 1024;
+// Magnitudes closer than this may tie once normalized.
+static const double NEAR_TIE = 1e-9;
+
+// The last rows of a plane, row y in slot y % capacity. Rows [0, ready)
+// have been computed, only the last capacity of them are still there.
+class RowRing {
+  std::shared_ptr<double[]> data;
+  int width;
+  int capacity;
+
+public:
+  int ready = 0;
+
+  RowRing(int width, int capacity) :
+    data(BufferPool::shared().allocate<double>((size_t) width * capacity)),
+    width(width),
+    capacity(capacity)
+    {}
+
+  double *row(int y) const {return data.get() + (size_t) (y % capacity) * width;}
+  size_t get_bytes() const {return (size_t) width * capacity * sizeof(double);}
+};
+
+// A magnitude that survives non-max suppression only if normalizing rounds
+// it to the same value as a larger neighbour.
+struct NearTie {
+  double m;
+  double q;
+  double r;
+};
+
+class StripCanny {
+  std::istream &in;
+  std::ostream &out;
+  std::streampos start;
+  CannyOptions options;
+  Job *job;
+  int width = 0;
+  int height = 0;
+  int strip_rows = 0;
+  int offset = 0;
+  std::vector<double> gaussian;
+  std::unique_ptr<RowRing> grey;
+  std::unique_ptr<RowRing> blurred;
+  std::unique_ptr<RowRing> magnitude;
+  std::unique_ptr<RowRing> theta;
+  std::unique_ptr<RowRing> edges;
+  size_t peak_bytes = 0;
+
+  // Found by the first pass.
+  double magnitude_max = -INFINITY;
+  double survivor_max = -INFINITY;
+  std::vector<NearTie> near_ties;
+  double suppressed_max = 0;
+
+  // Set for the second pass, as canny_graph() normalizes.
+  double normalize_max = 0;
+  double normalize_k = 0;
+
+  void convolve_row(const RowRing &src, const double *kernel, int size, int row, double *dest) const;
+  bool neighbours(int i, int j, double &q, double &r) const;
+  void read_grey(PngRowReader &reader, int target, std::vector<byte> &rgba, std::vector<byte> &luma);
+  template <class F>
+  void advance(RowRing &ring, int target, F compute);
+  void compute_gradients(int target, bool normalized);
+  void find_survivors(int y0, int y1);
+  void compute_edges(int target);
+  void hysteresis(int y0, int y1);
+  void run_pass(bool first);
+
+public:
+  StripCanny(std::istream &in, std::ostream &out, const CannyOptions &options, Job *job);
+  StripStats run(const StripOptions &strip_options);
+};
+
+StripCanny::StripCanny(std::istream &in, std::ostream &out, const CannyOptions &options, Job *job) :
+  in(in),
+  out(out),
+  start(in.tellg()),
+  options(options),
+  job(job)
+{
+  if (start == std::streampos(-1)) throw std::invalid_argument("Strip processing needs a seekable stream");
+
+  auto kernel = gaussian_kernel(options.kernel_size, options.sigma);
+  gaussian.assign(kernel.data(), kernel.data() + (size_t) options.kernel_size * options.kernel_size);
+  offset = options.kernel_size / 2;
+}
+
+// Same as the convolution of Graph, which is Matrix::convolve row by row.
+void StripCanny::convolve_row(const RowRing &src, const double *kernel, int size, int row, double *dest) const
+{
+  int offset = (size - 1) / 2;
+
+  for (int col = 0; col < width; col++) {
+    double val = 0;
+
+    for (int kernel_row = 0; kernel_row < size; kernel_row++) {
+      int src_row = row + kernel_row - offset;
+      if (src_row < 0 || src_row > height - 1) {
+        src_row = row + (size - kernel_row) - offset;
+      }
+      const double *src_values = src.row(src_row);
+      const double *kernel_values = kernel + (size_t) (size - 1 - kernel_row) * size;
+
+      for (int kernel_col = 0; kernel_col < size; kernel_col++) {
+        int src_col = col + kernel_col - offset;
+        if (src_col < 0 || src_col > width - 1) {
+          src_col = col + (size - kernel_col) - offset;
+        }
+
+        val += kernel_values[size - 1 - kernel_col] * src_values[src_col];
+      }
+    }
+
+    dest[col] = val;
+  }
+}
+
+// The magnitudes non-max suppression compares pixel (i, j) with, as in
+// Graph. Returns false where the direction points off the image and the
+// pixel is suppressed outright. An undefined direction leaves 255 on both
+// sides, it only happens where the gradient is zero.
+bool StripCanny::neighbours(int i, int j, double &q, double &r) const
+{
+  const double angle_scale = (float) 180;
+  const double angle_div = (float) M_PI;
+  double angle = theta->row(i)[j] * angle_scale / angle_div;
+  if (angle < 0) angle += 180;
+  q = 255;
+  r = 255;
+
+  if ((angle >= 0 && angle < 22.5) || (angle >= 157.5 && angle <= 180)) {
+    if (j + 1 > width - 1 || j - 1 < 0) return false;
+    q = magnitude->row(i)[j + 1];
+    r = magnitude->row(i)[j - 1];
+  } else if (angle >= 22.5 && angle < 67.5) {
+    if (j + 1 > width - 1 || j - 1 < 0) return false;
+    if (i + 1 > height - 1 || i - 1 < 0) return false;
+    q = magnitude->row(i + 1)[j - 1];
+    r = magnitude->row(i - 1)[j + 1];
+  } else if (angle >= 67.5 && angle < 112.5) {
+    if (i + 1 > height - 1 || i - 1 < 0) return false;
+    q = magnitude->row(i + 1)[j];
+    r = magnitude->row(i - 1)[j];
+  } else if (angle >= 112.5 && angle < 157.5) {
+    if (j + 1 > width - 1 || j - 1 < 0) return false;
+    if (i + 1 > height - 1 || i - 1 < 0) return false;
+    q = magnitude->row(i - 1)[j - 1];
+    r = magnitude->row(i + 1)[j + 1];
+  }
+
+  return true;
+}
+
+// Decoding is serial, the rows come in order.
+void StripCanny::read_grey(PngRowReader &reader, int target, std::vector<byte> &rgba, std::vector<byte> &luma)
+{
+  PIXOR_TRACE_SCOPE("strip.decode", "strip");
+  auto transform = ColourTransform().luma(LUMA_REC601);
+
+  for (int y = grey->ready; y < std::min(target, height); y++) {
+    reader.read_row(rgba.data());
+    transform.apply(rgba.data(), luma.data(), width);
+    extract_channel(luma.data(), PIXEL_FORMAT_RGBA8, 0, grey->row(y), width);
+    grey->ready = y + 1;
+  }
+}
+
+// Computes the rows of ring up to target on the thread pool.
+template <class F>
+void StripCanny::advance(RowRing &ring, int target, F compute)
+{
+  int first = ring.ready;
+  target = std::min(target, height);
+  if (target <= first) return;
+
+  parallel_for_rows(target - first, width, [&](int begin, int end) {
+    compute(first + begin, first + end);
+  });
+  ring.ready = target;
+}
+
+// Blurs and takes the gradients up to target. The magnitude is normalized
+// in the second pass only, the first one finds its maximum.
+void StripCanny::compute_gradients(int target, bool normalized)
+{
+  PIXOR_TRACE_SCOPE("strip.gradients", "strip");
+  static const double kx[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+  static const double ky[] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
+  std::mutex max_mutex;
+
+  advance(*blurred, target + 2, [&](int y0, int y1) {
+    for (int y = y0; y < y1; y++) {
+      convolve_row(*grey, gaussian.data(), options.kernel_size, y, blurred->row(y));
+    }
+  });
+
+  advance(*magnitude, target, [&](int y0, int y1) {
+    std::vector<double> ix(width);
+    std::vector<double> iy(width);
+    double local_max = -INFINITY;
+
+    for (int y = y0; y < y1; y++) {
+      double *m = magnitude->row(y);
+      double *t = theta->row(y);
+
+      convolve_row(*blurred, kx, 3, y, ix.data());
+      convolve_row(*blurred, ky, 3, y, iy.data());
+      for (int j = 0; j < width; j++) {
+        m[j] = sqrt(ix[j] * ix[j] + iy[j] * iy[j]);
+        t[j] = atan(iy[j] / ix[j]);
+        if (normalized) m[j] = m[j] / normalize_max * normalize_k;
+        else local_max = std::max(local_max, m[j]);
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(max_mutex);
+    magnitude_max = std::max(magnitude_max, local_max);
+  });
+  theta->ready = magnitude->ready;
+}
+
+// First pass: the largest magnitude that survives non-max suppression.
+// Normalizing is monotonic, so a pixel at least as large as its
+// neighbours stays so. Near ties are kept to check once the maximum is
+// known.
+void StripCanny::find_survivors(int y0, int y1)
+{
+  PIXOR_TRACE_SCOPE("strip.survivors", "strip");
+  std::mutex survivors_mutex;
+
+  parallel_for_rows(y1 - y0, width, [&](int begin, int end) {
+    std::vector<NearTie> local_ties;
+    double local_max = -INFINITY;
+
+    for (int i = y0 + begin; i < y0 + end; i++) {
+      const double *m = magnitude->row(i);
+
+      for (int j = 0; j < width; j++) {
+        double q;
+        double r;
+        if (!neighbours(i, j, q, r)) continue;
+
+        if (m[j] >= q && m[j] >= r) {
+          local_max = std::max(local_max, m[j]);
+        } else if (m[j] > local_max && m[j] >= q * (1 - NEAR_TIE) && m[j] >= r * (1 - NEAR_TIE)) {
+          local_ties.push_back({m[j], q, r});
+        }
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(survivors_mutex);
+    survivor_max = std::max(survivor_max, local_max);
+    near_ties.insert(near_ties.end(), local_ties.begin(), local_ties.end());
+  });
+
+  // Only near ties above every certain survivor can change the maximum.
+  double max = survivor_max;
+  near_ties.erase(std::remove_if(near_ties.begin(), near_ties.end(), [max](const NearTie &tie) {
+    return tie.m <= max;
+  }), near_ties.end());
+}
+
+// Second pass: suppression and thresholds up to target.
+void StripCanny::compute_edges(int target)
+{
+  PIXOR_TRACE_SCOPE("strip.edges", "strip");
+  double high = suppressed_max * options.high_threshold_ratio;
+  double low = high * options.low_threshold_ratio;
+
+  advance(*edges, target, [&](int y0, int y1) {
+    for (int i = y0; i < y1; i++) {
+      const double *m = magnitude->row(i);
+      double *dest = edges->row(i);
+
+      for (int j = 0; j < width; j++) {
+        double q;
+        double r;
+        double value = neighbours(i, j, q, r) && m[j] >= q && m[j] >= r ? m[j] : 0;
+
+        dest[j] = value >= high ? 255 : value >= low ? 25 : 0;
+      }
+    }
+  });
+}
+
+// Same as Graph's hysteresis pass, in place: row y - 1 is final and row
+// y + 1 is still as thresholded.
+void StripCanny::hysteresis(int y0, int y1)
+{
+  PIXOR_TRACE_SCOPE("strip.hysteresis", "strip");
+
+  for (int i = y0; i < y1; i++) {
+    double *row = edges->row(i);
+
+    for (int j = 0; j < width; j++) {
+      if (row[j] != 25) continue;
+
+      bool promoted = false;
+      for (int src_row = std::max(0, i - 1); src_row <= std::min(height - 1, i + 1) && !promoted; src_row++) {
+        const double *src = edges->row(src_row);
+
+        for (int src_col = std::max(0, j - 1); src_col <= std::min(width - 1, j + 1); src_col++) {
+          if (src_row == i && src_col == j) continue;
+          if (src[src_col] == 255) {
+            promoted = true;
+            break;
+          }
+        }
+      }
+
+      row[j] = promoted ? 255 : 0;
+    }
+  }
+}
+
+// Every step finishes the rows [y0, y1) of the last stage. Each stage
+// runs ahead of its reader by the reader's halo, which is what the ring
+// capacities are sized for.
+void StripCanny::run_pass(bool first)
+{
+  PIXOR_TRACE_SCOPE(first ? "strip.maxima_pass" : "strip.edges_pass", "strip");
+  in.clear();
+  in.seekg(start);
+
+  PngRowReader reader(in);
+  std::unique_ptr<PngRowWriter> writer;
+  std::vector<byte> rgba((size_t) width * 4);
+  std::vector<byte> luma((size_t) width * 4);
+  std::vector<byte> output(width);
+
+  if (!first) writer.reset(new PngRowWriter(out, width, height, PNG_TYPE_GREYSCALE));
+  for (RowRing *ring : {grey.get(), blurred.get(), magnitude.get(), theta.get(), edges.get()}) {
+    ring->ready = 0;
+  }
+
+  for (int y0 = 0; y0 < height; y0 += strip_rows) {
+    int y1 = std::min(height, y0 + strip_rows);
+
+    // Hysteresis reads one edge row ahead, suppression one magnitude row
+    // ahead of that, the gradients two blurred rows and the blur its
+    // radius plus one grey row.
+    read_grey(reader, y1 + 4 + offset + 1, rgba, luma);
+    compute_gradients(y1 + 2, !first);
+
+    if (first) {
+      find_survivors(y0, y1);
+    } else {
+      compute_edges(y1 + 1);
+      hysteresis(y0, y1);
+
+      for (int y = y0; y < y1; y++) {
+        insert_channel(edges->row(y), output.data(), PIXEL_FORMAT_GRAY8, 0, width);
+        writer->write_row(output.data());
+      }
+    }
+
+    if (job) job->set_progress(((first ? 0 : 1) + (float) y1 / height) / 2);
+  }
+}
+
+StripStats StripCanny::run(const StripOptions &strip_options)
+{
+  PIXOR_TRACE_SCOPE("strip.canny", "strip");
+  {
+    PngRowReader reader(in);
+    width = reader.get_width();
+    height = reader.get_height();
+  }
+
+  // Every ring holds a strip plus the rows run_pass() computes ahead of it
+  // and the rows a reader still needs behind it. The blur of the first new
+  // row reads offset + 1 grey rows above it, which is offset - 3 rows
+  // behind the strip. The first pass reads one magnitude row behind it and
+  // hysteresis one edge row.
+  int halo_rows[] = {offset + 5 + std::max(0, offset - 3), 4, 3, 2, 2};
+  size_t row_bytes = (size_t) width * sizeof(double);
+  size_t fixed_bytes = ZLIB_STATE_BYTES + (size_t) width * 24
+    + (size_t) ThreadPool::shared().get_concurrency() * 2 * row_bytes;
+  for (int rows : halo_rows) {
+    fixed_bytes += rows * row_bytes;
+  }
+
+  size_t strip_bytes = 5 * row_bytes;
+  if (strip_options.max_bytes < fixed_bytes + strip_bytes) {
+    throw std::invalid_argument("Memory limit is too small for the image width");
+  }
+  strip_rows = std::min<size_t>(height, (strip_options.max_bytes - fixed_bytes) / strip_bytes);
+  dbgln("Running canny on %dx%d in strips of %d rows", width, height, strip_rows);
+
+  grey.reset(new RowRing(width, strip_rows + halo_rows[0]));
+  blurred.reset(new RowRing(width, strip_rows + halo_rows[1]));
+  magnitude.reset(new RowRing(width, strip_rows + halo_rows[2]));
+  theta.reset(new RowRing(width, strip_rows + halo_rows[3]));
+  edges.reset(new RowRing(width, strip_rows + halo_rows[4]));
+  peak_bytes = fixed_bytes + (size_t) 5 * strip_rows * row_bytes;
+
+  if (job) job->set_progress(0);
+  run_pass(true);
+
+  // As canny_graph() normalizes: factors rounded to float like those of
+  // Matrix::div and Matrix::mult.
+  normalize_max = (float) magnitude_max;
+  normalize_k = (float) 255;
+  auto normalize = [this](double value) {
+    return value / normalize_max * normalize_k;
+  };
+
+  suppressed_max = 0;
+  if (survivor_max > -INFINITY && normalize(survivor_max) > suppressed_max) suppressed_max = normalize(survivor_max);
+  for (auto &tie : near_ties) {
+    double m = normalize(tie.m);
+    if (m >= normalize(tie.q) && m >= normalize(tie.r) && m > suppressed_max) suppressed_max = m;
+  }
+
+  run_pass(false);
+
+  return {strip_rows, peak_bytes};
+}
+
+StripStats Pixor::canny_png_strips(std::istream &in, std::ostream &out, const CannyOptions &options,
+  const StripOptions &strip_options, Job *job)
+{
+  StripCanny canny(in, out, options, job);
+
+  return canny.run(strip_options);
+}
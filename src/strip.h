@@ -0,0 +1,36 @@
+#pragma once
+#include <iostream>
+#include "pixor.h"
+#include "canny.h"
+#include "job.h"
+
+namespace Pixor {
+
+struct StripOptions {
+  // Upper bound for the buffers of all stages together. The strips get as
+  // tall as it allows, taller strips give the thread pool more rows to
+  // share.
+  size_t max_bytes = (size_t) 256 << 20;
+};
+
+struct StripStats {
+  int strip_rows;
+  size_t peak_bytes;
+};
+
+// canny_edge_detector() for images far larger than memory. Rows are pulled
+// from the PNG decoder, go through the blur, the gradients and non-max
+// suppression in strips, and each stage only keeps the rows the next one
+// still needs. Finished edge rows go straight to the PNG encoder, as a
+// greyscale image.
+//
+// The normalization and the thresholds depend on maxima over the whole
+// image, so in is decoded twice, the first pass only finds them. in has to
+// be seekable. The edges are those canny_graph() finds on the luma of the
+// decoded image.
+//
+// Throws std::invalid_argument if max_bytes cannot hold a strip of one row.
+StripStats canny_png_strips(std::istream &in, std::ostream &out, const CannyOptions &options = CannyOptions(),
+  const StripOptions &strip_options = StripOptions(), Job *job = nullptr);
+
+}
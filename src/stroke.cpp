@@ -0,0 +1,145 @@
+#include <cmath>
+#include <algorithm>
+#include "stroke.h"
+
+using namespace Pixor;
+
+double OneEuroFilter::smoothing_factor(double cutoff, double dt)
+{
+  double tau = 1 / (2 * M_PI * cutoff);
+  return 1 / (1 + tau / dt);
+}
+
+double OneEuroFilter::filter(double x, double time)
+{
+  if (!initialized || time <= last_time) {
+    if (!initialized) {
+      value = x;
+      derivative = 0;
+    }
+    initialized = true;
+    last_time = time;
+    return value;
+  }
+
+  double dt = time - last_time;
+  double dx = (x - value) / dt;
+  derivative += smoothing_factor(derivative_cutoff, dt) * (dx - derivative);
+
+  double cutoff = min_cutoff + beta * std::abs(derivative);
+  value += smoothing_factor(cutoff, dt) * (x - value);
+  last_time = time;
+
+  return value;
+}
+
+static bool same_point(point p1, point p2)
+{
+  return p1.x == p2.x && p1.y == p2.y;
+}
+
+void StrokeBuilder::set_smoothing(bool catmull_rom, bool one_euro)
+{
+  this->catmull_rom = catmull_rom;
+  this->one_euro = one_euro;
+}
+
+void StrokeBuilder::begin(point p, double time)
+{
+  pending.clear();
+  history.clear();
+  filter_x.reset();
+  filter_y.reset();
+  filter_x.filter(p.x, time);
+  filter_y.filter(p.y, time);
+
+  history.push_back(p);
+  last_output = p;
+}
+
+void StrokeBuilder::add(point p, double time)
+{
+  if (one_euro) {
+    p = {(int) std::round(filter_x.filter(p.x, time)), (int) std::round(filter_y.filter(p.y, time))};
+  }
+
+  point last = pending.empty() ? history.back() : pending.back();
+  if (same_point(p, last)) return;
+
+  if (pending.size() >= capacity) {
+    pending.back() = p;
+  } else {
+    pending.push_back(p);
+  }
+}
+
+// Samples the Catmull-Rom segment between p1 and p2, one sample every
+// couple of pixels, p1 itself is not included.
+void StrokeBuilder::add_segment(std::vector<point> &res, point p0, point p1, point p2, point p3) const
+{
+  double length = std::hypot(p2.x - p1.x, p2.y - p1.y);
+  int samples = std::max(1, (int) (length / 2));
+
+  for (int i = 1; i <= samples; i++) {
+    double t = i / (double) samples;
+    double t2 = t * t;
+    double t3 = t2 * t;
+    double x = 0.5 * ((2 * p1.x) + (-p0.x + p2.x) * t
+      + (2 * p0.x - 5 * p1.x + 4 * p2.x - p3.x) * t2
+      + (-p0.x + 3 * p1.x - 3 * p2.x + p3.x) * t3);
+    double y = 0.5 * ((2 * p1.y) + (-p0.y + p2.y) * t
+      + (2 * p0.y - 5 * p1.y + 4 * p2.y - p3.y) * t2
+      + (-p0.y + 3 * p1.y - 3 * p2.y + p3.y) * t3);
+    point sample = {(int) std::round(x), (int) std::round(y)};
+
+    if (!same_point(sample, res.back())) res.push_back(sample);
+  }
+}
+
+// The segment ending at the previous point can be drawn once the point
+// after it is known.
+void StrokeBuilder::push_history(std::vector<point> &res, point p)
+{
+  size_t n = history.size();
+
+  if (n >= 2) {
+    point p0 = n >= 3 ? history[n - 3] : history[n - 2];
+    add_segment(res, p0, history[n - 2], history[n - 1], p);
+  }
+
+  history.push_back(p);
+  if (history.size() > 3) history.erase(history.begin());
+}
+
+std::vector<point> StrokeBuilder::drain()
+{
+  std::vector<point> res = {last_output};
+
+  for (const auto &p : pending) {
+    if (catmull_rom) {
+      push_history(res, p);
+    } else {
+      res.push_back(p);
+      history.back() = p;
+    }
+  }
+  pending.clear();
+
+  last_output = res.back();
+  return res;
+}
+
+std::vector<point> StrokeBuilder::finish()
+{
+  std::vector<point> res = drain();
+  size_t n = history.size();
+
+  if (catmull_rom && n >= 2) {
+    point p0 = n >= 3 ? history[n - 3] : history[n - 2];
+    add_segment(res, p0, history[n - 2], history[n - 1], history[n - 1]);
+  }
+
+  history.clear();
+  last_output = res.back();
+  return res;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include "pixor.h"
+
+namespace Pixor {
+
+// One-euro filter (Casiez et al.): a low-pass filter whose cutoff rises
+// with speed, so slow movements are steadied without adding lag to fast
+// ones.
+class OneEuroFilter {
+  double min_cutoff;
+  double beta;
+  double derivative_cutoff;
+  double value = 0;
+  double derivative = 0;
+  double last_time = 0;
+  bool initialized = false;
+
+  static double smoothing_factor(double cutoff, double dt);
+
+public:
+  OneEuroFilter(double min_cutoff = 1.0, double beta = 0.01, double derivative_cutoff = 1.0) :
+    min_cutoff(min_cutoff),
+    beta(beta),
+    derivative_cutoff(derivative_cutoff)
+  {}
+
+  void reset() {initialized = false;}
+  double filter(double x, double time);
+};
+
+// Collects pointer positions between frames and turns them into a polyline
+// to rasterize once per frame. Pending input is bounded: when a frame is
+// late, new positions replace the newest pending one instead of growing
+// the buffer. With Catmull-Rom smoothing the curve through the input points
+// is sampled, which delays drawing by one input point until finish().
+class StrokeBuilder {
+  OneEuroFilter filter_x;
+  OneEuroFilter filter_y;
+  bool catmull_rom = true;
+  bool one_euro = false;
+  size_t capacity;
+  std::vector<point> pending;
+  std::vector<point> history;
+  point last_output = {0, 0};
+
+  void add_segment(std::vector<point> &res, point p0, point p1, point p2, point p3) const;
+  void push_history(std::vector<point> &res, point p);
+
+public:
+  StrokeBuilder(size_t capacity = 256) : capacity(capacity) {}
+
+  void set_smoothing(bool catmull_rom, bool one_euro);
+  void begin(point p, double time);
+  void add(point p, double time);
+  bool has_pending() const {return !pending.empty();}
+
+  // Returns the polyline to draw since the last call, starting at the
+  // last point that was returned. finish() also flushes the points held
+  // back for smoothing and should be called when the stroke ends.
+  std::vector<point> drain();
+  std::vector<point> finish();
+};
+
+}
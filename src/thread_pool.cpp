@@ -0,0 +1,196 @@
+#include <algorithm>
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+// Tasks per thread a loop is split into, so threads that finish early
+// have something left to steal.
+static const int TASKS_PER_THREAD = 4;
+static const int MIN_PIXELS_PER_TASK = 4096;
+
+static thread_local const ThreadPool *worker_pool = nullptr;
+static thread_local int worker_index = -1;
+
+ThreadPool::ThreadPool(int threads)
+{
+  int worker_count = std::max(1, threads) - 1;
+
+  for (int i = 0; i < worker_count; i++) {
+    queues.push_back(std::make_unique<Queue>());
+  }
+
+  active_workers = worker_count;
+  for (int i = 0; i < worker_count; i++) {
+    workers.emplace_back(&ThreadPool::worker_loop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::set_concurrency(int threads)
+{
+  active_workers = std::clamp(threads - 1, 0, (int) workers.size());
+  wake.notify_all();
+}
+
+int ThreadPool::current_index() const
+{
+  return worker_pool == this ? worker_index : -1;
+}
+
+void ThreadPool::worker_loop(int index)
+{
+  worker_pool = this;
+  worker_index = index;
+
+  while (true) {
+    Task task;
+
+    if (index < active_workers && take_task(index, task)) {
+      run_task(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    wake.wait(lock, [this, index] {return stopping || (queued > 0 && index < active_workers);});
+    if (stopping) return;
+  }
+}
+
+// Own tasks are taken newest first, they are the ones most likely to be
+// in cache. Stolen tasks are taken oldest first, they tend to be the
+// biggest pieces of work left.
+bool ThreadPool::take_task(int index, Task &task)
+{
+  int count = queues.size();
+
+  for (int i = 0; i < count; i++) {
+    bool own = i == 0 && index >= 0;
+    Queue &queue = *queues[((index < 0 ? 0 : index) + i) % count];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) continue;
+
+    if (own) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+
+    queued--;
+    return true;
+  }
+
+  return false;
+}
+
+void ThreadPool::run_task(Task &task)
+{
+  Loop &loop = *task.loop;
+
+  try {
+    PIXOR_TRACE_SCOPE("parallel_for.task", "pool");
+    loop.body(task.begin, task.end);
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(loop.mutex);
+    if (!loop.error) loop.error = std::current_exception();
+  }
+
+  std::lock_guard<std::mutex> lock(loop.mutex);
+  if (--loop.pending == 0) loop.done.notify_all();
+}
+
+void ThreadPool::parallel_for(int begin, int end, int grain, std::function<void(int, int)> body)
+{
+  int length = end - begin;
+  if (length <= 0) return;
+
+  int threads = get_concurrency();
+  int tasks = std::min((length + std::max(1, grain) - 1) / std::max(1, grain), threads * TASKS_PER_THREAD);
+  if (threads == 1 || tasks <= 1) {
+    body(begin, end);
+    return;
+  }
+
+  int chunk = (length + tasks - 1) / tasks;
+  tasks = (length + chunk - 1) / chunk;
+
+  auto loop = std::make_shared<Loop>();
+  loop->body = std::move(body);
+  loop->pending = tasks;
+
+  // A worker keeps the chunks in its own deque for the others to steal,
+  // any other thread deals them out over the active workers.
+  int index = current_index();
+  for (int i = 1; i < tasks; i++) {
+    int target = index >= 0 ? index : next_queue++ % active_workers;
+    Queue &queue = *queues[target];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+
+    queue.tasks.push_back({loop, begin + i * chunk, std::min(end, begin + (i + 1) * chunk)});
+    queued++;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+  }
+  wake.notify_all();
+
+  Task first = {loop, begin, std::min(end, begin + chunk)};
+  run_task(first);
+
+  // Help out until the queues are empty, then every chunk of this loop is
+  // taken and all that is left is to wait for the ones still running.
+  while (loop->pending > 0) {
+    Task task;
+    if (!take_task(index, task)) break;
+    run_task(task);
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    loop->done.wait(lock, [&loop] {return loop->pending == 0;});
+  }
+
+  if (loop->error) std::rethrow_exception(loop->error);
+}
+
+ThreadPool &ThreadPool::shared()
+{
+  static ThreadPool pool;
+  return pool;
+}
+
+void Pixor::parallel_for_rows(int height, int width, std::function<void(int, int)> body)
+{
+  int grain = std::max(1, MIN_PIXELS_PER_TASK / std::max(1, width));
+  ThreadPool::shared().parallel_for(0, height, grain, std::move(body));
+}
+
+void Pixor::parallel_for_tiles(int width, int height, std::function<void(rect)> body)
+{
+  int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+  ThreadPool::shared().parallel_for(0, tiles_x * tiles_y, 1, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      int x = (i % tiles_x) * TILE_SIZE;
+      int y = (i / tiles_x) * TILE_SIZE;
+
+      body({x, y, std::min(TILE_SIZE, width - x), std::min(TILE_SIZE, height - y)});
+    }
+  });
+}
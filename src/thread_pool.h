@@ -0,0 +1,83 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "pixor.h"
+#include "tiled_bitmap.h"
+
+namespace Pixor {
+
+// Fixed set of worker threads for data-parallel loops, unlike JobQueue
+// which runs whole jobs one after another.
+//
+// Every worker owns a deque. It pushes and pops its own tasks at the back
+// and steals from the front of the others' deques when it runs dry. The
+// thread that started a loop runs tasks too while it waits, so a loop
+// nested inside another loop's body makes progress even when every
+// worker is busy.
+class ThreadPool {
+  struct Loop {
+    std::function<void(int, int)> body;
+    std::atomic<int> pending{0};
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+  struct Task {
+    std::shared_ptr<Loop> loop;
+    int begin;
+    int end;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<int> active_workers;
+  std::atomic<int> queued{0};
+  std::atomic<unsigned int> next_queue{0};
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+
+  void worker_loop(int index);
+  bool take_task(int index, Task &task);
+  void run_task(Task &task);
+  int current_index() const;
+
+public:
+  ThreadPool(int threads = std::thread::hardware_concurrency());
+  ~ThreadPool();
+
+  // Threads a loop may use, the calling thread included.
+  int get_concurrency() const {return active_workers + 1;}
+  // Limits the workers taking part in new loops, for measuring scaling.
+  // Call it while no loop is running.
+  void set_concurrency(int threads);
+
+  // Calls body(chunk_begin, chunk_end) on disjoint chunks covering
+  // [begin, end), each at least grain long, and returns once all of them
+  // have run. The first exception thrown by body is rethrown here.
+  void parallel_for(int begin, int end, int grain, std::function<void(int, int)> body);
+  static ThreadPool &shared();
+};
+
+// Row bands of an image width pixels wide. The grain keeps a band at a
+// few thousand pixels, so narrow images are not split into tiny tasks.
+void parallel_for_rows(int height, int width, std::function<void(int, int)> body);
+
+// Every TILE_SIZE aligned tile of a width x height image, clipped to the
+// image. Tiles of a TiledBitmap map one to one onto these.
+void parallel_for_tiles(int width, int height, std::function<void(rect)> body);
+
+}
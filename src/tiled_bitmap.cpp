@@ -0,0 +1,177 @@
+#include "tiled_bitmap.h"
+#include "buffer_pool.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace Pixor;
+
+TiledBitmap::Tile *TiledBitmap::make_tile()
+{
+  return new Tile(BufferPool::shared().allocate<RGBA>(TILE_PIXELS));
+}
+
+TiledBitmap::Tile *TiledBitmap::blank_tile()
+{
+  // Every untouched tile of every bitmap points here, so a fresh canvas
+  // costs one pointer per tile until it is drawn on. The reference held
+  // here keeps it shared, so it is never written to.
+  static Tile *tile = new Tile(std::shared_ptr<RGBA[]>(new RGBA[TILE_PIXELS]()));
+  return share(tile);
+}
+
+TiledBitmap::Tile *TiledBitmap::share(Tile *tile)
+{
+  tile->owners.fetch_add(1, std::memory_order_relaxed);
+  return tile;
+}
+
+// The release orders the reads of this holder before the writes of the
+// one that sees itself as the last.
+void TiledBitmap::release(Tile *tile)
+{
+  if (tile->owners.fetch_sub(1, std::memory_order_acq_rel) == 1) delete tile;
+}
+
+TiledBitmap::TiledBitmap(int width, int height) :
+  width(width),
+  height(height),
+  tiles_x((width + TILE_SIZE - 1) / TILE_SIZE),
+  tiles_y((height + TILE_SIZE - 1) / TILE_SIZE)
+{
+  tiles.resize((size_t) tiles_x * tiles_y);
+  for (auto &tile : tiles) {
+    tile = blank_tile();
+  }
+}
+
+TiledBitmap::TiledBitmap(const byte *bitmap, int width, int height) :
+  TiledBitmap(width, height)
+{
+  for (int i = 0; i < get_tile_count(); i++) {
+    rect area = get_tile_rect(i);
+    RGBA *tile = detach_tile(i);
+
+    for (int row = 0; row < area.height; row++) {
+      const byte *src = bitmap + ((size_t) (area.y + row) * width + area.x) * 4;
+      memcpy(tile + row * TILE_SIZE, src, area.width * 4);
+    }
+  }
+}
+
+TiledBitmap::TiledBitmap(const TiledBitmap &bitmap) :
+  tiles(bitmap.tiles),
+  width(bitmap.width),
+  height(bitmap.height),
+  tiles_x(bitmap.tiles_x),
+  tiles_y(bitmap.tiles_y)
+{
+  for (Tile *tile : tiles) {
+    share(tile);
+  }
+}
+
+TiledBitmap::~TiledBitmap()
+{
+  for (Tile *tile : tiles) {
+    release(tile);
+  }
+}
+
+RGBA *TiledBitmap::detach_tile(int index)
+{
+  Tile *tile = make_tile();
+  memcpy(tile->pixels.get(), tiles[index]->pixels.get(), TILE_PIXELS * sizeof(RGBA));
+  release(tiles[index]);
+  tiles[index] = tile;
+
+  return tile->pixels.get();
+}
+
+rect TiledBitmap::get_tile_rect(int index) const
+{
+  int x = (index % tiles_x) * TILE_SIZE;
+  int y = (index / tiles_x) * TILE_SIZE;
+
+  return {x, y, std::min(TILE_SIZE, width - x), std::min(TILE_SIZE, height - y)};
+}
+
+RGBA *TiledBitmap::get_tile_for_write(int index)
+{
+  if (tile_shared(index)) return detach_tile(index);
+  return tiles[index]->pixels.get();
+}
+
+size_t TiledBitmap::get_resident_size() const
+{
+  std::vector<const RGBA *> seen;
+
+  for (Tile *tile : tiles) {
+    seen.push_back(tile->pixels.get());
+  }
+
+  std::sort(seen.begin(), seen.end());
+  size_t unique = std::unique(seen.begin(), seen.end()) - seen.begin();
+
+  return unique * TILE_PIXELS * sizeof(RGBA);
+}
+
+RGBA *TiledBitmap::get_pixel_ptr(point coord) const
+{
+  RGBA *tile = tiles[tile_index(coord)]->pixels.get();
+  return tile + (coord.y % TILE_SIZE) * TILE_SIZE + coord.x % TILE_SIZE;
+}
+
+void TiledBitmap::read_rect(rect area, RGBA *dest) const
+{
+  for (int y = area.y; y < area.y + area.height; ) {
+    int rows = std::min(TILE_SIZE - y % TILE_SIZE, area.y + area.height - y);
+
+    for (int x = area.x; x < area.x + area.width; ) {
+      int cols = std::min(TILE_SIZE - x % TILE_SIZE, area.x + area.width - x);
+      const RGBA *tile = get_tile(tile_index({x, y}));
+
+      for (int row = 0; row < rows; row++) {
+        const RGBA *src = tile + (y % TILE_SIZE + row) * TILE_SIZE + x % TILE_SIZE;
+        memcpy(dest + (size_t) (y - area.y + row) * area.width + (x - area.x), src, cols * sizeof(RGBA));
+      }
+
+      x += cols;
+    }
+
+    y += rows;
+  }
+}
+
+void TiledBitmap::write_rect(rect area, const RGBA *src)
+{
+  for (int y = area.y; y < area.y + area.height; ) {
+    int rows = std::min(TILE_SIZE - y % TILE_SIZE, area.y + area.height - y);
+
+    for (int x = area.x; x < area.x + area.width; ) {
+      int cols = std::min(TILE_SIZE - x % TILE_SIZE, area.x + area.width - x);
+      RGBA *tile = get_tile_for_write(tile_index({x, y}));
+
+      for (int row = 0; row < rows; row++) {
+        RGBA *dest = tile + (y % TILE_SIZE + row) * TILE_SIZE + x % TILE_SIZE;
+        memcpy(dest, src + (size_t) (y - area.y + row) * area.width + (x - area.x), cols * sizeof(RGBA));
+      }
+
+      x += cols;
+    }
+
+    y += rows;
+  }
+}
+
+void TiledBitmap::copy_to(byte *dest) const
+{
+  read_rect({0, 0, width, height}, (RGBA *) dest);
+}
+
+std::shared_ptr<byte[]> TiledBitmap::flatten() const
+{
+  auto res = BufferPool::shared().allocate<byte>(get_byte_size());
+  copy_to(res.get());
+
+  return res;
+}
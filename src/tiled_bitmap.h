@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include "pixor.h"
+
+namespace Pixor {
+
+const int TILE_SIZE = 64;
+const int TILE_PIXELS = TILE_SIZE * TILE_SIZE;
+
+// RGBA bitmap split into TILE_SIZE x TILE_SIZE tiles. Tiles are reference
+// counted and shared between copies; a tile is cloned only when a copy
+// that shares it gets written to. Edge tiles are allocated at full size
+// so every tile has a stride of TILE_SIZE pixels.
+//
+// A bitmap is not thread safe, but its copies are independent of each
+// other: different threads may read and write copies that share tiles at
+// the same time, as the APNG pipeline does with the canvas. Each tile
+// counts the bitmaps holding it with release and acquire ordering, so a
+// copy only writes a tile in place once every other holder has let go of
+// it and finished reading.
+class TiledBitmap {
+  struct Tile {
+    std::atomic<int> owners;
+    std::shared_ptr<RGBA[]> pixels;
+
+    Tile(std::shared_ptr<RGBA[]> pixels) : owners(1), pixels(pixels) {}
+  };
+
+  std::vector<Tile *> tiles;
+  int width;
+  int height;
+  int tiles_x;
+  int tiles_y;
+
+  static Tile *make_tile();
+  static Tile *blank_tile();
+  static Tile *share(Tile *tile);
+  static void release(Tile *tile);
+  RGBA *detach_tile(int index);
+
+public:
+  TiledBitmap(int width, int height);
+  TiledBitmap(const byte *bitmap, int width, int height);
+  // Shares every tile with bitmap.
+  TiledBitmap(const TiledBitmap &bitmap);
+  TiledBitmap &operator=(const TiledBitmap &bitmap) = delete;
+  ~TiledBitmap();
+
+  int get_width() const {return width;}
+  int get_height() const {return height;}
+  int get_tiles_x() const {return tiles_x;}
+  int get_tiles_y() const {return tiles_y;}
+  int get_tile_count() const {return tiles_x * tiles_y;}
+  int tile_index(point coord) const {return (coord.y / TILE_SIZE) * tiles_x + coord.x / TILE_SIZE;}
+  rect get_tile_rect(int index) const;
+  bool tile_shared(int index) const {return tiles[index]->owners.load(std::memory_order_acquire) > 1;}
+  const RGBA *get_tile(int index) const {return tiles[index]->pixels.get();}
+  RGBA *get_tile_for_write(int index);
+  size_t get_byte_size() const {return (size_t) width * height * 4;}
+  size_t get_resident_size() const;
+
+  RGBA get_pixel(point coord) const
+  {
+    const RGBA *tile = get_tile(tile_index(coord));
+    return tile[(coord.y % TILE_SIZE) * TILE_SIZE + coord.x % TILE_SIZE];
+  }
+
+  void set_pixel(point coord, RGBA value)
+  {
+    RGBA *tile = get_tile_for_write(tile_index(coord));
+    tile[(coord.y % TILE_SIZE) * TILE_SIZE + coord.x % TILE_SIZE] = value;
+  }
+
+  RGBA *get_pixel_ptr(point coord) const;
+  void read_rect(rect area, RGBA *dest) const;
+  void write_rect(rect area, const RGBA *src);
+  void copy_to(byte *dest) const;
+  std::shared_ptr<byte[]> flatten() const;
+};
+
+}
@@ -0,0 +1,183 @@
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "trace.h"
+
+using namespace Pixor;
+
+static const int CHUNK_EVENTS = 4096;
+static const size_t MAX_CHUNKS_PER_THREAD = 256;
+
+namespace {
+
+struct TraceEvent {
+  const char *name;
+  const char *category;
+  int64_t start;
+  int64_t end;
+};
+
+// Only the owning thread writes a chunk. It publishes each event by bumping
+// count, so the exporter can read a chunk while it is being filled.
+struct EventChunk {
+  TraceEvent events[CHUNK_EVENTS];
+  std::atomic<int> count{0};
+};
+
+struct ThreadTrace {
+  int tid = 0;
+  std::mutex chunks_mutex;
+  std::vector<std::unique_ptr<EventChunk>> chunks;
+  EventChunk *current = nullptr;
+  std::atomic<int64_t> counters[MAX_TRACE_COUNTERS];
+
+  ThreadTrace()
+  {
+    for (auto &counter : counters) {
+      counter.store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+// Thread records outlive their threads, so events of finished workers
+// still end up in the export.
+struct TraceRegistry {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ThreadTrace>> threads;
+  std::vector<const char *> counter_names;
+  int next_tid = 1;
+};
+
+}
+
+static TraceRegistry &registry()
+{
+  static TraceRegistry registry;
+  return registry;
+}
+
+static ThreadTrace &thread_trace()
+{
+  thread_local std::shared_ptr<ThreadTrace> trace = [] {
+    auto trace = std::make_shared<ThreadTrace>();
+    TraceRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    trace->tid = r.next_tid++;
+    r.threads.push_back(trace);
+    return trace;
+  }();
+
+  return *trace;
+}
+
+void Pixor::set_tracing(bool enabled)
+{
+  tracing.store(enabled, std::memory_order_relaxed);
+}
+
+int64_t Pixor::trace_now()
+{
+  static const auto epoch = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void Pixor::record_trace_event(const char *name, const char *category, int64_t start, int64_t end)
+{
+  ThreadTrace &trace = thread_trace();
+  EventChunk *chunk = trace.current;
+  int count = chunk ? chunk->count.load(std::memory_order_relaxed) : CHUNK_EVENTS;
+
+  if (count == CHUNK_EVENTS) {
+    std::lock_guard<std::mutex> lock(trace.chunks_mutex);
+    if (trace.chunks.size() >= MAX_CHUNKS_PER_THREAD) return;
+
+    trace.chunks.push_back(std::make_unique<EventChunk>());
+    chunk = trace.current = trace.chunks.back().get();
+    count = 0;
+  }
+
+  chunk->events[count] = {name, category, start, end};
+  chunk->count.store(count + 1, std::memory_order_release);
+}
+
+TraceCounter::TraceCounter(const char *name) :
+  name(name)
+{
+  TraceRegistry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+
+  id = r.counter_names.size() < MAX_TRACE_COUNTERS ? (int) r.counter_names.size() : -1;
+  if (id >= 0) r.counter_names.push_back(name);
+}
+
+void TraceCounter::add(int64_t value)
+{
+  if (id < 0) return;
+  thread_trace().counters[id].fetch_add(value, std::memory_order_relaxed);
+}
+
+int64_t TraceCounter::total() const
+{
+  if (id < 0) return 0;
+
+  TraceRegistry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  int64_t res = 0;
+
+  for (const auto &thread : r.threads) {
+    res += thread->counters[id].load(std::memory_order_relaxed);
+  }
+
+  return res;
+}
+
+bool Pixor::write_trace(const std::string &path)
+{
+  std::ofstream out(path);
+  if (!out.is_open()) return false;
+
+  TraceRegistry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  bool first = true;
+
+  auto separator = [&]() -> std::ofstream & {
+    out << (first ? "\n" : ",\n");
+    first = false;
+    return out;
+  };
+
+  out << "{\"traceEvents\": [";
+
+  for (const auto &thread : r.threads) {
+    std::lock_guard<std::mutex> chunks_lock(thread->chunks_mutex);
+
+    for (const auto &chunk : thread->chunks) {
+      int count = chunk->count.load(std::memory_order_acquire);
+
+      for (int i = 0; i < count; i++) {
+        const TraceEvent &e = chunk->events[i];
+        separator() << "{\"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+          << "\", \"ph\": \"X\", \"ts\": " << e.start << ", \"dur\": " << e.end - e.start
+          << ", \"pid\": 1, \"tid\": " << thread->tid << "}";
+      }
+    }
+  }
+
+  // Counter totals, as a single sample at the time of the export.
+  int64_t now = trace_now();
+  for (size_t id = 0; id < r.counter_names.size(); id++) {
+    int64_t total = 0;
+    for (const auto &thread : r.threads) {
+      total += thread->counters[id].load(std::memory_order_relaxed);
+    }
+
+    separator() << "{\"name\": \"" << r.counter_names[id] << "\", \"ph\": \"C\", \"ts\": " << now
+      << ", \"pid\": 1, \"tid\": 0, \"args\": {\"value\": " << total << "}}";
+  }
+
+  out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+
+  return out.good();
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace Pixor {
+
+// Tracing of pipeline stages and counters.
+//
+// Scoped timers record complete events into a buffer owned by the calling
+// thread, counters add into per-thread slots, neither takes a lock on the
+// hot path. While tracing is switched off a trace point is a relaxed load
+// and a branch, and building with PIXOR_NO_TRACE removes them entirely.
+// write_trace() exports everything recorded so far in the Chrome
+// trace-event format (chrome://tracing, Perfetto).
+
+const int MAX_TRACE_COUNTERS = 64;
+
+inline std::atomic<bool> tracing{false};
+
+inline bool trace_enabled() {return tracing.load(std::memory_order_relaxed);}
+void set_tracing(bool enabled);
+bool write_trace(const std::string &path);
+
+// Microseconds since the trace clock started.
+int64_t trace_now();
+void record_trace_event(const char *name, const char *category, int64_t start, int64_t end);
+
+// A named counter. Declare them at namespace scope, the id is handed out
+// once at start-up.
+class TraceCounter {
+  const char *name;
+  int id;
+
+public:
+  TraceCounter(const char *name);
+
+  const char *get_name() const {return name;}
+  void add(int64_t value);
+  int64_t total() const;
+};
+
+class TraceScope {
+  const char *name;
+  const char *category;
+  int64_t start;
+
+public:
+  TraceScope(const char *name, const char *category = "pixor") :
+    name(name),
+    category(category),
+    start(trace_enabled() ? trace_now() : -1)
+  {}
+
+  ~TraceScope()
+  {
+    if (start >= 0) record_trace_event(name, category, start, trace_now());
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+};
+
+}
+
+#define PIXOR_TRACE_CONCAT_(a, b) a##b
+#define PIXOR_TRACE_CONCAT(a, b) PIXOR_TRACE_CONCAT_(a, b)
+
+#ifdef PIXOR_NO_TRACE
+#define PIXOR_TRACE_SCOPE(...) do {} while (0)
+#define PIXOR_TRACE_COUNT(counter, value) do {} while (0)
+#else
+#define PIXOR_TRACE_SCOPE(...) Pixor::TraceScope PIXOR_TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+#define PIXOR_TRACE_COUNT(counter, value) do { if (Pixor::trace_enabled()) (counter).add(value); } while (0)
+#endif
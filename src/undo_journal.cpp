@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <zlib.h>
+#include "undo_journal.h"
+#include "context.h"
+#include "debug.h"
+#include "trace.h"
+
+using namespace Pixor;
+
+static TraceCounter tiles_recorded("undo.tiles_recorded");
+
+bool UndoJournal::pack(const RGBA *pixels, size_t count, std::vector<byte> &data)
+{
+  unsigned long packed_size = compressBound(count * sizeof(RGBA));
+  std::vector<byte> res(packed_size);
+
+  int result = compress2(res.data(), &packed_size, (const byte *) pixels, count * sizeof(RGBA), Z_BEST_SPEED);
+  if (result != Z_OK) {
+    errln("Undo journal compression error code: %d", result);
+    return false;
+  }
+
+  res.resize(packed_size);
+  res.shrink_to_fit();
+  data = std::move(res);
+
+  return true;
+}
+
+bool UndoJournal::unpack(const std::vector<byte> &data, RGBA *pixels, size_t count)
+{
+  unsigned long unpacked_size = count * sizeof(RGBA);
+
+  int result = uncompress((byte *) pixels, &unpacked_size, data.data(), data.size());
+  if (result != Z_OK || unpacked_size != count * sizeof(RGBA)) {
+    errln("Undo journal decompression error code: %d", result);
+    return false;
+  }
+
+  return true;
+}
+
+void UndoJournal::begin_entry()
+{
+  if (depth++ > 0) return;
+
+  pending = Entry();
+  std::fill(touched_tiles.begin(), touched_tiles.end(), false);
+}
+
+void UndoJournal::end_entry()
+{
+  if (depth == 0 || --depth > 0) return;
+  if (pending.incomplete) {
+    errln("Cannot record the undo entry, dropping the undo history");
+    pending = Entry();
+    clear();
+    return;
+  }
+  if (pending.deltas.empty()) return;
+
+  for (auto &entry : redo_entries) {
+    drop_entry(entry);
+  }
+  redo_entries.clear();
+
+  memory_used += pending.byte_size;
+  undo_entries.push_back(std::move(pending));
+  pending = Entry();
+  trim();
+}
+
+void UndoJournal::record_tile(const Context &context, point coord)
+{
+  int context_tiles_x = (context.get_width() + TILE_SIZE - 1) / TILE_SIZE;
+  int context_tiles_y = (context.get_height() + TILE_SIZE - 1) / TILE_SIZE;
+  size_t tile_count = (size_t) context_tiles_x * context_tiles_y;
+
+  if (tiles_x != context_tiles_x || touched_tiles.size() != tile_count) {
+    tiles_x = context_tiles_x;
+    touched_tiles.assign(tile_count, false);
+  }
+
+  size_t index = (size_t) (coord.y / TILE_SIZE) * tiles_x + coord.x / TILE_SIZE;
+  if (touched_tiles[index]) return;
+  touched_tiles[index] = true;
+  if (pending.incomplete) return;
+
+  int x = (coord.x / TILE_SIZE) * TILE_SIZE;
+  int y = (coord.y / TILE_SIZE) * TILE_SIZE;
+  rect area = rect_intersect({x, y, TILE_SIZE, TILE_SIZE}, context.get_bounds());
+  std::vector<RGBA> before((size_t) area.width * area.height);
+
+  context.read_rect(area, before.data());
+
+  TileDelta delta{area, {}};
+  if (!pack(before.data(), before.size(), delta.data)) {
+    pending.incomplete = true;
+    return;
+  }
+  PIXOR_TRACE_COUNT(tiles_recorded, 1);
+  pending.byte_size += delta.data.size() + sizeof(TileDelta);
+  pending.deltas.push_back(std::move(delta));
+}
+
+void UndoJournal::record_rect(const Context &context, rect area)
+{
+  if (depth == 0 || replaying) return;
+
+  area = rect_intersect(area, context.get_bounds());
+  if (rect_empty(area)) return;
+
+  int first_x = area.x / TILE_SIZE;
+  int first_y = area.y / TILE_SIZE;
+  int last_x = (area.x + area.width - 1) / TILE_SIZE;
+  int last_y = (area.y + area.height - 1) / TILE_SIZE;
+
+  for (int ty = first_y; ty <= last_y; ty++) {
+    for (int tx = first_x; tx <= last_x; tx++) {
+      record_write(context, {tx * TILE_SIZE, ty * TILE_SIZE});
+    }
+  }
+}
+
+void UndoJournal::trim()
+{
+  while (memory_used > memory_budget && !undo_entries.empty()) {
+    drop_entry(undo_entries.front());
+    undo_entries.pop_front();
+  }
+}
+
+// Swaps the saved tiles of an entry with the current contents of the
+// context, which turns an undo entry into its redo entry and back. The
+// current contents are all saved before anything is written, if that
+// fails the context and the entry are left as they are. A tile whose saved
+// contents cannot be unpacked keeps its pixels, which is also what the
+// entry then holds for it.
+bool UndoJournal::swap_entry(Context &context, Entry &entry, rect &changed)
+{
+  PIXOR_TRACE_SCOPE("undo.swap_entry", "undo");
+  std::vector<std::vector<byte>> packed(entry.deltas.size());
+  std::vector<RGBA> pixels;
+
+  for (size_t i = 0; i < entry.deltas.size(); i++) {
+    rect area = entry.deltas[i].area;
+    pixels.resize((size_t) area.width * area.height);
+    context.read_rect(area, pixels.data());
+    if (!pack(pixels.data(), pixels.size(), packed[i])) return false;
+  }
+
+  replaying = true;
+  memory_used -= entry.byte_size;
+  entry.byte_size = 0;
+  changed = {0, 0, 0, 0};
+
+  for (size_t i = 0; i < entry.deltas.size(); i++) {
+    TileDelta &delta = entry.deltas[i];
+    pixels.resize((size_t) delta.area.width * delta.area.height);
+    if (unpack(delta.data, pixels.data(), pixels.size())) {
+      context.write_rect(delta.area, pixels.data());
+      changed = rect_union(changed, delta.area);
+    }
+
+    delta.data = std::move(packed[i]);
+    entry.byte_size += delta.data.size() + sizeof(TileDelta);
+  }
+
+  memory_used += entry.byte_size;
+  replaying = false;
+
+  return true;
+}
+
+rect UndoJournal::undo(Context &context)
+{
+  if (undo_entries.empty() || depth > 0) return {0, 0, 0, 0};
+
+  rect changed;
+  if (!swap_entry(context, undo_entries.back(), changed)) return {0, 0, 0, 0};
+  redo_entries.push_back(std::move(undo_entries.back()));
+  undo_entries.pop_back();
+
+  return changed;
+}
+
+rect UndoJournal::redo(Context &context)
+{
+  if (redo_entries.empty() || depth > 0) return {0, 0, 0, 0};
+
+  rect changed;
+  if (!swap_entry(context, redo_entries.back(), changed)) return {0, 0, 0, 0};
+  undo_entries.push_back(std::move(redo_entries.back()));
+  redo_entries.pop_back();
+  trim();
+
+  return changed;
+}
+
+void UndoJournal::clear()
+{
+  undo_entries.clear();
+  redo_entries.clear();
+  memory_used = 0;
+}
+
+void UndoJournal::set_memory_budget(size_t budget)
+{
+  memory_budget = budget;
+  trim();
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include "pixor.h"
+#include "tiled_bitmap.h"
+
+namespace Pixor {
+
+class Context;
+
+const size_t DEFAULT_UNDO_BUDGET = 64 * 1024 * 1024;
+
+// Records the tiles touched by each drawing operation instead of whole
+// bitmaps. The first write to a tile inside an entry saves the tile's
+// previous contents, compressed, so undo and redo only cost as much as the
+// area that actually changed.
+class UndoJournal {
+  struct TileDelta {
+    rect area;
+    std::vector<byte> data;
+  };
+
+  struct Entry {
+    std::vector<TileDelta> deltas;
+    size_t byte_size = 0;
+    // A tile could not be saved, the entry cannot be undone.
+    bool incomplete = false;
+  };
+
+  std::deque<Entry> undo_entries;
+  std::vector<Entry> redo_entries;
+  Entry pending;
+  std::vector<bool> touched_tiles;
+  int tiles_x = 0;
+  int depth = 0;
+  bool replaying = false;
+  size_t memory_budget;
+  size_t memory_used = 0;
+
+  // Both return false if zlib fails, pack() leaves data untouched then.
+  static bool pack(const RGBA *pixels, size_t count, std::vector<byte> &data);
+  static bool unpack(const std::vector<byte> &data, RGBA *pixels, size_t count);
+  void record_tile(const Context &context, point coord);
+  void drop_entry(Entry &entry) {memory_used -= entry.byte_size;}
+  void trim();
+  bool swap_entry(Context &context, Entry &entry, rect &changed);
+
+public:
+  UndoJournal(size_t memory_budget = DEFAULT_UNDO_BUDGET) : memory_budget(memory_budget) {}
+
+  void begin_entry();
+  // An entry with a tile that could not be saved is not recorded, and the
+  // history before it is cleared since it no longer leads back to the
+  // current image.
+  void end_entry();
+  bool entry_open() const {return depth > 0;}
+
+  void record_write(const Context &context, point coord)
+  {
+    if (depth == 0 || replaying) return;
+
+    size_t index = (size_t) (coord.y / TILE_SIZE) * tiles_x + coord.x / TILE_SIZE;
+    if (index < touched_tiles.size() && touched_tiles[index]) return;
+    record_tile(context, coord);
+  }
+
+  void record_rect(const Context &context, rect area);
+  // Both return the area that changed. When the current contents cannot be
+  // saved for the way back, the context is left as it is.
+  rect undo(Context &context);
+  rect redo(Context &context);
+  bool can_undo() const {return !undo_entries.empty();}
+  bool can_redo() const {return !redo_entries.empty();}
+  void clear();
+  void set_memory_budget(size_t budget);
+  size_t get_memory_budget() const {return memory_budget;}
+  size_t get_memory_used() const {return memory_used;}
+};
+
+// Opens a journal entry for the lifetime of the scope. Scopes nest, so a
+// stroke that spans many drawing calls still ends up as a single entry.
+class JournalScope {
+  std::shared_ptr<UndoJournal> journal;
+
+public:
+  JournalScope(std::shared_ptr<UndoJournal> journal) : journal(journal)
+  {
+    if (journal) journal->begin_entry();
+  }
+
+  ~JournalScope()
+  {
+    if (journal) journal->end_entry();
+  }
+};
+
+}
@@ -0,0 +1,50 @@
+#include <cstring>
+#include <stdio.h>
+#include "test.h"
+
+int PixorTest::failures = 0;
+
+struct Suite {
+  const char *name;
+  void (*run)();
+};
+
+static const Suite SUITES[] = {
+  {"graph", PixorTest::test_graph},
+  {"strip", PixorTest::test_strip},
+  {"hough", PixorTest::test_hough},
+  {"distance", PixorTest::test_distance},
+  {"labeling", PixorTest::test_labeling},
+  {"image_io", PixorTest::test_image_io},
+  {"corners", PixorTest::test_corners},
+  {"qoi", PixorTest::test_qoi},
+  {"pnm", PixorTest::test_pnm},
+  {"apng", PixorTest::test_apng},
+  {"flood_fill", PixorTest::test_flood_fill},
+  {"undo", PixorTest::test_undo},
+};
+
+// pixor-tests [suite], without a suite every one runs.
+int main(int argc, char *argv[])
+{
+  bool found = false;
+  for (auto &suite : SUITES) {
+    if (argc > 1 && strcmp(argv[1], suite.name)) continue;
+    found = true;
+    printf("%s\n", suite.name);
+    suite.run();
+  }
+
+  if (!found) {
+    fprintf(stderr, "usage: %s [suite], one of:", argv[0]);
+    for (auto &suite : SUITES) fprintf(stderr, " %s", suite.name);
+    fprintf(stderr, "\n");
+    return 2;
+  }
+  if (PixorTest::failures) {
+    fprintf(stderr, "%d checks failed\n", PixorTest::failures);
+    return 1;
+  }
+
+  return 0;
+}
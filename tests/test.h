@@ -0,0 +1,31 @@
+#pragma once
+#include <stdio.h>
+
+namespace PixorTest {
+
+// Failed checks so far, main() turns them into the exit status.
+extern int failures;
+
+void test_graph();
+void test_strip();
+void test_hough();
+void test_distance();
+void test_labeling();
+void test_image_io();
+void test_corners();
+void test_qoi();
+void test_pnm();
+void test_apng();
+void test_flood_fill();
+void test_undo();
+
+}
+
+// Reports a failed condition and carries on, so one run shows every
+// mismatch.
+#define PIXOR_CHECK(condition) do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      PixorTest::failures++; \
+    } \
+  } while (0)
@@ -0,0 +1,150 @@
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include "test.h"
+#include "apng.h"
+#include "png.h"
+
+using namespace Pixor;
+
+struct TestFrame {
+  rect area;
+  ApngDisposeOp dispose_op;
+  ApngBlendOp blend_op;
+  std::vector<byte> pixels;
+};
+
+// Over with straight alpha, in floating point.
+static void blend(const byte *src, byte *dest)
+{
+  double sa = src[3] / 255.0;
+  double da = dest[3] / 255.0;
+  double out = sa + da * (1 - sa);
+  if (sa == 0) return;
+
+  for (int c = 0; c < 3; c++) {
+    dest[c] = (byte) std::lround((src[c] * sa + dest[c] * da * (1 - sa)) / out);
+  }
+  dest[3] = (byte) std::lround(out * 255);
+}
+
+// The canvas after every frame, following the APNG specification on a
+// flat bitmap.
+static std::vector<std::vector<byte>> reference_canvases(int width, int height, const std::vector<TestFrame> &frames)
+{
+  std::vector<std::vector<byte>> res;
+  std::vector<byte> canvas((size_t) width * height * 4, 0);
+  std::vector<byte> previous;
+
+  for (size_t i = 0; i < frames.size(); i++) {
+    const TestFrame &frame = frames[i];
+    ApngDisposeOp dispose_op = frame.dispose_op;
+    if (i == 0 && dispose_op == APNG_DISPOSE_PREVIOUS) dispose_op = APNG_DISPOSE_BACKGROUND;
+    previous = canvas;
+
+    for (int y = 0; y < frame.area.height; y++) {
+      for (int x = 0; x < frame.area.width; x++) {
+        const byte *src = &frame.pixels[((size_t) y * frame.area.width + x) * 4];
+        byte *dest = &canvas[((size_t) (frame.area.y + y) * width + frame.area.x + x) * 4];
+        if (frame.blend_op == APNG_BLEND_SOURCE) memcpy(dest, src, 4);
+        else blend(src, dest);
+      }
+    }
+    res.push_back(canvas);
+
+    if (dispose_op == APNG_DISPOSE_PREVIOUS) {
+      canvas = previous;
+    } else if (dispose_op == APNG_DISPOSE_BACKGROUND) {
+      for (int y = frame.area.y; y < frame.area.y + frame.area.height; y++) {
+        memset(&canvas[((size_t) y * width + frame.area.x) * 4], 0, (size_t) frame.area.width * 4);
+      }
+    }
+  }
+
+  return res;
+}
+
+static bool near(const std::vector<byte> &a, const byte *b)
+{
+  for (size_t i = 0; i < a.size(); i++) {
+    if (std::abs(a[i] - b[i]) > 1) return false;
+  }
+  return true;
+}
+
+// Every dispose op with every blend op, on frames of random areas with
+// opaque, clear and translucent pixels.
+static void test_dispose_and_blend()
+{
+  unsigned int state = 29;
+  auto next = [&state](int range) {
+    state = state * 1103515245 + 12345;
+    return (int) ((state >> 16) % range);
+  };
+  ApngDisposeOp dispose_ops[] = {APNG_DISPOSE_NONE, APNG_DISPOSE_BACKGROUND, APNG_DISPOSE_PREVIOUS};
+  ApngBlendOp blend_ops[] = {APNG_BLEND_SOURCE, APNG_BLEND_OVER};
+
+  for (int trial = 0; trial < 12; trial++) {
+    int width = 20 + next(130);
+    int height = 20 + next(100);
+    std::vector<TestFrame> frames;
+
+    // The first frame covers the image and is its default image.
+    for (int i = 0; i < 7 + next(6); i++) {
+      TestFrame frame;
+      if (i == 0) {
+        frame.area = {0, 0, width, height};
+      } else {
+        frame.area.width = 1 + next(width);
+        frame.area.height = 1 + next(height);
+        frame.area.x = next(width - frame.area.width + 1);
+        frame.area.y = next(height - frame.area.height + 1);
+      }
+      // The first six frames go through the combinations in turn.
+      int op = i < 6 ? (i + trial) % 6 : next(6);
+      frame.dispose_op = dispose_ops[op / 2];
+      frame.blend_op = blend_ops[op % 2];
+
+      frame.pixels.resize((size_t) frame.area.width * frame.area.height * 4);
+      byte base[4] = {(byte) next(256), (byte) next(256), (byte) next(256), 0};
+      for (size_t p = 0; p < frame.pixels.size() / 4; p++) {
+        for (int c = 0; c < 3; c++) frame.pixels[p * 4 + c] = base[c] + next(40);
+        int alpha = next(4);
+        frame.pixels[p * 4 + 3] = alpha == 0 ? 0 : alpha == 1 ? 255 : next(256);
+      }
+      frames.push_back(frame);
+    }
+
+    PngImage image;
+    image.set_header(new PngHeader(width, height, PNG_TYPE_TRUECOLOUR_ALPHA));
+    for (auto &frame : frames) {
+      image.add_frame(new PngFrameControl(frame.area.width, frame.area.height, frame.area.x, frame.area.y,
+        1, 10, frame.dispose_op, frame.blend_op), frame.pixels.data());
+    }
+    std::ostringstream out;
+    out << image;
+
+    std::istringstream in(out.str());
+    std::unique_ptr<PngImage> decoded(decode_png(in));
+    PIXOR_CHECK(decoded->get_frame_count() == (int) frames.size());
+    for (int i = 0; i < decoded->get_frame_count(); i++) {
+      auto &control = *decoded->get_frame(i).control;
+      PIXOR_CHECK(control.get_dispose_op() == frames[i].dispose_op && control.get_blend_op() == frames[i].blend_op);
+    }
+
+    auto expected = reference_canvases(width, height, frames);
+    std::vector<byte> canvas((size_t) width * height * 4);
+    int frame_count = 0;
+    process_apng_frames(*decoded, [&](int index, const Context &context) {
+      context.read_rect(context.get_bounds(), (RGBA *) canvas.data());
+      PIXOR_CHECK(index == frame_count++);
+      PIXOR_CHECK(near(expected[index], canvas.data()));
+    });
+    PIXOR_CHECK(frame_count == (int) frames.size());
+  }
+}
+
+void PixorTest::test_apng()
+{
+  test_dispose_and_blend();
+}
@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <cmath>
+#include "test.h"
+#include "corners.h"
+#include "thread_pool.h"
+
+using namespace Pixor;
+
+// Blocks on a gradient with some noise, so there are corners of both signs.
+static Matrix<double> test_image(int width, int height, unsigned int seed)
+{
+  Matrix<double> m(width, height);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      seed = seed * 1103515245 + 12345;
+      double block = ((x / 23 + y / 17) % 3) * 70;
+      m.data()[(size_t) y * width + x] = block + x * 0.3 + (seed >> 16) % 9;
+    }
+  }
+  return m;
+}
+
+// The structure tensor of every pixel summed over the whole 2D window, with
+// the edges extended as in Graph::convolve_separable().
+static std::vector<double> reference_response(Matrix<double> &ix, Matrix<double> &iy, const CornerOptions &options)
+{
+  int width = ix.get_width();
+  int height = ix.get_height();
+  int size = options.window_size;
+  std::vector<double> window(size);
+  double sum = 0;
+  for (int i = 0; i < size; i++) {
+    double x = i - size / 2;
+    window[i] = std::exp(-x * x / (2 * options.window_sigma * options.window_sigma));
+    sum += window[i];
+  }
+  for (double &value : window) value /= sum;
+
+  std::vector<double> res((size_t) width * height);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      double xx = 0, yy = 0, xy = 0;
+      for (int j = 0; j < size; j++) {
+        for (int i = 0; i < size; i++) {
+          int sx = std::clamp(x + i - size / 2, 0, width - 1);
+          int sy = std::clamp(y + j - size / 2, 0, height - 1);
+          double gx = ix.data()[(size_t) sy * width + sx];
+          double gy = iy.data()[(size_t) sy * width + sx];
+          double w = window[i] * window[j];
+          xx += w * gx * gx;
+          yy += w * gy * gy;
+          xy += w * gx * gy;
+        }
+      }
+
+      double value;
+      if (options.method == CORNER_SHI_TOMASI) {
+        // The smaller root of the characteristic polynomial.
+        double trace = xx + yy;
+        double det = xx * yy - xy * xy;
+        value = trace / 2 - std::sqrt(std::max(0.0, trace * trace / 4 - det));
+      } else {
+        value = xx * yy - xy * xy - options.harris_k * (xx + yy) * (xx + yy);
+      }
+      res[(size_t) y * width + x] = value;
+    }
+  }
+
+  return res;
+}
+
+static void test_response()
+{
+  CornerMethod methods[] = {CORNER_HARRIS, CORNER_SHI_TOMASI};
+  int sizes[][2] = {{120, 90}, {33, 200}, {7, 5}};
+
+  for (int threads : {1, 4}) {
+    ThreadPool::shared().set_concurrency(threads);
+    for (auto &size : sizes) {
+      for (CornerMethod method : methods) {
+        CornerOptions options;
+        options.method = method;
+        options.window_size = method == CORNER_HARRIS ? 5 : 7;
+        options.window_sigma = method == CORNER_HARRIS ? 1 : 1.5;
+
+        auto m = test_image(size[0], size[1], size[0] + method);
+        Graph graph;
+        auto gradients = sobel_graph(graph, graph.input(m), CannyOptions());
+        auto outputs = graph.run(std::vector<GraphNode> {gradients.ix, gradients.iy, corner_graph(graph, gradients, options)});
+        auto expected = reference_response(outputs[0], outputs[1], options);
+
+        // The sums are taken in another order, so only nearly equal.
+        double scale = 0;
+        for (double value : expected) scale = std::max(scale, std::abs(value));
+        double error = 0;
+        for (size_t i = 0; i < expected.size(); i++) {
+          error = std::max(error, std::abs(outputs[2].data()[i] - expected[i]));
+        }
+        PIXOR_CHECK(scale > 0);
+        PIXOR_CHECK(error <= scale * 1e-12);
+      }
+    }
+  }
+}
+
+// Every candidate against every accepted corner.
+static std::vector<Corner> reference_corners(Matrix<double> &response, const CornerOptions &options)
+{
+  int width = response.get_width();
+  int height = response.get_height();
+  const double *data = response.data();
+  std::vector<Corner> candidates;
+  double max = 0;
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      double value = data[(size_t) y * width + x];
+      if (value <= 0) continue;
+      max = std::max(max, value);
+
+      bool peak = true;
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          int nx = x + dx, ny = y + dy;
+          if ((!dx && !dy) || nx < 0 || ny < 0 || nx >= width || ny >= height) continue;
+          double other = data[(size_t) ny * width + nx];
+          if (other > value || (other == value && (dy < 0 || (dy == 0 && dx < 0)))) peak = false;
+        }
+      }
+      if (peak) candidates.push_back({{x, y}, value});
+    }
+  }
+
+  std::vector<Corner> sorted;
+  for (auto &corner : candidates) {
+    if (corner.response >= max * options.quality_ratio) sorted.push_back(corner);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(), [](const Corner &a, const Corner &b) {
+    return a.response > b.response;
+  });
+
+  std::vector<Corner> res;
+  for (auto &corner : sorted) {
+    bool suppressed = false;
+    for (auto &accepted : res) {
+      int dx = accepted.position.x - corner.position.x;
+      int dy = accepted.position.y - corner.position.y;
+      if (dx * dx + dy * dy < options.min_distance * options.min_distance) suppressed = true;
+    }
+    if (suppressed) continue;
+
+    res.push_back(corner);
+    if (options.max_corners > 0 && (int) res.size() == options.max_corners) break;
+  }
+
+  return res;
+}
+
+static bool same_corners(const std::vector<Corner> &a, const std::vector<Corner> &b)
+{
+  return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const Corner &p, const Corner &q) {
+    return p.position.x == q.position.x && p.position.y == q.position.y && p.response == q.response;
+  });
+}
+
+static void test_selection()
+{
+  unsigned int state = 5;
+  auto next = [&state](int range) {
+    state = state * 1103515245 + 12345;
+    return (int) ((state >> 16) % range);
+  };
+
+  for (int trial = 0; trial < 150; trial++) {
+    ThreadPool::shared().set_concurrency(trial % 2 ? 4 : 1);
+    int width = 1 + next(80);
+    int height = 1 + next(80);
+    // Few distinct values, so there are plateaus and ties to break.
+    int levels = 2 + next(20);
+    Matrix<double> response(width, height);
+    for (int i = 0; i < width * height; i++) {
+      response.data()[i] = next(levels) - levels / 4;
+    }
+
+    CornerOptions options;
+    options.min_distance = next(15);
+    options.quality_ratio = next(4) * 0.2;
+    options.max_corners = trial % 3 ? 0 : 1 + next(20);
+
+    auto corners = select_corners(response, options);
+    PIXOR_CHECK(same_corners(corners, reference_corners(response, options)));
+
+    // A limit keeps the strongest of the unlimited selection.
+    if (options.max_corners) {
+      CornerOptions unlimited = options;
+      unlimited.max_corners = 0;
+      auto all = select_corners(response, unlimited);
+      size_t expected = std::min(all.size(), (size_t) options.max_corners);
+      PIXOR_CHECK(corners.size() == expected);
+      PIXOR_CHECK(same_corners(corners, std::vector<Corner>(all.begin(), all.begin() + expected)));
+    }
+
+    for (size_t i = 0; i < corners.size(); i++) {
+      for (size_t j = 0; j < i; j++) {
+        int dx = corners[i].position.x - corners[j].position.x;
+        int dy = corners[i].position.y - corners[j].position.y;
+        PIXOR_CHECK(dx * dx + dy * dy >= options.min_distance * options.min_distance);
+      }
+    }
+  }
+}
+
+void PixorTest::test_corners()
+{
+  test_response();
+  test_selection();
+}
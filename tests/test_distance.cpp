@@ -0,0 +1,63 @@
+#include <cmath>
+#include "test.h"
+#include "distance.h"
+#include "thread_pool.h"
+
+using namespace Pixor;
+
+// The square root of an integer squared distance, which hypot() can miss
+// by an ulp.
+static double distance(int dx, int dy)
+{
+  return std::sqrt((double) (dx * dx + dy * dy));
+}
+
+// Every pixel against every edge.
+static void test_brute_force()
+{
+  unsigned int state = 3;
+  auto next = [&state](int range) {
+    state = state * 1103515245 + 12345;
+    return (int) ((state >> 16) % range);
+  };
+
+  for (int trial = 0; trial < 60; trial++) {
+    int width = 1 + next(70);
+    int height = 1 + next(70);
+    // Edges per 10000 pixels, none at all in the first image.
+    int density = trial ? next(200) : 0;
+
+    Matrix<double> edges(width, height);
+    for (int i = 0; i < width * height; i++) {
+      if (next(10000) < density) edges.data()[i] = 255;
+    }
+
+    Matrix<int> nearest(1, 1);
+    auto distances = distance_transform(edges, &nearest);
+    auto without_nearest = distance_transform(edges);
+
+    int mismatches = 0;
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        double best = INFINITY;
+        for (int i = 0; i < width * height; i++) {
+          if (edges.data()[i] > 0) best = std::min(best, distance(i % width - x, i / width - y));
+        }
+
+        int n = nearest[y][x];
+        double to_nearest = n < 0 ? INFINITY : distance(n % width - x, n / width - y);
+        if (distances[y][x] != best || without_nearest[y][x] != best || to_nearest != best) mismatches++;
+        if (n >= 0 && !(edges.data()[n] > 0)) mismatches++;
+      }
+    }
+    PIXOR_CHECK(mismatches == 0);
+  }
+}
+
+void PixorTest::test_distance()
+{
+  for (int threads : {1, 4}) {
+    ThreadPool::shared().set_concurrency(threads);
+    test_brute_force();
+  }
+}
@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include "test.h"
+#include "flood_fill.h"
+
+using namespace Pixor;
+
+static bool within(RGBA a, RGBA b, int tolerance)
+{
+  for (int shift = 0; shift < 32; shift += 8) {
+    if (std::abs((int) ((a >> shift) & 0xff) - (int) ((b >> shift) & 0xff)) > tolerance) return false;
+  }
+  return true;
+}
+
+// Breadth-first from the seed over the original pixels. Returns the
+// bounding box of the reached pixels.
+static rect reference_fill(std::vector<RGBA> &pixels, int width, int height, point seed, RGBA color, int tolerance,
+  FillConnectivity connectivity)
+{
+  RGBA target = pixels[(size_t) seed.y * width + seed.x];
+  std::vector<bool> reached((size_t) width * height);
+  std::deque<point> queue{seed};
+  int min_x = width, min_y = height, max_x = -1, max_y = -1;
+  reached[(size_t) seed.y * width + seed.x] = true;
+
+  while (!queue.empty()) {
+    point p = queue.front();
+    queue.pop_front();
+    min_x = std::min(min_x, p.x);
+    max_x = std::max(max_x, p.x);
+    min_y = std::min(min_y, p.y);
+    max_y = std::max(max_y, p.y);
+
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        if ((!dx && !dy) || (connectivity == FILL_CONNECTIVITY_4 && dx && dy)) continue;
+        int x = p.x + dx;
+        int y = p.y + dy;
+        if (x < 0 || y < 0 || x >= width || y >= height) continue;
+
+        size_t index = (size_t) y * width + x;
+        if (reached[index] || !within(pixels[index], target, tolerance)) continue;
+        reached[index] = true;
+        queue.push_back({x, y});
+      }
+    }
+  }
+
+  for (size_t i = 0; i < pixels.size(); i++) {
+    if (reached[i]) pixels[i] = color;
+  }
+
+  return {min_x, min_y, max_x - min_x + 1, max_y - min_y + 1};
+}
+
+// Blobs of a few colours with some noise, so the tolerance decides how far
+// a fill gets, and thin diagonal lines only 8-connectivity crosses.
+static void test_against_bfs()
+{
+  unsigned int state = 31;
+  auto next = [&state](int range) {
+    state = state * 1103515245 + 12345;
+    return (int) ((state >> 16) % range);
+  };
+
+  for (int trial = 0; trial < 300; trial++) {
+    int width = 1 + next(90);
+    int height = 1 + next(90);
+    int noise = 1 + next(12);
+    RGBA palette[3];
+    for (RGBA &colour : palette) colour = rgba(next(256), next(256), next(256), 255);
+
+    std::vector<RGBA> pixels((size_t) width * height);
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        int kind = ((x / 9 + y / 7) % 2) + ((x + y) % 11 == 0 || (x - y) % 13 == 0 ? 1 : 0);
+        RGBA colour = palette[kind];
+        int shift = 8 * next(3);
+        int value = std::clamp((int) ((colour >> shift) & 0xff) + next(2 * noise + 1) - noise, 0, 255);
+        pixels[(size_t) y * width + x] = (colour & ~(0xffu << shift)) | ((RGBA) value << shift);
+      }
+    }
+
+    point seed = {next(width), next(height)};
+    int tolerance = trial % 4 == 0 ? 0 : next(2 * noise + 40);
+    FillConnectivity connectivity = trial % 2 ? FILL_CONNECTIVITY_4 : FILL_CONNECTIVITY_8;
+    // Sometimes the fill colour itself is within the tolerance.
+    RGBA target = pixels[(size_t) seed.y * width + seed.x];
+    RGBA color = trial % 3 == 0 ? target : rgba(next(256), next(256), next(256), 255);
+
+    Context context(width, height, trial % 5 == 0 ? CONTEXT_STORAGE_TILED : CONTEXT_STORAGE_FLAT);
+    context.write_rect(context.get_bounds(), pixels.data());
+    rect area = flood_fill(context, seed, color, tolerance, connectivity);
+
+    rect expected = reference_fill(pixels, width, height, seed, color, tolerance, connectivity);
+    // Filling a colour with itself changes nothing.
+    if (color == target && tolerance == 0) expected = {0, 0, 0, 0};
+
+    std::vector<RGBA> filled((size_t) width * height);
+    context.read_rect(context.get_bounds(), filled.data());
+    PIXOR_CHECK(filled == pixels);
+    PIXOR_CHECK(area.x == expected.x && area.y == expected.y && area.width == expected.width && area.height == expected.height);
+  }
+}
+
+void PixorTest::test_flood_fill()
+{
+  test_against_bfs();
+}
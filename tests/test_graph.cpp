@@ -0,0 +1,86 @@
+#include <algorithm>
+#include "test.h"
+#include "canny.h"
+#include "graph.h"
+#include "thread_pool.h"
+
+using namespace Pixor;
+
+// Blocks, a ramp and noise, so every direction of the suppression and both
+// thresholds are hit.
+static Matrix<double> test_image(int width, int height)
+{
+  Matrix<double> m(width, height);
+  unsigned int state = 1;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      m[y][x] = ((x / 37 + y / 23) % 2) * 180 + (state & 31) + x * 0.1;
+    }
+  }
+
+  return m;
+}
+
+// The detector as it was before it became a graph, one full-size stage
+// after the other.
+static Matrix<double> stage_chain(Matrix<double> &m, const CannyOptions &options)
+{
+  auto blurred = m.convolve(gaussian_kernel(options.kernel_size, options.sigma));
+  Matrix<double> theta(1, 1);
+  auto magnitude = sobel_filter(blurred, theta);
+  auto suppressed = non_max_suppression(magnitude, theta);
+  auto thresholded = threshold(suppressed, options.low_threshold_ratio, options.high_threshold_ratio);
+  return hysteresis(thresholded);
+}
+
+static void test_graph_matches_stages()
+{
+  struct Case {
+    int width;
+    int height;
+    int kernel_size;
+  } cases[] = {{517, 389, 5}, {64, 40, 3}, {200, 301, 7}};
+
+  for (auto &c : cases) {
+    auto m = test_image(c.width, c.height);
+    CannyOptions options;
+    options.kernel_size = c.kernel_size;
+
+    auto expected = stage_chain(m, options);
+    Graph graph;
+    auto edges = graph.run(canny_graph(graph, graph.input(m), options));
+
+    PIXOR_CHECK(std::equal(expected.data(), expected.data() + (size_t) c.width * c.height, edges.data()));
+  }
+}
+
+// Values shared by several outputs are computed once, the outputs have to
+// come out as they do on their own.
+static void test_multiple_outputs()
+{
+  auto m = test_image(300, 200);
+  Graph graph;
+  auto gradients = sobel_graph(graph, graph.input(m));
+  auto edges = canny_graph(graph, gradients);
+  auto results = graph.run(std::vector<GraphNode>{gradients.ix, edges});
+
+  Graph ix_graph;
+  auto ix = ix_graph.run(sobel_graph(ix_graph, ix_graph.input(m)).ix);
+  auto alone = canny_edge_detector(m);
+
+  PIXOR_CHECK(results.size() == 2);
+  if (results.size() != 2) return;
+  PIXOR_CHECK(std::equal(ix.data(), ix.data() + 300 * 200, results[0].data()));
+  PIXOR_CHECK(std::equal(alone.data(), alone.data() + 300 * 200, results[1].data()));
+}
+
+void PixorTest::test_graph()
+{
+  // More threads than cores still splits the images into several bands.
+  ThreadPool::shared().set_concurrency(4);
+  test_graph_matches_stages();
+  test_multiple_outputs();
+}
@@ -0,0 +1,131 @@
+#include <cmath>
+#include <cstdlib>
+#include "test.h"
+#include "hough.h"
+#include "thread_pool.h"
+
+using namespace Pixor;
+
+static const int WIDTH = 400;
+static const int HEIGHT = 300;
+
+static void set(Matrix<double> &edges, int x, int y)
+{
+  if (x >= 0 && y >= 0 && x < WIDTH && y < HEIGHT) edges[y][x] = 255;
+}
+
+static void draw_circle(Matrix<double> &edges, int cx, int cy, int radius)
+{
+  for (int a = 0; a < 2000; a++) {
+    set(edges, cx + (int) std::lround(radius * cos(a * M_PI / 1000)), cy + (int) std::lround(radius * sin(a * M_PI / 1000)));
+  }
+}
+
+// Two lines through the whole image, a diagonal segment, two circles and
+// scattered noise.
+static Matrix<double> test_edges()
+{
+  Matrix<double> edges(WIDTH, HEIGHT);
+  for (int x = 0; x < WIDTH; x++) set(edges, x, 100);
+  for (int y = 0; y < HEIGHT; y++) set(edges, 250, y);
+  for (int t = 20; t < 180; t++) set(edges, t, t + 10);
+  draw_circle(edges, 100, 200, 30);
+  draw_circle(edges, 320, 220, 20);
+
+  unsigned int state = 12345;
+  for (int i = 0; i < 300; i++) {
+    state = state * 1103515245 + 12345;
+    set(edges, (state >> 8) % WIDTH, (state >> 20) % HEIGHT);
+  }
+
+  return edges;
+}
+
+static bool near(point a, int x, int y)
+{
+  return abs(a.x - x) <= 1 && abs(a.y - y) <= 1;
+}
+
+static bool matches(const LineSegment &segment, int x1, int y1, int x2, int y2)
+{
+  return (near(segment.p1, x1, y1) && near(segment.p2, x2, y2)) || (near(segment.p1, x2, y2) && near(segment.p2, x1, y1));
+}
+
+static void test_lines(Matrix<double> &edges)
+{
+  HoughLineOptions options;
+  options.threshold = 150;
+  auto lines = hough_lines(edges, options);
+
+  PIXOR_CHECK(lines.size() == 3);
+  if (lines.size() != 3) return;
+  PIXOR_CHECK(fabs(lines[0].rho - 100) <= 1 && fabs(lines[0].theta - M_PI / 2) < 0.02 && lines[0].votes == WIDTH);
+  PIXOR_CHECK(fabs(lines[1].rho - 250) <= 1 && fabs(lines[1].theta) < 0.02 && lines[1].votes == HEIGHT);
+  PIXOR_CHECK(fabs(lines[2].theta - 3 * M_PI / 4) < 0.02);
+
+  LineSegment clipped;
+  PIXOR_CHECK(clip_line(lines[0], WIDTH, HEIGHT, clipped) && matches(clipped, 0, 100, WIDTH - 1, 100));
+}
+
+static void test_segments(Matrix<double> &edges)
+{
+  auto segments = hough_line_segments(edges);
+
+  PIXOR_CHECK(segments.size() == 3);
+  int found = 0;
+  for (auto &segment : segments) {
+    found += matches(segment, 0, 100, WIDTH - 1, 100);
+    found += matches(segment, 250, 0, 250, HEIGHT - 1);
+    found += matches(segment, 20, 30, 179, 189);
+  }
+  PIXOR_CHECK(found == 3);
+}
+
+// The quantized angle of a shallow diagonal drifts off it, the walk has to
+// follow the pixels to return it whole.
+static void test_segment_drift()
+{
+  Matrix<double> edges(200, 120);
+  for (int x = 0; x < 200; x++) edges[10 + x / 2][x] = 255;
+  for (int y = 0; y < 120; y++) edges[y][100] = 255;
+
+  for (unsigned int seed = 1; seed <= 5; seed++) {
+    HoughSegmentOptions options;
+    options.seed = seed;
+    auto segments = hough_line_segments(edges, options);
+
+    PIXOR_CHECK(segments.size() == 2);
+    int found = 0;
+    for (auto &segment : segments) {
+      found += matches(segment, 0, 10, 199, 109);
+      found += matches(segment, 100, 0, 100, 119);
+    }
+    PIXOR_CHECK(found == 2);
+  }
+}
+
+static void test_circles(Matrix<double> &edges)
+{
+  HoughCircleOptions options;
+  options.min_radius = 10;
+  options.max_radius = 40;
+  auto circles = hough_circles(edges, options);
+
+  PIXOR_CHECK(circles.size() == 2);
+  if (circles.size() != 2) return;
+  PIXOR_CHECK(near(circles[0].centre, 100, 200) && abs(circles[0].radius - 30) <= 1);
+  PIXOR_CHECK(near(circles[1].centre, 320, 220) && abs(circles[1].radius - 20) <= 1);
+  PIXOR_CHECK(circles[1].coverage > 0.9);
+}
+
+void PixorTest::test_hough()
+{
+  auto edges = test_edges();
+  for (int threads : {1, 4}) {
+    ThreadPool::shared().set_concurrency(threads);
+    test_lines(edges);
+    test_segments(edges);
+    test_circles(edges);
+  }
+  test_segment_drift();
+}
@@ -0,0 +1,77 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "test.h"
+#include "image_io.h"
+#include "png.h"
+
+using namespace Pixor;
+
+static std::string test_png(int width, int height)
+{
+  std::vector<byte> pixels((size_t) width * height * 3);
+  for (size_t i = 0; i < pixels.size(); i++) pixels[i] = (byte) (i * 7 + i / 13);
+
+  PngImage image;
+  image.set_header(new PngHeader(width, height, PNG_TYPE_TRUECOLOUR));
+  image.set_bitmap(pixels.data());
+  std::ostringstream out;
+  out << image;
+  return out.str();
+}
+
+static bool decode_throws(const std::string &data)
+{
+  std::istringstream in(data);
+  try {
+    decode_image(in);
+  } catch (const std::invalid_argument &) {
+    return true;
+  }
+  return false;
+}
+
+static void test_rejects_broken_png()
+{
+  std::string data = test_png(40, 30);
+  std::istringstream in(data);
+  auto image = decode_image(in);
+  PIXOR_CHECK(image && image->get_width() == 40 && image->get_height() == 30);
+
+  PIXOR_CHECK(decode_throws(data.substr(0, data.size() - 20)));
+  PIXOR_CHECK(decode_throws(data.substr(0, 8)));
+  PIXOR_CHECK(decode_throws(data.substr(0, 8) + data.substr(33)));
+
+  std::string corrupt = data;
+  corrupt[40] ^= 0x10;
+  PIXOR_CHECK(decode_throws(corrupt));
+
+  // Through a file, the way the application opens them.
+  const char *path = "pixor-test-truncated.png";
+  {
+    std::ofstream file(path, std::ios::out|std::ios::binary);
+    file << data.substr(0, data.size() - 20);
+  }
+  bool thrown = false;
+  try {
+    open_image(path);
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  PIXOR_CHECK(thrown);
+  remove(path);
+
+  thrown = false;
+  try {
+    load_greyscale(nullptr);
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  PIXOR_CHECK(thrown);
+}
+
+void PixorTest::test_image_io()
+{
+  test_rejects_broken_png();
+}
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <deque>
+#include "test.h"
+#include "labeling.h"
+#include "thread_pool.h"
+
+using namespace Pixor;
+
+// Breadth-first flood from every unlabelled pixel in raster order, which
+// numbers the components the way label_components() promises.
+static std::vector<int> reference_labels(Matrix<double> &mask, const LabelOptions &options, int &count)
+{
+  int width = mask.get_width();
+  int height = mask.get_height();
+  const double *data = mask.data();
+  std::vector<int> labels((size_t) width * height, 0);
+  count = 0;
+
+  for (int i = 0; i < width * height; i++) {
+    if (!(data[i] > 0) || labels[i]) continue;
+    labels[i] = ++count;
+    std::deque<int> queue{i};
+
+    while (!queue.empty()) {
+      int p = queue.front();
+      queue.pop_front();
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          if ((!dx && !dy) || (options.connectivity == FILL_CONNECTIVITY_4 && dx && dy)) continue;
+          int x = p % width + dx;
+          int y = p / width + dy;
+          if (x < 0 || y < 0 || x >= width || y >= height) continue;
+
+          int q = y * width + x;
+          if (labels[q] || !(data[q] > 0)) continue;
+          if (options.by_value && data[q] != data[p]) continue;
+          labels[q] = count;
+          queue.push_back(q);
+        }
+      }
+    }
+  }
+
+  return labels;
+}
+
+static void test_against_bfs()
+{
+  unsigned int state = 11;
+  auto next = [&state](int range) {
+    state = state * 1103515245 + 12345;
+    return (int) ((state >> 16) % range);
+  };
+
+  for (int trial = 0; trial < 200; trial++) {
+    int width = 1 + next(60);
+    int height = 1 + next(60);
+    int density = next(100);
+    LabelOptions options;
+    options.connectivity = trial % 2 ? FILL_CONNECTIVITY_4 : FILL_CONNECTIVITY_8;
+    options.by_value = trial % 3 == 0;
+
+    Matrix<double> mask(width, height);
+    for (int i = 0; i < width * height; i++) {
+      if (next(100) < density) mask.data()[i] = options.by_value ? 1 + next(3) : 255;
+    }
+
+    auto components = label_components(mask, options);
+    int count;
+    auto expected = reference_labels(mask, options, count);
+
+    PIXOR_CHECK((int) components.stats.size() == count);
+    PIXOR_CHECK(std::equal(expected.begin(), expected.end(), components.labels.data()));
+    if ((int) components.stats.size() != count) continue;
+
+    for (int label = 1; label <= count; label++) {
+      size_t area = 0;
+      int x0 = width, y0 = height, x1 = -1, y1 = -1;
+      double sum_x = 0, sum_y = 0;
+      for (int i = 0; i < width * height; i++) {
+        if (expected[i] != label) continue;
+        int x = i % width;
+        int y = i / width;
+        area++;
+        x0 = std::min(x0, x);
+        y0 = std::min(y0, y);
+        x1 = std::max(x1, x);
+        y1 = std::max(y1, y);
+        sum_x += x;
+        sum_y += y;
+      }
+
+      auto &stats = components.stats[label - 1];
+      PIXOR_CHECK(stats.area == area);
+      PIXOR_CHECK(stats.bounds.x == x0 && stats.bounds.y == y0 && stats.bounds.width == x1 - x0 + 1 && stats.bounds.height == y1 - y0 + 1);
+      PIXOR_CHECK(stats.centroid_x == sum_x / area && stats.centroid_y == sum_y / area);
+    }
+  }
+}
+
+void PixorTest::test_labeling()
+{
+  for (int threads : {1, 4}) {
+    ThreadPool::shared().set_concurrency(threads);
+    test_against_bfs();
+  }
+}
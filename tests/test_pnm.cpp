@@ -0,0 +1,111 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "test.h"
+#include "image_io.h"
+#include "pnm.h"
+
+using namespace Pixor;
+
+static std::string encode(int width, int height, int channels, const std::vector<byte> &pixels)
+{
+  PnmImage image(width, height, channels);
+  image.set_bitmap((byte *) pixels.data());
+  std::ostringstream out;
+  out << image;
+  return out.str();
+}
+
+// What get_image_bitmap_with_alpha() should give for the pixel.
+static void expand(const byte *pixel, int channels, byte *rgba)
+{
+  bool grey = channels < 3;
+  for (int c = 0; c < 3; c++) rgba[c] = pixel[grey ? 0 : c];
+  rgba[3] = channels == 2 || channels == 4 ? pixel[channels - 1] : 255;
+}
+
+static bool matches(PnmImage &image, int width, int height, int channels, const std::vector<byte> &pixels)
+{
+  if (image.get_width() != width || image.get_height() != height || image.get_channels() != channels) return false;
+  if (memcmp(image.get_pixels(), pixels.data(), pixels.size())) return false;
+
+  auto rgba = image.get_image_bitmap_with_alpha();
+  for (size_t i = 0; i < (size_t) width * height; i++) {
+    byte expected[4];
+    expand(&pixels[i * channels], channels, expected);
+    if (memcmp(expected, &rgba[i * 4], 4)) return false;
+  }
+
+  return true;
+}
+
+static void test_round_trip()
+{
+  unsigned int state = 23;
+  auto next = [&state](int range) {
+    state = state * 1103515245 + 12345;
+    return (int) ((state >> 16) % range);
+  };
+
+  const char *path = "pixor-test.pnm";
+  for (int trial = 0; trial < 40; trial++) {
+    int width = 1 + next(70);
+    int height = 1 + next(70);
+    int channels = 1 + trial % 4;
+    std::vector<byte> pixels((size_t) width * height * channels);
+    for (byte &value : pixels) value = next(256);
+
+    // P5 and P6 for grey and RGB, the rest only fits P7.
+    std::string data = encode(width, height, channels, pixels);
+    const char *magic = channels == 1 ? "P5" : channels == 3 ? "P6" : "P7";
+    PIXOR_CHECK(data.compare(0, 2, magic) == 0);
+
+    std::istringstream in(data);
+    std::unique_ptr<PnmImage> decoded(decode_pnm(in));
+    PIXOR_CHECK(matches(*decoded, width, height, channels, pixels));
+
+    {
+      std::ofstream file(path, std::ios::out|std::ios::binary);
+      file << data;
+    }
+    auto opened = std::dynamic_pointer_cast<PnmImage>(open_image(path));
+    PIXOR_CHECK(opened && matches(*opened, width, height, channels, pixels));
+  }
+  remove(path);
+}
+
+static bool decode_throws(const std::string &data)
+{
+  std::istringstream in(data);
+  try {
+    std::unique_ptr<PnmImage> image(decode_pnm(in));
+  } catch (const std::invalid_argument &) {
+    return true;
+  }
+  return false;
+}
+
+static void test_rejects()
+{
+  std::string pixels(4 * 3 * 4, 'x');
+  PIXOR_CHECK(!decode_throws("P6\n4 4\n255\n" + pixels));
+  PIXOR_CHECK(!decode_throws("P7\nWIDTH 4\nHEIGHT 3\nDEPTH 4\nMAXVAL 255\nENDHDR\n" + pixels));
+
+  PIXOR_CHECK(decode_throws("P6\n4 4\n255\n" + pixels.substr(1)));
+  PIXOR_CHECK(decode_throws("P6\n4 4\n"));
+  PIXOR_CHECK(decode_throws("P7\nWIDTH 4\nHEIGHT 3\nDEPTH 4\nMAXVAL 255\nENDHDR\n" + pixels.substr(1)));
+  PIXOR_CHECK(decode_throws("P7\nWIDTH 4\nHEIGHT 3\nDEPTH 4\nMAXVAL 255\n"));
+  PIXOR_CHECK(decode_throws("P7\nWIDTH 4\nHEIGHT 3\nDEPTH 5\nMAXVAL 255\nENDHDR\n" + pixels + pixels));
+  PIXOR_CHECK(decode_throws("P7\nWIDTH 4\nHEIGHT 3\nDEPTH 0\nMAXVAL 255\nENDHDR\n" + pixels));
+  PIXOR_CHECK(decode_throws("P6\n4 4\n65535\n" + pixels + pixels));
+  PIXOR_CHECK(decode_throws("P6\n0 4\n255\n"));
+  PIXOR_CHECK(decode_throws("P4\n4 4\n" + pixels));
+}
+
+void PixorTest::test_pnm()
+{
+  test_round_trip();
+  test_rejects();
+}
@@ -0,0 +1,178 @@
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include "test.h"
+#include "image_io.h"
+#include "qoi.h"
+
+using namespace Pixor;
+
+static std::string encode(int width, int height, int channels, const std::vector<byte> &pixels)
+{
+  QoiImage image(width, height, channels);
+  image.set_bitmap((byte *) pixels.data());
+  std::ostringstream out;
+  out << image;
+  return out.str();
+}
+
+static bool round_trips(int width, int height, int channels, const std::vector<byte> &pixels)
+{
+  std::istringstream in(encode(width, height, channels, pixels));
+  std::shared_ptr<Image> image = decode_image(in);
+  if (image->get_width() != width || image->get_height() != height) return false;
+
+  auto bitmap = image->get_image_bitmap();
+  auto with_alpha = image->get_image_bitmap_with_alpha();
+  for (size_t i = 0; i < (size_t) width * height; i++) {
+    for (int c = 0; c < 4; c++) {
+      byte expected = c < channels ? pixels[i * channels + c] : 255;
+      if (c < channels && bitmap[i * channels + c] != expected) return false;
+      if (with_alpha[i * 4 + c] != expected) return false;
+    }
+  }
+
+  return true;
+}
+
+// Images made of a single kind of chunk, each of known encoded size.
+static void test_chunks()
+{
+  const size_t overhead = 14 + 8;
+
+  // Opaque black is the pixel before the first, so all of it is runs of
+  // at most 62.
+  std::vector<byte> black(100 * 4, 0);
+  for (int i = 0; i < 100; i++) black[i * 4 + 3] = 255;
+  PIXOR_CHECK(encode(100, 1, 4, black).size() == overhead + 2);
+  PIXOR_CHECK(round_trips(100, 1, 4, black));
+  PIXOR_CHECK(round_trips(10, 10, 3, std::vector<byte>(300, 0)));
+
+  // Two far apart colours, written in full once and then from the index.
+  std::vector<byte> alternating;
+  for (int i = 0; i < 10; i++) {
+    byte a[] = {10, 200, 30}, b[] = {250, 5, 90};
+    alternating.insert(alternating.end(), i % 2 ? b : a, (i % 2 ? b : a) + 3);
+  }
+  PIXOR_CHECK(encode(10, 1, 3, alternating).size() == overhead + 2 * 4 + 8);
+  PIXOR_CHECK(round_trips(10, 1, 3, alternating));
+
+  // Steps of one are differences, steps of ten the luma chunk.
+  std::vector<byte> small_steps, large_steps;
+  for (int i = 0; i < 50; i++) small_steps.insert(small_steps.end(), 3, (byte) (i + 1));
+  for (int i = 0; i < 20; i++) large_steps.insert(large_steps.end(), 3, (byte) (10 * i + 10));
+  PIXOR_CHECK(encode(50, 1, 3, small_steps).size() == overhead + 50);
+  PIXOR_CHECK(encode(20, 1, 3, large_steps).size() == overhead + 20 * 2);
+  PIXOR_CHECK(round_trips(50, 1, 3, small_steps));
+  PIXOR_CHECK(round_trips(20, 1, 3, large_steps));
+
+  // A change of alpha needs the full RGBA chunk.
+  std::vector<byte> alpha;
+  for (int i = 0; i < 6; i++) alpha.insert(alpha.end(), {5, 5, 5, (byte) (i % 2 ? 100 : 200)});
+  PIXOR_CHECK(encode(6, 1, 4, alpha).size() == overhead + 2 * 5 + 4);
+  PIXOR_CHECK(round_trips(6, 1, 4, alpha));
+}
+
+// Noise, flat areas, gradients and repeated colours mixed in one image.
+static void test_mixed()
+{
+  unsigned int state = 17;
+  auto next = [&state](int range) {
+    state = state * 1103515245 + 12345;
+    return (int) ((state >> 16) % range);
+  };
+
+  for (int trial = 0; trial < 40; trial++) {
+    int width = 1 + next(90);
+    int height = 1 + next(90);
+    int channels = trial % 2 ? 3 : 4;
+    std::vector<byte> pixels((size_t) width * height * channels);
+    byte palette[4][4];
+    for (auto &colour : palette) {
+      for (byte &value : colour) value = next(256);
+    }
+
+    size_t i = 0;
+    while (i < (size_t) width * height) {
+      size_t length = std::min((size_t) width * height - i, (size_t) 1 + next(150));
+      int kind = next(4);
+      byte *colour = palette[next(4)];
+      for (size_t j = 0; j < length; j++, i++) {
+        for (int c = 0; c < channels; c++) {
+          byte value = colour[c];
+          if (kind == 1) value = next(256);
+          else if (kind == 2) value = colour[c] + j * (c + 1);
+          else if (kind == 3) value = palette[next(4)][c];
+          pixels[i * channels + c] = value;
+        }
+      }
+    }
+
+    PIXOR_CHECK(round_trips(width, height, channels, pixels));
+  }
+}
+
+static bool decode_throws(const std::string &data)
+{
+  std::istringstream in(data);
+  try {
+    decode_qoi(in);
+  } catch (const std::invalid_argument &) {
+    return true;
+  }
+  return false;
+}
+
+static void test_rejects()
+{
+  std::vector<byte> pixels(30 * 20 * 4);
+  for (size_t i = 0; i < pixels.size(); i++) pixels[i] = (byte) (i * 13 + i / 7);
+  std::string data = encode(30, 20, 4, pixels);
+  PIXOR_CHECK(!decode_throws(data));
+
+  PIXOR_CHECK(decode_throws(data.substr(0, 10)));
+  PIXOR_CHECK(decode_throws(data.substr(0, data.size() - 1)));
+  PIXOR_CHECK(decode_throws(data.substr(0, data.size() / 2)));
+
+  std::string channels = data;
+  channels[12] = 5;
+  PIXOR_CHECK(decode_throws(channels));
+
+  std::string empty = data;
+  memset(&empty[4], 0, 4);
+  PIXOR_CHECK(decode_throws(empty));
+
+  // 2^16 by 2^16 is within the limit of each side but not of the total.
+  std::string huge = data;
+  byte side[] = {0, 1, 0, 0};
+  memcpy(&huge[4], side, 4);
+  memcpy(&huge[8], side, 4);
+  PIXOR_CHECK(decode_throws(huge));
+}
+
+// Equal pixels hash the same after a round trip, another pixel does not.
+static void test_content_hash()
+{
+  std::vector<byte> pixels(64 * 48 * 3);
+  for (size_t i = 0; i < pixels.size(); i++) pixels[i] = (byte) (i * 7 + i / 11);
+
+  QoiImage image(64, 48, 3);
+  image.set_bitmap(pixels.data());
+  std::istringstream in(encode(64, 48, 3, pixels));
+  std::unique_ptr<QoiImage> decoded(decode_qoi(in));
+  PIXOR_CHECK(image.get_content_hash() != 0);
+  PIXOR_CHECK(decoded->get_content_hash() == image.get_content_hash());
+
+  pixels[pixels.size() / 2] ^= 1;
+  image.set_bitmap(pixels.data());
+  PIXOR_CHECK(decoded->get_content_hash() != image.get_content_hash());
+}
+
+void PixorTest::test_qoi()
+{
+  test_chunks();
+  test_mixed();
+  test_rejects();
+  test_content_hash();
+}
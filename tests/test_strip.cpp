@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include "test.h"
+#include "canny.h"
+#include "graph.h"
+#include "png.h"
+#include "strip.h"
+#include "thread_pool.h"
+
+using namespace Pixor;
+
+static std::string test_png(int width, int height, PngImageType type, int channels, int seed)
+{
+  std::vector<byte> pixels((size_t) width * height * channels);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int c = 0; c < channels; c++) {
+        double value = 128 + 90 * sin(x * 0.07 + c + seed) * cos(y * 0.05) + ((x / 17 + y / 13) % 2) * 30 + (x * y * seed) % 7;
+        pixels[((size_t) y * width + x) * channels + c] = (byte) std::clamp(value, 0.0, 255.0);
+      }
+    }
+  }
+
+  PngImage image;
+  image.set_header(new PngHeader(width, height, type));
+  image.set_bitmap(pixels.data());
+  std::ostringstream out;
+  out << image;
+  return out.str();
+}
+
+static void test_strips_match_graph()
+{
+  struct Case {
+    int width;
+    int height;
+    PngImageType type;
+    int channels;
+    size_t max_bytes;
+    int kernel_size;
+  } cases[] = {
+    {200, 150, PNG_TYPE_TRUECOLOUR, 3, 1 << 20, 5},
+    {97, 301, PNG_TYPE_TRUECOLOUR_ALPHA, 4, 560000, 5},
+    {64, 64, PNG_TYPE_GREYSCALE, 1, 1 << 30, 3},
+    {131, 77, PNG_TYPE_GREYSCALE_ALPHA, 2, 580000, 7},
+    {5, 40, PNG_TYPE_TRUECOLOUR, 3, 530000, 5},
+  };
+
+  int seed = 0;
+  for (auto &c : cases) {
+    std::string data = test_png(c.width, c.height, c.type, c.channels, ++seed);
+    CannyOptions options;
+    options.kernel_size = c.kernel_size;
+
+    std::istringstream in(data);
+    std::shared_ptr<Image> image(decode_png(in));
+    Graph graph;
+    auto expected = graph.encode(canny_graph(graph, graph.luma(graph.decode(image)), options))->get_image_bitmap();
+
+    std::istringstream strip_in(data);
+    std::ostringstream strip_out;
+    StripOptions strip_options;
+    strip_options.max_bytes = c.max_bytes;
+    canny_png_strips(strip_in, strip_out, options, strip_options);
+
+    std::istringstream result_in(strip_out.str());
+    std::shared_ptr<PngImage> result(decode_png(result_in));
+    auto edges = result->get_image_bitmap();
+
+    PIXOR_CHECK(result->get_width() == c.width && result->get_height() == c.height);
+    PIXOR_CHECK(std::equal(expected.get(), expected.get() + (size_t) c.width * c.height * 3, edges.get()));
+  }
+
+  std::istringstream in(test_png(100, 100, PNG_TYPE_TRUECOLOUR, 3, 1));
+  std::ostringstream out;
+  StripOptions too_small;
+  too_small.max_bytes = 1000;
+  bool thrown = false;
+  try {
+    canny_png_strips(in, out, CannyOptions(), too_small);
+  } catch (std::invalid_argument &) {
+    thrown = true;
+  }
+  PIXOR_CHECK(thrown);
+}
+
+void PixorTest::test_strip()
+{
+  // More threads than cores still shares every strip out in bands.
+  ThreadPool::shared().set_concurrency(4);
+  test_strips_match_graph();
+}
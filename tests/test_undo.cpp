@@ -0,0 +1,117 @@
+#include <memory>
+#include "test.h"
+#include "context.h"
+#include "flood_fill.h"
+
+using namespace Pixor;
+
+static std::vector<RGBA> snapshot(const Context &context)
+{
+  std::vector<RGBA> res((size_t) context.get_width() * context.get_height());
+  context.read_rect(context.get_bounds(), res.data());
+  return res;
+}
+
+// Entries of rectangles, single pixels and fills, undone and redone to
+// every earlier state.
+static void test_undo_redo()
+{
+  unsigned int state = 37;
+  auto next = [&state](int range) {
+    state = state * 1103515245 + 12345;
+    return (int) ((state >> 16) % range);
+  };
+
+  for (int trial = 0; trial < 20; trial++) {
+    int width = 1 + next(300);
+    int height = 1 + next(200);
+    Context context(width, height, trial % 2 ? CONTEXT_STORAGE_TILED : CONTEXT_STORAGE_FLAT);
+    auto journal = std::make_shared<UndoJournal>();
+    context.set_journal(journal);
+
+    std::vector<std::vector<RGBA>> states = {snapshot(context)};
+    for (int entry = 0; entry < 12; entry++) {
+      JournalScope scope(journal);
+      for (int op = 0; op < 1 + next(4); op++) {
+        RGBA colour = rgba(next(256), next(256), next(256), next(256));
+        int kind = next(3);
+        if (kind == 0) {
+          rect area = {next(width), next(height), 0, 0};
+          area.width = 1 + next(width - area.x);
+          area.height = 1 + next(height - area.y);
+          std::vector<RGBA> pixels((size_t) area.width * area.height);
+          for (RGBA &pixel : pixels) pixel = colour + next(3);
+          context.write_rect(area, pixels.data());
+        } else if (kind == 1) {
+          for (int i = 0; i < 20; i++) context.set_pixel({next(width), next(height)}, colour);
+        } else {
+          flood_fill(context, {next(width), next(height)}, colour, next(8), FILL_CONNECTIVITY_8);
+        }
+      }
+      states.push_back(snapshot(context));
+    }
+
+    // An entry without writes is not recorded.
+    journal->begin_entry();
+    journal->end_entry();
+
+    for (int i = (int) states.size() - 2; i >= 0; i--) {
+      PIXOR_CHECK(journal->can_undo());
+      journal->undo(context);
+      PIXOR_CHECK(snapshot(context) == states[i]);
+    }
+    PIXOR_CHECK(!journal->can_undo());
+
+    for (size_t i = 1; i < states.size(); i++) {
+      PIXOR_CHECK(journal->can_redo());
+      journal->redo(context);
+      PIXOR_CHECK(snapshot(context) == states[i]);
+    }
+    PIXOR_CHECK(!journal->can_redo());
+
+    // A new entry after an undo drops what could have been redone.
+    journal->undo(context);
+    context.set_pixel({0, 0}, rgba(1, 2, 3, 4));
+    journal->begin_entry();
+    context.set_pixel({0, 0}, rgba(4, 3, 2, 1));
+    journal->end_entry();
+    PIXOR_CHECK(!journal->can_redo());
+    journal->undo(context);
+    PIXOR_CHECK(context.get_pixel({0, 0}) == rgba(1, 2, 3, 4));
+  }
+}
+
+// A budget too small for the whole history drops the oldest entries, the
+// ones left still restore exactly.
+static void test_budget()
+{
+  Context context(256, 256, CONTEXT_STORAGE_TILED);
+  auto journal = std::make_shared<UndoJournal>(200 * 1024);
+  context.set_journal(journal);
+
+  std::vector<std::vector<RGBA>> states = {snapshot(context)};
+  unsigned int seed = 41;
+  for (int entry = 0; entry < 40; entry++) {
+    std::vector<RGBA> noise(128 * 128);
+    for (RGBA &pixel : noise) pixel = (seed = seed * 1103515245 + 12345) >> 8;
+    journal->begin_entry();
+    context.write_rect({(entry % 3) * 64, (entry % 2) * 64, 128, 128}, noise.data());
+    journal->end_entry();
+    states.push_back(snapshot(context));
+    PIXOR_CHECK(journal->get_memory_used() <= journal->get_memory_budget());
+  }
+
+  int undone = 0;
+  while (journal->can_undo()) {
+    journal->undo(context);
+    undone++;
+    PIXOR_CHECK(snapshot(context) == states[states.size() - 1 - undone]);
+  }
+  PIXOR_CHECK(undone > 0 && undone < 40);
+}
+
+void PixorTest::test_undo()
+{
+  test_undo_redo();
+  test_budget();
+}